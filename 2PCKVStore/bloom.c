@@ -0,0 +1,68 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kvconstants.h"
+#include "bloom.h"
+
+/* Initializes an empty filter BLOOM sized for NKEYS keys at BITS_PER_KEY bits
+ * each, using the number of probes which minimizes its false positive rate. */
+void bloom_init(bloom_t *bloom, size_t nkeys, unsigned int bits_per_key) {
+  size_t nbits = nkeys * bits_per_key;
+  /* Tiny filters have a high false positive rate; enforce a minimum size. */
+  if (nbits < 64)
+    nbits = 64;
+  bloom->nbits = (nbits + 7) / 8 * 8;
+  bloom->bits = calloc(bloom->nbits / 8, 1);
+  if (!bloom->bits)
+    fatal_malloc();
+  /* bits_per_key * ln(2), rounded down. */
+  bloom->probes = bits_per_key * 69 / 100;
+  if (bloom->probes < 1)
+    bloom->probes = 1;
+  if (bloom->probes > 30)
+    bloom->probes = 30;
+}
+
+/* Initializes BLOOM from the SIZE bytes of BITS previously returned by
+ * bloom_size and stored from BLOOM->bits, probed PROBES times per key. BLOOM
+ * takes ownership of BITS, which must have been malloc()d. */
+void bloom_load(bloom_t *bloom, uint8_t *bits, size_t size, uint32_t probes) {
+  bloom->bits = bits;
+  bloom->nbits = size * 8;
+  bloom->probes = probes;
+}
+
+/* Adds the key with the given HASH to BLOOM. */
+void bloom_add(bloom_t *bloom, uint64_t hash) {
+  uint32_t h = hash, delta = hash >> 32, i, bit;
+  for (i = 0; i < bloom->probes; i++) {
+    bit = h % bloom->nbits;
+    bloom->bits[bit / 8] |= 1 << (bit % 8);
+    h += delta;
+  }
+}
+
+/* Returns false if the key with the given HASH was definitely never added to
+ * BLOOM, else true. */
+bool bloom_may_contain(const bloom_t *bloom, uint64_t hash) {
+  uint32_t h = hash, delta = hash >> 32, i, bit;
+  if (bloom->nbits == 0)
+    return true;
+  for (i = 0; i < bloom->probes; i++) {
+    bit = h % bloom->nbits;
+    if ((bloom->bits[bit / 8] & (1 << (bit % 8))) == 0)
+      return false;
+    h += delta;
+  }
+  return true;
+}
+
+/* Returns the size of the bit array of BLOOM in bytes. */
+size_t bloom_size(const bloom_t *bloom) { return bloom->nbits / 8; }
+
+/* Frees the bit array of BLOOM. */
+void bloom_free(bloom_t *bloom) {
+  free(bloom->bits);
+  bloom->bits = NULL;
+  bloom->nbits = 0;
+}
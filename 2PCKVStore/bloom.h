@@ -0,0 +1,37 @@
+#ifndef __BLOOM__
+#define __BLOOM__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Bloom defines a Bloom filter over 64-bit key hashes, used to answer "is this
+ * key definitely absent?" without reading any data.
+ *
+ * The filter is a plain bit array probed PROBES times per key, the probe
+ * positions being derived from the two halves of the key's hash by double
+ * hashing. With B bits per key and the optimal number of probes (B * ln 2),
+ * the false positive rate is roughly 0.6185^B, e.g. about 1% for B = 10.
+ *
+ * The bit array can be stored and loaded verbatim; together with the number of
+ * probes it fully describes the filter. A filter does no locking of its own,
+ * but any number of threads may query a filter which is no longer modified.
+ */
+
+/* A Bloom filter. */
+typedef struct {
+  uint8_t *bits;   /* The bit array. */
+  uint32_t nbits;  /* The number of bits within BITS. */
+  uint32_t probes; /* The number of bits set per key. */
+} bloom_t;
+
+void bloom_init(bloom_t *, size_t nkeys, unsigned int bits_per_key);
+void bloom_load(bloom_t *, uint8_t *bits, size_t size, uint32_t probes);
+
+void bloom_add(bloom_t *, uint64_t hash);
+bool bloom_may_contain(const bloom_t *, uint64_t hash);
+
+size_t bloom_size(const bloom_t *);
+void bloom_free(bloom_t *);
+
+#endif
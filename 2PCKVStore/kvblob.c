@@ -0,0 +1,266 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "kvconstants.h"
+#include "kvblob.h"
+
+/* Writes the name of the extent file ID of BLOB, with the given FILETYPE, into
+ * FILENAME. */
+static void kvblob_filename(kvblob_t *blob, uint32_t id, const char *filetype, char *filename) {
+  sprintf(filename, "%s/%u%s", blob->dirname, id, filetype);
+}
+
+/* Records in the map of BLOB that the blob of KEY, of the given SIZE, is stored
+ * in extent file ID, removing the extent file it was previously stored in. */
+static void kvblob_set(kvblob_t *blob, const char *key, uint32_t id, uint64_t size) {
+  char filename[MAX_FILENAME];
+  kvblob_extent_t *ext;
+  HASH_FIND_STR(blob->extents, key, ext);
+  if (ext == NULL) {
+    ext = malloc(sizeof(kvblob_extent_t));
+    if (!ext)
+      fatal_malloc();
+    ext->key = strdup(key);
+    if (!ext->key)
+      fatal_malloc();
+    HASH_ADD_KEYPTR(hh, blob->extents, ext->key, strlen(ext->key), ext);
+    blob->count++;
+  } else {
+    kvblob_filename(blob, ext->id, KVBLOB_FILETYPE, filename);
+    unlink(filename);
+  }
+  ext->id = id;
+  ext->size = size;
+}
+
+/* Reads the header and key of extent file ID of BLOB into the map of BLOB.
+ * Extent files which cannot be read are removed. */
+static void kvblob_load(kvblob_t *blob, uint32_t id) {
+  char filename[MAX_FILENAME], key[MAX_KEYLEN + 1];
+  kvblob_header_t header;
+  kvblob_extent_t *ext;
+  struct stat st;
+  int fd;
+  kvblob_filename(blob, id, KVBLOB_FILETYPE, filename);
+  if ((fd = open(filename, O_RDONLY)) < 0)
+    return;
+  if (fstat(fd, &st) < 0 || pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+      header.magic != KVBLOB_MAGIC || header.keylen == 0 || header.keylen > MAX_KEYLEN ||
+      pread(fd, key, header.keylen, sizeof(header)) != header.keylen ||
+      st.st_size != sizeof(header) + header.keylen + header.size) {
+    close(fd);
+    unlink(filename);
+    return;
+  }
+  close(fd);
+  key[header.keylen] = '\0';
+  HASH_FIND_STR(blob->extents, key, ext);
+  if (ext != NULL && ext->id > id) {
+    unlink(filename);
+    return;
+  }
+  kvblob_set(blob, key, id, header.size);
+}
+
+/* Initializes BLOB within DIRNAME, which must already exist, rebuilding its map
+ * from the extent files found within DIRNAME and removing the temporary files
+ * of blobs which were never completed. Returns 0 if successful, else a
+ * negative error code. */
+int kvblob_init(kvblob_t *blob, char *dirname) {
+  char filename[MAX_FILENAME], suffix[MAX_FILENAME];
+  struct dirent *dent;
+  uint32_t id;
+  DIR *dir;
+  blob->dirname = strdup(dirname);
+  if (!blob->dirname)
+    fatal_malloc();
+  blob->next_id = 0;
+  blob->count = 0;
+  blob->extents = NULL;
+  if ((dir = opendir(dirname)) == NULL)
+    return ERR_FILACCESS;
+  while ((dent = readdir(dir)) != NULL) {
+    if (sscanf(dent->d_name, "%u%s", &id, suffix) != 2)
+      continue;
+    if (!strcmp(suffix, KVBLOB_TMPTYPE)) {
+      sprintf(filename, "%s/%s", dirname, dent->d_name);
+      unlink(filename);
+    } else if (!strcmp(suffix, KVBLOB_FILETYPE)) {
+      kvblob_load(blob, id);
+    } else {
+      continue;
+    }
+    if (id >= blob->next_id)
+      blob->next_id = id + 1;
+  }
+  closedir(dir);
+  return 0;
+}
+
+/* Writes the LEN bytes of DATA to FD, at its current offset. Returns 0 if
+ * successful, else a negative error code. */
+static int kvblob_write_all(int fd, const char *data, size_t len) {
+  ssize_t written;
+  while (len > 0) {
+    if ((written = write(fd, data, len)) <= 0)
+      return ERR_FILACCESS;
+    data += written;
+    len -= written;
+  }
+  return 0;
+}
+
+/* Starts writing the blob of KEY, whose value will be SIZE bytes long, with W.
+ * The value must then be passed to kvblob_write, after which the blob is
+ * completed by kvblob_finish and kvblob_install (or dropped by kvblob_abort).
+ * Returns 0 if successful, else a negative error code. */
+int kvblob_begin(kvblob_t *blob, kvblob_writer_t *w, const char *key, uint64_t size) {
+  char filename[MAX_FILENAME];
+  kvblob_header_t header;
+  if (strlen(key) > MAX_KEYLEN || strlen(key) == 0)
+    return ERR_KEYLEN;
+  if (size > KVBLOB_MAX_SIZE)
+    return ERR_VALLEN;
+  w->id = __sync_fetch_and_add(&blob->next_id, 1);
+  w->size = size;
+  w->written = 0;
+  w->key = strdup(key);
+  if (!w->key)
+    fatal_malloc();
+  kvblob_filename(blob, w->id, KVBLOB_TMPTYPE, filename);
+  if ((w->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) < 0) {
+    free(w->key);
+    return ERR_FILACCESS;
+  }
+  memset(&header, 0, sizeof(header));
+  header.magic = KVBLOB_MAGIC;
+  header.size = size;
+  header.keylen = strlen(key);
+  if (kvblob_write_all(w->fd, (char *)&header, sizeof(header)) < 0 ||
+      kvblob_write_all(w->fd, key, header.keylen) < 0) {
+    kvblob_abort(blob, w);
+    return ERR_FILACCESS;
+  }
+  return 0;
+}
+
+/* Appends the next LEN bytes of DATA to the value being written by W. Returns
+ * 0 if successful, else a negative error code. */
+int kvblob_write(kvblob_writer_t *w, const char *data, size_t len) {
+  if (w->written + len > w->size)
+    return ERR_VALLEN;
+  if (kvblob_write_all(w->fd, data, len) < 0)
+    return ERR_FILACCESS;
+  w->written += len;
+  return 0;
+}
+
+/* Syncs the blob written by W to disk, once its whole value has been written.
+ * Returns 0 if successful, else a negative error code. */
+int kvblob_finish(kvblob_writer_t *w) {
+  if (w->written != w->size)
+    return ERR_VALLEN;
+  if (fdatasync(w->fd) < 0)
+    return ERR_FILACCESS;
+  return 0;
+}
+
+/* Makes the blob written (and finished) by W the value of its key within BLOB,
+ * replacing any previous blob of the key, and releases W. Returns 0 if
+ * successful, else a negative error code, in which case the blob is dropped. */
+int kvblob_install(kvblob_t *blob, kvblob_writer_t *w) {
+  char tmpname[MAX_FILENAME], filename[MAX_FILENAME];
+  kvblob_filename(blob, w->id, KVBLOB_TMPTYPE, tmpname);
+  kvblob_filename(blob, w->id, KVBLOB_FILETYPE, filename);
+  if (rename(tmpname, filename) < 0) {
+    kvblob_abort(blob, w);
+    return ERR_FILACCESS;
+  }
+  kvblob_set(blob, w->key, w->id, w->size);
+  close(w->fd);
+  free(w->key);
+  return 0;
+}
+
+/* Drops the blob being written by W and releases W. */
+void kvblob_abort(kvblob_t *blob, kvblob_writer_t *w) {
+  char filename[MAX_FILENAME];
+  kvblob_filename(blob, w->id, KVBLOB_TMPTYPE, filename);
+  close(w->fd);
+  unlink(filename);
+  free(w->key);
+}
+
+/* Opens the blob of KEY within BLOB for reading with R. Returns 0 if
+ * successful, else a negative error code (ERR_NOKEY if KEY has no blob). */
+int kvblob_open(kvblob_t *blob, const char *key, kvblob_reader_t *r) {
+  char filename[MAX_FILENAME];
+  kvblob_extent_t *ext;
+  HASH_FIND_STR(blob->extents, key, ext);
+  if (ext == NULL)
+    return ERR_NOKEY;
+  kvblob_filename(blob, ext->id, KVBLOB_FILETYPE, filename);
+  if ((r->fd = open(filename, O_RDONLY)) < 0)
+    return ERR_FILACCESS;
+  r->size = ext->size;
+  r->offset = sizeof(kvblob_header_t) + strlen(key);
+  r->pos = 0;
+  return 0;
+}
+
+/* Reads the next chunk of at most LEN (and at most KVBLOB_CHUNK_SIZE) bytes of
+ * the value being read by R into BUF. Returns the number of bytes read, 0 once
+ * the whole value has been read, or a negative error code. */
+ssize_t kvblob_read(kvblob_reader_t *r, char *buf, size_t len) {
+  ssize_t n;
+  len = min(len, min(r->size - r->pos, KVBLOB_CHUNK_SIZE));
+  if (len == 0)
+    return 0;
+  if ((n = pread(r->fd, buf, len, r->offset + r->pos)) <= 0)
+    return ERR_FILACCESS;
+  r->pos += n;
+  return n;
+}
+
+/* Closes the blob being read by R. */
+void kvblob_reader_close(kvblob_reader_t *r) { close(r->fd); }
+
+/* Returns true if KEY has a blob within BLOB, else false. */
+bool kvblob_has(kvblob_t *blob, const char *key) {
+  kvblob_extent_t *ext;
+  HASH_FIND_STR(blob->extents, key, ext);
+  return ext != NULL;
+}
+
+/* Removes the blob of KEY from BLOB, if any. Returns true if there was one. */
+bool kvblob_remove(kvblob_t *blob, const char *key) {
+  char filename[MAX_FILENAME];
+  kvblob_extent_t *ext;
+  HASH_FIND_STR(blob->extents, key, ext);
+  if (ext == NULL)
+    return false;
+  kvblob_filename(blob, ext->id, KVBLOB_FILETYPE, filename);
+  unlink(filename);
+  HASH_DEL(blob->extents, ext);
+  blob->count--;
+  free(ext->key);
+  free(ext);
+  return true;
+}
+
+/* Frees the map of BLOB. BLOB must be reinitialized before it is used
+ * again. */
+void kvblob_close(kvblob_t *blob) {
+  kvblob_extent_t *ext, *tmp;
+  HASH_ITER(hh, blob->extents, ext, tmp) {
+    HASH_DEL(blob->extents, ext);
+    free(ext->key);
+    free(ext);
+  }
+  free(blob->dirname);
+  blob->count = 0;
+}
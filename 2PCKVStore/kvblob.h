@@ -0,0 +1,107 @@
+#ifndef __KV_BLOB__
+#define __KV_BLOB__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "uthash.h"
+#include "kvconstants.h"
+
+/* KVBlob stores the large values ("blobs") of a KVStore, which may exceed
+ * MAX_VALLEN and are therefore kept apart from its storage engine.
+ *
+ * Each blob is stored as an extent file within the store directory, named by
+ * an incrementing id:
+ *    sprintf(filename, "%u%s", id, KVBLOB_FILETYPE);
+ * An extent file starts with a kvblob_header_t and the key of the blob,
+ * followed by the value. Values are written and read in chunks of at most
+ * KVBLOB_CHUNK_SIZE bytes, so no value ever has to be held in memory as a
+ * whole.
+ *
+ * A blob is first written to a temporary file (KVBLOB_TMPTYPE), which is synced
+ * and renamed into place only once the whole value has been written, so a
+ * crash never leaves a partial blob behind. Replacing or removing a blob
+ * unlinks its extent file; readers which opened it before keep reading the
+ * value they started with.
+ *
+ * An in-memory map from key to extent is rebuilt upon initialization from the
+ * headers of the extent files. Should a key have several extents (after a crash
+ * while replacing it), the one with the highest id wins.
+ *
+ * Large values are not visited by kvstore_scan and cannot be retrieved with
+ * kvstore_get, only through the kvstore_get_stream_* functions.
+ *
+ * KVBlob does no locking of its own; KVStore serializes access to its map.
+ */
+
+#define KVBLOB_FILETYPE ".blob"
+#define KVBLOB_TMPTYPE ".blob.tmp"
+
+/* The size of the chunks in which values are written and read. */
+#define KVBLOB_CHUNK_SIZE (64 * 1024)
+
+/* The largest value which can be stored as a blob. */
+#define KVBLOB_MAX_SIZE (1ULL << 40)
+
+/* Identifies an extent file ("KVBLOB01"). */
+#define KVBLOB_MAGIC 0x31304f424c42564bULL
+
+/* The header of an extent file. */
+typedef struct {
+  uint64_t magic;  /* KVBLOB_MAGIC. */
+  uint64_t size;   /* The size of the value. */
+  uint32_t keylen; /* The length of the key following the header. */
+  uint32_t unused;
+} kvblob_header_t;
+
+/* An extent, locating the blob of KEY. */
+typedef struct {
+  char *key;         /* The key of the blob. Also the key of the hash table. */
+  uint32_t id;       /* The id of the extent file. */
+  uint64_t size;     /* The size of the value. */
+  UT_hash_handle hh; /* Makes this structure hashable. */
+} kvblob_extent_t;
+
+/* A KVBlob. */
+typedef struct {
+  char *dirname;            /* The directory in which extent files are stored. */
+  uint32_t next_id;         /* The next unused extent file id. */
+  uint32_t count;           /* The number of blobs. */
+  kvblob_extent_t *extents; /* The extents of all blobs (a uthash table). */
+} kvblob_t;
+
+/* A blob being written. */
+typedef struct {
+  int fd;           /* The open file descriptor of the temporary file. */
+  uint32_t id;      /* The id the extent file will have. */
+  char *key;        /* The key of the blob. */
+  uint64_t size;    /* The size of the value, as announced. */
+  uint64_t written; /* The number of bytes of the value written so far. */
+} kvblob_writer_t;
+
+/* A blob being read. */
+typedef struct {
+  int fd;          /* The open file descriptor of the extent file. */
+  uint64_t size;   /* The size of the value. */
+  uint64_t offset; /* The offset of the value within the extent file. */
+  uint64_t pos;    /* The number of bytes of the value read so far. */
+} kvblob_reader_t;
+
+int kvblob_init(kvblob_t *, char *dirname);
+
+int kvblob_begin(kvblob_t *, kvblob_writer_t *, const char *key, uint64_t size);
+int kvblob_write(kvblob_writer_t *, const char *data, size_t len);
+int kvblob_finish(kvblob_writer_t *);
+int kvblob_install(kvblob_t *, kvblob_writer_t *);
+void kvblob_abort(kvblob_t *, kvblob_writer_t *);
+
+int kvblob_open(kvblob_t *, const char *key, kvblob_reader_t *);
+ssize_t kvblob_read(kvblob_reader_t *, char *buf, size_t len);
+void kvblob_reader_close(kvblob_reader_t *);
+
+bool kvblob_has(kvblob_t *, const char *key);
+bool kvblob_remove(kvblob_t *, const char *key);
+
+void kvblob_close(kvblob_t *);
+
+#endif
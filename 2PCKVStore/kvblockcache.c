@@ -0,0 +1,244 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "kvconstants.h"
+#include "kvhash.h"
+#include "utlist.h"
+#include "kvblockcache.h"
+
+/* The number of pages of a staging buffer. */
+#define KVBLOCKCACHE_IO_PAGES (KVBLOCKCACHE_IO_SIZE / KVBLOCKCACHE_PAGE)
+
+/* Returns the id of page PAGE of file FILE. */
+#define KVBLOCKCACHE_ID(file, page) ((uint64_t)(file) << 32 | (page))
+
+/* Allocates SIZE bytes aligned to KVBLOCKCACHE_PAGE. */
+static char *kvblockcache_alloc(size_t size) {
+  void *mem;
+  if (posix_memalign(&mem, KVBLOCKCACHE_PAGE, size) != 0)
+    fatal_malloc();
+  return mem;
+}
+
+/* Initializes CACHE with a pool of SIZE bytes of pages. A pool too small to
+ * give every shard a page disables caching, in which case every page is read
+ * from its file. */
+void kvblockcache_init(kvblockcache_t *cache, size_t size) {
+  size_t per_shard = size / KVBLOCKCACHE_PAGE / KVBLOCKCACHE_SHARDS, i;
+  memset(cache, 0, sizeof(kvblockcache_t));
+  cache->npages = per_shard * KVBLOCKCACHE_SHARDS;
+  if (cache->npages > 0) {
+    cache->pool = kvblockcache_alloc(cache->npages * KVBLOCKCACHE_PAGE);
+    cache->pages = calloc(cache->npages, sizeof(kvblockcache_page_t));
+    if (!cache->pages)
+      fatal_malloc();
+  }
+  for (i = 0; i < cache->npages; i++) {
+    cache->pages[i].data = cache->pool + i * KVBLOCKCACHE_PAGE;
+    DL_APPEND(cache->shards[i / per_shard].free, &cache->pages[i]);
+  }
+  for (i = 0; i < KVBLOCKCACHE_SHARDS; i++)
+    pthread_mutex_init(&cache->shards[i].lock, NULL);
+  cache->io = kvblockcache_alloc(KVBLOCKCACHE_IO_BUFFERS * KVBLOCKCACHE_IO_SIZE);
+  for (i = 0; i < KVBLOCKCACHE_IO_BUFFERS; i++)
+    cache->io_free[i] = cache->io + i * KVBLOCKCACHE_IO_SIZE;
+  cache->nio_free = KVBLOCKCACHE_IO_BUFFERS;
+  pthread_mutex_init(&cache->io_lock, NULL);
+  pthread_cond_init(&cache->io_cond, NULL);
+}
+
+/* Returns the shard of CACHE responsible for the page ID. Consecutive pages
+ * of a file are spread over all shards. */
+static kvblockcache_shard_t *kvblockcache_shard(kvblockcache_t *cache, uint64_t id) {
+  return &cache->shards[kvhash64(&id, sizeof(uint64_t)) % KVBLOCKCACHE_SHARDS];
+}
+
+/* Copies the part of the range [OFFSET, OFFSET + SIZE) of a file which lies
+ * within its page PAGE, whose bytes are DATA, to where BUF holds the range. */
+static void kvblockcache_copy(char *buf, size_t size, uint64_t offset, uint64_t page,
+                              const char *data) {
+  uint64_t start = page * KVBLOCKCACHE_PAGE, end = start + KVBLOCKCACHE_PAGE;
+  if (start < offset)
+    start = offset;
+  if (end > offset + size)
+    end = offset + size;
+  memcpy(buf + (start - offset), data + (start - page * KVBLOCKCACHE_PAGE), end - start);
+}
+
+/* Looks up page PAGE of FILE within CACHE. If it is cached, copies its part of
+ * the range [OFFSET, OFFSET + SIZE) into BUF (unless BUF is NULL, in which
+ * case nothing is counted or reordered either) and returns true, else returns
+ * false. */
+static bool kvblockcache_get(kvblockcache_t *cache, uint32_t file, uint64_t page, char *buf,
+                             size_t size, uint64_t offset) {
+  uint64_t id = KVBLOCKCACHE_ID(file, page);
+  kvblockcache_shard_t *shard = kvblockcache_shard(cache, id);
+  kvblockcache_page_t *ent;
+  if (cache->npages == 0)
+    return false;
+  pthread_mutex_lock(&shard->lock);
+  HASH_FIND(hh, shard->table, &id, sizeof(uint64_t), ent);
+  if (ent != NULL && buf != NULL) {
+    kvblockcache_copy(buf, size, offset, page, ent->data);
+    DL_DELETE(shard->lru, ent);
+    DL_APPEND(shard->lru, ent);
+    shard->hits++;
+  }
+  pthread_mutex_unlock(&shard->lock);
+  return ent != NULL;
+}
+
+/* Caches DATA as page PAGE of FILE within CACHE, evicting the least recently
+ * used page of its shard if the shard has no free page. */
+static void kvblockcache_insert(kvblockcache_t *cache, uint32_t file, uint64_t page,
+                                const char *data) {
+  uint64_t id = KVBLOCKCACHE_ID(file, page);
+  kvblockcache_shard_t *shard = kvblockcache_shard(cache, id);
+  kvblockcache_page_t *ent;
+  if (cache->npages == 0)
+    return;
+  pthread_mutex_lock(&shard->lock);
+  HASH_FIND(hh, shard->table, &id, sizeof(uint64_t), ent);
+  if (ent != NULL) {
+    /* Read by another thread meanwhile. */
+    DL_DELETE(shard->lru, ent);
+  } else {
+    if ((ent = shard->free) != NULL) {
+      DL_DELETE(shard->free, ent);
+    } else {
+      ent = shard->lru;
+      HASH_DEL(shard->table, ent);
+      DL_DELETE(shard->lru, ent);
+      shard->evictions++;
+    }
+    ent->id = id;
+    memcpy(ent->data, data, KVBLOCKCACHE_PAGE);
+    HASH_ADD(hh, shard->table, id, sizeof(uint64_t), ent);
+  }
+  DL_APPEND(shard->lru, ent);
+  pthread_mutex_unlock(&shard->lock);
+}
+
+/* Takes a staging buffer of CACHE, waiting for one to be returned if all are
+ * in use, and counts a read of MISSES pages with it. */
+static char *kvblockcache_io_take(kvblockcache_t *cache, uint64_t misses) {
+  char *io;
+  pthread_mutex_lock(&cache->io_lock);
+  while (cache->nio_free == 0)
+    pthread_cond_wait(&cache->io_cond, &cache->io_lock);
+  io = cache->io_free[--cache->nio_free];
+  cache->misses += misses;
+  cache->reads++;
+  pthread_mutex_unlock(&cache->io_lock);
+  return io;
+}
+
+/* Returns the staging buffer IO to CACHE. */
+static void kvblockcache_io_return(kvblockcache_t *cache, char *io) {
+  pthread_mutex_lock(&cache->io_lock);
+  cache->io_free[cache->nio_free++] = io;
+  pthread_cond_signal(&cache->io_cond);
+  pthread_mutex_unlock(&cache->io_lock);
+}
+
+/* Reads the SIZE bytes at OFFSET of FILE, which is open as FD, into BUF,
+ * copying the pages cached by CACHE and reading the others from FD, in
+ * aligned runs suitable for O_DIRECT. The pages read are cached as well if
+ * FILL is true; a caller reading through a whole file once (such as a
+ * compaction) should pass false, so as not to evict pages worth keeping.
+ * Returns 0 if successful, else a negative error code. */
+int kvblockcache_read(kvblockcache_t *cache, uint32_t file, int fd, void *buf, size_t size,
+                      uint64_t offset, bool fill) {
+  uint64_t page, last, n, i, need;
+  ssize_t got;
+  char *io;
+  if (size == 0)
+    return 0;
+  page = offset / KVBLOCKCACHE_PAGE;
+  last = (offset + size - 1) / KVBLOCKCACHE_PAGE;
+  while (page <= last) {
+    if (kvblockcache_get(cache, file, page, buf, size, offset)) {
+      page++;
+      continue;
+    }
+    /* Read all pages up to the next one cached with a single read. */
+    for (n = 1; page + n <= last && n < KVBLOCKCACHE_IO_PAGES &&
+                !kvblockcache_get(cache, file, page + n, NULL, 0, 0);
+         n++)
+      ;
+    io = kvblockcache_io_take(cache, n);
+    got = pread(fd, io, n * KVBLOCKCACHE_PAGE, page * KVBLOCKCACHE_PAGE);
+    /* The last page of a file is read short; its remainder is never asked
+     * for, so caching it as a whole page does no harm. */
+    need = (offset + size < (page + n) * KVBLOCKCACHE_PAGE ? offset + size
+                                                           : (page + n) * KVBLOCKCACHE_PAGE) -
+           page * KVBLOCKCACHE_PAGE;
+    if (got < 0 || (uint64_t)got < need) {
+      kvblockcache_io_return(cache, io);
+      return ERR_FILACCESS;
+    }
+    for (i = 0; i < n; i++) {
+      kvblockcache_copy(buf, size, offset, page + i, io + i * KVBLOCKCACHE_PAGE);
+      if (fill)
+        kvblockcache_insert(cache, file, page + i, io + i * KVBLOCKCACHE_PAGE);
+    }
+    kvblockcache_io_return(cache, io);
+    page += n;
+  }
+  return 0;
+}
+
+/* Drops the pages of FILE, which is SIZE bytes long, from CACHE. */
+void kvblockcache_drop(kvblockcache_t *cache, uint32_t file, uint64_t size) {
+  kvblockcache_shard_t *shard;
+  kvblockcache_page_t *ent;
+  uint64_t page, id;
+  if (cache->npages == 0)
+    return;
+  for (page = 0; page * KVBLOCKCACHE_PAGE < size; page++) {
+    id = KVBLOCKCACHE_ID(file, page);
+    shard = kvblockcache_shard(cache, id);
+    pthread_mutex_lock(&shard->lock);
+    HASH_FIND(hh, shard->table, &id, sizeof(uint64_t), ent);
+    if (ent != NULL) {
+      HASH_DEL(shard->table, ent);
+      DL_DELETE(shard->lru, ent);
+      DL_APPEND(shard->free, ent);
+    }
+    pthread_mutex_unlock(&shard->lock);
+  }
+}
+
+/* Sums up the counters of CACHE into STATS. */
+void kvblockcache_stats(kvblockcache_t *cache, kvblockcache_stats_t *stats) {
+  kvblockcache_shard_t *shard;
+  int i;
+  memset(stats, 0, sizeof(kvblockcache_stats_t));
+  for (i = 0; i < KVBLOCKCACHE_SHARDS; i++) {
+    shard = &cache->shards[i];
+    pthread_mutex_lock(&shard->lock);
+    stats->hits += shard->hits;
+    stats->evictions += shard->evictions;
+    pthread_mutex_unlock(&shard->lock);
+  }
+  pthread_mutex_lock(&cache->io_lock);
+  stats->misses = cache->misses;
+  stats->reads = cache->reads;
+  pthread_mutex_unlock(&cache->io_lock);
+}
+
+/* Frees the pool and staging buffers of CACHE. CACHE must be reinitialized
+ * before it is used again. */
+void kvblockcache_destroy(kvblockcache_t *cache) {
+  int i;
+  for (i = 0; i < KVBLOCKCACHE_SHARDS; i++) {
+    HASH_CLEAR(hh, cache->shards[i].table);
+    pthread_mutex_destroy(&cache->shards[i].lock);
+  }
+  free(cache->pages);
+  free(cache->pool);
+  free(cache->io);
+  pthread_mutex_destroy(&cache->io_lock);
+  pthread_cond_destroy(&cache->io_cond);
+}
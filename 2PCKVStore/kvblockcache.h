@@ -0,0 +1,95 @@
+#ifndef __KV_BLOCKCACHE__
+#define __KV_BLOCKCACHE__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "uthash.h"
+
+/* KVBlockCache caches the pages of files which are read with O_DIRECT, so
+ * that they bypass the page cache of the kernel and their memory use is
+ * bounded by the cache alone.
+ *
+ * Files are cached in pages of KVBLOCKCACHE_PAGE bytes, aligned within the
+ * file and within memory as O_DIRECT requires, under the id of their file and
+ * their index. All pages come from a single pool allocated upon
+ * initialization, which is split evenly between KVBLOCKCACHE_SHARDS shards,
+ * each with its own lock, hash table and LRU list; a shard evicts its least
+ * recently used page once its share of the pool is used up. Reads of pages
+ * which are not cached are made in runs of up to KVBLOCKCACHE_IO_SIZE bytes
+ * into staging buffers, of which KVBLOCKCACHE_IO_BUFFERS are allocated upon
+ * initialization as well, readers waiting for one if all are in use.
+ *
+ * Files must not change while they are cached, and their pages must be
+ * dropped (see kvblockcache_drop) before their id is used for another file.
+ */
+
+/* The size and alignment of a page. */
+#define KVBLOCKCACHE_PAGE 4096
+
+/* The number of shards of a cache. */
+#define KVBLOCKCACHE_SHARDS 16
+
+/* The default size of the pool of pages of a cache. */
+#define KVBLOCKCACHE_SIZE (32 * 1024 * 1024)
+
+/* The size of a staging buffer, and so the largest single read. */
+#define KVBLOCKCACHE_IO_SIZE (64 * 1024)
+
+/* The number of staging buffers. */
+#define KVBLOCKCACHE_IO_BUFFERS 8
+
+/* A page of the pool. */
+typedef struct kvblockcache_page {
+  uint64_t id;                    /* The file (upper half) and index of the page. */
+  char *data;                     /* The KVBLOCKCACHE_PAGE bytes of the page. */
+  struct kvblockcache_page *prev; /* The previous page in LRU (or free list) order. */
+  struct kvblockcache_page *next; /* The next page in LRU (or free list) order. */
+  UT_hash_handle hh;              /* Makes this structure hashable by ID. */
+} kvblockcache_page_t;
+
+/* A shard of a cache. */
+typedef struct {
+  pthread_mutex_t lock;       /* Protects all fields of the shard. */
+  kvblockcache_page_t *table; /* The cached pages (a uthash table). */
+  kvblockcache_page_t *lru;   /* The cached pages from least to most recently used. */
+  kvblockcache_page_t *free;  /* The pages of the shard which hold nothing. */
+  uint64_t hits;              /* The number of pages found cached. */
+  uint64_t evictions;         /* The number of pages evicted to make room. */
+} kvblockcache_shard_t;
+
+/* A KVBlockCache. */
+typedef struct {
+  char *pool;                  /* The memory of all pages. */
+  kvblockcache_page_t *pages;  /* All pages. */
+  size_t npages;               /* The number of pages, split evenly between the shards. */
+  kvblockcache_shard_t shards[KVBLOCKCACHE_SHARDS];
+  char *io;                    /* The memory of all staging buffers. */
+  char *io_free[KVBLOCKCACHE_IO_BUFFERS]; /* The staging buffers not in use. */
+  unsigned int nio_free;       /* The number of those. */
+  uint64_t misses;             /* The number of pages which had to be read. */
+  uint64_t reads;              /* The number of reads made for those. */
+  pthread_mutex_t io_lock;     /* Protects the staging buffers, MISSES and READS. */
+  pthread_cond_t io_cond;      /* Signalled when a staging buffer is returned. */
+} kvblockcache_t;
+
+/* Cumulative counters of a cache. */
+typedef struct {
+  uint64_t hits;      /* The number of pages found cached. */
+  uint64_t misses;    /* The number of pages which had to be read. */
+  uint64_t evictions; /* The number of pages evicted to make room. */
+  uint64_t reads;     /* The number of reads made for the pages missed. */
+} kvblockcache_stats_t;
+
+void kvblockcache_init(kvblockcache_t *, size_t size);
+
+int kvblockcache_read(kvblockcache_t *, uint32_t file, int fd, void *buf, size_t size,
+                      uint64_t offset, bool fill);
+void kvblockcache_drop(kvblockcache_t *, uint32_t file, uint64_t size);
+
+void kvblockcache_stats(kvblockcache_t *, kvblockcache_stats_t *stats);
+
+void kvblockcache_destroy(kvblockcache_t *);
+
+#endif
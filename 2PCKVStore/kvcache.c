@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kvconstants.h"
+#include "utlist.h"
+#include "kvcache.h"
+
+/* Initializes CACHE with a budget of SIZE bytes. A SIZE of 0 disables the
+ * cache, in which case every lookup misses and nothing is ever inserted. */
+void kvcache_init(kvcache_t *cache, size_t size) {
+  int i;
+  memset(cache, 0, sizeof(kvcache_t));
+  cache->capacity = size / KVCACHE_SHARDS;
+  for (i = 0; i < KVCACHE_SHARDS; i++)
+    pthread_mutex_init(&cache->shards[i].lock, NULL);
+}
+
+/* Returns the shard of CACHE responsible for HASH. */
+static kvcache_shard_t *kvcache_shard(kvcache_t *cache, uint64_t hash) {
+  return &cache->shards[(hash >> 32) % KVCACHE_SHARDS];
+}
+
+/* Unlinks ENT from SHARD and frees it. The caller must hold the shard's
+ * lock. */
+static void kvcache_remove(kvcache_shard_t *shard, kvcache_entry_t *ent) {
+  HASH_DEL(shard->table, ent);
+  DL_DELETE(shard->lru, ent);
+  shard->size -= ent->size;
+  shard->entries--;
+  free(ent->key);
+  free(ent->value);
+  free(ent);
+}
+
+/* Looks up KEY, whose hash is HASH, within CACHE. If it is cached, copies its
+ * value into VALUE (if VALUE is not NULL), marks it as most recently used and
+ * returns true, else returns false. */
+bool kvcache_get(kvcache_t *cache, uint64_t hash, const char *key, char *value) {
+  kvcache_shard_t *shard = kvcache_shard(cache, hash);
+  kvcache_entry_t *ent;
+  if (cache->capacity == 0)
+    return false;
+  pthread_mutex_lock(&shard->lock);
+  HASH_FIND(hh, shard->table, &hash, sizeof(uint64_t), ent);
+  if (ent == NULL || strcmp(ent->key, key) != 0) {
+    shard->misses++;
+    pthread_mutex_unlock(&shard->lock);
+    return false;
+  }
+  if (value != NULL)
+    strcpy(value, ent->value);
+  DL_DELETE(shard->lru, ent);
+  DL_APPEND(shard->lru, ent);
+  shard->hits++;
+  pthread_mutex_unlock(&shard->lock);
+  return true;
+}
+
+/* Must be called before reading the value of a key with hash HASH from the
+ * store, in order to insert it into CACHE afterwards. Returns a ticket which
+ * should be passed to kvcache_insert. */
+uint64_t kvcache_begin(kvcache_t *cache, uint64_t hash) {
+  kvcache_shard_t *shard = kvcache_shard(cache, hash);
+  uint64_t ticket;
+  if (cache->capacity == 0)
+    return 0;
+  pthread_mutex_lock(&shard->lock);
+  ticket = shard->invalidations;
+  pthread_mutex_unlock(&shard->lock);
+  return ticket;
+}
+
+/* Caches VALUE under KEY, whose hash is HASH, evicting the least recently
+ * used values of its shard as needed. TICKET must have been returned by
+ * kvcache_begin before VALUE was read from the store; if the shard has been
+ * invalidated since, VALUE may be stale and is not inserted. */
+void kvcache_insert(kvcache_t *cache, uint64_t hash, const char *key, const char *value,
+                    uint64_t ticket) {
+  kvcache_shard_t *shard = kvcache_shard(cache, hash);
+  kvcache_entry_t *ent;
+  size_t size = sizeof(kvcache_entry_t) + strlen(key) + strlen(value) + 2;
+  if (size > cache->capacity)
+    return;
+  pthread_mutex_lock(&shard->lock);
+  if (shard->invalidations != ticket) {
+    pthread_mutex_unlock(&shard->lock);
+    return;
+  }
+  HASH_FIND(hh, shard->table, &hash, sizeof(uint64_t), ent);
+  if (ent != NULL)
+    kvcache_remove(shard, ent);
+  while (shard->size + size > cache->capacity) {
+    kvcache_remove(shard, shard->lru);
+    shard->evictions++;
+  }
+  ent = malloc(sizeof(kvcache_entry_t));
+  if (!ent)
+    fatal_malloc();
+  ent->hash = hash;
+  ent->key = strdup(key);
+  ent->value = strdup(value);
+  if (!ent->key || !ent->value)
+    fatal_malloc();
+  ent->size = size;
+  HASH_ADD(hh, shard->table, hash, sizeof(uint64_t), ent);
+  DL_APPEND(shard->lru, ent);
+  shard->size += size;
+  shard->entries++;
+  pthread_mutex_unlock(&shard->lock);
+}
+
+/* Drops any value cached under HASH from CACHE. Must be called after the
+ * corresponding key was changed in the store. */
+void kvcache_invalidate(kvcache_t *cache, uint64_t hash) {
+  kvcache_shard_t *shard = kvcache_shard(cache, hash);
+  kvcache_entry_t *ent;
+  if (cache->capacity == 0)
+    return;
+  pthread_mutex_lock(&shard->lock);
+  shard->invalidations++;
+  HASH_FIND(hh, shard->table, &hash, sizeof(uint64_t), ent);
+  if (ent != NULL)
+    kvcache_remove(shard, ent);
+  pthread_mutex_unlock(&shard->lock);
+}
+
+/* Sums up the counters of all shards of CACHE into STATS. */
+void kvcache_stats(kvcache_t *cache, kvcache_stats_t *stats) {
+  kvcache_shard_t *shard;
+  int i;
+  memset(stats, 0, sizeof(kvcache_stats_t));
+  for (i = 0; i < KVCACHE_SHARDS; i++) {
+    shard = &cache->shards[i];
+    pthread_mutex_lock(&shard->lock);
+    stats->hits += shard->hits;
+    stats->misses += shard->misses;
+    stats->evictions += shard->evictions;
+    stats->entries += shard->entries;
+    stats->bytes += shard->size;
+    pthread_mutex_unlock(&shard->lock);
+  }
+}
+
+/* Frees all values cached by CACHE. CACHE must be reinitialized before it is
+ * used again. */
+void kvcache_destroy(kvcache_t *cache) {
+  kvcache_shard_t *shard;
+  int i;
+  for (i = 0; i < KVCACHE_SHARDS; i++) {
+    shard = &cache->shards[i];
+    while (shard->lru != NULL)
+      kvcache_remove(shard, shard->lru);
+    pthread_mutex_destroy(&shard->lock);
+  }
+}
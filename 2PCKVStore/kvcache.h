@@ -0,0 +1,87 @@
+#ifndef __KV_CACHE__
+#define __KV_CACHE__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "uthash.h"
+
+/* KVCache defines a bounded read cache which KVStore keeps in front of its
+ * storage engine.
+ *
+ * Values are cached under the 64-bit hash of their key. The cache is split
+ * into KVCACHE_SHARDS shards, selected by the hash, each with its own lock,
+ * hash table and LRU list, so that lookups of unrelated keys rarely contend.
+ * Every shard holds at most its share of the configured byte budget; once a
+ * shard would grow beyond it, its least recently used values are evicted.
+ *
+ * Writers must invalidate a key after changing it in the store. A value read
+ * from the store is only inserted if its shard saw no invalidation since the
+ * read started (see kvcache_begin), so a racing writer can never be
+ * overwritten by a stale value.
+ *
+ * KVStore keeps a cache of OPTS->cache_size bytes in front of every engine but
+ * KVSTORE_MEMORY, which is as fast as the cache would be. A GET which misses
+ * the cache takes the mutex of its shard three times, to look the key up, to
+ * begin the read and to fill the value in, and one which hits it once. With a
+ * size of 0, GETs take no lock.
+ */
+
+/* The number of shards of a cache. */
+#define KVCACHE_SHARDS 16
+
+/* The default byte budget of a cache. */
+#define KVCACHE_SIZE (16 * 1024 * 1024)
+
+/* A cached value. */
+typedef struct kvcache_entry {
+  uint64_t hash;              /* The hash of KEY. Also the key of the hash table. */
+  char *key;                  /* The key of the value. */
+  char *value;                /* The cached value. */
+  size_t size;                /* The number of bytes charged for this entry. */
+  struct kvcache_entry *prev; /* The previous entry in LRU order. */
+  struct kvcache_entry *next; /* The next entry in LRU order. */
+  UT_hash_handle hh;          /* Makes this structure hashable. */
+} kvcache_entry_t;
+
+/* A shard of a cache. */
+typedef struct {
+  pthread_mutex_t lock;    /* Protects all fields of the shard. */
+  kvcache_entry_t *table;  /* The entries of the shard (a uthash table). */
+  kvcache_entry_t *lru;    /* The entries from least to most recently used. */
+  size_t size;             /* The number of bytes charged to the shard. */
+  uint64_t invalidations;  /* The number of invalidations seen by the shard. */
+  uint64_t hits;           /* The number of lookups which found a value. */
+  uint64_t misses;         /* The number of lookups which found no value. */
+  uint64_t evictions;      /* The number of entries evicted to stay within budget. */
+  uint64_t entries;        /* The number of entries within the shard. */
+} kvcache_shard_t;
+
+/* A KVCache. */
+typedef struct {
+  size_t capacity; /* The byte budget of each shard, or 0 if the cache is disabled. */
+  kvcache_shard_t shards[KVCACHE_SHARDS];
+} kvcache_t;
+
+/* Cumulative counters of a cache. */
+typedef struct {
+  uint64_t hits;      /* The number of lookups which found a value. */
+  uint64_t misses;    /* The number of lookups which found no value. */
+  uint64_t evictions; /* The number of values evicted to stay within budget. */
+  uint64_t entries;   /* The number of values currently cached. */
+  uint64_t bytes;     /* The number of bytes currently charged to the cache. */
+} kvcache_stats_t;
+
+void kvcache_init(kvcache_t *, size_t size);
+
+bool kvcache_get(kvcache_t *, uint64_t hash, const char *key, char *value);
+uint64_t kvcache_begin(kvcache_t *, uint64_t hash);
+void kvcache_insert(kvcache_t *, uint64_t hash, const char *key, const char *value,
+                    uint64_t ticket);
+void kvcache_invalidate(kvcache_t *, uint64_t hash);
+
+void kvcache_stats(kvcache_t *, kvcache_stats_t *stats);
+
+void kvcache_destroy(kvcache_t *);
+
+#endif
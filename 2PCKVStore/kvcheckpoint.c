@@ -0,0 +1,335 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "kvcheckpoint.h"
+
+/* The checksum of the records of a checkpoint is their 64-bit FNV-1a hash,
+ * which, unlike KVHash, is stable, and can be computed a record at a time. */
+#define KVCHECKPOINT_FNV_OFFSET 0xcbf29ce484222325ULL
+#define KVCHECKPOINT_FNV_PRIME 0x100000001b3ULL
+
+/* The number of records of a log read at a time. */
+#define KVCHECKPOINT_LOG_BATCH 512
+
+/* Returns SUM updated with the LEN bytes of DATA. */
+static uint64_t kvcheckpoint_checksum(uint64_t sum, const void *data, size_t len) {
+  const unsigned char *p = data;
+  while (len-- > 0)
+    sum = (sum ^ *p++) * KVCHECKPOINT_FNV_PRIME;
+  return sum;
+}
+
+/* Writes the name NAME of a file of CKPT into FILENAME. */
+static void kvcheckpoint_filename(kvcheckpoint_t *ckpt, const char *name, char *filename) {
+  sprintf(filename, "%s/%s", ckpt->dirname, name);
+}
+
+/* Reads the boot id of the running system into ID, which must be able to
+ * hold KVCHECKPOINT_BOOT_ID_SIZE bytes, zeroed past its end. Returns true if
+ * successful. */
+static bool kvcheckpoint_boot_id(char *id) {
+  FILE *file = fopen("/proc/sys/kernel/random/boot_id", "r");
+  bool ret;
+  memset(id, 0, KVCHECKPOINT_BOOT_ID_SIZE);
+  if (file == NULL)
+    return false;
+  ret = fgets(id, KVCHECKPOINT_BOOT_ID_SIZE, file) != NULL;
+  fclose(file);
+  id[strcspn(id, "\n")] = '\0';
+  return ret && id[0] != '\0';
+}
+
+/* Syncs the directory of CKPT, making the files created, removed and renamed
+ * within it durable. Returns 0 if successful, else a negative error code. */
+static int kvcheckpoint_sync_dir(kvcheckpoint_t *ckpt) {
+  int fd, ret;
+  if ((fd = open(ckpt->dirname, O_RDONLY | O_DIRECTORY)) < 0)
+    return ERR_FILACCESS;
+  ret = fsync(fd) == 0 ? 0 : ERR_FILACCESS;
+  close(fd);
+  return ret;
+}
+
+/* Appends the hash of every chain recorded by the log NAME of CKPT, if it
+ * exists, to the *COUNT hashes of *HASHES, which has room for *CAPACITY.
+ * Returns 0 if successful, or a negative error code if the log cannot be
+ * trusted. */
+static int kvcheckpoint_replay(kvcheckpoint_t *ckpt, const char *name, uint64_t **hashes,
+                               size_t *count, size_t *capacity) {
+  char filename[MAX_FILENAME], boot_id[KVCHECKPOINT_BOOT_ID_SIZE];
+  uint64_t batch[KVCHECKPOINT_LOG_BATCH];
+  kvcheckpoint_log_header_t header;
+  ssize_t len;
+  size_t n, i;
+  int fd;
+  kvcheckpoint_filename(ckpt, name, filename);
+  if ((fd = open(filename, O_RDONLY)) < 0)
+    return errno == ENOENT ? 0 : ERR_FILACCESS;
+  /* A log of another boot may have lost records in a crash of the system. */
+  if (read(fd, &header, sizeof(header)) != sizeof(header) || header.magic != KVCHECKPOINT_MAGIC ||
+      !kvcheckpoint_boot_id(boot_id) || memcmp(header.boot_id, boot_id, sizeof(boot_id)) != 0) {
+    close(fd);
+    return ERR_FILACCESS;
+  }
+  /* A torn record at the end belongs to a change which never began. */
+  while ((len = read(fd, batch, sizeof(batch))) >= (ssize_t)sizeof(uint64_t)) {
+    n = len / sizeof(uint64_t);
+    if (*count + n > *capacity) {
+      *capacity = *count + n > 2 * *capacity ? *count + n : 2 * *capacity;
+      if (!(*hashes = realloc(*hashes, *capacity * sizeof(uint64_t))))
+        fatal_malloc();
+    }
+    for (i = 0; i < n; i++)
+      (*hashes)[(*count)++] = batch[i];
+  }
+  close(fd);
+  return len < 0 ? ERR_FILACCESS : 0;
+}
+
+static int kvcheckpoint_hash_cmp(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+/* Validates the checkpoint mapped at DATA, of SIZE bytes, and passes each of
+ * its keys to LOAD with ARG. The keys are only passed on once the checksum of
+ * the records matches. Returns 0 if successful, or a negative error code if
+ * the checkpoint is invalid. */
+static int kvcheckpoint_parse(const char *data, size_t size, kvcheckpoint_load_fn load,
+                              void *arg) {
+  char key[MAX_KEYLEN + 1];
+  kvcheckpoint_header_t header;
+  kvcheckpoint_record_t record;
+  const char *p, *end = data + size;
+  uint64_t i;
+  if (size < sizeof(header))
+    return ERR_FILACCESS;
+  memcpy(&header, data, sizeof(header));
+  p = data + sizeof(header);
+  if (header.magic != KVCHECKPOINT_MAGIC || header.size != size - sizeof(header) ||
+      header.checksum != kvcheckpoint_checksum(KVCHECKPOINT_FNV_OFFSET, p, header.size))
+    return ERR_FILACCESS;
+  for (i = 0; i < header.count; i++) {
+    if ((size_t)(end - p) < sizeof(record))
+      return ERR_FILACCESS;
+    memcpy(&record, p, sizeof(record));
+    p += sizeof(record);
+    if (record.keylen == 0 || record.keylen > MAX_KEYLEN || (size_t)(end - p) < record.keylen)
+      return ERR_FILACCESS;
+    memcpy(key, p, record.keylen);
+    key[record.keylen] = '\0';
+    p += record.keylen;
+    load(record.hash, record.chainpos, key, arg);
+  }
+  return p == end ? 0 : ERR_FILACCESS;
+}
+
+/* Initializes CKPT within DIRNAME, which must already exist, and loads its
+ * checkpoint, passing each of its keys to LOAD with ARG. The hashes of the
+ * chains changed since, which must be read again from their entry files, are
+ * stored into *HASHES, a malloc()d array of *COUNT distinct hashes which
+ * should be free()d later. Returns 0 if successful, or a negative error code
+ * if there is no checkpoint or it cannot be used, in which case the keys
+ * passed to LOAD, if any, must be dropped. Either way, the log must then be
+ * begun with kvcheckpoint_begin. */
+int kvcheckpoint_load(kvcheckpoint_t *ckpt, const char *dirname, kvcheckpoint_load_fn load,
+                      void *arg, uint64_t **hashes, size_t *count) {
+  char filename[MAX_FILENAME];
+  size_t capacity = 0, i, n = 0;
+  struct stat st;
+  void *data;
+  int fd, ret;
+  ckpt->dirname = strdup(dirname);
+  if (!ckpt->dirname)
+    fatal_malloc();
+  ckpt->fd = -1;
+  ckpt->records = 0;
+  *hashes = NULL;
+  *count = 0;
+  if ((ret = kvcheckpoint_replay(ckpt, KVCHECKPOINT_OLDNAME, hashes, count, &capacity)) < 0 ||
+      (ret = kvcheckpoint_replay(ckpt, KVCHECKPOINT_LOGNAME, hashes, count, &capacity)) < 0)
+    goto fail;
+  kvcheckpoint_filename(ckpt, KVCHECKPOINT_FILENAME, filename);
+  ret = ERR_FILACCESS;
+  if ((fd = open(filename, O_RDONLY)) < 0)
+    goto fail;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(kvcheckpoint_header_t) ||
+      (data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+    close(fd);
+    goto fail;
+  }
+  close(fd);
+  madvise(data, st.st_size, MADV_SEQUENTIAL);
+  ret = kvcheckpoint_parse(data, st.st_size, load, arg);
+  munmap(data, st.st_size);
+  if (ret < 0)
+    goto fail;
+  /* A chain changed several times is read again once. */
+  qsort(*hashes, *count, sizeof(uint64_t), kvcheckpoint_hash_cmp);
+  for (i = 0; i < *count; i++) {
+    if (n == 0 || (*hashes)[i] != (*hashes)[n - 1])
+      (*hashes)[n++] = (*hashes)[i];
+  }
+  *count = n;
+  return 0;
+fail:
+  free(*hashes);
+  *hashes = NULL;
+  *count = 0;
+  return ret;
+}
+
+/* Begins a new log of CKPT, replacing the current one, and makes it durable
+ * before it is used. Returns 0 if successful, else a negative error code. */
+static int kvcheckpoint_open_log(kvcheckpoint_t *ckpt) {
+  char filename[MAX_FILENAME];
+  kvcheckpoint_log_header_t header;
+  kvcheckpoint_filename(ckpt, KVCHECKPOINT_LOGNAME, filename);
+  header.magic = KVCHECKPOINT_MAGIC;
+  kvcheckpoint_boot_id(header.boot_id);
+  if ((ckpt->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, S_IRUSR | S_IWUSR)) < 0)
+    return ERR_FILACCESS;
+  ckpt->records = 0;
+  /* Were the log lost in a crash of the system, the checkpoint would seem to
+   * be up to date. */
+  if (write(ckpt->fd, &header, sizeof(header)) != sizeof(header) || fdatasync(ckpt->fd) < 0)
+    return ERR_FILACCESS;
+  return kvcheckpoint_sync_dir(ckpt);
+}
+
+/* Begins the log of CKPT, once its checkpoint is up to date, dropping the logs
+ * of the previous run. Returns 0 if successful, else a negative error code. */
+int kvcheckpoint_begin(kvcheckpoint_t *ckpt) {
+  char filename[MAX_FILENAME];
+  kvcheckpoint_filename(ckpt, KVCHECKPOINT_OLDNAME, filename);
+  unlink(filename);
+  return kvcheckpoint_open_log(ckpt);
+}
+
+/* Records within the log of CKPT that the hash chain HASH is about to change.
+ * May be called concurrently. Returns 0 if successful, else a negative error
+ * code, in which case the chain must not be changed. */
+int kvcheckpoint_log(kvcheckpoint_t *ckpt, uint64_t hash) {
+  if (write(ckpt->fd, &hash, sizeof(hash)) != sizeof(hash))
+    return ERR_FILACCESS;
+  __atomic_add_fetch(&ckpt->records, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+/* Returns true if the log of CKPT is long enough for a new checkpoint of
+ * KEYS keys to be written. */
+bool kvcheckpoint_due(kvcheckpoint_t *ckpt, size_t keys) {
+  uint64_t records = __atomic_load_n(&ckpt->records, __ATOMIC_RELAXED);
+  return records >= KVCHECKPOINT_MIN && records >= keys;
+}
+
+/* Appends the records of the log FILENAME to the old log OLDNAME, which
+ * still exists because the last checkpoint could not be written. Returns 0 if
+ * successful, else a negative error code. */
+static int kvcheckpoint_append_log(const char *filename, const char *oldname) {
+  uint64_t batch[KVCHECKPOINT_LOG_BATCH];
+  int in, out, ret = 0;
+  ssize_t len = 0;
+  if ((in = open(filename, O_RDONLY)) < 0)
+    return ERR_FILACCESS;
+  if ((out = open(oldname, O_WRONLY | O_APPEND)) < 0) {
+    close(in);
+    return ERR_FILACCESS;
+  }
+  if (lseek(in, sizeof(kvcheckpoint_log_header_t), SEEK_SET) < 0)
+    ret = ERR_FILACCESS;
+  while (ret == 0 && (len = read(in, batch, sizeof(batch))) > 0) {
+    len -= len % sizeof(uint64_t);
+    if (write(out, batch, len) != len)
+      ret = ERR_FILACCESS;
+  }
+  if (ret == 0 && (len < 0 || fdatasync(out) < 0))
+    ret = ERR_FILACCESS;
+  close(in);
+  close(out);
+  return ret;
+}
+
+/* Begins a new log of CKPT, keeping the current one as the old log until the
+ * next checkpoint is in place. No chain may be changing meanwhile. Should the
+ * old log remain from a checkpoint which failed, the current one is appended
+ * to it instead, as the checkpoint it applies to is still in place. Returns 0
+ * if successful, else a negative error code. */
+int kvcheckpoint_rotate(kvcheckpoint_t *ckpt) {
+  char filename[MAX_FILENAME], oldname[MAX_FILENAME];
+  kvcheckpoint_filename(ckpt, KVCHECKPOINT_LOGNAME, filename);
+  kvcheckpoint_filename(ckpt, KVCHECKPOINT_OLDNAME, oldname);
+  if (access(oldname, F_OK) == 0) {
+    if (kvcheckpoint_append_log(filename, oldname) < 0)
+      return ERR_FILACCESS;
+  } else if (rename(filename, oldname) < 0) {
+    return ERR_FILACCESS;
+  }
+  close(ckpt->fd);
+  return kvcheckpoint_open_log(ckpt);
+}
+
+/* Writes a new checkpoint of CKPT with the keys NEXT stores, called with ARG,
+ * through a temporary file renamed into place, and removes the old log.
+ * Returns 0 if successful, else a negative error code. */
+int kvcheckpoint_write(kvcheckpoint_t *ckpt, kvcheckpoint_next_fn next, void *arg) {
+  char filename[MAX_FILENAME], tmpname[MAX_FILENAME], key[MAX_KEYLEN + 1];
+  kvcheckpoint_header_t header;
+  kvcheckpoint_record_t record;
+  unsigned int chainpos;
+  bool failed = false;
+  FILE *file;
+  kvcheckpoint_filename(ckpt, KVCHECKPOINT_FILENAME, filename);
+  kvcheckpoint_filename(ckpt, KVCHECKPOINT_TMPNAME, tmpname);
+  if ((file = fopen(tmpname, "w")) == NULL)
+    return ERR_FILACCESS;
+  setvbuf(file, NULL, _IOFBF, 64 * 1024);
+  memset(&header, 0, sizeof(header));
+  header.magic = KVCHECKPOINT_MAGIC;
+  header.checksum = KVCHECKPOINT_FNV_OFFSET;
+  failed = fwrite(&header, sizeof(header), 1, file) != 1;
+  memset(&record, 0, sizeof(record));
+  while (!failed && next(arg, &record.hash, &chainpos, key)) {
+    record.chainpos = chainpos;
+    record.keylen = strlen(key);
+    header.checksum = kvcheckpoint_checksum(header.checksum, &record, sizeof(record));
+    header.checksum = kvcheckpoint_checksum(header.checksum, key, record.keylen);
+    header.count++;
+    header.size += sizeof(record) + record.keylen;
+    failed = fwrite(&record, sizeof(record), 1, file) != 1 ||
+             fwrite(key, record.keylen, 1, file) != 1;
+  }
+  if (failed || fseek(file, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, file) != 1 ||
+      fflush(file) != 0 || fdatasync(fileno(file)) < 0 || rename(tmpname, filename) < 0) {
+    fclose(file);
+    unlink(tmpname);
+    return ERR_FILACCESS;
+  }
+  fclose(file);
+  if (kvcheckpoint_sync_dir(ckpt) < 0)
+    return ERR_FILACCESS;
+  kvcheckpoint_filename(ckpt, KVCHECKPOINT_OLDNAME, filename);
+  unlink(filename);
+  return 0;
+}
+
+/* Releases the resources of CKPT. If CLEAN is true, a checkpoint of the
+ * current keys has just been written, and the log is removed, so that the
+ * next run trusts the checkpoint alone. */
+void kvcheckpoint_close(kvcheckpoint_t *ckpt, bool clean) {
+  char filename[MAX_FILENAME];
+  if (ckpt->fd >= 0)
+    close(ckpt->fd);
+  ckpt->fd = -1;
+  if (clean) {
+    kvcheckpoint_filename(ckpt, KVCHECKPOINT_LOGNAME, filename);
+    unlink(filename);
+    kvcheckpoint_sync_dir(ckpt);
+  }
+  free(ckpt->dirname);
+}
@@ -0,0 +1,105 @@
+#ifndef __KV_CHECKPOINT__
+#define __KV_CHECKPOINT__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "kvconstants.h"
+
+/* KVCheckpoint persists the index of the KVSTORE_FILES engine of KVStore (see
+ * kvindex.h), so that a store need not read every entry file within its
+ * directory upon initialization.
+ *
+ * A checkpoint, KVCHECKPOINT_FILENAME, is a kvcheckpoint_header_t followed by
+ * a kvcheckpoint_record_t per key, each followed by the key: the hash chain
+ * and chain position of every key as of when it was written. The header holds
+ * the size and a checksum of the records, so that the checkpoint is validated
+ * in one pass over its mapping, in time proportional to its size.
+ *
+ * The changes since the checkpoint are recorded in a log, KVCHECKPOINT_LOGNAME:
+ * before an entry file of a hash chain is written or removed, the hash of the
+ * chain is appended to the log.
+ * Upon initialization, the chains logged are read again from their entry
+ * files, whatever the checkpoint says about them, which is right however far
+ * the change got. The log is written, but not synced, before the change, so it
+ * only survives a crash of the process, not of the system: each log begins
+ * with the boot id of the system which wrote it, and the log of another boot
+ * makes the checkpoint unusable. A store whose checkpoint is missing or
+ * unusable is scanned in full instead. A clean close writes a checkpoint and
+ * removes the log.
+ *
+ * Once the log holds as many records as there are keys (and at least
+ * KVCHECKPOINT_MIN), a new checkpoint is written. The log is first renamed to
+ * KVCHECKPOINT_OLDNAME while no chain is changing, and a new one begun, which
+ * records the chains changed while the checkpoint is written; these may then
+ * be recorded inconsistently by the checkpoint. The old log is removed once
+ * the new checkpoint is in place.
+ *
+ * KVCheckpoint does no locking of its own; KVStore serializes access to it,
+ * except that kvcheckpoint_log may be called concurrently.
+ */
+
+#define KVCHECKPOINT_FILENAME "index.ckpt"
+#define KVCHECKPOINT_TMPNAME "index.ckpt.tmp"
+#define KVCHECKPOINT_LOGNAME "index.log"
+#define KVCHECKPOINT_OLDNAME "index.log.old"
+
+#define KVCHECKPOINT_MAGIC 0x4b56434b50543031ULL /* "KVCKPT01" */
+
+/* The number of records of the log below which no checkpoint is written. */
+#define KVCHECKPOINT_MIN 4096
+
+/* The size of a boot id, as read from /proc, terminator included. */
+#define KVCHECKPOINT_BOOT_ID_SIZE 40
+
+/* The header of a checkpoint. */
+typedef struct {
+  uint64_t magic;    /* KVCHECKPOINT_MAGIC. */
+  uint64_t count;    /* The number of records. */
+  uint64_t size;     /* The size of the records, in bytes. */
+  uint64_t checksum; /* The checksum of the records (see kvcheckpoint.c). */
+} kvcheckpoint_header_t;
+
+/* The header of a record of a checkpoint, followed by KEYLEN bytes of key. */
+typedef struct {
+  uint64_t hash;     /* The hash chain of the key. */
+  uint32_t chainpos; /* The position of the key within it. */
+  uint32_t keylen;   /* The length of the key. */
+} kvcheckpoint_record_t;
+
+/* The header of a log, followed by the hash of each chain changed. */
+typedef struct {
+  uint64_t magic;                          /* KVCHECKPOINT_MAGIC. */
+  char boot_id[KVCHECKPOINT_BOOT_ID_SIZE]; /* The boot id of the system which wrote it. */
+} kvcheckpoint_log_header_t;
+
+/* Called with every key of a checkpoint being loaded, passing ARG along. */
+typedef void (*kvcheckpoint_load_fn)(uint64_t hash, unsigned int chainpos, const char *key,
+                                     void *arg);
+
+/* Called for every key of a checkpoint being written, passing ARG along, to
+ * store the next key into KEY (which can hold MAX_KEYLEN + 1 bytes), and its
+ * hash chain and chain position into *HASH and *CHAINPOS. Returns 1 if it
+ * did, 0 once there are no more keys. */
+typedef int (*kvcheckpoint_next_fn)(void *arg, uint64_t *hash, unsigned int *chainpos, char *key);
+
+/* A KVCheckpoint. */
+typedef struct {
+  char *dirname;    /* The directory holding the files. */
+  int fd;           /* The log, open for appending, or -1. */
+  uint64_t records; /* The number of records of the log, updated atomically. */
+} kvcheckpoint_t;
+
+int kvcheckpoint_load(kvcheckpoint_t *, const char *dirname, kvcheckpoint_load_fn load, void *arg,
+                      uint64_t **hashes, size_t *count);
+int kvcheckpoint_begin(kvcheckpoint_t *);
+
+int kvcheckpoint_log(kvcheckpoint_t *, uint64_t hash);
+bool kvcheckpoint_due(kvcheckpoint_t *, size_t keys);
+
+int kvcheckpoint_rotate(kvcheckpoint_t *);
+int kvcheckpoint_write(kvcheckpoint_t *, kvcheckpoint_next_fn next, void *arg);
+
+void kvcheckpoint_close(kvcheckpoint_t *, bool clean);
+
+#endif
@@ -36,8 +36,16 @@
 /* Maximum size for a valid URL path (i.e. "register") */
 #define PATH_MAX_SIZE 8
 
+/* Maximum number of digits of a time to live, in seconds. */
+#define MAX_TTL_DIGITS 10
+
+/* Maximum number of digits of a transaction ID. */
+#define MAX_TXID_DIGITS 20
+
 /* Maximum size for an HTTP message */
-#define HTTP_MSG_MAX_SIZE (PATH_MAX_SIZE + MAX_KEYLEN + MAX_VALLEN + KVRES_BODY_MAX_SIZE + 20)
+#define HTTP_MSG_MAX_SIZE                                                                          \
+  (PATH_MAX_SIZE + MAX_KEYLEN + 2 * MAX_VALLEN + MAX_TTL_DIGITS + MAX_TXID_DIGITS +                \
+   KVRES_BODY_MAX_SIZE + 41)
 
 /* Maximum length for a file name. */
 #define MAX_FILENAME 1024
@@ -47,6 +55,9 @@
 #define ERRMSG_NO_KEY "error: no key"
 #define ERRMSG_KEY_LEN "error: improper key length"
 #define ERRMSG_VAL_LEN "error: value too long"
+#define ERRMSG_MISMATCH "error: value mismatch"
+#define ERRMSG_KEY_EXISTS "error: key exists"
+#define ERRMSG_KEY_BUSY "error: key busy, try again"
 #define ERRMSG_INVALID_REQUEST "error: invalid request"
 #define ERRMSG_NOT_IMPLEMENTED "error: not implemented"
 #define ERRMSG_NOT_AT_CAPACITY "error: follower_capacity not yet full"
@@ -62,9 +73,17 @@
 #define ERR_NOKEY -13
 /* Error for invalid message type. */
 #define ERR_INVLDMSG -14
+/* Error for a compare-and-set whose expected value is not the current one. */
+#define ERR_MISMATCH -15
+/* Error for a put-if-absent of a key which is present. */
+#define ERR_KEYEXISTS -16
 /* Error returned if error was encountered accessing a file.
  * NOTE: You shouldn't have to use this one. */
 #define ERR_FILACCESS -17
+/* Error for a record read from disk whose checksum does not match. */
+#define ERR_CHECKSUM -18
+/* Error for a write of a key which another transaction is still writing. */
+#define ERR_KEYBUSY -19
 
 /* Convert an error code to an error message.
  * GETMSG(ERR_NOKEY) --> ERRMSG_NO_KEY --> "error: no key"
@@ -72,13 +91,23 @@
 #define GETMSG(error)                                                                              \
   ((error == ERR_KEYLEN)                                                                           \
        ? ERRMSG_KEY_LEN                                                                            \
-       : ((error == ERR_VALLEN) ? ERRMSG_VAL_LEN                                                   \
-                                : ((error == ERR_NOKEY) ? ERRMSG_NO_KEY : ERRMSG_GENERIC_ERROR)))
+       : ((error == ERR_VALLEN)                                                                    \
+              ? ERRMSG_VAL_LEN                                                                     \
+              : ((error == ERR_NOKEY)                                                              \
+                     ? ERRMSG_NO_KEY                                                               \
+                     : ((error == ERR_MISMATCH)                                                    \
+                            ? ERRMSG_MISMATCH                                                      \
+                            : ((error == ERR_KEYEXISTS)                                            \
+                                   ? ERRMSG_KEY_EXISTS                                             \
+                                   : ((error == ERR_KEYBUSY) ? ERRMSG_KEY_BUSY                     \
+                                                             : ERRMSG_GENERIC_ERROR))))))
 
 /* Paths for API endpoints. */
 #define COMMIT_PATH MSG_COMMIT
 #define ABORT_PATH "abort"
 #define REGISTER_PATH "register"
+#define CAS_PATH "cas"
+#define PUTNX_PATH "putnx"
 
 /* Message types for use by KVMessage. */
 typedef enum {
@@ -90,6 +119,10 @@ typedef enum {
   REGISTER,
   COMMIT,
   ABORT,
+  /* Conditional requests, which come after those above so that the types of
+   * entries already within a TPCLog keep their values. */
+  CASREQ,   /* A PUTREQ only if the value of the key is EXPECTED (compare-and-set). */
+  PUTNXREQ, /* A PUTREQ only if the key is absent. */
   /* Responses */
   GETRESP,
   SUCCESS,
@@ -103,6 +136,10 @@ typedef enum {
 /* Possible TPC states. */
 typedef enum { TPC_INIT, TPC_WAIT, TPC_READY, TPC_ABORT, TPC_COMMIT } tpc_state_t;
 
+/* A function called with every entry visited by a range scan, in key order,
+ * and the ARG passed to the scan. Returning nonzero stops the scan. */
+typedef int (*kvscan_fn_t)(const char *key, const char *value, void *arg);
+
 /* A 64-bit string hash, based on MD5.
  * Do NOT change this function. */
 static inline uint64_t strhash64(const char *str) {
@@ -115,6 +152,24 @@ static inline uint64_t strhash64(const char *str) {
   return *(uint64_t *)result;
 }
 
+/* Computes strhash64 of each of the COUNT strings STRS into HASHES, hashing
+ * up to MD5_MULTI_LANES strings at once (see MD5_Multi), which is faster than
+ * hashing them one at a time. */
+static inline void strhash64_batch(char *const *strs, unsigned int count, uint64_t *hashes) {
+  unsigned char results[MD5_MULTI_LANES][16];
+  unsigned long sizes[MD5_MULTI_LANES];
+  unsigned int i, n;
+  for (; count > 0; strs += n, hashes += n, count -= n) {
+    n = min(count, MD5_MULTI_LANES);
+    for (i = 0; i < n; i++)
+      sizes[i] = strlen(strs[i]);
+    MD5_Multi((const void *const *)strs, sizes, n, results);
+    /* This only works for little-endian machines. */
+    for (i = 0; i < n; i++)
+      hashes[i] = *(uint64_t *)results[i];
+  }
+}
+
 static inline bool is_empty_str(const char *str) { return str[0] == '\0'; }
 
 #endif
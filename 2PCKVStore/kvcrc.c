@@ -0,0 +1,78 @@
+#include <pthread.h>
+#include <string.h>
+#include "kvcrc.h"
+
+/* The Castagnoli polynomial, bit reversed. */
+#define KVCRC_POLY 0x82f63b78
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define KVCRC_SSE42 __attribute__((target("sse4.2")))
+#define KVCRC_HAS_SSE42() __builtin_cpu_supports("sse4.2")
+#endif
+
+/* The lookup tables: KVCRC_TABLES[0] advances a checksum by one byte, and
+ * KVCRC_TABLES[N] by one byte followed by N zero bytes. */
+static uint32_t kvcrc_tables[8][256];
+static pthread_once_t kvcrc_once = PTHREAD_ONCE_INIT;
+
+/* Builds KVCRC_TABLES. */
+static void kvcrc_init_tables(void) {
+  uint32_t crc;
+  int i, j;
+  for (i = 0; i < 256; i++) {
+    crc = i;
+    for (j = 0; j < 8; j++)
+      crc = (crc >> 1) ^ (KVCRC_POLY & -(crc & 1));
+    kvcrc_tables[0][i] = crc;
+  }
+  for (i = 0; i < 256; i++) {
+    for (j = 1; j < 8; j++) {
+      crc = kvcrc_tables[j - 1][i];
+      kvcrc_tables[j][i] = (crc >> 8) ^ kvcrc_tables[0][crc & 0xff];
+    }
+  }
+}
+
+/* Advances CRC over the LEN bytes at P using the lookup tables. */
+static uint32_t kvcrc_tables_update(uint32_t crc, const uint8_t *p, size_t len) {
+  uint32_t lo;
+  pthread_once(&kvcrc_once, kvcrc_init_tables);
+  for (; len >= 8; p += 8, len -= 8) {
+    lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+                (uint32_t)p[3] << 24);
+    crc = kvcrc_tables[7][lo & 0xff] ^ kvcrc_tables[6][(lo >> 8) & 0xff] ^
+          kvcrc_tables[5][(lo >> 16) & 0xff] ^ kvcrc_tables[4][lo >> 24] ^
+          kvcrc_tables[3][p[4]] ^ kvcrc_tables[2][p[5]] ^ kvcrc_tables[1][p[6]] ^
+          kvcrc_tables[0][p[7]];
+  }
+  for (; len > 0; p++, len--)
+    crc = (crc >> 8) ^ kvcrc_tables[0][(crc ^ *p) & 0xff];
+  return crc;
+}
+
+#ifdef KVCRC_SSE42
+/* Advances CRC over the LEN bytes at P using the crc32 instruction. */
+static KVCRC_SSE42 uint32_t kvcrc_sse42_update(uint32_t crc, const uint8_t *p, size_t len) {
+  uint64_t word, crc64 = crc;
+  for (; len >= 8; p += 8, len -= 8) {
+    memcpy(&word, p, sizeof(word));
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  crc = crc64;
+  for (; len > 0; p++, len--)
+    crc = _mm_crc32_u8(crc, *p);
+  return crc;
+}
+#endif
+
+/* Returns the CRC32C of the LEN bytes at DATA, continuing from CRC, the
+ * checksum of the bytes before them (0 for none). */
+uint32_t kvcrc32c(uint32_t crc, const void *data, size_t len) {
+  crc = ~crc;
+#ifdef KVCRC_SSE42
+  if (KVCRC_HAS_SSE42())
+    return ~kvcrc_sse42_update(crc, data, len);
+#endif
+  return ~kvcrc_tables_update(crc, data, len);
+}
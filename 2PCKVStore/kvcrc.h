@@ -0,0 +1,25 @@
+#ifndef __KV_CRC__
+#define __KV_CRC__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* KVCRC computes CRC32C (the Castagnoli polynomial, as used by iSCSI, ext4
+ * and SSE4.2) checksums, which the records written to disk carry so that torn
+ * or otherwise corrupted records are detected when they are read.
+ *
+ * On x86 processors supporting SSE4.2, the checksum is computed 8 bytes at a
+ * time with the crc32 instruction, at several bytes per cycle, so that
+ * verifying every record read costs little next to reading it. Elsewhere it
+ * is computed with lookup tables, 8 bytes at a time (slicing-by-8), which are
+ * built upon first use. Both compute the same values, so records written on
+ * one machine verify on any other.
+ *
+ * KVStore verifies every entry it reads from disk, so that a torn or corrupted
+ * entry is never returned: a read of one fails with ERR_CHECKSUM instead, and
+ * is counted in the CORRUPTIONS statistic.
+ */
+
+uint32_t kvcrc32c(uint32_t crc, const void *data, size_t len);
+
+#endif
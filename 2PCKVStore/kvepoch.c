@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/membarrier.h>
+#include "kvconstants.h"
+#include "kvepoch.h"
+
+/* The slot of a thread. EPOCH is the epoch the thread observed upon entering
+ * its current traversal, or 0 outside of traversals. Slots are padded to a
+ * cache line each, so that readers never write to a shared line. */
+typedef struct {
+  uint64_t epoch;
+  bool claimed;
+  char pad[64 - sizeof(uint64_t) - sizeof(bool)];
+} kvepoch_slot_t;
+
+/* Memory waiting to be freed. */
+typedef struct {
+  void *ptr;      /* The memory to free. */
+  uint64_t epoch; /* The epoch during which it was retired. */
+} kvepoch_retired_t;
+
+static uint64_t kvepoch_global = 1;
+static kvepoch_slot_t kvepoch_slots[KVEPOCH_MAX_THREADS] __attribute__((aligned(64)));
+static uint32_t kvepoch_nslots; /* The number of slots ever claimed. */
+
+static pthread_mutex_t kvepoch_lock = PTHREAD_MUTEX_INITIALIZER; /* Protects the fields below. */
+static kvepoch_retired_t *kvepoch_limbo;
+static size_t kvepoch_nlimbo, kvepoch_climbo;
+
+static pthread_once_t kvepoch_once = PTHREAD_ONCE_INIT;
+static pthread_key_t kvepoch_key;
+/* Whether the process may issue expedited membarriers, with which
+ * kvepoch_advance orders the slot stores of readers for them. */
+static bool kvepoch_membarrier;
+static __thread kvepoch_slot_t *kvepoch_self;
+static __thread unsigned int kvepoch_nesting;
+
+/* Releases the slot of an exiting thread. */
+static void kvepoch_release(void *slot) {
+  __atomic_store_n(&((kvepoch_slot_t *)slot)->epoch, 0, __ATOMIC_RELEASE);
+  __atomic_store_n(&((kvepoch_slot_t *)slot)->claimed, false, __ATOMIC_RELEASE);
+}
+
+/* Initializes the reclamation domain, upon first use. */
+static void kvepoch_init(void) {
+  pthread_key_create(&kvepoch_key, kvepoch_release);
+  kvepoch_membarrier =
+      syscall(__NR_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0) == 0;
+}
+
+/* Claims a slot for the calling thread. */
+static kvepoch_slot_t *kvepoch_claim(void) {
+  bool unclaimed;
+  uint32_t i;
+  pthread_once(&kvepoch_once, kvepoch_init);
+  for (i = 0; i < KVEPOCH_MAX_THREADS; i++) {
+    unclaimed = false;
+    if (__atomic_compare_exchange_n(&kvepoch_slots[i].claimed, &unclaimed, true, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+      break;
+  }
+  if (i == KVEPOCH_MAX_THREADS)
+    fatal("kvepoch: too many threads", 1);
+  /* Raise the number of slots the epoch is advanced over to include I. */
+  uint32_t n = __atomic_load_n(&kvepoch_nslots, __ATOMIC_RELAXED);
+  while (n <= i && !__atomic_compare_exchange_n(&kvepoch_nslots, &n, i + 1, false,
+                                                __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    ;
+  pthread_setspecific(kvepoch_key, &kvepoch_slots[i]);
+  return &kvepoch_slots[i];
+}
+
+/* Enters a traversal. Memory reachable from the shared structures at any time
+ * until the matching kvepoch_exit will not be freed before then. */
+void kvepoch_enter(void) {
+  if (kvepoch_nesting++ > 0)
+    return;
+  if (kvepoch_self == NULL)
+    kvepoch_self = kvepoch_claim();
+  __atomic_store_n(&kvepoch_self->epoch, __atomic_load_n(&kvepoch_global, __ATOMIC_ACQUIRE),
+                   __ATOMIC_RELAXED);
+  /* Make the slot visible before any shared pointer is loaded. With
+   * membarriers, kvepoch_advance forces that upon the reader, which then only
+   * keeps the compiler from reordering, rather than paying a fence per
+   * traversal. */
+  if (kvepoch_membarrier)
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  else
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/* Leaves the traversal entered by the matching kvepoch_enter. */
+void kvepoch_exit(void) {
+  if (--kvepoch_nesting > 0)
+    return;
+  __atomic_store_n(&kvepoch_self->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/* Advances the global epoch if every thread within a traversal has observed
+ * it. The caller must hold KVEPOCH_LOCK. Returns the current epoch. */
+static uint64_t kvepoch_advance(void) {
+  uint64_t global = __atomic_load_n(&kvepoch_global, __ATOMIC_SEQ_CST), epoch;
+  uint32_t i, n;
+  /* Readers fence only the compiler, so run a full barrier on every thread of
+   * the process before their slots are read. */
+  pthread_once(&kvepoch_once, kvepoch_init);
+  if (kvepoch_membarrier && syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0) < 0)
+    fatal("kvepoch: membarrier failed", 1);
+  n = __atomic_load_n(&kvepoch_nslots, __ATOMIC_SEQ_CST);
+  for (i = 0; i < n; i++) {
+    epoch = __atomic_load_n(&kvepoch_slots[i].epoch, __ATOMIC_SEQ_CST);
+    if (epoch != 0 && epoch != global)
+      return global;
+  }
+  __atomic_store_n(&kvepoch_global, global + 1, __ATOMIC_SEQ_CST);
+  return global + 1;
+}
+
+/* Frees the retired memory which no traversal can reach anymore, given the
+ * current epoch GLOBAL. The caller must hold KVEPOCH_LOCK. */
+static void kvepoch_reclaim(uint64_t global) {
+  size_t i, n = 0;
+  /* Memory is retired in epoch order. */
+  while (n < kvepoch_nlimbo && kvepoch_limbo[n].epoch + 2 <= global)
+    free(kvepoch_limbo[n++].ptr);
+  for (i = n; i < kvepoch_nlimbo; i++)
+    kvepoch_limbo[i - n] = kvepoch_limbo[i];
+  kvepoch_nlimbo -= n;
+}
+
+/* Frees PTR, which has been unlinked from every shared structure, once no
+ * traversal which could have seen it remains. */
+void kvepoch_retire(void *ptr) {
+  if (ptr == NULL)
+    return;
+  pthread_mutex_lock(&kvepoch_lock);
+  if (kvepoch_nlimbo == kvepoch_climbo) {
+    kvepoch_climbo = kvepoch_climbo ? kvepoch_climbo * 2 : 256;
+    kvepoch_limbo = realloc(kvepoch_limbo, kvepoch_climbo * sizeof(kvepoch_retired_t));
+    if (!kvepoch_limbo)
+      fatal_malloc();
+  }
+  kvepoch_limbo[kvepoch_nlimbo].ptr = ptr;
+  kvepoch_limbo[kvepoch_nlimbo++].epoch = __atomic_load_n(&kvepoch_global, __ATOMIC_SEQ_CST);
+  if (kvepoch_nlimbo % KVEPOCH_RECLAIM_BATCH == 0)
+    kvepoch_reclaim(kvepoch_advance());
+  pthread_mutex_unlock(&kvepoch_lock);
+}
+
+/* Waits until every traversal in progress has ended, and frees all memory
+ * retired so far. Must not be called from within a traversal. */
+void kvepoch_synchronize(void) {
+  uint64_t target;
+  pthread_mutex_lock(&kvepoch_lock);
+  target = __atomic_load_n(&kvepoch_global, __ATOMIC_SEQ_CST) + 2;
+  while (kvepoch_advance() < target) {
+    pthread_mutex_unlock(&kvepoch_lock);
+    sched_yield();
+    pthread_mutex_lock(&kvepoch_lock);
+  }
+  kvepoch_reclaim(__atomic_load_n(&kvepoch_global, __ATOMIC_SEQ_CST));
+  pthread_mutex_unlock(&kvepoch_lock);
+}
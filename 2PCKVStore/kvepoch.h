@@ -0,0 +1,39 @@
+#ifndef __KV_EPOCH__
+#define __KV_EPOCH__
+
+/* KVEpoch implements epoch-based reclamation, which lets readers traverse
+ * shared structures without taking any lock while writers replace parts of
+ * them.
+ *
+ * Readers bracket every traversal with kvepoch_enter and kvepoch_exit. Writers
+ * publish new versions with atomic stores and, instead of freeing what they
+ * unlinked, hand it to kvepoch_retire. A global epoch is advanced whenever
+ * every thread within a traversal has observed the current epoch; memory
+ * retired during an epoch is freed once the epoch has advanced twice since,
+ * by which time no traversal which could have seen it remains.
+ *
+ * There is a single reclamation domain per process. Every thread which enters
+ * it claims one of KVEPOCH_MAX_THREADS slots, released when the thread exits.
+ * Traversals may nest, but must not block for long, as that holds back
+ * reclamation for everyone.
+ *
+ * Entering a traversal costs no memory fence where the kernel offers
+ * expedited membarrier(2): the slot of a reader is only ordered against the
+ * compiler, and each attempt to advance the epoch issues a membarrier, which
+ * runs a full barrier on every thread of the process, before reading the
+ * slots. Elsewhere, readers fence.
+ */
+
+/* The largest number of threads which may use KVEpoch at a time. */
+#define KVEPOCH_MAX_THREADS 256
+
+/* The number of retirements after which reclamation is attempted. */
+#define KVEPOCH_RECLAIM_BATCH 64
+
+void kvepoch_enter(void);
+void kvepoch_exit(void);
+
+void kvepoch_retire(void *ptr);
+void kvepoch_synchronize(void);
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef __KV_HASH__
+#define __KV_HASH__
+
+#include <stdint.h>
+#include <string.h>
+
+/* KVHash is a fast, non-cryptographic 64-bit hash in the style of wyhash, for
+ * hash tables, lock stripes and caches which only live within one process.
+ * Each step folds 16 bytes of input into the state with a 64x64->128-bit
+ * multiply, so a short key costs a few multiplies instead of a full MD5 block.
+ *
+ * Its values are NOT stable across versions of this file, and are unrelated
+ * to those of strhash64. Anything which outlives the process or is shared
+ * with other processes (file names of entries, bloom filters on disk, the
+ * placement of keys on followers) must keep using strhash64.
+ */
+
+#define KVHASH_P0 0xa0761d6478bd642full
+#define KVHASH_P1 0xe7037ed1a0b428dbull
+#define KVHASH_P2 0x8ebc6af09c88c6e3ull
+
+/* Returns the 64 bits of A * B folded into each other. */
+static inline uint64_t kvhash_mix(uint64_t a, uint64_t b) {
+  __uint128_t r = (__uint128_t)a * b;
+  return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+/* Reads 8 and 4 bytes at P, which need not be aligned. */
+static inline uint64_t kvhash_read64(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint64_t kvhash_read32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+/* Returns the hash of the LEN bytes at DATA. */
+static inline uint64_t kvhash64(const void *data, size_t len) {
+  const uint8_t *p = data;
+  uint64_t seed = KVHASH_P0, a, b;
+  size_t i = len;
+  if (len <= 16) {
+    if (len >= 4) {
+      /* Two possibly overlapping reads from each end cover all the bytes. */
+      a = (kvhash_read32(p) << 32) | kvhash_read32(p + ((len >> 3) << 2));
+      b = (kvhash_read32(p + len - 4) << 32) | kvhash_read32(p + len - 4 - ((len >> 3) << 2));
+    } else if (len > 0) {
+      a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    for (; i > 16; p += 16, i -= 16)
+      seed = kvhash_mix(kvhash_read64(p) ^ KVHASH_P1, kvhash_read64(p + 8) ^ seed);
+    /* The last 16 bytes, some of which may have been hashed already. */
+    a = kvhash_read64(p + i - 16);
+    b = kvhash_read64(p + i - 8);
+  }
+  return kvhash_mix(KVHASH_P1 ^ len, kvhash_mix(a ^ KVHASH_P1, b ^ seed) ^ KVHASH_P2);
+}
+
+/* Returns the hash of the string STR. */
+static inline uint64_t kvhash_str(const char *str) { return kvhash64(str, strlen(str)); }
+
+#endif
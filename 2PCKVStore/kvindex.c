@@ -0,0 +1,222 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kvconstants.h"
+#include "kvepoch.h"
+#include "kvindex.h"
+
+/* Allocates a hash table of NBUCKETS empty buckets. */
+static kvindex_table_t *kvindex_table_new(size_t nbuckets) {
+  kvindex_table_t *table;
+  table = calloc(1, sizeof(kvindex_table_t) + nbuckets * sizeof(kvindex_chain_t *));
+  if (!table)
+    fatal_malloc();
+  table->mask = nbuckets - 1;
+  return table;
+}
+
+/* Returns the number of bytes of the hash table TABLE. */
+static size_t kvindex_table_bytes(kvindex_table_t *table) {
+  return sizeof(kvindex_table_t) + (table->mask + 1) * sizeof(kvindex_chain_t *);
+}
+
+/* Returns the number of bytes of CHAIN. */
+static size_t kvindex_chain_bytes(kvindex_chain_t *chain) {
+  return sizeof(kvindex_chain_t) + chain->length * sizeof(uint32_t) + chain->size;
+}
+
+/* Returns the key at CHAINPOS of CHAIN, or NULL if there is none. */
+static const char *kvindex_chain_key(kvindex_chain_t *chain, unsigned int chainpos) {
+  if (chainpos >= chain->length || chain->slots[chainpos] == KVINDEX_EMPTY)
+    return NULL;
+  return (char *)&chain->slots[chain->length] + chain->slots[chainpos];
+}
+
+/* Allocates a chain of HASH with LENGTH slots, holding the keys of OLD (which
+ * may be NULL), except that CHAINPOS holds KEY instead (if it is less than
+ * LENGTH), and leaving the others empty. */
+static kvindex_chain_t *kvindex_chain_new(uint64_t hash, unsigned int length,
+                                          kvindex_chain_t *old, unsigned int chainpos,
+                                          const char *key) {
+  kvindex_chain_t *chain;
+  size_t size = 0, len;
+  const char *k;
+  unsigned int i;
+  char *keys;
+  for (i = 0; i < length; i++) {
+    k = i == chainpos ? key : old ? kvindex_chain_key(old, i) : NULL;
+    size += k ? strlen(k) + 1 : 0;
+  }
+  chain = malloc(sizeof(kvindex_chain_t) + length * sizeof(uint32_t) + size);
+  if (!chain)
+    fatal_malloc();
+  chain->hash = hash;
+  chain->next = NULL;
+  chain->length = length;
+  chain->size = size;
+  keys = (char *)&chain->slots[length];
+  for (i = 0, size = 0; i < length; i++) {
+    k = i == chainpos ? key : old ? kvindex_chain_key(old, i) : NULL;
+    if (k == NULL) {
+      chain->slots[i] = KVINDEX_EMPTY;
+      continue;
+    }
+    len = strlen(k) + 1;
+    memcpy(keys + size, k, len);
+    chain->slots[i] = size;
+    size += len;
+  }
+  return chain;
+}
+
+/* Returns the current chain of HASH within INDEX, or NULL if there is none.
+ * Readers must be within a KVEpoch traversal. */
+static kvindex_chain_t *kvindex_find(kvindex_t *index, uint64_t hash) {
+  kvindex_table_t *table = __atomic_load_n(&index->table, __ATOMIC_ACQUIRE);
+  kvindex_chain_t *chain = __atomic_load_n(&table->buckets[hash & table->mask], __ATOMIC_ACQUIRE);
+  while (chain != NULL && chain->hash != hash)
+    chain = __atomic_load_n(&chain->next, __ATOMIC_ACQUIRE);
+  return chain;
+}
+
+/* Replaces the chain OLD of INDEX with CHAIN, or unlinks it if CHAIN is NULL,
+ * and retires OLD. */
+static void kvindex_replace(kvindex_t *index, kvindex_chain_t *old, kvindex_chain_t *chain) {
+  kvindex_chain_t **link = &index->table->buckets[old->hash & index->table->mask];
+  while (*link != old)
+    link = &(*link)->next;
+  index->bytes -= kvindex_chain_bytes(old);
+  if (chain != NULL) {
+    chain->next = old->next;
+    index->bytes += kvindex_chain_bytes(chain);
+  }
+  __atomic_store_n(link, chain ? chain : old->next, __ATOMIC_RELEASE);
+  kvepoch_retire(old);
+}
+
+/* Doubles the number of buckets of INDEX. Since chains are linked through
+ * their buckets, every chain is copied into the new table, which is then
+ * published at once. */
+static void kvindex_grow(kvindex_t *index) {
+  kvindex_table_t *old = index->table, *table = kvindex_table_new((old->mask + 1) * 2);
+  kvindex_chain_t *chain, *next, *copy, **bucket;
+  size_t i;
+  for (i = 0; i <= old->mask; i++) {
+    for (chain = old->buckets[i]; chain != NULL; chain = chain->next) {
+      copy = malloc(kvindex_chain_bytes(chain));
+      if (!copy)
+        fatal_malloc();
+      memcpy(copy, chain, kvindex_chain_bytes(chain));
+      bucket = &table->buckets[chain->hash & table->mask];
+      copy->next = *bucket;
+      *bucket = copy;
+    }
+  }
+  __atomic_store_n(&index->table, table, __ATOMIC_RELEASE);
+  index->bytes += kvindex_table_bytes(table) - kvindex_table_bytes(old);
+  for (i = 0; i <= old->mask; i++) {
+    for (chain = old->buckets[i]; chain != NULL; chain = next) {
+      next = chain->next;
+      kvepoch_retire(chain);
+    }
+  }
+  kvepoch_retire(old);
+}
+
+/* Initializes the empty index INDEX. */
+void kvindex_init(kvindex_t *index) {
+  index->table = kvindex_table_new(KVINDEX_BUCKETS);
+  index->count = 0;
+  index->bytes = kvindex_table_bytes(index->table);
+}
+
+/* Frees INDEX and all of its keys. No reader may use INDEX anymore. */
+void kvindex_free(kvindex_t *index) {
+  kvindex_chain_t *chain, *next;
+  size_t b;
+  for (b = 0; b <= index->table->mask; b++) {
+    for (chain = index->table->buckets[b]; chain != NULL; chain = next) {
+      next = chain->next;
+      free(chain);
+    }
+  }
+  free(index->table);
+  index->table = NULL;
+  /* Release the versions retired meanwhile along with the index. */
+  kvepoch_synchronize();
+}
+
+/* Returns the position of KEY within the hash chain HASH of INDEX, or
+ * ERR_NOKEY if KEY is not present. Takes no lock, and may be called
+ * concurrently with writers. */
+int kvindex_lookup(kvindex_t *index, uint64_t hash, const char *key) {
+  kvindex_chain_t *chain;
+  unsigned int i;
+  int ret = ERR_NOKEY;
+  kvepoch_enter();
+  chain = kvindex_find(index, hash);
+  for (i = 0; chain != NULL && i < chain->length; i++) {
+    if (chain->slots[i] != KVINDEX_EMPTY && strcmp(kvindex_chain_key(chain, i), key) == 0) {
+      ret = i;
+      break;
+    }
+  }
+  kvepoch_exit();
+  return ret;
+}
+
+/* Returns the length of the hash chain HASH of INDEX, which is where a new key
+ * is appended to it. Takes no lock. */
+unsigned int kvindex_length(kvindex_t *index, uint64_t hash) {
+  kvindex_chain_t *chain;
+  unsigned int length;
+  kvepoch_enter();
+  chain = kvindex_find(index, hash);
+  length = chain ? chain->length : 0;
+  kvepoch_exit();
+  return length;
+}
+
+/* Returns the key stored at CHAINPOS of the hash chain HASH of INDEX, or NULL
+ * if there is none. The key is only valid until the next write, with which
+ * the caller must serialize this. */
+const char *kvindex_key(kvindex_t *index, uint64_t hash, unsigned int chainpos) {
+  kvindex_chain_t *chain = kvindex_find(index, hash);
+  return chain != NULL ? kvindex_chain_key(chain, chainpos) : NULL;
+}
+
+/* Records in INDEX that KEY is stored at CHAINPOS of the hash chain HASH.
+ * Returns true if KEY was added, or false if CHAINPOS already held a key. */
+bool kvindex_set(kvindex_t *index, uint64_t hash, unsigned int chainpos, const char *key) {
+  kvindex_chain_t *old = kvindex_find(index, hash), *chain, **bucket;
+  if (old != NULL && kvindex_chain_key(old, chainpos) != NULL)
+    return false;
+  chain = kvindex_chain_new(hash, old && old->length > chainpos ? old->length : chainpos + 1, old,
+                            chainpos, key);
+  if (old != NULL) {
+    kvindex_replace(index, old, chain);
+    return true;
+  }
+  bucket = &index->table->buckets[hash & index->table->mask];
+  chain->next = *bucket;
+  __atomic_store_n(bucket, chain, __ATOMIC_RELEASE);
+  index->bytes += kvindex_chain_bytes(chain);
+  if (++index->count > index->table->mask + 1)
+    kvindex_grow(index);
+  return true;
+}
+
+/* Removes the key at CHAINPOS of the hash chain HASH from INDEX, moving the
+ * last key of the chain into its place just as kvstore_del does with the
+ * entry files. */
+void kvindex_remove(kvindex_t *index, uint64_t hash, unsigned int chainpos) {
+  kvindex_chain_t *old = kvindex_find(index, hash), *chain = NULL;
+  if (old == NULL || chainpos >= old->length)
+    return;
+  if (old->length > 1)
+    chain = kvindex_chain_new(hash, old->length - 1, old, chainpos,
+                              kvindex_chain_key(old, old->length - 1));
+  else
+    index->count--;
+  kvindex_replace(index, old, chain);
+}
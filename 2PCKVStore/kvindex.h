@@ -0,0 +1,79 @@
+#ifndef __KV_INDEX__
+#define __KV_INDEX__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* KVIndex is the in-memory index of the KVSTORE_FILES engine of KVStore,
+ * mapping hash(key) to the keys of its hash chain, in chain order.
+ *
+ * The index can be read without taking any lock: kvindex_lookup only loads
+ * pointers published by writers and never blocks. Chains are never modified
+ * in place; a writer instead builds a new version of the chain and publishes
+ * it with a single atomic store, so a reader sees either the old or the new
+ * chain as a whole. The hash table is grown the same way. Versions replaced
+ * are retired to KVEpoch (see kvepoch.h) and freed once no reader can still be
+ * looking at them.
+ *
+ * Each version of a chain is a single allocation: a fixed-size slot per
+ * chain position, holding the offset of its key within the keys packed after
+ * the slots, so that a key costs its bytes and a slot rather than a pointer
+ * and an allocation of its own.
+ *
+ * Writers (kvindex_set and kvindex_remove) must be serialized by the caller.
+ *
+ * KVStore builds the index upon initialization, from its checkpoint (see
+ * kvcheckpoint.h) or by scanning the store directory once, and keeps it in
+ * sync on every put and delete, so that finding an entry costs at most one
+ * file read and finding a key absent costs no file system access at all. The
+ * keys are also kept in sorted order (see kvkeys.h), for kvstore_scan.
+ *
+ * Reads of the KVSTORE_FILES engine therefore take no lock at all. Each stripe
+ * of the key locks carries a sequence number which writers make odd while they
+ * change the entry files of the stripe. A reader which finds the sequence
+ * number odd, or changed after reading an entry file, retries, and after
+ * KVSTORE_READ_RETRIES attempts falls back to taking the key lock, as every
+ * read does with OPTS->locked_reads.
+ */
+
+/* The initial number of buckets of the hash table. */
+#define KVINDEX_BUCKETS 1024
+
+/* The slot of a chain position which holds no key. */
+#define KVINDEX_EMPTY UINT32_MAX
+
+/* A version of a hash chain, followed by its keys, each terminated. */
+typedef struct kvindex_chain {
+  uint64_t hash;              /* The hash(key) shared by all keys in this chain. */
+  struct kvindex_chain *next; /* The next chain within the same bucket. */
+  unsigned int length;        /* The number of SLOTS. */
+  unsigned int size;          /* The number of bytes of the keys. */
+  uint32_t slots[];           /* The offset of the key at each chain position within the
+                                 keys, or KVINDEX_EMPTY. */
+} kvindex_chain_t;
+
+/* A version of the hash table. */
+typedef struct {
+  size_t mask;                /* The number of buckets, minus one. */
+  kvindex_chain_t *buckets[]; /* The chains of each bucket. */
+} kvindex_table_t;
+
+/* A KVIndex. */
+typedef struct {
+  kvindex_table_t *table; /* The current hash table. */
+  size_t count;           /* The number of chains. */
+  size_t bytes;           /* The number of bytes of memory held by the current version. */
+} kvindex_t;
+
+void kvindex_init(kvindex_t *);
+void kvindex_free(kvindex_t *);
+
+int kvindex_lookup(kvindex_t *, uint64_t hash, const char *key);
+unsigned int kvindex_length(kvindex_t *, uint64_t hash);
+const char *kvindex_key(kvindex_t *, uint64_t hash, unsigned int chainpos);
+
+bool kvindex_set(kvindex_t *, uint64_t hash, unsigned int chainpos, const char *key);
+void kvindex_remove(kvindex_t *, uint64_t hash, unsigned int chainpos);
+
+#endif
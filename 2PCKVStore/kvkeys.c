@@ -0,0 +1,361 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kvkeys.h"
+
+/* A record is the length of the prefix its key shares with the key before it
+ * within its block, the length of the rest of the key, and the rest of the
+ * key. Lengths are stored 7 bits per byte, low bits first, with the top bit
+ * set on every byte but the last, so that keys shorter than 128 bytes cost
+ * two bytes beyond their unshared suffix. */
+
+/* The largest size of the two lengths of a record, for keys of at most
+ * MAX_KEYLEN bytes. */
+#define KVKEYS_HEADER_MAX 4
+
+/* Stores LEN into BUF. Returns the number of bytes stored. */
+static size_t kvkeys_put_len(char *buf, size_t len) {
+  size_t n = 0;
+  while (len >= 0x80) {
+    buf[n++] = (char)(len | 0x80);
+    len >>= 7;
+  }
+  buf[n++] = (char)len;
+  return n;
+}
+
+/* Loads the length stored at BUF into *LEN. Returns the number of bytes it
+ * was stored in. */
+static size_t kvkeys_get_len(const char *buf, size_t *len) {
+  const unsigned char *p = (const unsigned char *)buf;
+  size_t n = 0, shift = 0;
+  *len = 0;
+  do {
+    *len |= (size_t)(p[n] & 0x7f) << shift;
+    shift += 7;
+  } while (p[n++] & 0x80);
+  return n;
+}
+
+/* Encodes KEY, of KEYLEN bytes, as the record following the key PREV, of
+ * PREVLEN bytes (0 for the first key of a block), into BUF, which must be able
+ * to hold KVKEYS_HEADER_MAX + KEYLEN bytes. Returns the size of the record. */
+static size_t kvkeys_encode(char *buf, const char *prev, size_t prevlen, const char *key,
+                            size_t keylen) {
+  size_t shared = 0, n;
+  while (shared < prevlen && shared < keylen && prev[shared] == key[shared])
+    shared++;
+  n = kvkeys_put_len(buf, shared);
+  n += kvkeys_put_len(buf + n, keylen - shared);
+  memcpy(buf + n, key + shared, keylen - shared);
+  return n + keylen - shared;
+}
+
+/* Decodes the record at OFFSET of BLOCK into KEY, which must hold the key of
+ * the record before it, and its length into *KEYLEN. Returns the offset of the
+ * next record. */
+static uint32_t kvkeys_decode(kvkeys_block_t *block, uint32_t offset, char *key, size_t *keylen) {
+  size_t shared, rest;
+  offset += kvkeys_get_len(block->data + offset, &shared);
+  offset += kvkeys_get_len(block->data + offset, &rest);
+  memcpy(key + shared, block->data + offset, rest);
+  *keylen = shared + rest;
+  return offset + rest;
+}
+
+/* Compares the key A, of ALEN bytes, with the key B, of BLEN bytes, as
+ * strcmp() does. */
+static int kvkeys_cmp(const char *a, size_t alen, const char *b, size_t blen) {
+  int ret = memcmp(a, b, min(alen, blen));
+  if (ret != 0)
+    return ret;
+  return alen < blen ? -1 : alen > blen;
+}
+
+/* Returns the block of KEYS which holds KEY, of KEYLEN bytes, or would: the
+ * last one whose first key is not greater than KEY, or the first one. KEYS
+ * must not be empty. */
+static size_t kvkeys_find_block(kvkeys_t *keys, const char *key, size_t keylen) {
+  size_t lo = 0, hi = keys->nblocks, mid, len, offset;
+  kvkeys_block_t *block;
+  while (hi - lo > 1) {
+    mid = lo + (hi - lo) / 2;
+    block = &keys->blocks[mid];
+    /* The first key of a block shares no prefix. */
+    offset = kvkeys_get_len(block->data, &len);
+    offset += kvkeys_get_len(block->data + offset, &len);
+    if (kvkeys_cmp(block->data + offset, len, key, keylen) <= 0)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* Inserts an empty block into KEYS at index I. */
+static void kvkeys_block_insert(kvkeys_t *keys, size_t i) {
+  if (keys->nblocks == keys->capacity) {
+    keys->bytes -= keys->capacity * sizeof(kvkeys_block_t);
+    keys->capacity = keys->capacity ? 2 * keys->capacity : 16;
+    keys->blocks = realloc(keys->blocks, keys->capacity * sizeof(kvkeys_block_t));
+    if (!keys->blocks)
+      fatal_malloc();
+    keys->bytes += keys->capacity * sizeof(kvkeys_block_t);
+  }
+  memmove(&keys->blocks[i + 1], &keys->blocks[i], (keys->nblocks - i) * sizeof(kvkeys_block_t));
+  memset(&keys->blocks[i], 0, sizeof(kvkeys_block_t));
+  keys->nblocks++;
+}
+
+/* Removes the block at index I of KEYS, whose keys must already be accounted
+ * for elsewhere. */
+static void kvkeys_block_delete(kvkeys_t *keys, size_t i) {
+  free(keys->blocks[i].data);
+  keys->nblocks--;
+  memmove(&keys->blocks[i], &keys->blocks[i + 1], (keys->nblocks - i) * sizeof(kvkeys_block_t));
+}
+
+/* Replaces the bytes [FROM, TO) of the block I of KEYS with the LEN bytes of
+ * DATA. */
+static void kvkeys_splice(kvkeys_t *keys, size_t i, uint32_t from, uint32_t to, const char *data,
+                          size_t len) {
+  kvkeys_block_t *block = &keys->blocks[i];
+  uint32_t size = block->size - (to - from) + len;
+  if (size > block->size) {
+    block->data = realloc(block->data, size);
+    if (!block->data)
+      fatal_malloc();
+  }
+  memmove(block->data + from + len, block->data + to, block->size - to);
+  if (len > 0)
+    memcpy(block->data + from, data, len);
+  if (size < block->size && size > 0 && !(block->data = realloc(block->data, size)))
+    fatal_malloc();
+  keys->bytes += size;
+  keys->bytes -= block->size;
+  block->size = size;
+}
+
+/* Splits the block I of KEYS in two, the second half of its keys moving into
+ * a new block after it. */
+static void kvkeys_split(kvkeys_t *keys, size_t i) {
+  char key[MAX_KEYLEN + 1], first[KVKEYS_HEADER_MAX + MAX_KEYLEN];
+  kvkeys_block_t *block = &keys->blocks[i], *next;
+  uint32_t offset = 0, end, n;
+  size_t keylen = 0, len;
+  for (n = 0; n < block->count / 2; n++)
+    offset = kvkeys_decode(block, offset, key, &keylen);
+  /* The key at OFFSET begins the new block, so it is stored whole. */
+  end = kvkeys_decode(block, offset, key, &keylen);
+  len = kvkeys_encode(first, NULL, 0, key, keylen);
+  kvkeys_block_insert(keys, i + 1);
+  block = &keys->blocks[i];
+  next = &keys->blocks[i + 1];
+  next->size = len + block->size - end;
+  next->data = malloc(next->size);
+  if (!next->data)
+    fatal_malloc();
+  memcpy(next->data, first, len);
+  memcpy(next->data + len, block->data + end, block->size - end);
+  next->count = block->count - n;
+  keys->bytes += next->size;
+  block->count = n;
+  kvkeys_splice(keys, i, offset, block->size, NULL, 0);
+}
+
+/* Returns true if the blocks A and B fit into one. */
+static bool kvkeys_fit(kvkeys_block_t *a, kvkeys_block_t *b) {
+  return a->size + b->size <= KVKEYS_BLOCK_SIZE && a->count + b->count <= KVKEYS_BLOCK_KEYS;
+}
+
+/* Merges the block I + 1 of KEYS into the block I before it. */
+static void kvkeys_merge(kvkeys_t *keys, size_t i) {
+  char last[MAX_KEYLEN + 1], key[MAX_KEYLEN + 1], rec[KVKEYS_HEADER_MAX + MAX_KEYLEN];
+  kvkeys_block_t *block = &keys->blocks[i], *next = &keys->blocks[i + 1];
+  size_t lastlen = 0, keylen, len;
+  uint32_t offset = 0, end;
+  while (offset < block->size)
+    offset = kvkeys_decode(block, offset, last, &lastlen);
+  /* The first key of the next block now follows LAST. */
+  end = kvkeys_decode(next, 0, key, &keylen);
+  len = kvkeys_encode(rec, last, lastlen, key, keylen);
+  kvkeys_splice(keys, i, block->size, block->size, rec, len);
+  kvkeys_splice(keys, i, block->size, block->size, next->data + end, next->size - end);
+  block->count += next->count;
+  keys->bytes -= next->size;
+  kvkeys_block_delete(keys, i + 1);
+}
+
+/* Stores the greatest key of KEYS, which must not be empty, into LAST. */
+static void kvkeys_find_last(kvkeys_t *keys) {
+  kvkeys_block_t *block = &keys->blocks[keys->nblocks - 1];
+  uint32_t offset = 0;
+  while (offset < block->size)
+    offset = kvkeys_decode(block, offset, keys->last, &keys->lastlen);
+}
+
+/* Initializes the empty KVKeys KEYS. */
+void kvkeys_init(kvkeys_t *keys) {
+  keys->blocks = NULL;
+  keys->nblocks = keys->capacity = keys->count = keys->bytes = keys->lastlen = 0;
+}
+
+/* Frees KEYS and all of its keys. */
+void kvkeys_free(kvkeys_t *keys) {
+  size_t i;
+  for (i = 0; i < keys->nblocks; i++)
+    free(keys->blocks[i].data);
+  free(keys->blocks);
+  kvkeys_init(keys);
+}
+
+/* The position of a key within a block, as found by kvkeys_locate. */
+typedef struct {
+  size_t block;               /* The block. */
+  uint32_t offset;            /* The offset of the record of KEY, or the size of the block. */
+  uint32_t end;               /* The offset of the record after it. */
+  size_t prevlen, keylen;     /* The lengths of PREV and KEY. */
+  char prev[MAX_KEYLEN + 1];  /* The key before it within the block, if any. */
+  char key[MAX_KEYLEN + 1];   /* The first key of the block not less than the one sought. */
+} kvkeys_pos_t;
+
+/* Finds the first key of KEYS, which must not be empty, not less than KEY,
+ * of KEYLEN bytes, within the block which holds KEY or would, storing its
+ * position into POS. Returns the result of comparing it to KEY, or 1 if the
+ * block holds none. */
+static int kvkeys_locate(kvkeys_t *keys, const char *key, size_t keylen, kvkeys_pos_t *pos) {
+  kvkeys_block_t *block;
+  int cmp = 1;
+  pos->block = kvkeys_find_block(keys, key, keylen);
+  block = &keys->blocks[pos->block];
+  pos->offset = 0;
+  pos->prevlen = pos->keylen = 0;
+  while (pos->offset < block->size) {
+    memcpy(pos->prev, pos->key, pos->keylen);
+    pos->prevlen = pos->keylen;
+    pos->end = kvkeys_decode(block, pos->offset, pos->key, &pos->keylen);
+    if ((cmp = kvkeys_cmp(pos->key, pos->keylen, key, keylen)) >= 0)
+      return cmp;
+    pos->offset = pos->end;
+  }
+  /* KEY sorts after the whole block, so it follows its last key. */
+  memcpy(pos->prev, pos->key, pos->keylen);
+  pos->prevlen = pos->keylen;
+  return 1;
+}
+
+/* Adds KEY to KEYS. Returns true if it was added, or false if it was already
+ * present. */
+bool kvkeys_insert(kvkeys_t *keys, const char *key) {
+  char rec[2 * (KVKEYS_HEADER_MAX + MAX_KEYLEN)];
+  size_t keylen = strlen(key), len;
+  kvkeys_block_t *block;
+  kvkeys_pos_t pos;
+  if (keys->nblocks == 0)
+    kvkeys_block_insert(keys, 0);
+  if (keys->count > 0 && kvkeys_cmp(key, keylen, keys->last, keys->lastlen) > 0) {
+    /* KEY follows the greatest key, at the end of the last block. */
+    pos.block = keys->nblocks - 1;
+    pos.offset = keys->blocks[pos.block].size;
+    memcpy(pos.prev, keys->last, keys->lastlen);
+    pos.prevlen = keys->lastlen;
+  } else if (kvkeys_locate(keys, key, keylen, &pos) == 0) {
+    return false;
+  }
+  block = &keys->blocks[pos.block];
+  if (pos.offset == block->size && pos.block == keys->nblocks - 1) {
+    memcpy(keys->last, key, keylen);
+    keys->lastlen = keylen;
+    /* Keys inserted in order fill their blocks rather than splitting them. */
+    if (block->count == KVKEYS_BLOCK_KEYS || block->size + keylen > KVKEYS_BLOCK_SIZE) {
+      kvkeys_block_insert(keys, ++pos.block);
+      block = &keys->blocks[pos.block];
+      pos.offset = 0;
+      pos.prevlen = 0;
+    }
+  }
+  len = kvkeys_encode(rec, pos.prev, pos.prevlen, key, keylen);
+  if (pos.offset < block->size) {
+    /* The key after it now follows KEY instead. */
+    len += kvkeys_encode(rec + len, key, keylen, pos.key, pos.keylen);
+    kvkeys_splice(keys, pos.block, pos.offset, pos.end, rec, len);
+  } else {
+    kvkeys_splice(keys, pos.block, pos.offset, pos.offset, rec, len);
+  }
+  block->count++;
+  keys->count++;
+  if ((block->size > KVKEYS_BLOCK_SIZE || block->count > KVKEYS_BLOCK_KEYS) && block->count > 1)
+    kvkeys_split(keys, pos.block);
+  return true;
+}
+
+/* Removes KEY from KEYS. Returns true if it was removed, or false if it was
+ * not present. */
+bool kvkeys_remove(kvkeys_t *keys, const char *key) {
+  char rec[KVKEYS_HEADER_MAX + MAX_KEYLEN];
+  size_t keylen = strlen(key), len = 0;
+  kvkeys_block_t *block;
+  kvkeys_pos_t pos;
+  uint32_t end;
+  size_t i;
+  if (keys->nblocks == 0 || kvkeys_locate(keys, key, keylen, &pos) != 0)
+    return false;
+  i = pos.block;
+  block = &keys->blocks[i];
+  end = pos.end;
+  if (end < block->size) {
+    /* The key after it now follows the key before it instead. */
+    end = kvkeys_decode(block, end, pos.key, &pos.keylen);
+    len = kvkeys_encode(rec, pos.prev, pos.prevlen, pos.key, pos.keylen);
+  }
+  kvkeys_splice(keys, i, pos.offset, end, rec, len);
+  block->count--;
+  keys->count--;
+  if (block->count == 0) {
+    kvkeys_block_delete(keys, i);
+  } else if (block->size < KVKEYS_BLOCK_SIZE / 4 || block->count < KVKEYS_BLOCK_KEYS / 4) {
+    if (i + 1 < keys->nblocks && kvkeys_fit(block, &keys->blocks[i + 1]))
+      kvkeys_merge(keys, i);
+    else if (i > 0 && kvkeys_fit(&keys->blocks[i - 1], block))
+      kvkeys_merge(keys, i - 1);
+  }
+  if (keys->count > 0 && kvkeys_cmp(key, keylen, keys->last, keys->lastlen) == 0)
+    kvkeys_find_last(keys);
+  return true;
+}
+
+/* Positions ITER at the first key of KEYS not less than KEY. Returns true if
+ * there is one, else false. */
+bool kvkeys_seek(kvkeys_t *keys, const char *key, kvkeys_iter_t *iter) {
+  size_t keylen = strlen(key);
+  iter->keys = keys;
+  iter->block = 0;
+  iter->next = 0;
+  iter->keylen = 0;
+  if (keys->nblocks == 0)
+    return false;
+  iter->block = kvkeys_find_block(keys, key, keylen);
+  while (kvkeys_next(iter)) {
+    if (kvkeys_cmp(iter->key, iter->keylen, key, keylen) >= 0)
+      return true;
+  }
+  return false;
+}
+
+/* Advances ITER to the next key. Returns true if there is one, else false. */
+bool kvkeys_next(kvkeys_iter_t *iter) {
+  kvkeys_t *keys = iter->keys;
+  kvkeys_block_t *block;
+  if (iter->block >= keys->nblocks)
+    return false;
+  block = &keys->blocks[iter->block];
+  if (iter->next >= block->size) {
+    if (++iter->block >= keys->nblocks)
+      return false;
+    block = &keys->blocks[iter->block];
+    iter->next = 0;
+  }
+  iter->next = kvkeys_decode(block, iter->next, iter->key, &iter->keylen);
+  iter->key[iter->keylen] = '\0';
+  return true;
+}
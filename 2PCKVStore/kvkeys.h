@@ -0,0 +1,75 @@
+#ifndef __KV_KEYS__
+#define __KV_KEYS__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "kvconstants.h"
+
+/* KVKeys is a sorted set of keys, which the KVSTORE_FILES engine of KVStore
+ * keeps so that it can visit its keys in order.
+ *
+ * Keys which are neighbors in order tend to share long prefixes (such as
+ * "tenant:region:"), so rather than allocating each key on its own, KVKeys
+ * packs them into blocks of up to KVKEYS_BLOCK_KEYS keys, front coded: each
+ * key is stored as the length of the prefix it shares with the key before it
+ * within its block, followed by the rest of it. The first key of each block
+ * is stored whole, so that the block which holds a key is found by a binary
+ * search over the blocks, and the key within it by decoding the block from
+ * its start.
+ *
+ * A key is inserted or removed by splicing its record into its block, which
+ * re-encodes at most the one record after it. A block which outgrows
+ * KVKEYS_BLOCK_KEYS keys or KVKEYS_BLOCK_SIZE bytes is split in two, and one
+ * which shrinks below a quarter of either is merged with a neighbor if they
+ * fit together. Since a block is decoded from its start, its number of keys
+ * bounds the cost of every operation, beyond the binary search.
+ *
+ * KVKeys does no locking of its own; KVStore serializes access to it.
+ */
+
+/* The number of keys beyond which a block is split. */
+#define KVKEYS_BLOCK_KEYS 64
+
+/* The size beyond which a block is split. */
+#define KVKEYS_BLOCK_SIZE 4096
+
+/* A block of keys. */
+typedef struct {
+  char *data;     /* The records of the keys, front coded. */
+  uint32_t size;  /* The number of bytes of DATA. */
+  uint32_t count; /* The number of keys. */
+} kvkeys_block_t;
+
+/* A KVKeys. */
+typedef struct {
+  kvkeys_block_t *blocks; /* The blocks, in key order, none of them empty. */
+  size_t nblocks;         /* The number of BLOCKS. */
+  size_t capacity;        /* The number of BLOCKS allocated. */
+  size_t count;           /* The number of keys. */
+  size_t bytes;           /* The number of bytes of memory held by the blocks. */
+  size_t lastlen;         /* The length of LAST. */
+  char last[MAX_KEYLEN + 1]; /* The greatest key, if COUNT is not 0, which keys inserted
+                                in order are appended after without decoding its block. */
+} kvkeys_t;
+
+/* A position within a KVKeys, at KEY, which is only valid until the KVKeys
+ * changes. */
+typedef struct {
+  kvkeys_t *keys;           /* The KVKeys. */
+  size_t block;             /* The block holding KEY. */
+  uint32_t next;            /* The offset of the record after KEY within it. */
+  size_t keylen;            /* The length of KEY. */
+  char key[MAX_KEYLEN + 1]; /* The current key, terminated. */
+} kvkeys_iter_t;
+
+void kvkeys_init(kvkeys_t *);
+void kvkeys_free(kvkeys_t *);
+
+bool kvkeys_insert(kvkeys_t *, const char *key);
+bool kvkeys_remove(kvkeys_t *, const char *key);
+
+bool kvkeys_seek(kvkeys_t *, const char *key, kvkeys_iter_t *iter);
+bool kvkeys_next(kvkeys_iter_t *);
+
+#endif
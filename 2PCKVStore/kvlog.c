@@ -0,0 +1,581 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "kvconstants.h"
+#include "kvstore.h"
+#include "kvlog.h"
+
+/* Writes the filename of segment ID of LOG into FILENAME. */
+static void kvlog_segment_name(kvlog_t *log, uint32_t id, char *filename) {
+  sprintf(filename, "%s/%u%s", log->dirname, id, KVLOG_FILETYPE);
+}
+
+/* Writes the filename of the compaction copy taking the id ID of LOG into
+ * FILENAME. */
+static void kvlog_compact_name(kvlog_t *log, uint32_t id, char *filename) {
+  sprintf(filename, "%s/%u%s", log->dirname, id, KVLOG_COMPACT_FILETYPE);
+}
+
+/* Makes sure LOG has a slot for segment ID. */
+static void kvlog_reserve(kvlog_t *log, uint32_t id) {
+  uint32_t i, nsegments = log->nsegments ? log->nsegments : 8;
+  if (id < log->nsegments)
+    return;
+  while (nsegments <= id)
+    nsegments *= 2;
+  log->segments = realloc(log->segments, nsegments * sizeof(kvlog_segment_t));
+  if (!log->segments)
+    fatal_malloc();
+  for (i = log->nsegments; i < nsegments; i++) {
+    log->segments[i].fd = -1;
+    log->segments[i].size = 0;
+    log->segments[i].live = 0;
+  }
+  log->nsegments = nsegments;
+}
+
+/* Opens (creating if necessary) segment ID of LOG. Returns 0 if successful,
+ * else a negative error code. */
+static int kvlog_segment_open(kvlog_t *log, uint32_t id) {
+  char filename[MAX_FILENAME];
+  struct stat st;
+  int fd;
+  kvlog_reserve(log, id);
+  kvlog_segment_name(log, id, filename);
+  if ((fd = open(filename, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR)) < 0)
+    return ERR_FILACCESS;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return ERR_FILACCESS;
+  }
+  log->segments[id].fd = fd;
+  log->segments[id].size = st.st_size;
+  return 0;
+}
+
+/* Points the keydir entry for KEY at the given record, adding an entry if KEY
+ * is not yet present. */
+static void kvlog_keydir_set(kvlog_t *log, char *key, uint32_t segment, uint64_t offset,
+                             uint32_t length) {
+  kvlog_keydir_t *ent;
+  HASH_FIND_STR(log->keydir, key, ent);
+  if (ent == NULL) {
+    ent = malloc(sizeof(kvlog_keydir_t));
+    if (!ent)
+      fatal_malloc();
+    ent->key = strdup(key);
+    if (!ent->key)
+      fatal_malloc();
+    HASH_ADD_KEYPTR(hh, log->keydir, ent->key, strlen(ent->key), ent);
+    skiplist_insert(&log->order, key, ent, NULL);
+  } else {
+    log->segments[ent->segment].live -= ent->length;
+  }
+  log->segments[segment].live += length;
+  ent->segment = segment;
+  ent->offset = offset;
+  ent->length = length;
+}
+
+/* Removes the keydir entry for KEY, if any. */
+static void kvlog_keydir_remove(kvlog_t *log, char *key) {
+  kvlog_keydir_t *ent;
+  HASH_FIND_STR(log->keydir, key, ent);
+  if (ent == NULL)
+    return;
+  log->segments[ent->segment].live -= ent->length;
+  HASH_DEL(log->keydir, ent);
+  skiplist_remove(&log->order, key, NULL);
+  free(ent->key);
+  free(ent);
+}
+
+/* Replays the records of segment ID into the keydir of LOG. A record which
+ * is cut short by the end of the file, or fails its checksum there, ends the
+ * replay, and the segment is truncated to the last complete record. A record
+ * failing its checksum elsewhere is skipped. Returns 0 if successful, else a
+ * negative error code. */
+static int kvlog_replay(kvlog_t *log, uint32_t id) {
+  kvlog_segment_t *seg = &log->segments[id];
+  char buf[KVENTRY_MAX_SIZE];
+  kventry_t *entry = (kventry_t *)buf;
+  uint64_t offset = 0;
+  size_t size;
+  FILE *file;
+  if (lseek(seg->fd, 0, SEEK_SET) < 0 || (file = fdopen(dup(seg->fd), "r")) == NULL)
+    return ERR_FILACCESS;
+  while (fread(entry, sizeof(kventry_t), 1, file) == 1) {
+    if (entry->length <= 0 || entry->length > KVENTRY_MAX_SIZE - sizeof(kventry_t) ||
+        fread(entry->data, 1, entry->length, file) != entry->length)
+      break;
+    size = sizeof(kventry_t) + entry->length;
+    if (!kventry_verify(entry, size)) {
+      if (offset + size >= seg->size)
+        break;
+      log->corruptions++;
+    } else if (entry->flags & KVENTRY_TOMBSTONE) {
+      kvlog_keydir_remove(log, entry->data);
+    } else {
+      kvlog_keydir_set(log, entry->data, id, offset, size);
+    }
+    offset += size;
+  }
+  fclose(file);
+  if (offset < seg->size) {
+    log->corruptions++;
+    if (ftruncate(seg->fd, offset) < 0)
+      return ERR_FILACCESS;
+    seg->size = offset;
+  }
+  return 0;
+}
+
+/* Initializes LOG within DIRNAME, which must already exist. Opens every
+ * segment found in DIRNAME and rebuilds the keydir from them. SEGMENT_SIZE is
+ * the size at which the active segment will be sealed, and COMPRESS_THRESHOLD
+ * the size from which values are compressed. Returns 0 if successful, else a
+ * negative error code. */
+int kvlog_init(kvlog_t *log, char *dirname, size_t segment_size, size_t compress_threshold) {
+  struct dirent *dent;
+  char suffix[MAX_FILENAME], filename[MAX_FILENAME];
+  uint32_t id, maxid = 0;
+  bool found = false;
+  int ret;
+  DIR *dir;
+  log->dirname = strdup(dirname);
+  if (!log->dirname)
+    fatal_malloc();
+  log->segment_size = segment_size;
+  log->compress_threshold = compress_threshold;
+  memset(&log->compression, 0, sizeof(kvlz_stats_t));
+  log->compactions = log->compact_read = log->compact_written = log->compact_nsecs = 0;
+  log->corruptions = 0;
+  log->segments = NULL;
+  log->nsegments = 0;
+  log->keydir = NULL;
+  skiplist_init(&log->order);
+
+  if ((dir = opendir(dirname)) == NULL)
+    return ERR_FILACCESS;
+  while ((dent = readdir(dir)) != NULL) {
+    if (sscanf(dent->d_name, "%u%s", &id, suffix) != 2)
+      continue;
+    if (!strcmp(suffix, KVLOG_COMPACT_FILETYPE)) {
+      /* A copy of a compaction which did not complete. */
+      kvlog_compact_name(log, id, filename);
+      unlink(filename);
+      continue;
+    }
+    if (strcmp(suffix, KVLOG_FILETYPE))
+      continue;
+    if ((ret = kvlog_segment_open(log, id)) < 0) {
+      closedir(dir);
+      return ret;
+    }
+    if (!found || id > maxid)
+      maxid = id;
+    found = true;
+  }
+  closedir(dir);
+
+  log->synced = 0;
+  if (!found)
+    return kvlog_segment_open(log, log->active = 0);
+  for (id = 0; id <= maxid; id++) {
+    if (log->segments[id].fd >= 0 && (ret = kvlog_replay(log, id)) < 0)
+      return ret;
+  }
+  log->active = log->synced = maxid;
+  return 0;
+}
+
+/* Reads the record located by ENT into BUF, which must be able to hold
+ * KVENTRY_MAX_SIZE bytes, and verifies its checksum. Returns 0 if successful,
+ * else a negative error code. */
+static int kvlog_read(kvlog_t *log, kvlog_keydir_t *ent, char *buf) {
+  kvlog_segment_t *seg = &log->segments[ent->segment];
+  if (pread(seg->fd, buf, ent->length, ent->offset) != ent->length)
+    return ERR_FILACCESS;
+  if (!kventry_verify((kventry_t *)buf, ent->length)) {
+    __sync_fetch_and_add(&log->corruptions, 1);
+    return ERR_CHECKSUM;
+  }
+  return 0;
+}
+
+/* Attempts to retrieve the value of KEY from LOG into VALUE. Returns 0 if
+ * successful, else a negative error code. */
+int kvlog_get(kvlog_t *log, char *key, char *value) {
+  char buf[KVENTRY_MAX_SIZE];
+  kventry_t *entry = (kventry_t *)buf;
+  kvlog_keydir_t *ent;
+  char *stored;
+  int ret;
+  HASH_FIND_STR(log->keydir, key, ent);
+  if (ent == NULL)
+    return ERR_NOKEY;
+  if (value == NULL)
+    return 0;
+  if ((ret = kvlog_read(log, ent, buf)) < 0)
+    return ret;
+  if ((stored = kventry_value(entry, value)) == NULL)
+    return ERR_FILACCESS;
+  if (stored != value)
+    strcpy(value, stored);
+  return 0;
+}
+
+/* Returns true if LOG contains KEY, else false. */
+bool kvlog_haskey(kvlog_t *log, char *key) {
+  kvlog_keydir_t *ent;
+  HASH_FIND_STR(log->keydir, key, ent);
+  return ent != NULL;
+}
+
+/* Calls VISIT with every entry of LOG whose key lies within [START, END), in
+ * key order, until VISIT returns nonzero. START and END may be NULL to leave
+ * the range unbounded. Returns 0 if successful, else a negative error code. */
+int kvlog_scan(kvlog_t *log, const char *start, const char *end, kvscan_fn_t visit, void *arg) {
+  char buf[KVENTRY_MAX_SIZE], value[MAX_VALLEN + 1];
+  kventry_t *entry = (kventry_t *)buf;
+  skiplist_node_t *node;
+  char *stored;
+  int ret;
+  node = start ? skiplist_seek(&log->order, start) : skiplist_first(&log->order);
+  for (; node != NULL && (end == NULL || strcmp(node->key, end) < 0); node = node->next[0]) {
+    if ((ret = kvlog_read(log, node->value, buf)) < 0)
+      return ret;
+    if ((stored = kventry_value(entry, value)) == NULL)
+      return ERR_FILACCESS;
+    if (visit(node->key, stored, arg))
+      break;
+  }
+  return 0;
+}
+
+/* Appends ENTRY to the active segment of LOG, first rolling over to a new
+ * segment if the active one is full. On success, stores where the record was
+ * written into SEGMENT and OFFSET and returns 0, else returns a negative error
+ * code. */
+static int kvlog_append(kvlog_t *log, kventry_t *entry, uint32_t *segment, uint64_t *offset) {
+  size_t size = sizeof(kventry_t) + entry->length;
+  kvlog_segment_t *seg = &log->segments[log->active];
+  int ret;
+  if (seg->size > 0 && seg->size + size > log->segment_size) {
+    if ((ret = kvlog_segment_open(log, log->active + 1)) < 0)
+      return ret;
+    seg = &log->segments[++log->active];
+  }
+  if (pwrite(seg->fd, entry, size, seg->size) != size)
+    return ERR_FILACCESS;
+  *segment = log->active;
+  *offset = seg->size;
+  seg->size += size;
+  return 0;
+}
+
+/* Stores the given KEY, VALUE entry in LOG. Returns 0 if successful, else a
+ * negative error code. */
+int kvlog_put(kvlog_t *log, char *key, char *value) {
+  char buf[KVENTRY_MAX_SIZE];
+  kventry_t *entry = (kventry_t *)buf;
+  uint32_t segment;
+  uint64_t offset;
+  int ret;
+  kventry_encode(entry, key, value, log->compress_threshold, &log->compression);
+  if ((ret = kvlog_append(log, entry, &segment, &offset)) < 0)
+    return ret;
+  kvlog_keydir_set(log, key, segment, offset, sizeof(kventry_t) + entry->length);
+  return 0;
+}
+
+/* Removes KEY from LOG by appending a tombstone for it. Returns 0 if
+ * successful, else a negative error code. */
+int kvlog_del(kvlog_t *log, char *key) {
+  char buf[KVENTRY_MAX_SIZE];
+  kventry_t *entry = (kventry_t *)buf;
+  uint32_t segment;
+  uint64_t offset;
+  int ret;
+  if (!kvlog_haskey(log, key))
+    return ERR_NOKEY;
+  kventry_encode(entry, key, NULL, 0, NULL);
+  if ((ret = kvlog_append(log, entry, &segment, &offset)) < 0)
+    return ret;
+  kvlog_keydir_remove(log, key);
+  return 0;
+}
+
+/* Flushes all records appended to LOG to disk, syncing every segment written
+ * since the previous call (and the directory, if segments were created). The
+ * caller must hold LOG at least for reading; concurrent calls are safe.
+ * Returns 0 if successful, else a negative error code. */
+int kvlog_sync(kvlog_t *log) {
+  uint32_t id, synced = __atomic_load_n(&log->synced, __ATOMIC_RELAXED);
+  int fd, ret = 0;
+  for (id = synced; id <= log->active; id++) {
+    if (log->segments[id].fd >= 0 && fdatasync(log->segments[id].fd) < 0)
+      return ERR_FILACCESS;
+  }
+  if (synced != log->active) {
+    if ((fd = open(log->dirname, O_RDONLY | O_DIRECTORY)) < 0)
+      return ERR_FILACCESS;
+    if (fsync(fd) < 0)
+      ret = ERR_FILACCESS;
+    close(fd);
+  }
+  if (ret == 0)
+    __atomic_store_n(&log->synced, log->active, __ATOMIC_RELAXED);
+  return ret;
+}
+
+/* Stores the number of bytes of current records of LOG into LIVE and the size
+ * of all of its segments into SIZE; the difference is garbage. */
+void kvlog_space(kvlog_t *log, uint64_t *live, uint64_t *size) {
+  uint32_t id;
+  *live = *size = 0;
+  for (id = 0; id <= log->active; id++) {
+    *live += log->segments[id].live;
+    *size += log->segments[id].size;
+  }
+}
+
+/* Returns the current time of the monotonic clock, in nanoseconds. */
+static uint64_t kvlog_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Begins the compaction C of all sealed segments of LOG, if at least RATIO of
+ * their bytes are garbage (and some are). The caller must hold LOG for
+ * reading. Returns true if C was begun, in which case it must be completed
+ * with kvlog_compact_finish or dropped with kvlog_compact_abort. */
+bool kvlog_compact_begin(kvlog_t *log, kvlog_compaction_t *c, double ratio) {
+  uint64_t size = 0, garbage = 0;
+  uint32_t id;
+  for (id = 0; id < log->active; id++) {
+    size += log->segments[id].size;
+    garbage += log->segments[id].size - log->segments[id].live;
+  }
+  if (garbage == 0 || garbage < ratio * size)
+    return false;
+  memset(c, 0, sizeof(kvlog_compaction_t));
+  c->inputs = malloc(log->active * sizeof(uint32_t));
+  c->outputs = malloc(log->active * sizeof(int));
+  c->sizes = malloc(log->active * sizeof(uint64_t));
+  if (!c->inputs || !c->outputs || !c->sizes)
+    fatal_malloc();
+  for (id = 0; id < log->active; id++) {
+    if (log->segments[id].fd >= 0)
+      c->inputs[c->ninputs++] = id;
+  }
+  c->started = kvlog_now();
+  return true;
+}
+
+/* Appends the record ENTRY of SIZE bytes, which is found at OFFSET within
+ * segment ID, to the copies of C. Returns 0 if successful, else a negative
+ * error code. */
+static int kvlog_compact_copy(kvlog_t *log, kvlog_compaction_t *c, kventry_t *entry, size_t size,
+                              uint32_t id, uint64_t offset) {
+  char filename[MAX_FILENAME];
+  kvlog_move_t *move;
+  uint32_t out = c->noutputs - 1;
+  if (c->noutputs == 0 || (c->sizes[out] > 0 && c->sizes[out] + size > log->segment_size)) {
+    /* Records only ever shrink into fewer segments, so a copy is never
+     * needed beyond the segment the record came from. */
+    if (c->noutputs == c->ninputs || c->inputs[c->noutputs] > id)
+      return ERR_FILACCESS;
+    out = c->noutputs;
+    kvlog_compact_name(log, c->inputs[out], filename);
+    if ((c->outputs[out] = open(filename, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) < 0)
+      return ERR_FILACCESS;
+    c->sizes[out] = 0;
+    c->noutputs++;
+  }
+  if (pwrite(c->outputs[out], entry, size, c->sizes[out]) != size)
+    return ERR_FILACCESS;
+  if (c->nmoves == c->capacity) {
+    c->capacity = c->capacity ? c->capacity * 2 : 256;
+    c->moves = realloc(c->moves, c->capacity * sizeof(kvlog_move_t));
+    if (!c->moves)
+      fatal_malloc();
+  }
+  move = &c->moves[c->nmoves++];
+  move->key = strdup(entry->data);
+  if (!move->key)
+    fatal_malloc();
+  move->segment = id;
+  move->offset = offset;
+  move->output = out;
+  move->new_offset = c->sizes[out];
+  move->length = size;
+  c->sizes[out] += size;
+  c->written += size;
+  return 0;
+}
+
+/* Copies the next records of the compaction C of LOG, reading about BUDGET
+ * bytes. Only the records the keydir still points at are copied. The caller
+ * must hold LOG for reading. Returns 1 once all records have been copied, 0
+ * if more remain, else a negative error code. */
+int kvlog_compact_step(kvlog_t *log, kvlog_compaction_t *c, uint64_t budget) {
+  char buf[KVENTRY_MAX_SIZE];
+  kventry_t *entry = (kventry_t *)buf;
+  kvlog_segment_t *seg;
+  kvlog_keydir_t *ent;
+  uint64_t start = c->read;
+  size_t size;
+  uint32_t id;
+  int ret;
+  while (c->read - start < budget) {
+    if (c->input == c->ninputs)
+      return 1;
+    id = c->inputs[c->input];
+    seg = &log->segments[id];
+    if (c->offset >= seg->size) {
+      c->input++;
+      c->offset = 0;
+      continue;
+    }
+    if (pread(seg->fd, entry, sizeof(kventry_t), c->offset) != sizeof(kventry_t) ||
+        entry->length <= 0 || entry->length > KVENTRY_MAX_SIZE - sizeof(kventry_t))
+      return ERR_FILACCESS;
+    size = sizeof(kventry_t) + entry->length;
+    if (pread(seg->fd, entry->data, entry->length, c->offset + sizeof(kventry_t)) !=
+        entry->length)
+      return ERR_FILACCESS;
+    c->read += size;
+    HASH_FIND_STR(log->keydir, entry->data, ent);
+    if (!(entry->flags & KVENTRY_TOMBSTONE) && ent != NULL && ent->segment == id &&
+        ent->offset == c->offset &&
+        (ret = kvlog_compact_copy(log, c, entry, size, id, c->offset)) < 0)
+      return ret;
+    c->offset += size;
+  }
+  return c->input == c->ninputs;
+}
+
+/* Flushes the copies of the compaction C to disk. Needs no lock. Returns 0 if
+ * successful, else a negative error code. */
+int kvlog_compact_sync(kvlog_compaction_t *c) {
+  uint32_t i;
+  for (i = 0; i < c->noutputs; i++) {
+    if (fdatasync(c->outputs[i]) < 0)
+      return ERR_FILACCESS;
+  }
+  return 0;
+}
+
+/* Drops the compaction C of LOG, removing the copies which remain. */
+void kvlog_compact_abort(kvlog_t *log, kvlog_compaction_t *c) {
+  char filename[MAX_FILENAME];
+  uint32_t i;
+  size_t m;
+  for (i = 0; i < c->noutputs; i++) {
+    if (c->outputs[i] < 0)
+      continue;
+    close(c->outputs[i]);
+    kvlog_compact_name(log, c->inputs[i], filename);
+    unlink(filename);
+  }
+  for (m = 0; m < c->nmoves; m++)
+    free(c->moves[m].key);
+  free(c->moves);
+  free(c->inputs);
+  free(c->outputs);
+  free(c->sizes);
+}
+
+/* Completes the compaction C of LOG, whose copies have been flushed with
+ * kvlog_compact_sync: the copies replace the first segments compacted, the
+ * others are removed, and the keydir entries of the records copied which are
+ * still current are pointed at their copies. The caller must hold LOG for
+ * writing. Returns 0 if successful, else a negative error code, in which case
+ * LOG is left consistent but possibly only partly compacted. */
+int kvlog_compact_finish(kvlog_t *log, kvlog_compaction_t *c) {
+  char from[MAX_FILENAME], to[MAX_FILENAME];
+  kvlog_segment_t *seg;
+  kvlog_keydir_t *ent;
+  kvlog_move_t *move;
+  uint32_t i, renamed;
+  int fd, ret = 0;
+  size_t m;
+  for (renamed = 0; renamed < c->noutputs; renamed++) {
+    kvlog_compact_name(log, c->inputs[renamed], from);
+    kvlog_segment_name(log, c->inputs[renamed], to);
+    if (rename(from, to) < 0) {
+      ret = ERR_FILACCESS;
+      break;
+    }
+    seg = &log->segments[c->inputs[renamed]];
+    close(seg->fd);
+    seg->fd = c->outputs[renamed];
+    seg->size = c->sizes[renamed];
+    c->outputs[renamed] = -1;
+  }
+  /* The remaining segments are removed oldest first, so that those left after
+   * a crash replay to the same state. */
+  for (i = c->noutputs; ret == 0 && i < c->ninputs; i++) {
+    kvlog_segment_name(log, c->inputs[i], to);
+    if (unlink(to) < 0) {
+      ret = ERR_FILACCESS;
+      break;
+    }
+    seg = &log->segments[c->inputs[i]];
+    close(seg->fd);
+    seg->fd = -1;
+    seg->size = 0;
+  }
+  if ((fd = open(log->dirname, O_RDONLY | O_DIRECTORY)) < 0 || fsync(fd) < 0)
+    ret = ERR_FILACCESS;
+  if (fd >= 0)
+    close(fd);
+  /* The records of a segment replaced were all copied to copies which were
+   * renamed, so no keydir entry is left pointing into a replaced segment. */
+  for (m = 0; m < c->nmoves; m++) {
+    move = &c->moves[m];
+    HASH_FIND_STR(log->keydir, move->key, ent);
+    if (move->output >= renamed || ent == NULL || ent->segment != move->segment ||
+        ent->offset != move->offset)
+      continue;
+    log->segments[move->segment].live -= move->length;
+    ent->segment = c->inputs[move->output];
+    ent->offset = move->new_offset;
+    log->segments[ent->segment].live += move->length;
+  }
+  log->compactions++;
+  log->compact_read += c->read;
+  log->compact_written += c->written;
+  log->compact_nsecs += kvlog_now() - c->started;
+  kvlog_compact_abort(log, c);
+  return ret;
+}
+
+/* Closes all segments of LOG and frees its keydir. LOG must be reinitialized
+ * before it is used again. */
+void kvlog_close(kvlog_t *log) {
+  kvlog_keydir_t *ent, *tmp;
+  uint32_t id;
+  HASH_ITER(hh, log->keydir, ent, tmp) {
+    HASH_DEL(log->keydir, ent);
+    free(ent->key);
+    free(ent);
+  }
+  skiplist_free(&log->order, NULL);
+  for (id = 0; id < log->nsegments; id++) {
+    if (log->segments[id].fd >= 0)
+      close(log->segments[id].fd);
+  }
+  free(log->segments);
+  free(log->dirname);
+  log->segments = NULL;
+  log->nsegments = 0;
+}
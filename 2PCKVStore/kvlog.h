@@ -0,0 +1,159 @@
+#ifndef __KV_LOG__
+#define __KV_LOG__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "uthash.h"
+#include "skiplist.h"
+#include "kvlz.h"
+#include "kvconstants.h"
+
+/* KVLog defines a log-structured storage engine for KVStore, in the style of
+ * Bitcask.
+ *
+ * Instead of storing each entry as its own file, entries are appended as
+ * kventry_t records to the active segment file within the store directory.
+ * Segments are named by an incrementing id:
+ *    sprintf(filename, "%u%s", id, KVLOG_FILETYPE);
+ * Once the active segment would grow beyond SEGMENT_SIZE it is sealed and a
+ * new segment with the next id is started. Records are never modified after
+ * they are written; deleting a key appends a tombstone record for it.
+ *
+ * An in-memory keydir maps every live key to the segment, offset and length of
+ * its most recent record, so a lookup costs a single pread() and an update a
+ * single append. The keys of the keydir are also kept in key order (a
+ * skiplist), which serves range scans. The keydir is not persisted; it is rebuilt upon
+ * initialization by replaying every segment in order of id, so a directory
+ * previously used by a KVLog can be reopened and will contain the same
+ * entries. A partially written record at the end of the newest segment (e.g.
+ * after a crash) is discarded during the replay.
+ *
+ * Every record carries a checksum (see kvcrc.h), which the replay and every
+ * read verify. A record at the end of a segment which fails it is taken to be
+ * torn and discarded like a partial one, while one elsewhere is skipped by the
+ * replay, and fails the reads of its key with ERR_CHECKSUM. Each is counted
+ * in CORRUPTIONS.
+ *
+ * Values of at least COMPRESS_THRESHOLD bytes are compressed (see kvlz.h).
+ *
+ * Appends are left to the operating system to write back; kvlog_sync flushes
+ * them to disk explicitly.
+ *
+ * Records which were overwritten or deleted remain in their segments as
+ * garbage until a compaction rewrites the sealed segments with only their
+ * current records, dropping tombstones, which nothing older can be hidden by
+ * any more. A compaction is done in steps holding LOG for reading, so that it
+ * can be interleaved with requests: kvlog_compact_begin picks the sealed
+ * segments, kvlog_compact_step copies records into new files named
+ *    sprintf(filename, "%u%s", id, KVLOG_COMPACT_FILETYPE);
+ * kvlog_compact_sync flushes them (without any lock), and finally
+ * kvlog_compact_finish, holding LOG for writing, renames them over the
+ * segments compacted and points the keydir at the copies. The copies take the
+ * ids of the oldest segments compacted, and each record is copied to an id no
+ * larger than the one it came from, so the replay order of the records is
+ * unchanged; a crash at any point leaves segments which replay to the same
+ * state. Leftover copies are removed upon initialization.
+ *
+ * KVLog does no locking of its own; KVStore serializes access to it with the
+ * lock of the store, which is also the key lock of every key, since all keys
+ * are appended to the same segment.
+ *
+ * KVStore compacts in a background thread, which checks the segments every
+ * KVSTORE_COMPACT_INTERVAL seconds and compacts them once OPTS->compact_ratio
+ * of the bytes of the sealed segments are garbage, copying
+ * KVSTORE_COMPACT_CHUNK bytes at a time between requests. Its reads and writes
+ * are throttled to OPTS->compact_rate bytes per second (see kvratelimit.h), so
+ * that it does not compete with requests for the disk. kvstore_compact
+ * compacts at once.
+ */
+
+/* The filetype to append to the filenames of segments. */
+#define KVLOG_FILETYPE ".seg"
+
+/* The filetype of the copies written by a compaction. */
+#define KVLOG_COMPACT_FILETYPE ".seg.compact"
+
+/* The default size at which the active segment is sealed. */
+#define KVLOG_SEGMENT_SIZE (64 * 1024 * 1024)
+
+/* A keydir entry, locating the most recent record of KEY. */
+typedef struct {
+  char *key;         /* The key of the entry. Also the key of the hash table. */
+  uint32_t segment;  /* The id of the segment which holds the record. */
+  uint32_t length;   /* The length of the record, including its header. */
+  uint64_t offset;   /* The offset of the record within its segment. */
+  UT_hash_handle hh; /* Makes this structure hashable. */
+} kvlog_keydir_t;
+
+/* A segment file. */
+typedef struct {
+  int fd;        /* The open file descriptor of the segment, or -1 if unused. */
+  uint64_t size; /* The number of bytes of valid records within the segment. */
+  uint64_t live; /* The number of those bytes which are current records. */
+} kvlog_segment_t;
+
+/* A record copied by a compaction. */
+typedef struct {
+  char *key;            /* The key of the record. */
+  uint32_t segment;     /* The id of the segment the record was copied from. */
+  uint32_t output;      /* The index of the copy the record was copied to. */
+  uint64_t offset;      /* The offset of the record within SEGMENT. */
+  uint64_t new_offset;  /* The offset of the record within OUTPUT. */
+  uint32_t length;      /* The length of the record, including its header. */
+} kvlog_move_t;
+
+/* A compaction of the sealed segments of a KVLog, see kvlog_compact_begin. */
+typedef struct {
+  uint32_t *inputs;     /* The ids of the segments compacted, oldest first. */
+  uint32_t ninputs;     /* The number of segments compacted. */
+  uint32_t input;       /* The index within INPUTS of the segment being copied. */
+  uint64_t offset;      /* The offset of the next record to copy within it. */
+  int *outputs;         /* The open copies, replacing the first NOUTPUTS inputs. */
+  uint64_t *sizes;      /* The number of bytes written to each copy. */
+  uint32_t noutputs;    /* The number of copies begun. */
+  kvlog_move_t *moves;  /* The records copied. */
+  size_t nmoves;        /* The number of records copied. */
+  size_t capacity;      /* The number of slots of MOVES. */
+  uint64_t read;        /* The number of bytes read. */
+  uint64_t written;     /* The number of bytes written. */
+  uint64_t started;     /* When the compaction began, in nanoseconds. */
+} kvlog_compaction_t;
+
+/* A KVLog. */
+typedef struct {
+  char *dirname;             /* The directory in which segments are stored. */
+  size_t segment_size;       /* The size at which the active segment is sealed. */
+  kvlog_segment_t *segments; /* All segments, indexed by id. */
+  uint32_t nsegments;        /* The number of slots within SEGMENTS. */
+  uint32_t active;           /* The id of the segment currently appended to. */
+  uint32_t synced;           /* The id of the oldest segment which may hold unsynced records. */
+  kvlog_keydir_t *keydir;    /* The keydir (a uthash table). */
+  skiplist_t order;          /* The keydir entries sorted by key. */
+  size_t compress_threshold; /* The size from which values are compressed (0 = never). */
+  kvlz_stats_t compression;  /* The compression of the values appended. */
+  uint64_t compactions;      /* The number of compactions completed. */
+  uint64_t compact_read;     /* The number of bytes read by those compactions. */
+  uint64_t compact_written;  /* The number of bytes written by those compactions. */
+  uint64_t compact_nsecs;    /* The time taken by those compactions, in nanoseconds. */
+  uint64_t corruptions;      /* The number of records found whose checksum did not match. */
+} kvlog_t;
+
+int kvlog_init(kvlog_t *, char *dirname, size_t segment_size, size_t compress_threshold);
+
+int kvlog_get(kvlog_t *, char *key, char *value);
+int kvlog_put(kvlog_t *, char *key, char *value);
+int kvlog_del(kvlog_t *, char *key);
+bool kvlog_haskey(kvlog_t *, char *key);
+int kvlog_scan(kvlog_t *, const char *start, const char *end, kvscan_fn_t visit, void *arg);
+int kvlog_sync(kvlog_t *);
+void kvlog_space(kvlog_t *, uint64_t *live, uint64_t *size);
+
+bool kvlog_compact_begin(kvlog_t *, kvlog_compaction_t *c, double ratio);
+int kvlog_compact_step(kvlog_t *, kvlog_compaction_t *c, uint64_t budget);
+int kvlog_compact_sync(kvlog_compaction_t *c);
+int kvlog_compact_finish(kvlog_t *, kvlog_compaction_t *c);
+void kvlog_compact_abort(kvlog_t *, kvlog_compaction_t *c);
+
+void kvlog_close(kvlog_t *);
+
+#endif
@@ -0,0 +1,1418 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include "kvconstants.h"
+#include "kvstore.h"
+#include "kvlsm.h"
+
+/* Identifies the footer of a table ("KLSM_TB2"). */
+#define KVLSM_MAGIC 0x3242545f4d534c4bULL
+/* Identifies the footer of a table written without a filter ("KLSM_TB1"),
+ * which consists of the fields from INDEX_OFFSET onwards only. */
+#define KVLSM_MAGIC_V1 0x3142545f4d534c4bULL
+
+/* The footer found at the end of every table. */
+typedef struct {
+  uint64_t filter_offset; /* The offset of the Bloom filter. */
+  uint32_t filter_size;   /* The size of the Bloom filter, or 0 if there is none. */
+  uint32_t filter_probes; /* The number of probes per key of the Bloom filter. */
+  uint64_t index_offset;  /* The offset of the index. */
+  uint32_t index_size;    /* The size of the index. */
+  uint32_t nblocks;       /* The number of data blocks. */
+  uint64_t magic;         /* KVLSM_MAGIC. */
+} kvlsm_footer_t;
+
+/* The outcome of looking up a key within a memtable or table. */
+typedef enum {
+  LOOKUP_MISS,
+  LOOKUP_FOUND,
+  LOOKUP_DELETED,
+  LOOKUP_ERROR,
+  LOOKUP_CORRUPT, /* The entry of the key failed its checksum. */
+} kvlsm_lookup_t;
+
+/* A table which is being written. */
+typedef struct {
+  kvlsm_table_t *table;       /* The table being written. */
+  char *block;                /* The data block being filled. */
+  size_t blocklen;            /* The number of bytes within BLOCK. */
+  uint32_t capacity;          /* The number of slots of TABLE->blocks. */
+  char last[MAX_KEYLEN + 1];  /* The last key added. */
+  unsigned int bits_per_key;  /* The size of the filter per key, or 0 for no filter. */
+  size_t compress_threshold;  /* The size from which values are compressed, or 0. */
+  kvlz_stats_t *compression;  /* Where the compression of values is recorded. */
+  uint64_t *hashes;           /* The hashes of the keys added, for the filter. */
+  size_t nhashes;             /* The number of hashes within HASHES. */
+  size_t hcapacity;           /* The number of slots of HASHES. */
+} kvlsm_builder_t;
+
+/* A sequential iterator over the entries of a table. */
+typedef struct {
+  kvlsm_table_t *table; /* The table iterated over. */
+  uint32_t block;       /* The next block to be read. */
+  char *buf;            /* The current block. */
+  size_t len;           /* The size of the current block. */
+  size_t pos;           /* The offset of ENTRY within BUF. */
+  kventry_t *entry;     /* The current entry, or NULL once exhausted. */
+  bool fill;            /* Whether the blocks read are added to the block cache. */
+} kvlsm_iter_t;
+
+/* Writes the name of the file ID with the given FILETYPE into FILENAME. */
+static void kvlsm_filename(kvlsm_t *lsm, uint32_t id, const char *filetype, char *filename) {
+  sprintf(filename, "%s/%u%s", lsm->dirname, id, filetype);
+}
+
+/* Returns an unused file id. */
+static uint32_t kvlsm_new_file(kvlsm_t *lsm) { return __sync_fetch_and_add(&lsm->next_file, 1); }
+
+/* Encodes KEY and VALUE (NULL for a tombstone) as an uncompressed kventry_t
+ * into BUF, which must be able to hold KVENTRY_MAX_SIZE bytes, as written to
+ * write-ahead logs. Returns the size of the encoded entry. */
+static size_t kvlsm_encode(char *buf, const char *key, const char *value) {
+  return kventry_encode((kventry_t *)buf, key, value, 0, NULL);
+}
+
+/* Creates an empty memtable whose write-ahead log has id WAL, or, if WAL is
+ * negative, which has no write-ahead log. Returns NULL if the log could not
+ * be created. */
+static kvlsm_memtable_t *kvlsm_memtable_new(kvlsm_t *lsm, int64_t wal) {
+  char filename[MAX_FILENAME];
+  kvlsm_memtable_t *mem = malloc(sizeof(kvlsm_memtable_t));
+  if (!mem)
+    fatal_malloc();
+  skiplist_init(&mem->entries);
+  mem->size = 0;
+  mem->wal = wal;
+  mem->walfd = -1;
+  if (wal >= 0) {
+    kvlsm_filename(lsm, wal, KVLSM_WAL_FILETYPE, filename);
+    mem->walfd = open(filename, O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR);
+    if (mem->walfd < 0) {
+      skiplist_free(&mem->entries, free);
+      free(mem);
+      return NULL;
+    }
+  }
+  return mem;
+}
+
+/* Frees MEM, closing (but not removing) its write-ahead log. */
+static void kvlsm_memtable_free(kvlsm_memtable_t *mem) {
+  if (mem->walfd >= 0)
+    close(mem->walfd);
+  skiplist_free(&mem->entries, free);
+  free(mem);
+}
+
+/* Stores KEY and VALUE (NULL for a tombstone) within MEM. */
+static void kvlsm_memtable_apply(kvlsm_memtable_t *mem, const char *key, const char *value) {
+  char *copy = NULL, *old;
+  bool replaced;
+  if (value != NULL) {
+    copy = strdup(value);
+    if (!copy)
+      fatal_malloc();
+    mem->size += strlen(copy) + 1;
+  }
+  old = skiplist_insert(&mem->entries, key, copy, &replaced);
+  if (!replaced)
+    mem->size += strlen(key) + 1 + sizeof(skiplist_node_t);
+  else if (old != NULL)
+    mem->size -= strlen(old) + 1;
+  free(old);
+}
+
+/* Looks up KEY within MEM, copying its value into VALUE if VALUE is not
+ * NULL. */
+static kvlsm_lookup_t kvlsm_memtable_get(kvlsm_memtable_t *mem, const char *key, char *value) {
+  skiplist_node_t *node = skiplist_find(&mem->entries, key);
+  if (node == NULL)
+    return LOOKUP_MISS;
+  if (node->value == NULL)
+    return LOOKUP_DELETED;
+  if (value != NULL)
+    strcpy(value, node->value);
+  return LOOKUP_FOUND;
+}
+
+/* Replays the write-ahead log WAL into MEM. A record cut short by the end of
+ * the file, or failing its checksum, ends the replay. Returns 0 if successful,
+ * else a negative error code. */
+static int kvlsm_wal_replay(kvlsm_t *lsm, uint32_t wal, kvlsm_memtable_t *mem) {
+  char filename[MAX_FILENAME];
+  char buf[KVENTRY_MAX_SIZE], value[MAX_VALLEN + 1];
+  kventry_t *entry = (kventry_t *)buf;
+  FILE *file;
+  char *stored;
+  kvlsm_filename(lsm, wal, KVLSM_WAL_FILETYPE, filename);
+  if ((file = fopen(filename, "r")) == NULL)
+    return ERR_FILACCESS;
+  while (fread(entry, sizeof(kventry_t), 1, file) == 1) {
+    if (entry->length <= 0 || entry->length > KVENTRY_MAX_SIZE - sizeof(kventry_t) ||
+        fread(entry->data, 1, entry->length, file) != entry->length)
+      break;
+    if (!kventry_verify(entry, sizeof(kventry_t) + entry->length)) {
+      lsm->corruptions++;
+      break;
+    }
+    stored = kventry_value(entry, value);
+    if (stored == NULL && !(entry->flags & KVENTRY_TOMBSTONE))
+      break;
+    kvlsm_memtable_apply(mem, entry->data, stored);
+  }
+  fclose(file);
+  return 0;
+}
+
+/* Closes TABLE and frees its index. */
+static void kvlsm_table_free(kvlsm_table_t *table) {
+  uint32_t i;
+  for (i = 0; i < table->nblocks; i++)
+    free(table->blocks[i].last);
+  free(table->blocks);
+  free(table->smallest);
+  free(table->largest);
+  bloom_free(&table->filter);
+  if (table->fd >= 0)
+    close(table->fd);
+  free(table);
+}
+
+/* Opens FILENAME for reading with O_DIRECT, or without it if the file system
+ * does not support it. Returns the file descriptor, or -1 on failure. */
+static int kvlsm_open_direct(const char *filename) {
+  int fd = open(filename, O_RDONLY | O_DIRECT);
+  if (fd < 0 && errno == EINVAL)
+    fd = open(filename, O_RDONLY);
+  return fd;
+}
+
+/* Reads the SIZE bytes at OFFSET of TABLE into BUF, through its block cache
+ * if it has one, adding the pages read to the cache if FILL is true. Returns
+ * 0 if successful, else a negative error code. */
+static int kvlsm_table_pread(kvlsm_table_t *table, void *buf, size_t size, uint64_t offset,
+                             bool fill) {
+  if (table->cache != NULL)
+    return kvblockcache_read(table->cache, table->id, table->fd, buf, size, offset, fill);
+  return pread(table->fd, buf, size, offset) == size ? 0 : ERR_FILACCESS;
+}
+
+/* Opens table ID and reads its index. Returns NULL if the table could not be
+ * read. */
+static kvlsm_table_t *kvlsm_table_open(kvlsm_t *lsm, uint32_t id) {
+  char filename[MAX_FILENAME];
+  kvlsm_footer_t footer;
+  kvlsm_table_t *table;
+  struct stat st;
+  char *index = NULL, *pos;
+  uint8_t *filter;
+  uint32_t i, keylen;
+  size_t footer_size = sizeof(footer);
+  table = calloc(1, sizeof(kvlsm_table_t));
+  if (!table)
+    fatal_malloc();
+  table->id = id;
+  kvlsm_filename(lsm, id, KVLSM_TABLE_FILETYPE, filename);
+  if (lsm->direct_io) {
+    table->fd = kvlsm_open_direct(filename);
+    table->cache = &lsm->blocks;
+  } else {
+    table->fd = open(filename, O_RDONLY);
+  }
+  if (table->fd < 0 || fstat(table->fd, &st) < 0 || st.st_size < sizeof(kvlsm_footer_t))
+    goto error;
+  table->size = st.st_size;
+  /* The filter and index are read once, and are not worth caching. */
+  if (kvlsm_table_pread(table, &footer, sizeof(footer), table->size - sizeof(footer), false) < 0)
+    goto error;
+  if (footer.magic == KVLSM_MAGIC_V1) {
+    footer_size = sizeof(footer) - offsetof(kvlsm_footer_t, index_offset);
+    footer.filter_size = 0;
+  } else if (footer.magic != KVLSM_MAGIC) {
+    goto error;
+  }
+  if (footer.nblocks == 0 || footer.index_offset + footer.index_size + footer_size != table->size ||
+      (footer.filter_size > 0 && footer.filter_offset + footer.filter_size > footer.index_offset))
+    goto error;
+  if (footer.filter_size > 0) {
+    filter = malloc(footer.filter_size);
+    if (!filter)
+      fatal_malloc();
+    bloom_load(&table->filter, filter, footer.filter_size, footer.filter_probes);
+    if (kvlsm_table_pread(table, filter, footer.filter_size, footer.filter_offset, false) < 0)
+      goto error;
+  }
+  index = malloc(footer.index_size);
+  if (!index)
+    fatal_malloc();
+  if (kvlsm_table_pread(table, index, footer.index_size, footer.index_offset, false) < 0)
+    goto error;
+  table->blocks = calloc(footer.nblocks, sizeof(kvlsm_block_t));
+  if (!table->blocks)
+    fatal_malloc();
+  pos = index;
+  memcpy(&keylen, pos, sizeof(uint32_t));
+  table->smallest = strndup(pos + sizeof(uint32_t), keylen);
+  pos += sizeof(uint32_t) + keylen;
+  for (i = 0; i < footer.nblocks; i++) {
+    memcpy(&table->blocks[i].offset, pos, sizeof(uint64_t));
+    memcpy(&table->blocks[i].size, pos + sizeof(uint64_t), sizeof(uint32_t));
+    memcpy(&keylen, pos + sizeof(uint64_t) + sizeof(uint32_t), sizeof(uint32_t));
+    pos += sizeof(uint64_t) + 2 * sizeof(uint32_t);
+    table->blocks[i].last = strndup(pos, keylen);
+    pos += keylen;
+    table->nblocks++;
+  }
+  table->largest = strdup(table->blocks[table->nblocks - 1].last);
+  free(index);
+  return table;
+
+error:
+  free(index);
+  kvlsm_table_free(table);
+  return NULL;
+}
+
+/* Reads data block BLOCK of TABLE into malloc()d memory, which should later
+ * be free()d, adding it to the block cache of TABLE (if any) if FILL is true.
+ * Returns NULL if the block could not be read. */
+static char *kvlsm_table_read_block(kvlsm_table_t *table, uint32_t block, bool fill) {
+  kvlsm_block_t *blk = &table->blocks[block];
+  char *buf = malloc(blk->size);
+  if (!buf)
+    fatal_malloc();
+  if (kvlsm_table_pread(table, buf, blk->size, blk->offset, fill) < 0) {
+    free(buf);
+    return NULL;
+  }
+  return buf;
+}
+
+/* Looks up KEY within TABLE of LSM, copying its value into VALUE if VALUE is
+ * not NULL. Reads at most one data block. */
+static kvlsm_lookup_t kvlsm_table_get(kvlsm_t *lsm, kvlsm_table_t *table, const char *key,
+                                      char *value) {
+  uint32_t lo = 0, hi = table->nblocks - 1, mid;
+  kvlsm_lookup_t ret = LOOKUP_MISS;
+  kventry_t *entry;
+  size_t pos = 0;
+  char *buf, *stored;
+  int cmp;
+  if (strcmp(key, table->smallest) < 0 || strcmp(key, table->largest) > 0)
+    return LOOKUP_MISS;
+  /* Find the first block whose last key is not less than KEY. */
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (strcmp(table->blocks[mid].last, key) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if ((buf = kvlsm_table_read_block(table, lo, true)) == NULL)
+    return LOOKUP_ERROR;
+  while (pos < table->blocks[lo].size) {
+    entry = (kventry_t *)(buf + pos);
+    if ((cmp = strcmp(entry->data, key)) == 0) {
+      if (!kventry_verify(entry, table->blocks[lo].size - pos)) {
+        __sync_fetch_and_add(&lsm->corruptions, 1);
+        ret = LOOKUP_CORRUPT;
+      } else if (entry->flags & KVENTRY_TOMBSTONE) {
+        ret = LOOKUP_DELETED;
+      } else if (value == NULL) {
+        ret = LOOKUP_FOUND;
+      } else if ((stored = kventry_value(entry, value)) == NULL) {
+        ret = LOOKUP_ERROR;
+      } else {
+        if (stored != value)
+          strcpy(value, stored);
+        ret = LOOKUP_FOUND;
+      }
+      break;
+    } else if (cmp > 0) {
+      break;
+    }
+    pos += sizeof(kventry_t) + entry->length;
+  }
+  free(buf);
+  return ret;
+}
+
+/* Returns true if TABLE holds keys within the range [LO, HI]. */
+static bool kvlsm_table_overlaps(kvlsm_table_t *table, const char *lo, const char *hi) {
+  return strcmp(table->largest, lo) >= 0 && strcmp(table->smallest, hi) <= 0;
+}
+
+/* Starts iterating over TABLE with IT, which reads every block once and so
+ * bypasses the block cache. Returns 0 if successful, else a negative error
+ * code. */
+static int kvlsm_iter_next(kvlsm_iter_t *it);
+static int kvlsm_iter_begin(kvlsm_iter_t *it, kvlsm_table_t *table) {
+  it->table = table;
+  it->block = 0;
+  it->buf = NULL;
+  it->len = it->pos = 0;
+  it->entry = NULL;
+  it->fill = false;
+  return kvlsm_iter_next(it);
+}
+
+/* Advances IT to the next entry of its table, setting IT->entry to NULL once
+ * all entries have been visited. Returns 0 if successful, ERR_CHECKSUM if the
+ * next entry fails its checksum, else a negative error code. */
+static int kvlsm_iter_next(kvlsm_iter_t *it) {
+  if (it->entry != NULL)
+    it->pos += sizeof(kventry_t) + it->entry->length;
+  while (it->pos >= it->len) {
+    free(it->buf);
+    it->buf = NULL;
+    it->entry = NULL;
+    if (it->block == it->table->nblocks)
+      return 0;
+    if ((it->buf = kvlsm_table_read_block(it->table, it->block, it->fill)) == NULL)
+      return ERR_FILACCESS;
+    it->len = it->table->blocks[it->block++].size;
+    it->pos = 0;
+  }
+  it->entry = (kventry_t *)(it->buf + it->pos);
+  if (!kventry_verify(it->entry, it->len - it->pos)) {
+    it->entry = NULL;
+    return ERR_CHECKSUM;
+  }
+  return 0;
+}
+
+/* Starts iterating over TABLE with IT at the first entry whose key is not less
+ * than KEY. Reads at most one data block to find it. Returns 0 if successful,
+ * else a negative error code. */
+static int kvlsm_iter_seek(kvlsm_iter_t *it, kvlsm_table_t *table, const char *key) {
+  uint32_t lo = 0, hi = table->nblocks, mid;
+  int ret;
+  /* Find the first block whose last key is not less than KEY. */
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (strcmp(table->blocks[mid].last, key) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  it->table = table;
+  it->block = lo;
+  it->buf = NULL;
+  it->len = it->pos = 0;
+  it->entry = NULL;
+  it->fill = true;
+  if ((ret = kvlsm_iter_next(it)) < 0)
+    return ret;
+  while (it->entry != NULL && strcmp(it->entry->data, key) < 0) {
+    if ((ret = kvlsm_iter_next(it)) < 0)
+      return ret;
+  }
+  return 0;
+}
+
+/* Starts writing a new table with B. The compression of the values added is
+ * recorded if COUNTED, as it is when a memtable is flushed; compactions only
+ * rewrite values counted before. Returns 0 if successful, else a negative
+ * error code. */
+static int kvlsm_builder_begin(kvlsm_t *lsm, kvlsm_builder_t *b, bool counted) {
+  char filename[MAX_FILENAME];
+  b->table = calloc(1, sizeof(kvlsm_table_t));
+  if (!b->table)
+    fatal_malloc();
+  b->block = malloc(KVLSM_BLOCK_SIZE + KVENTRY_MAX_SIZE);
+  if (!b->block)
+    fatal_malloc();
+  b->blocklen = 0;
+  b->capacity = 0;
+  b->bits_per_key = lsm->bits_per_key;
+  b->compress_threshold = lsm->compress_threshold;
+  b->compression = counted ? &lsm->compression : NULL;
+  b->hashes = NULL;
+  b->nhashes = b->hcapacity = 0;
+  b->table->id = kvlsm_new_file(lsm);
+  kvlsm_filename(lsm, b->table->id, KVLSM_TABLE_FILETYPE, filename);
+  b->table->fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  if (b->table->fd < 0) {
+    free(b->block);
+    kvlsm_table_free(b->table);
+    return ERR_FILACCESS;
+  }
+  return 0;
+}
+
+/* Writes the data block being filled by B. Returns 0 if successful, else a
+ * negative error code. */
+static int kvlsm_builder_flush_block(kvlsm_builder_t *b) {
+  kvlsm_table_t *table = b->table;
+  kvlsm_block_t *blk;
+  if (b->blocklen == 0)
+    return 0;
+  if (pwrite(table->fd, b->block, b->blocklen, table->size) != b->blocklen)
+    return ERR_FILACCESS;
+  if (table->nblocks == b->capacity) {
+    b->capacity = b->capacity ? b->capacity * 2 : 64;
+    table->blocks = realloc(table->blocks, b->capacity * sizeof(kvlsm_block_t));
+    if (!table->blocks)
+      fatal_malloc();
+  }
+  blk = &table->blocks[table->nblocks++];
+  blk->offset = table->size;
+  blk->size = b->blocklen;
+  blk->last = strdup(b->last);
+  if (!blk->last)
+    fatal_malloc();
+  table->size += b->blocklen;
+  b->blocklen = 0;
+  return 0;
+}
+
+/* Adds KEY and VALUE (NULL for a tombstone) to the table being written by B.
+ * Keys must be added in increasing order. Returns 0 if successful, else a
+ * negative error code. */
+static int kvlsm_builder_add(kvlsm_builder_t *b, const char *key, const char *value) {
+  if (b->table->smallest == NULL) {
+    b->table->smallest = strdup(key);
+    if (!b->table->smallest)
+      fatal_malloc();
+  }
+  if (b->bits_per_key > 0) {
+    if (b->nhashes == b->hcapacity) {
+      b->hcapacity = b->hcapacity ? b->hcapacity * 2 : 1024;
+      b->hashes = realloc(b->hashes, b->hcapacity * sizeof(uint64_t));
+      if (!b->hashes)
+        fatal_malloc();
+    }
+    b->hashes[b->nhashes++] = strhash64(key);
+  }
+  b->blocklen += kventry_encode((kventry_t *)(b->block + b->blocklen), key, value,
+                                b->compress_threshold, b->compression);
+  strcpy(b->last, key);
+  if (b->blocklen >= KVLSM_BLOCK_SIZE)
+    return kvlsm_builder_flush_block(b);
+  return 0;
+}
+
+/* Returns the number of bytes written so far by B. */
+static uint64_t kvlsm_builder_size(kvlsm_builder_t *b) { return b->table->size + b->blocklen; }
+
+/* Abandons the table being written by B, removing its file. */
+static void kvlsm_builder_abandon(kvlsm_t *lsm, kvlsm_builder_t *b) {
+  char filename[MAX_FILENAME];
+  kvlsm_filename(lsm, b->table->id, KVLSM_TABLE_FILETYPE, filename);
+  unlink(filename);
+  kvlsm_table_free(b->table);
+  free(b->block);
+  free(b->hashes);
+  b->table = NULL;
+}
+
+/* Switches TABLE of LSM, which has just been written and synced, to be read
+ * with O_DIRECT, dropping the pages written from the page cache. Returns 0 if
+ * successful, else a negative error code. */
+static int kvlsm_table_direct(kvlsm_t *lsm, kvlsm_table_t *table) {
+  char filename[MAX_FILENAME];
+  int fd;
+  kvlsm_filename(lsm, table->id, KVLSM_TABLE_FILETYPE, filename);
+  if ((fd = kvlsm_open_direct(filename)) < 0)
+    return ERR_FILACCESS;
+  posix_fadvise(table->fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(table->fd);
+  table->fd = fd;
+  table->cache = &lsm->blocks;
+  return 0;
+}
+
+/* Finishes the table being written by B by writing its filter, index and footer and
+ * syncing it to disk. On success, stores the table into TABLE (or NULL if no
+ * entries were added, in which case the file is removed) and returns 0, else
+ * returns a negative error code. */
+static int kvlsm_builder_finish(kvlsm_t *lsm, kvlsm_builder_t *b, kvlsm_table_t **table) {
+  kvlsm_table_t *t = b->table;
+  kvlsm_footer_t footer;
+  uint32_t i, keylen;
+  size_t size;
+  char *index, *pos;
+  *table = NULL;
+  if (t->smallest == NULL) {
+    kvlsm_builder_abandon(lsm, b);
+    return 0;
+  }
+  if (kvlsm_builder_flush_block(b) < 0)
+    goto error;
+  footer.filter_offset = t->size;
+  footer.filter_size = 0;
+  footer.filter_probes = 0;
+  if (b->bits_per_key > 0) {
+    bloom_init(&t->filter, b->nhashes, b->bits_per_key);
+    for (i = 0; i < b->nhashes; i++)
+      bloom_add(&t->filter, b->hashes[i]);
+    footer.filter_size = bloom_size(&t->filter);
+    footer.filter_probes = t->filter.probes;
+    if (pwrite(t->fd, t->filter.bits, footer.filter_size, t->size) != footer.filter_size)
+      goto error;
+    t->size += footer.filter_size;
+  }
+  size = sizeof(uint32_t) + strlen(t->smallest);
+  for (i = 0; i < t->nblocks; i++)
+    size += sizeof(uint64_t) + 2 * sizeof(uint32_t) + strlen(t->blocks[i].last);
+  index = pos = malloc(size);
+  if (!index)
+    fatal_malloc();
+  keylen = strlen(t->smallest);
+  memcpy(pos, &keylen, sizeof(uint32_t));
+  memcpy(pos + sizeof(uint32_t), t->smallest, keylen);
+  pos += sizeof(uint32_t) + keylen;
+  for (i = 0; i < t->nblocks; i++) {
+    keylen = strlen(t->blocks[i].last);
+    memcpy(pos, &t->blocks[i].offset, sizeof(uint64_t));
+    memcpy(pos + sizeof(uint64_t), &t->blocks[i].size, sizeof(uint32_t));
+    memcpy(pos + sizeof(uint64_t) + sizeof(uint32_t), &keylen, sizeof(uint32_t));
+    pos += sizeof(uint64_t) + 2 * sizeof(uint32_t);
+    memcpy(pos, t->blocks[i].last, keylen);
+    pos += keylen;
+  }
+  footer.index_offset = t->size;
+  footer.index_size = size;
+  footer.nblocks = t->nblocks;
+  footer.magic = KVLSM_MAGIC;
+  if (pwrite(t->fd, index, size, t->size) != size ||
+      pwrite(t->fd, &footer, sizeof(footer), t->size + size) != sizeof(footer) ||
+      fdatasync(t->fd) < 0) {
+    free(index);
+    goto error;
+  }
+  free(index);
+  t->size += size + sizeof(footer);
+  if (lsm->direct_io && kvlsm_table_direct(lsm, t) < 0)
+    goto error;
+  t->largest = strdup(b->last);
+  if (!t->largest)
+    fatal_malloc();
+  free(b->block);
+  free(b->hashes);
+  *table = t;
+  return 0;
+
+error:
+  kvlsm_builder_abandon(lsm, b);
+  return ERR_FILACCESS;
+}
+
+/* Writes the entries of MEM (including tombstones) as a new table. On
+ * success, stores the table into TABLE (NULL if MEM is empty) and returns 0,
+ * else returns a negative error code. */
+static int kvlsm_write_memtable(kvlsm_t *lsm, kvlsm_memtable_t *mem, kvlsm_table_t **table) {
+  kvlsm_builder_t b;
+  skiplist_node_t *node;
+  int ret;
+  if ((ret = kvlsm_builder_begin(lsm, &b, true)) < 0)
+    return ret;
+  for (node = skiplist_first(&mem->entries); node != NULL; node = node->next[0]) {
+    if ((ret = kvlsm_builder_add(&b, node->key, node->value)) < 0) {
+      kvlsm_builder_abandon(lsm, &b);
+      return ret;
+    }
+  }
+  return kvlsm_builder_finish(lsm, &b, table);
+}
+
+/* Writes the manifest of LSM, which lists its live tables. The caller must
+ * hold the lock of LSM, or otherwise be its only user. Returns 0 if
+ * successful, else a negative error code. */
+static int kvlsm_write_manifest(kvlsm_t *lsm) {
+  char filename[MAX_FILENAME], tmpname[MAX_FILENAME];
+  uint32_t level, i;
+  FILE *file;
+  int ret;
+  sprintf(filename, "%s/%s", lsm->dirname, KVLSM_MANIFEST);
+  sprintf(tmpname, "%s/%s.tmp", lsm->dirname, KVLSM_MANIFEST);
+  if ((file = fopen(tmpname, "w")) == NULL)
+    return ERR_FILACCESS;
+  fprintf(file, "next %u\n", lsm->next_file);
+  fprintf(file, "log %u\n", lsm->imm ? lsm->imm->wal : lsm->mem->wal);
+  for (level = 0; level < KVLSM_LEVELS; level++) {
+    for (i = 0; i < lsm->levels[level].ntables; i++)
+      fprintf(file, "table %u %u\n", level, lsm->levels[level].tables[i]->id);
+  }
+  ret = (fflush(file) == 0 && fdatasync(fileno(file)) == 0) ? 0 : ERR_FILACCESS;
+  fclose(file);
+  if (ret == 0 && rename(tmpname, filename) < 0)
+    ret = ERR_FILACCESS;
+  return ret;
+}
+
+/* Adds TABLE to LEVEL of LSM. Level 0 tables are added as the newest table;
+ * other levels are kept sorted by key. */
+static void kvlsm_level_add(kvlsm_t *lsm, uint32_t level, kvlsm_table_t *table) {
+  kvlsm_level_t *lvl = &lsm->levels[level];
+  uint32_t pos = 0;
+  lvl->tables = realloc(lvl->tables, (lvl->ntables + 1) * sizeof(kvlsm_table_t *));
+  if (!lvl->tables)
+    fatal_malloc();
+  if (level > 0) {
+    while (pos < lvl->ntables && strcmp(lvl->tables[pos]->smallest, table->smallest) < 0)
+      pos++;
+  }
+  memmove(lvl->tables + pos + 1, lvl->tables + pos, (lvl->ntables - pos) * sizeof(kvlsm_table_t *));
+  lvl->tables[pos] = table;
+  lvl->ntables++;
+  lvl->size += table->size;
+}
+
+/* Removes TABLE from LEVEL of LSM, if present. */
+static void kvlsm_level_remove(kvlsm_t *lsm, uint32_t level, kvlsm_table_t *table) {
+  kvlsm_level_t *lvl = &lsm->levels[level];
+  uint32_t pos;
+  for (pos = 0; pos < lvl->ntables; pos++) {
+    if (lvl->tables[pos] == table) {
+      memmove(lvl->tables + pos, lvl->tables + pos + 1,
+              (lvl->ntables - pos - 1) * sizeof(kvlsm_table_t *));
+      lvl->ntables--;
+      lvl->size -= table->size;
+      return;
+    }
+  }
+}
+
+/* Closes TABLE and removes its file, dropping its pages from the block
+ * cache. */
+static void kvlsm_table_drop(kvlsm_t *lsm, kvlsm_table_t *table) {
+  char filename[MAX_FILENAME];
+  kvlsm_filename(lsm, table->id, KVLSM_TABLE_FILETYPE, filename);
+  if (table->cache != NULL)
+    kvblockcache_drop(table->cache, table->id, table->size);
+  kvlsm_table_free(table);
+  unlink(filename);
+}
+
+/* Looks up KEY, whose hash is HASH, within TABLE of LSM, consulting the
+ * filter of TABLE first so that no block is read if KEY is definitely
+ * absent. */
+static kvlsm_lookup_t kvlsm_table_probe(kvlsm_t *lsm, kvlsm_table_t *table, const char *key,
+                                        uint64_t hash, char *value) {
+  kvlsm_lookup_t ret;
+  if (table->filter.nbits == 0 || strcmp(key, table->smallest) < 0 ||
+      strcmp(key, table->largest) > 0)
+    return kvlsm_table_get(lsm, table, key, value);
+  __sync_fetch_and_add(&lsm->filter_checks, 1);
+  if (!bloom_may_contain(&table->filter, hash)) {
+    __sync_fetch_and_add(&lsm->filter_negatives, 1);
+    return LOOKUP_MISS;
+  }
+  if ((ret = kvlsm_table_get(lsm, table, key, value)) == LOOKUP_MISS)
+    __sync_fetch_and_add(&lsm->filter_false_positives, 1);
+  return ret;
+}
+
+/* Looks up KEY within LSM, from the newest to the oldest data. The caller
+ * must hold the lock of LSM. */
+static kvlsm_lookup_t kvlsm_lookup(kvlsm_t *lsm, const char *key, char *value) {
+  kvlsm_lookup_t ret;
+  kvlsm_level_t *lvl;
+  uint32_t level, i, lo, hi, mid;
+  uint64_t hash;
+  if ((ret = kvlsm_memtable_get(lsm->mem, key, value)) != LOOKUP_MISS)
+    return ret;
+  if (lsm->imm != NULL && (ret = kvlsm_memtable_get(lsm->imm, key, value)) != LOOKUP_MISS)
+    return ret;
+  hash = strhash64(key);
+  lvl = &lsm->levels[0];
+  for (i = 0; i < lvl->ntables; i++) {
+    if ((ret = kvlsm_table_probe(lsm, lvl->tables[i], key, hash, value)) != LOOKUP_MISS)
+      return ret;
+  }
+  for (level = 1; level < KVLSM_LEVELS; level++) {
+    lvl = &lsm->levels[level];
+    if (lvl->ntables == 0)
+      continue;
+    /* Find the first table whose largest key is not less than KEY. */
+    lo = 0;
+    hi = lvl->ntables;
+    while (lo < hi) {
+      mid = lo + (hi - lo) / 2;
+      if (strcmp(lvl->tables[mid]->largest, key) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    if (lo < lvl->ntables &&
+        (ret = kvlsm_table_probe(lsm, lvl->tables[lo], key, hash, value)) != LOOKUP_MISS)
+      return ret;
+  }
+  return LOOKUP_MISS;
+}
+
+/* Writes the immutable memtable of LSM (if any) into a level 0 table.
+ * Returns 0 if successful, else a negative error code. */
+static int kvlsm_flush(kvlsm_t *lsm) {
+  char filename[MAX_FILENAME];
+  kvlsm_memtable_t *imm;
+  kvlsm_table_t *table;
+  int ret;
+  pthread_rwlock_rdlock(&lsm->lock);
+  imm = lsm->imm;
+  pthread_rwlock_unlock(&lsm->lock);
+  if (imm == NULL)
+    return 0;
+  /* The immutable memtable is only modified by this thread, so it can be
+   * written out without holding the lock. */
+  if ((ret = kvlsm_write_memtable(lsm, imm, &table)) < 0)
+    return ret;
+  pthread_rwlock_wrlock(&lsm->lock);
+  if (table != NULL)
+    kvlsm_level_add(lsm, 0, table);
+  lsm->imm = NULL;
+  if ((ret = kvlsm_write_manifest(lsm)) < 0) {
+    if (table != NULL)
+      kvlsm_level_remove(lsm, 0, table);
+    lsm->imm = imm;
+    pthread_rwlock_unlock(&lsm->lock);
+    if (table != NULL)
+      kvlsm_table_drop(lsm, table);
+    return ret;
+  }
+  pthread_rwlock_unlock(&lsm->lock);
+  kvlsm_filename(lsm, imm->wal, KVLSM_WAL_FILETYPE, filename);
+  kvlsm_memtable_free(imm);
+  unlink(filename);
+
+  pthread_mutex_lock(&lsm->bg_mutex);
+  lsm->flushing = false;
+  pthread_cond_broadcast(&lsm->bg_cond);
+  pthread_mutex_unlock(&lsm->bg_mutex);
+  return 0;
+}
+
+/* Returns the size budget of LEVEL, which must be at least 1. */
+static uint64_t kvlsm_level_budget(uint32_t level) {
+  uint64_t budget = KVLSM_L1_SIZE;
+  while (--level > 0)
+    budget *= 10;
+  return budget;
+}
+
+/* Merges INPUTS (ordered from newest to oldest) into new tables, which are
+ * stored into OUTPUTS and counted by NOUTPUTS. Tombstones are dropped if
+ * DROP_TOMBSTONES is true. Returns 0 if successful, else a negative error
+ * code, in which case no output tables remain. */
+static int kvlsm_merge(kvlsm_t *lsm, kvlsm_table_t **inputs, uint32_t ninputs,
+                       bool drop_tombstones, kvlsm_table_t ***outputs, uint32_t *noutputs) {
+  kvlsm_iter_t its[ninputs];
+  kvlsm_table_t *table;
+  kvlsm_builder_t b;
+  char key[MAX_KEYLEN + 1], value[MAX_VALLEN + 1];
+  kventry_t *entry;
+  char *stored;
+  int ret = 0, min;
+  uint32_t i;
+  bool building = false;
+  *outputs = NULL;
+  *noutputs = 0;
+  for (i = 0; i < ninputs; i++) {
+    if (ret == 0)
+      ret = kvlsm_iter_begin(&its[i], inputs[i]);
+    else
+      its[i].buf = NULL;
+  }
+  while (ret == 0) {
+    /* The smallest current key wins; among equal keys, the newest input. */
+    min = -1;
+    for (i = 0; i < ninputs; i++) {
+      if (its[i].entry != NULL &&
+          (min < 0 || strcmp(its[i].entry->data, its[min].entry->data) < 0))
+        min = i;
+    }
+    if (min < 0)
+      break;
+    entry = its[min].entry;
+    strcpy(key, entry->data);
+    if (!drop_tombstones || !(entry->flags & KVENTRY_TOMBSTONE)) {
+      stored = kventry_value(entry, value);
+      if (stored == NULL && !(entry->flags & KVENTRY_TOMBSTONE)) {
+        ret = ERR_FILACCESS;
+        break;
+      }
+      if (!building && (ret = kvlsm_builder_begin(lsm, &b, false)) < 0)
+        break;
+      building = true;
+      if ((ret = kvlsm_builder_add(&b, key, stored)) < 0)
+        break;
+      if (kvlsm_builder_size(&b) >= KVLSM_TABLE_SIZE) {
+        building = false;
+        if ((ret = kvlsm_builder_finish(lsm, &b, &table)) < 0)
+          break;
+        *outputs = realloc(*outputs, (*noutputs + 1) * sizeof(kvlsm_table_t *));
+        if (!*outputs)
+          fatal_malloc();
+        (*outputs)[(*noutputs)++] = table;
+      }
+    }
+    for (i = 0; i < ninputs && ret == 0; i++) {
+      if (its[i].entry != NULL && strcmp(its[i].entry->data, key) == 0)
+        ret = kvlsm_iter_next(&its[i]);
+    }
+  }
+  if (building) {
+    if (ret < 0) {
+      kvlsm_builder_abandon(lsm, &b);
+    } else if ((ret = kvlsm_builder_finish(lsm, &b, &table)) == 0 && table != NULL) {
+      *outputs = realloc(*outputs, (*noutputs + 1) * sizeof(kvlsm_table_t *));
+      if (!*outputs)
+        fatal_malloc();
+      (*outputs)[(*noutputs)++] = table;
+    }
+  }
+  for (i = 0; i < ninputs; i++)
+    free(its[i].buf);
+  if (ret == ERR_CHECKSUM)
+    __sync_fetch_and_add(&lsm->corruptions, 1);
+  if (ret < 0) {
+    for (i = 0; i < *noutputs; i++)
+      kvlsm_table_drop(lsm, (*outputs)[i]);
+    free(*outputs);
+    *outputs = NULL;
+    *noutputs = 0;
+  }
+  return ret;
+}
+
+/* Performs a single compaction of LSM if any level needs one. Returns 1 if a
+ * compaction was done, 0 if none was needed, else a negative error code. Only
+ * ever called from the compactor thread, which is the only thread to modify
+ * the levels, so they can be read without holding the lock. */
+static int kvlsm_compact(kvlsm_t *lsm) {
+  kvlsm_table_t **inputs, **outputs;
+  kvlsm_level_t *lvl;
+  uint32_t level, ninputs = 0, noutputs, i, deeper;
+  const char *lo, *hi;
+  bool drop_tombstones = true;
+  int ret;
+  if (lsm->levels[0].ntables >= KVLSM_L0_TRIGGER) {
+    level = 0;
+  } else {
+    for (level = 1; level < KVLSM_LEVELS - 1; level++) {
+      if (lsm->levels[level].size > kvlsm_level_budget(level))
+        break;
+    }
+    if (level == KVLSM_LEVELS - 1)
+      return 0;
+  }
+  lvl = &lsm->levels[level];
+  inputs = malloc((lvl->ntables + lsm->levels[level + 1].ntables) * sizeof(kvlsm_table_t *));
+  if (!inputs)
+    fatal_malloc();
+  if (level == 0) {
+    for (i = 0; i < lvl->ntables; i++)
+      inputs[ninputs++] = lvl->tables[i];
+  } else {
+    inputs[ninputs++] = lvl->tables[lvl->next++ % lvl->ntables];
+  }
+  lo = inputs[0]->smallest;
+  hi = inputs[0]->largest;
+  for (i = 1; i < ninputs; i++) {
+    if (strcmp(inputs[i]->smallest, lo) < 0)
+      lo = inputs[i]->smallest;
+    if (strcmp(inputs[i]->largest, hi) > 0)
+      hi = inputs[i]->largest;
+  }
+  lvl = &lsm->levels[level + 1];
+  for (i = 0; i < lvl->ntables; i++) {
+    if (kvlsm_table_overlaps(lvl->tables[i], lo, hi))
+      inputs[ninputs++] = lvl->tables[i];
+  }
+  for (i = 0; i < ninputs; i++) {
+    if (strcmp(inputs[i]->smallest, lo) < 0)
+      lo = inputs[i]->smallest;
+    if (strcmp(inputs[i]->largest, hi) > 0)
+      hi = inputs[i]->largest;
+  }
+  /* Tombstones can only be dropped if no older data could be hidden by them. */
+  for (deeper = level + 2; deeper < KVLSM_LEVELS && drop_tombstones; deeper++) {
+    for (i = 0; i < lsm->levels[deeper].ntables; i++) {
+      if (kvlsm_table_overlaps(lsm->levels[deeper].tables[i], lo, hi))
+        drop_tombstones = false;
+    }
+  }
+  if ((ret = kvlsm_merge(lsm, inputs, ninputs, drop_tombstones, &outputs, &noutputs)) < 0) {
+    free(inputs);
+    return ret;
+  }
+
+  pthread_rwlock_wrlock(&lsm->lock);
+  for (i = 0; i < ninputs; i++) {
+    kvlsm_level_remove(lsm, level, inputs[i]);
+    kvlsm_level_remove(lsm, level + 1, inputs[i]);
+  }
+  for (i = 0; i < noutputs; i++)
+    kvlsm_level_add(lsm, level + 1, outputs[i]);
+  ret = kvlsm_write_manifest(lsm);
+  pthread_rwlock_unlock(&lsm->lock);
+  /* No reader can be using the inputs anymore, since readers hold the lock
+   * for the duration of a lookup. If the manifest could not be written the
+   * old manifest still lists the inputs, which hold the same data. */
+  if (ret == 0) {
+    for (i = 0; i < ninputs; i++)
+      kvlsm_table_drop(lsm, inputs[i]);
+  }
+  free(inputs);
+  free(outputs);
+  return ret < 0 ? ret : 1;
+}
+
+/* Returns true if the compactor of LSM has been asked to exit. */
+static bool kvlsm_stopping(kvlsm_t *lsm) {
+  bool ret;
+  pthread_mutex_lock(&lsm->bg_mutex);
+  ret = lsm->shutdown;
+  pthread_mutex_unlock(&lsm->bg_mutex);
+  return ret;
+}
+
+/* The compactor thread of LSM: flushes immutable memtables and compacts the
+ * levels whenever it is woken up. */
+static void *kvlsm_compactor(void *lsm_) {
+  kvlsm_t *lsm = (kvlsm_t *)lsm_;
+  int ret;
+  pthread_mutex_lock(&lsm->bg_mutex);
+  while (!lsm->shutdown) {
+    if (!lsm->work) {
+      pthread_cond_wait(&lsm->bg_cond, &lsm->bg_mutex);
+      continue;
+    }
+    lsm->work = false;
+    pthread_mutex_unlock(&lsm->bg_mutex);
+    ret = kvlsm_flush(lsm);
+    while (ret == 0 && !kvlsm_stopping(lsm) && (ret = kvlsm_compact(lsm)) > 0)
+      ret = 0;
+    if (ret < 0) {
+      /* Most likely out of disk space; try again later. */
+      fprintf(stderr, "kvlsm: background work failed in %s, retrying\n", lsm->dirname);
+      sleep(1);
+    }
+    pthread_mutex_lock(&lsm->bg_mutex);
+    if (ret < 0)
+      lsm->work = true;
+  }
+  pthread_mutex_unlock(&lsm->bg_mutex);
+  return NULL;
+}
+
+/* Reads the manifest of LSM, if there is one, opening all tables it lists.
+ * Stores the id of the oldest write-ahead log which is still needed into LOG.
+ * Returns 0 if successful, else a negative error code. */
+static int kvlsm_read_manifest(kvlsm_t *lsm, uint32_t *log) {
+  char filename[MAX_FILENAME], word[16];
+  uint32_t level, id;
+  kvlsm_table_t *table;
+  FILE *file;
+  *log = 0;
+  sprintf(filename, "%s/%s", lsm->dirname, KVLSM_MANIFEST);
+  if ((file = fopen(filename, "r")) == NULL)
+    return errno == ENOENT ? 0 : ERR_FILACCESS;
+  while (fscanf(file, "%15s", word) == 1) {
+    if (!strcmp(word, "next") && fscanf(file, "%u", &id) == 1) {
+      lsm->next_file = id;
+    } else if (!strcmp(word, "log") && fscanf(file, "%u", &id) == 1) {
+      *log = id;
+    } else if (!strcmp(word, "table") && fscanf(file, "%u %u", &level, &id) == 2 &&
+               level < KVLSM_LEVELS) {
+      if ((table = kvlsm_table_open(lsm, id)) == NULL) {
+        fclose(file);
+        return ERR_FILACCESS;
+      }
+      if (level == 0) {
+        /* The manifest lists level 0 from newest to oldest. */
+        kvlsm_level_add(lsm, 0, table);
+        memmove(lsm->levels[0].tables, lsm->levels[0].tables + 1,
+                (lsm->levels[0].ntables - 1) * sizeof(kvlsm_table_t *));
+        lsm->levels[0].tables[lsm->levels[0].ntables - 1] = table;
+      } else {
+        kvlsm_level_add(lsm, level, table);
+      }
+    } else {
+      fclose(file);
+      return ERR_FILACCESS;
+    }
+  }
+  fclose(file);
+  return 0;
+}
+
+/* Returns true if LSM has an open table with the given ID. */
+static bool kvlsm_has_table(kvlsm_t *lsm, uint32_t id) {
+  uint32_t level, i;
+  for (level = 0; level < KVLSM_LEVELS; level++) {
+    for (i = 0; i < lsm->levels[level].ntables; i++) {
+      if (lsm->levels[level].tables[i]->id == id)
+        return true;
+    }
+  }
+  return false;
+}
+
+static int kvlsm_cmp_id(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
+
+/* Initializes LSM within DIRNAME, which must already exist. Opens the tables
+ * listed by the manifest, recovers the writes of any remaining write-ahead
+ * logs into a level 0 table, and starts the compactor thread. MEMTABLE_SIZE
+ * is the size at which the memtable is flushed, and BITS_PER_KEY the size of
+ * the Bloom filter written with every new table (0 to write none).
+ * COMPRESS_THRESHOLD is the size from which values written to tables are
+ * compressed (0 for never). If DIRECT_IO is true, tables are read with
+ * O_DIRECT through a block cache of BLOCK_CACHE_SIZE bytes. Returns 0 if
+ * successful, else a negative error code. */
+int kvlsm_init(kvlsm_t *lsm, char *dirname, size_t memtable_size, unsigned int bits_per_key,
+               size_t compress_threshold, bool direct_io, size_t block_cache_size) {
+  char filename[MAX_FILENAME], suffix[MAX_FILENAME];
+  uint32_t *wals = NULL, nwals = 0, log, id, i;
+  kvlsm_memtable_t *recovered;
+  kvlsm_table_t *table;
+  struct dirent *dent;
+  DIR *dir;
+  int ret;
+  memset(lsm, 0, sizeof(kvlsm_t));
+  lsm->dirname = strdup(dirname);
+  if (!lsm->dirname)
+    fatal_malloc();
+  lsm->memtable_size = memtable_size;
+  lsm->bits_per_key = bits_per_key;
+  lsm->compress_threshold = compress_threshold;
+  lsm->direct_io = direct_io;
+  if (direct_io)
+    kvblockcache_init(&lsm->blocks, block_cache_size);
+  lsm->synced_wal = UINT32_MAX;
+  pthread_rwlock_init(&lsm->lock, NULL);
+  pthread_mutex_init(&lsm->bg_mutex, NULL);
+  pthread_cond_init(&lsm->bg_cond, NULL);
+  if ((ret = kvlsm_read_manifest(lsm, &log)) < 0)
+    return ret;
+
+  /* Collect the write-ahead logs to recover, and remove files left behind by
+   * flushes and compactions which did not complete. */
+  if ((dir = opendir(dirname)) == NULL)
+    return ERR_FILACCESS;
+  while ((dent = readdir(dir)) != NULL) {
+    if (sscanf(dent->d_name, "%u%s", &id, suffix) != 2)
+      continue;
+    sprintf(filename, "%s/%s", dirname, dent->d_name);
+    if (!strcmp(suffix, KVLSM_WAL_FILETYPE) && id >= log) {
+      wals = realloc(wals, (nwals + 1) * sizeof(uint32_t));
+      if (!wals)
+        fatal_malloc();
+      wals[nwals++] = id;
+    } else if (!strcmp(suffix, KVLSM_WAL_FILETYPE) ||
+               (!strcmp(suffix, KVLSM_TABLE_FILETYPE) && !kvlsm_has_table(lsm, id))) {
+      unlink(filename);
+    } else {
+      continue;
+    }
+    if (id >= lsm->next_file)
+      lsm->next_file = id + 1;
+  }
+  closedir(dir);
+  qsort(wals, nwals, sizeof(uint32_t), kvlsm_cmp_id);
+
+  recovered = kvlsm_memtable_new(lsm, -1);
+  for (i = 0; i < nwals; i++) {
+    if ((ret = kvlsm_wal_replay(lsm, wals[i], recovered)) < 0)
+      goto out;
+  }
+  if ((lsm->mem = kvlsm_memtable_new(lsm, kvlsm_new_file(lsm))) == NULL) {
+    ret = ERR_FILACCESS;
+    goto out;
+  }
+  if ((ret = kvlsm_write_memtable(lsm, recovered, &table)) < 0)
+    goto out;
+  if (table != NULL)
+    kvlsm_level_add(lsm, 0, table);
+  if ((ret = kvlsm_write_manifest(lsm)) < 0)
+    goto out;
+  for (i = 0; i < nwals; i++) {
+    kvlsm_filename(lsm, wals[i], KVLSM_WAL_FILETYPE, filename);
+    unlink(filename);
+  }
+
+  lsm->work = true;
+  if (pthread_create(&lsm->compactor, NULL, kvlsm_compactor, lsm) != 0)
+    ret = ERR_FILACCESS;
+out:
+  kvlsm_memtable_free(recovered);
+  free(wals);
+  return ret;
+}
+
+/* Makes sure the memtable of LSM has room for another write, turning a full
+ * memtable into the immutable memtable (waiting for the previous one to be
+ * flushed first, if necessary). The caller must hold the write lock of LSM,
+ * which may be released and reacquired. Returns 0 if successful, else a
+ * negative error code. */
+static int kvlsm_make_room(kvlsm_t *lsm) {
+  kvlsm_memtable_t *mem;
+  while (lsm->mem->size >= lsm->memtable_size) {
+    if (lsm->imm != NULL) {
+      pthread_rwlock_unlock(&lsm->lock);
+      pthread_mutex_lock(&lsm->bg_mutex);
+      while (lsm->flushing)
+        pthread_cond_wait(&lsm->bg_cond, &lsm->bg_mutex);
+      pthread_mutex_unlock(&lsm->bg_mutex);
+      pthread_rwlock_wrlock(&lsm->lock);
+      continue;
+    }
+    if ((mem = kvlsm_memtable_new(lsm, kvlsm_new_file(lsm))) == NULL)
+      return ERR_FILACCESS;
+    lsm->imm = lsm->mem;
+    lsm->mem = mem;
+    pthread_mutex_lock(&lsm->bg_mutex);
+    lsm->flushing = true;
+    lsm->work = true;
+    pthread_cond_broadcast(&lsm->bg_cond);
+    pthread_mutex_unlock(&lsm->bg_mutex);
+  }
+  return 0;
+}
+
+/* Writes KEY and VALUE (NULL for a tombstone) to the write-ahead log and the
+ * memtable of LSM. The caller must hold the write lock of LSM. Returns 0 if
+ * successful, else a negative error code. */
+static int kvlsm_write(kvlsm_t *lsm, char *key, char *value) {
+  char buf[KVENTRY_MAX_SIZE];
+  size_t size = kvlsm_encode(buf, key, value);
+  int ret;
+  if ((ret = kvlsm_make_room(lsm)) < 0)
+    return ret;
+  if (write(lsm->mem->walfd, buf, size) != size)
+    return ERR_FILACCESS;
+  kvlsm_memtable_apply(lsm->mem, key, value);
+  return 0;
+}
+
+/* Writes the COUNT entries KEYS[i], VALUES[i] (NULL for a deletion) to LSM,
+ * in order, under a single acquisition of its lock. The records of all
+ * entries are appended to the write-ahead log with a single write, which,
+ * like that of kvlsm_put, is left to the caller to sync (see kvlsm_sync).
+ * Returns 0 if successful, else a negative error code, in which case none of
+ * the entries are applied. */
+int kvlsm_write_batch(kvlsm_t *lsm, unsigned int count, char **keys, char **values) {
+  size_t size = 0, pos = 0;
+  unsigned int i;
+  char *buf;
+  int ret;
+  for (i = 0; i < count; i++)
+    size += sizeof(kventry_t) + strlen(keys[i]) + (values[i] ? strlen(values[i]) + 2 : 1);
+  buf = malloc(size);
+  if (!buf)
+    fatal_malloc();
+  for (i = 0; i < count; i++)
+    pos += kvlsm_encode(buf + pos, keys[i], values[i]);
+  pthread_rwlock_wrlock(&lsm->lock);
+  if ((ret = kvlsm_make_room(lsm)) == 0) {
+    if (write(lsm->mem->walfd, buf, size) != size) {
+      ret = ERR_FILACCESS;
+    } else {
+      for (i = 0; i < count; i++)
+        kvlsm_memtable_apply(lsm->mem, keys[i], values[i]);
+    }
+  }
+  pthread_rwlock_unlock(&lsm->lock);
+  free(buf);
+  return ret;
+}
+
+/* Flushes all writes made to LSM to disk, syncing the write-ahead logs of its
+ * memtables (and the directory, if a log was created since the previous
+ * call). May be called concurrently with other writes and syncs. Returns 0 if
+ * successful, else a negative error code. */
+int kvlsm_sync(kvlsm_t *lsm) {
+  uint32_t wal;
+  int fd, ret = 0;
+  pthread_rwlock_rdlock(&lsm->lock);
+  wal = lsm->mem->wal;
+  if ((lsm->imm != NULL && lsm->imm->walfd >= 0 && fdatasync(lsm->imm->walfd) < 0) ||
+      (lsm->mem->walfd >= 0 && fdatasync(lsm->mem->walfd) < 0))
+    ret = ERR_FILACCESS;
+  pthread_rwlock_unlock(&lsm->lock);
+  if (ret == 0 && __atomic_load_n(&lsm->synced_wal, __ATOMIC_RELAXED) != wal) {
+    if ((fd = open(lsm->dirname, O_RDONLY | O_DIRECTORY)) < 0)
+      return ERR_FILACCESS;
+    if (fsync(fd) < 0)
+      ret = ERR_FILACCESS;
+    close(fd);
+    if (ret == 0)
+      __atomic_store_n(&lsm->synced_wal, wal, __ATOMIC_RELAXED);
+  }
+  return ret;
+}
+
+/* A source of entries merged by a scan: either a memtable or a table. */
+typedef struct {
+  skiplist_node_t *node; /* The current node, if the source is a memtable. */
+  kvlsm_iter_t it;       /* The table iterator, if the source is a table. */
+  bool table;            /* Whether the source is a table. */
+  const char *key;       /* The current key, or NULL once exhausted. */
+  const char *value;     /* The current value, or NULL for a tombstone. */
+  char buf[MAX_VALLEN + 1]; /* Holds VALUE if it was stored compressed. */
+} kvlsm_source_t;
+
+/* Points SOURCE at the entry of its memtable node or table iterator. */
+static void kvlsm_source_load(kvlsm_source_t *source) {
+  if (source->table) {
+    source->key = source->it.entry ? source->it.entry->data : NULL;
+    source->value = source->it.entry ? kventry_value(source->it.entry, source->buf) : NULL;
+  } else {
+    source->key = source->node ? source->node->key : NULL;
+    source->value = source->node ? source->node->value : NULL;
+  }
+}
+
+/* Calls VISIT with every entry of LSM whose key lies within [START, END), in
+ * key order, until VISIT returns nonzero. START and END may be NULL to leave
+ * the range unbounded. The memtables and every table overlapping the range are
+ * merged, the newest version of each key winning; deleted keys are skipped.
+ * The read lock of LSM is held throughout, so VISIT must not modify LSM.
+ * Returns 0 if successful, else a negative error code. */
+int kvlsm_scan(kvlsm_t *lsm, const char *start, const char *end, kvscan_fn_t visit, void *arg) {
+  kvlsm_source_t *sources;
+  kvlsm_memtable_t *mems[2];
+  kvlsm_table_t *table;
+  uint32_t nsources = 0, level, i, j;
+  char key[MAX_KEYLEN + 1];
+  int ret = 0, min;
+  if (start == NULL)
+    start = "";
+  pthread_rwlock_rdlock(&lsm->lock);
+  /* Sources are ordered from newest to oldest. */
+  for (i = 0, level = 0; level < KVLSM_LEVELS; level++)
+    i += lsm->levels[level].ntables;
+  sources = calloc(i + 2, sizeof(kvlsm_source_t));
+  if (!sources)
+    fatal_malloc();
+  mems[0] = lsm->mem;
+  mems[1] = lsm->imm;
+  for (i = 0; i < 2; i++) {
+    if (mems[i] == NULL)
+      continue;
+    sources[nsources].node = skiplist_seek(&mems[i]->entries, start);
+    kvlsm_source_load(&sources[nsources++]);
+  }
+  for (level = 0; level < KVLSM_LEVELS && ret == 0; level++) {
+    for (j = 0; j < lsm->levels[level].ntables && ret == 0; j++) {
+      table = lsm->levels[level].tables[j];
+      if (strcmp(table->largest, start) < 0 || (end != NULL && strcmp(table->smallest, end) >= 0))
+        continue;
+      sources[nsources].table = true;
+      ret = kvlsm_iter_seek(&sources[nsources].it, table, start);
+      kvlsm_source_load(&sources[nsources++]);
+    }
+  }
+  while (ret == 0) {
+    /* The smallest current key wins; among equal keys, the newest source. */
+    min = -1;
+    for (i = 0; i < nsources; i++) {
+      if (sources[i].key != NULL &&
+          (min < 0 || strcmp(sources[i].key, sources[min].key) < 0))
+        min = i;
+    }
+    if (min < 0 || (end != NULL && strcmp(sources[min].key, end) >= 0))
+      break;
+    strcpy(key, sources[min].key);
+    if (sources[min].value != NULL && visit(key, sources[min].value, arg))
+      break;
+    for (i = 0; i < nsources && ret == 0; i++) {
+      if (sources[i].key == NULL || strcmp(sources[i].key, key) != 0)
+        continue;
+      if (sources[i].table)
+        ret = kvlsm_iter_next(&sources[i].it);
+      else
+        sources[i].node = sources[i].node->next[0];
+      kvlsm_source_load(&sources[i]);
+    }
+  }
+  pthread_rwlock_unlock(&lsm->lock);
+  for (i = 0; i < nsources; i++) {
+    if (sources[i].table)
+      free(sources[i].it.buf);
+  }
+  free(sources);
+  if (ret == ERR_CHECKSUM)
+    __sync_fetch_and_add(&lsm->corruptions, 1);
+  return ret;
+}
+
+/* Attempts to retrieve the value of KEY from LSM into VALUE. Returns 0 if
+ * successful, else a negative error code. */
+int kvlsm_get(kvlsm_t *lsm, char *key, char *value) {
+  kvlsm_lookup_t ret;
+  pthread_rwlock_rdlock(&lsm->lock);
+  ret = kvlsm_lookup(lsm, key, value);
+  pthread_rwlock_unlock(&lsm->lock);
+  if (ret == LOOKUP_ERROR)
+    return ERR_FILACCESS;
+  if (ret == LOOKUP_CORRUPT)
+    return ERR_CHECKSUM;
+  return ret == LOOKUP_FOUND ? 0 : ERR_NOKEY;
+}
+
+/* Returns true if LSM contains KEY, else false. */
+bool kvlsm_haskey(kvlsm_t *lsm, char *key) { return kvlsm_get(lsm, key, NULL) == 0; }
+
+/* Stores the given KEY, VALUE entry in LSM. Returns 0 if successful, else a
+ * negative error code. */
+int kvlsm_put(kvlsm_t *lsm, char *key, char *value) {
+  int ret;
+  pthread_rwlock_wrlock(&lsm->lock);
+  ret = kvlsm_write(lsm, key, value);
+  pthread_rwlock_unlock(&lsm->lock);
+  return ret;
+}
+
+/* Removes KEY from LSM by writing a tombstone for it. Returns 0 if
+ * successful, else a negative error code. */
+int kvlsm_del(kvlsm_t *lsm, char *key) {
+  kvlsm_lookup_t found;
+  int ret;
+  pthread_rwlock_wrlock(&lsm->lock);
+  found = kvlsm_lookup(lsm, key, NULL);
+  /* A corrupted entry can still be deleted. */
+  if (found == LOOKUP_FOUND || found == LOOKUP_CORRUPT)
+    ret = kvlsm_write(lsm, key, NULL);
+  else
+    ret = (found == LOOKUP_ERROR) ? ERR_FILACCESS : ERR_NOKEY;
+  pthread_rwlock_unlock(&lsm->lock);
+  return ret;
+}
+
+/* Stops the compactor thread of LSM and closes all of its files. Writes which
+ * have not been flushed yet remain in their write-ahead logs and are
+ * recovered when LSM is reinitialized. */
+void kvlsm_close(kvlsm_t *lsm) {
+  uint32_t level, i;
+  pthread_mutex_lock(&lsm->bg_mutex);
+  lsm->shutdown = true;
+  pthread_cond_broadcast(&lsm->bg_cond);
+  pthread_mutex_unlock(&lsm->bg_mutex);
+  pthread_join(lsm->compactor, NULL);
+  kvlsm_memtable_free(lsm->mem);
+  if (lsm->imm != NULL)
+    kvlsm_memtable_free(lsm->imm);
+  for (level = 0; level < KVLSM_LEVELS; level++) {
+    for (i = 0; i < lsm->levels[level].ntables; i++)
+      kvlsm_table_free(lsm->levels[level].tables[i]);
+    free(lsm->levels[level].tables);
+  }
+  if (lsm->direct_io)
+    kvblockcache_destroy(&lsm->blocks);
+  free(lsm->dirname);
+  pthread_rwlock_destroy(&lsm->lock);
+  pthread_mutex_destroy(&lsm->bg_mutex);
+  pthread_cond_destroy(&lsm->bg_cond);
+}
@@ -0,0 +1,162 @@
+#ifndef __KV_LSM__
+#define __KV_LSM__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "skiplist.h"
+#include "bloom.h"
+#include "kvlz.h"
+#include "kvblockcache.h"
+#include "kvconstants.h"
+
+/* KVLSM defines a log-structured merge-tree storage engine for KVStore.
+ *
+ * Writes are appended to a write-ahead log and inserted into an in-memory
+ * memtable (a skiplist sorted by key). Once the memtable grows beyond
+ * MEMTABLE_SIZE it becomes immutable and a fresh memtable and write-ahead log
+ * take its place, while a background thread writes the immutable memtable out
+ * as a sorted table (SSTable) into level 0.
+ *
+ * The same background thread compacts the levels: once level 0 holds
+ * KVLSM_L0_TRIGGER tables they are merged with the overlapping tables of level
+ * 1, and once level N >= 1 grows beyond its size budget (KVLSM_L1_SIZE,
+ * multiplied by 10 for every further level) one of its tables is merged with
+ * the overlapping tables of level N + 1. Tables of level 0 may overlap; the
+ * tables of every other level hold disjoint key ranges. Deletions are written
+ * as tombstones, which are dropped once they are compacted into a level below
+ * which no table overlaps them.
+ *
+ * All files are stored within the directory passed upon initialization:
+ *    sprintf(filename, "%u%s", id, KVLSM_WAL_FILETYPE);    (write-ahead logs)
+ *    sprintf(filename, "%u%s", id, KVLSM_TABLE_FILETYPE);  (tables)
+ * plus a KVLSM_MANIFEST file listing the live tables of each level, which is
+ * replaced atomically whenever the set of tables changes.
+ *
+ * A table consists of data blocks of roughly KVLSM_BLOCK_SIZE bytes, holding
+ * kventry_t records in key order, followed by a Bloom filter over its keys
+ * (see bloom.h), a sparse index holding the last key of every block and a
+ * fixed size footer locating the filter and the index. Only the filter and the
+ * index are kept in memory, so a lookup reads at most one block per table, and
+ * none at all for most tables which do not hold the key. Values of at least
+ * COMPRESS_THRESHOLD bytes are compressed within tables (see kvlz.h), but
+ * never within write-ahead logs, which are replayed rarely.
+ *
+ * Every entry carries a checksum (see kvcrc.h). The replay of a write-ahead
+ * log ends at the first entry which fails it, as at one cut short by a crash.
+ * An entry of a table is verified when a lookup finds its key, and as
+ * iterators reach it, so that a corrupted entry fails the lookup, scan or
+ * compaction with ERR_CHECKSUM rather than spreading. Each is counted in
+ * CORRUPTIONS.
+ *
+ * With DIRECT_IO, tables are read with O_DIRECT through a block cache of the
+ * LSM's own (see kvblockcache.h), instead of through the page cache of the
+ * kernel, so that the memory used for them is bounded by the cache. Reads by
+ * compactions bypass the cache, and the pages of a table just written are
+ * dropped from the page cache once it is synced. Write-ahead logs are written
+ * and replayed as usual.
+ *
+ * KVLSM locks itself, so KVStore writes to it without taking the key locks,
+ * unless large values exist, snapshots are open or exclusive writes
+ * (conditional writes, writes with a time to live and expiries) are in
+ * progress, which need every write of their keys to take the key locks.
+ */
+
+#define KVLSM_WAL_FILETYPE ".wal"
+#define KVLSM_TABLE_FILETYPE ".sst"
+#define KVLSM_MANIFEST "MANIFEST"
+
+/* The default size at which the memtable is written out as a table. */
+#define KVLSM_MEMTABLE_SIZE (4 * 1024 * 1024)
+/* The size at which compaction starts a new output table. */
+#define KVLSM_TABLE_SIZE (2 * 1024 * 1024)
+/* The size at which a data block is ended. */
+#define KVLSM_BLOCK_SIZE 4096
+/* The number of levels. */
+#define KVLSM_LEVELS 7
+/* The number of level 0 tables which triggers a compaction into level 1. */
+#define KVLSM_L0_TRIGGER 4
+/* The size budget of level 1. */
+#define KVLSM_L1_SIZE (10 * 1024 * 1024)
+/* The default size of the Bloom filter of a table, in bits per key. */
+#define KVLSM_BLOOM_BITS_PER_KEY 10
+
+/* The index entry of a data block. */
+typedef struct {
+  uint64_t offset; /* The offset of the block within its table. */
+  uint32_t size;   /* The size of the block. */
+  char *last;      /* The largest key within the block. */
+} kvlsm_block_t;
+
+/* An open table. */
+typedef struct {
+  uint32_t id;           /* The id of the table, which names its file. */
+  int fd;                /* The open file descriptor of the table. */
+  kvblockcache_t *cache; /* The block cache reading FD, if it was opened with O_DIRECT. */
+  uint64_t size;         /* The size of the table file. */
+  uint32_t nblocks;      /* The number of data blocks. */
+  kvlsm_block_t *blocks; /* The sparse index, one entry per data block. */
+  char *smallest;        /* The smallest key within the table. */
+  char *largest;         /* The largest key within the table. */
+  bloom_t filter;        /* The Bloom filter of the table (NBITS is 0 if it has none). */
+} kvlsm_table_t;
+
+/* A level of tables. Level 0 is ordered from newest to oldest table, every
+ * other level by key. */
+typedef struct {
+  kvlsm_table_t **tables; /* The tables of the level. */
+  uint32_t ntables;       /* The number of tables of the level. */
+  uint32_t next;          /* The table at which the next compaction starts. */
+  uint64_t size;          /* The total size of the tables of the level. */
+} kvlsm_level_t;
+
+/* A memtable. Values are malloc()d strings, or NULL for a tombstone. */
+typedef struct {
+  skiplist_t entries; /* The entries of the memtable. */
+  size_t size;        /* The number of bytes of keys and values stored. */
+  uint32_t wal;       /* The id of the write-ahead log of the memtable. */
+  int walfd;          /* The open file descriptor of the write-ahead log. */
+} kvlsm_memtable_t;
+
+/* A KVLSM. */
+typedef struct {
+  char *dirname;                       /* The directory storing all files. */
+  size_t memtable_size;                /* The size at which the memtable is flushed. */
+  unsigned int bits_per_key;           /* The filter size of new tables, in bits per key. */
+  size_t compress_threshold;           /* The size from which table values are compressed. */
+  bool direct_io;                      /* Whether tables are read with O_DIRECT through BLOCKS. */
+  kvblockcache_t blocks;               /* The cache of the pages of tables, if DIRECT_IO. */
+  kvlsm_memtable_t *mem;               /* The memtable receiving writes. */
+  kvlsm_memtable_t *imm;               /* The memtable being flushed, if any. */
+  kvlsm_level_t levels[KVLSM_LEVELS];  /* The levels of tables. */
+  uint32_t next_file;                  /* The next unused file id. */
+  uint32_t synced_wal;                 /* The write-ahead log last synced by kvlsm_sync. */
+  pthread_rwlock_t lock;               /* Protects all of the above. */
+  pthread_t compactor;                 /* The background flush and compaction thread. */
+  pthread_mutex_t bg_mutex;            /* Protects the fields below. */
+  pthread_cond_t bg_cond;              /* Signalled when the fields below change. */
+  bool work;                           /* Whether the compactor has been woken up. */
+  bool flushing;                       /* Whether IMM is waiting to be flushed. */
+  bool shutdown;                       /* Whether the compactor should exit. */
+  uint64_t filter_checks;              /* The number of table lookups which consulted a filter. */
+  uint64_t filter_negatives;           /* The number of those which the filter answered. */
+  uint64_t filter_false_positives;     /* The number of those which read a block in vain. */
+  uint64_t corruptions;                /* The number of entries found whose checksum did not match. */
+  kvlz_stats_t compression;            /* The compression of the values flushed to tables,
+                                          not counting their rewrites by compactions. */
+} kvlsm_t;
+
+int kvlsm_init(kvlsm_t *, char *dirname, size_t memtable_size, unsigned int bits_per_key,
+               size_t compress_threshold, bool direct_io, size_t block_cache_size);
+
+int kvlsm_get(kvlsm_t *, char *key, char *value);
+int kvlsm_put(kvlsm_t *, char *key, char *value);
+int kvlsm_del(kvlsm_t *, char *key);
+int kvlsm_write_batch(kvlsm_t *, unsigned int count, char **keys, char **values);
+int kvlsm_sync(kvlsm_t *);
+int kvlsm_scan(kvlsm_t *, const char *start, const char *end, kvscan_fn_t visit, void *arg);
+bool kvlsm_haskey(kvlsm_t *, char *key);
+
+void kvlsm_close(kvlsm_t *);
+
+#endif
@@ -0,0 +1,157 @@
+#include <string.h>
+#include "kvlz.h"
+
+/* The number of bits of the hash table of the compressor. */
+#define KVLZ_HASH_BITS 12
+
+/* Matches must start at least this many bytes before the end of the input. */
+#define KVLZ_MFLIMIT 12
+
+/* The largest distance a match may refer back. */
+#define KVLZ_MAX_OFFSET 65535
+
+/* Caps a length at what fits into a nibble of a token. */
+#define min_nibble(len) ((len) < 15 ? (len) : 15)
+
+static uint32_t kvlz_read32(const unsigned char *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint32_t kvlz_hash(uint32_t v) { return (v * 2654435761U) >> (32 - KVLZ_HASH_BITS); }
+
+/* Writes the remainder LEN of a length whose nibble was 15 to OP. Returns the
+ * position after it. */
+static unsigned char *kvlz_put_length(unsigned char *op, size_t len) {
+  while (len >= 255) {
+    *op++ = 255;
+    len -= 255;
+  }
+  *op++ = len;
+  return op;
+}
+
+/* Writes a sequence of the LITLEN literals at ANCHOR, followed (if MATCHLEN
+ * is not 0) by a match of MATCHLEN bytes at OFFSET, to OP. Returns the
+ * position after it, or NULL if it would not fit before OEND. */
+static unsigned char *kvlz_put_sequence(unsigned char *op, unsigned char *oend,
+                                        const unsigned char *anchor, size_t litlen,
+                                        size_t offset, size_t matchlen) {
+  unsigned char *token;
+  if ((size_t)(oend - op) < 2 + litlen + litlen / 255 + (matchlen ? 3 + matchlen / 255 : 0))
+    return NULL;
+  token = op++;
+  *token = min_nibble(litlen) << 4;
+  if (litlen >= 15)
+    op = kvlz_put_length(op, litlen - 15);
+  memcpy(op, anchor, litlen);
+  op += litlen;
+  if (matchlen == 0)
+    return op;
+  *op++ = offset & 0xff;
+  *op++ = offset >> 8;
+  matchlen -= KVLZ_MIN_MATCH;
+  *token |= min_nibble(matchlen);
+  if (matchlen >= 15)
+    op = kvlz_put_length(op, matchlen - 15);
+  return op;
+}
+
+/* Compresses the LEN bytes of SRC into DST, which can hold CAPACITY bytes
+ * (KVLZ_BOUND(LEN) always suffice). Returns the size of the compressed block,
+ * or 0 if it would not fit into CAPACITY bytes. */
+size_t kvlz_compress(const char *src, size_t len, char *dst, size_t capacity) {
+  uint32_t table[1 << KVLZ_HASH_BITS];
+  const unsigned char *base = (const unsigned char *)src, *ip = base, *anchor = base;
+  const unsigned char *iend = base + len, *ref;
+  unsigned char *op = (unsigned char *)dst, *oend = op + capacity;
+  size_t matchlen;
+  uint32_t h;
+  memset(table, 0, sizeof(table));
+  /* TABLE holds positions plus one, so that 0 means none. */
+  while (len > KVLZ_MFLIMIT && ip < iend - KVLZ_MFLIMIT) {
+    h = kvlz_hash(kvlz_read32(ip));
+    ref = table[h] ? base + table[h] - 1 : NULL;
+    table[h] = ip - base + 1;
+    if (ref == NULL || ip - ref > KVLZ_MAX_OFFSET || kvlz_read32(ref) != kvlz_read32(ip)) {
+      ip++;
+      continue;
+    }
+    matchlen = KVLZ_MIN_MATCH;
+    while (ip + matchlen < iend - KVLZ_LAST_LITERALS && ip[matchlen] == ref[matchlen])
+      matchlen++;
+    op = kvlz_put_sequence(op, oend, anchor, ip - anchor, ip - ref, matchlen);
+    if (op == NULL)
+      return 0;
+    ip += matchlen;
+    anchor = ip;
+  }
+  op = kvlz_put_sequence(op, oend, anchor, iend - anchor, 0, 0);
+  if (op == NULL)
+    return 0;
+  return op - (unsigned char *)dst;
+}
+
+/* Reads the remainder of a length whose nibble was 15 from *IP, adding it to
+ * *LEN. Returns 0 if successful, or -1 if it runs past IEND. */
+static int kvlz_get_length(const unsigned char **ip, const unsigned char *iend, size_t *len) {
+  unsigned char b;
+  do {
+    if (*ip >= iend)
+      return -1;
+    b = *(*ip)++;
+    *len += b;
+  } while (b == 255);
+  return 0;
+}
+
+/* Decompresses the LEN bytes of the block SRC into DST, which can hold CAPACITY
+ * bytes. Returns the size of the decompressed data, or -1 if SRC is malformed
+ * or decompresses to more than CAPACITY bytes. */
+ssize_t kvlz_decompress(const char *src, size_t len, char *dst, size_t capacity) {
+  const unsigned char *ip = (const unsigned char *)src, *iend = ip + len;
+  unsigned char *base = (unsigned char *)dst, *op = base, *oend = base + capacity;
+  size_t litlen, matchlen, offset;
+  unsigned char token;
+  while (ip < iend) {
+    token = *ip++;
+    litlen = token >> 4;
+    if (litlen == 15 && kvlz_get_length(&ip, iend, &litlen) < 0)
+      return -1;
+    if (litlen > (size_t)(iend - ip) || litlen > (size_t)(oend - op))
+      return -1;
+    memcpy(op, ip, litlen);
+    op += litlen;
+    ip += litlen;
+    if (ip == iend)
+      break;
+    if (iend - ip < 2)
+      return -1;
+    offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    if (offset == 0 || offset > (size_t)(op - base))
+      return -1;
+    matchlen = token & 15;
+    if (matchlen == 15 && kvlz_get_length(&ip, iend, &matchlen) < 0)
+      return -1;
+    matchlen += KVLZ_MIN_MATCH;
+    if (matchlen > (size_t)(oend - op))
+      return -1;
+    /* Matches may overlap their own output, so copy bytewise. */
+    while (matchlen-- > 0) {
+      *op = *(op - offset);
+      op++;
+    }
+  }
+  return op - base;
+}
+
+/* Records in STATS that a value of RAW bytes was stored with STORED bytes. */
+void kvlz_stats_add(kvlz_stats_t *stats, size_t raw, size_t stored) {
+  __sync_fetch_and_add(&stats->values, 1);
+  if (stored < raw)
+    __sync_fetch_and_add(&stats->compressed, 1);
+  __sync_fetch_and_add(&stats->raw_bytes, raw);
+  __sync_fetch_and_add(&stats->stored_bytes, stored);
+}
@@ -0,0 +1,53 @@
+#ifndef __KV_LZ__
+#define __KV_LZ__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* KVLZ is a small LZ77 block codec in the style of LZ4, used by KVStore to
+ * compress the values of its entries.
+ *
+ * A compressed block is a sequence of
+ *    token, [literal length bytes], literals, offset, [match length bytes]
+ * where the high nibble of the token is the number of literals and the low
+ * nibble the length of the match minus KVLZ_MIN_MATCH. A nibble of 15 is
+ * followed by bytes which are added to it, up to and including the first byte
+ * which is not 255. The offset is a 16-bit little-endian distance back into
+ * the output. The last sequence consists of literals only, and at least the
+ * last KVLZ_LAST_LITERALS bytes of the input are always literals.
+ *
+ * Compression is greedy, finding matches through a hash table of the last
+ * position of each 4-byte prefix, which favors speed over ratio. Repetitive
+ * text such as JSON typically shrinks to a half or less.
+ *
+ * KVStore stores values of at least OPTS->compress_threshold bytes compressed
+ * whenever that makes them smaller, flagging their entries KVENTRY_COMPRESSED.
+ * Entries written without compression remain readable, so the threshold may
+ * be changed when a directory is reopened.
+ */
+
+/* The shortest match encoded. */
+#define KVLZ_MIN_MATCH 4
+
+/* The number of bytes at the end of the input which are always literals. */
+#define KVLZ_LAST_LITERALS 5
+
+/* The largest number of bytes compressing LEN bytes can produce. */
+#define KVLZ_BOUND(len) ((len) + (len) / 255 + 16)
+
+/* Counters describing the compression of values. The achieved compression
+ * ratio is raw_bytes / stored_bytes. */
+typedef struct {
+  uint64_t values;       /* The number of values considered for compression. */
+  uint64_t compressed;   /* Of those, the number stored compressed. */
+  uint64_t raw_bytes;    /* The size of those values. */
+  uint64_t stored_bytes; /* The size those values were stored with. */
+} kvlz_stats_t;
+
+size_t kvlz_compress(const char *src, size_t len, char *dst, size_t capacity);
+ssize_t kvlz_decompress(const char *src, size_t len, char *dst, size_t capacity);
+
+void kvlz_stats_add(kvlz_stats_t *, size_t raw, size_t stored);
+
+#endif
@@ -0,0 +1,399 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "utlist.h"
+#include "kvmem.h"
+
+/* The size of the largest entry, header included. */
+#define KVMEM_MAX_ENTRY ((sizeof(kvmem_entry_t) + MAX_KEYLEN + MAX_VALLEN + 2 + 7) & ~7UL)
+
+/* The initial number of buckets of a shard. */
+#define KVMEM_BUCKETS 64
+
+/* KVMEM_LFU: the frequency of a new entry, which keeps it from being evicted
+ * before it had a chance to be used again. */
+#define KVMEM_LFU_INIT 5
+
+/* KVMEM_LFU: how much harder the frequency is to increment as it grows. */
+#define KVMEM_LFU_FACTOR 10
+
+/* Initializes KVMEM with a budget of SIZE bytes of pages (at least one page per
+ * shard), evicting as POLICY selects. */
+void kvmem_init(kvmem_t *kvmem, size_t size, kvmem_policy_t policy) {
+  kvmem_shard_t *shard;
+  uint32_t max_pages = size / KVMEM_PAGE_SIZE / KVMEM_SHARDS, chunk = 64;
+  int i;
+  memset(kvmem, 0, sizeof(kvmem_t));
+  kvmem->policy = policy;
+  for (i = 0; i < KVMEM_CLASSES; i++) {
+    kvmem->sizes[i] = chunk;
+    chunk = (chunk * 5 / 4 + 7) & ~7U;
+  }
+  kvmem->sizes[KVMEM_CLASSES - 1] = KVMEM_MAX_ENTRY;
+  for (i = 0; i < KVMEM_SHARDS; i++) {
+    shard = &kvmem->shards[i];
+    pthread_mutex_init(&shard->lock, NULL);
+    shard->nbuckets = KVMEM_BUCKETS;
+    shard->buckets = calloc(shard->nbuckets, sizeof(kvmem_entry_t *));
+    if (!shard->buckets)
+      fatal_malloc();
+    shard->max_pages = max_pages > 0 ? max_pages : 1;
+    shard->seed = i + 1;
+  }
+}
+
+/* Returns the shard of KVMEM responsible for HASH. */
+static kvmem_shard_t *kvmem_shard(kvmem_t *kvmem, uint64_t hash) {
+  return &kvmem->shards[(hash >> 32) % KVMEM_SHARDS];
+}
+
+/* Returns the smallest size class of KVMEM whose chunks hold an entry of
+ * KEYLEN and VALLEN. */
+static unsigned int kvmem_class(kvmem_t *kvmem, size_t keylen, size_t vallen) {
+  size_t size = sizeof(kvmem_entry_t) + keylen + vallen + 2;
+  unsigned int klass = 0;
+  while (kvmem->sizes[klass] < size)
+    klass++;
+  return klass;
+}
+
+/* Returns the current time in decay periods, wrapped to 16 bits. */
+static uint16_t kvmem_period(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return (now.tv_sec / KVMEM_LFU_DECAY) & 0xffff;
+}
+
+/* Returns the frequency of ENT, decremented for every decay period it went
+ * unused as of NOW. */
+static uint8_t kvmem_freq(kvmem_entry_t *ent, uint16_t now) {
+  uint16_t periods = now - ent->touched;
+  return periods >= ent->freq ? 0 : ent->freq - periods;
+}
+
+/* Records a use of ENT within SHARD, making it the most recently used entry of
+ * its class and, for KVMEM_LFU, counting it. */
+static void kvmem_touch(kvmem_t *kvmem, kvmem_shard_t *shard, kvmem_entry_t *ent) {
+  kvmem_class_t *klass = &shard->classes[shard->pages[ent->page].klass];
+  uint16_t now;
+  uint8_t freq;
+  if (klass->lru->prev != ent) {
+    DL_DELETE(klass->lru, ent);
+    DL_APPEND(klass->lru, ent);
+  }
+  if (kvmem->policy != KVMEM_LFU)
+    return;
+  now = kvmem_period();
+  freq = kvmem_freq(ent, now);
+  /* The more often ENT was used, the less likely another use counts. */
+  if (freq < UINT8_MAX &&
+      (double)rand_r(&shard->seed) / RAND_MAX <
+          1.0 / ((freq > KVMEM_LFU_INIT ? freq - KVMEM_LFU_INIT : 0) * KVMEM_LFU_FACTOR + 1))
+    freq++;
+  ent->freq = freq;
+  ent->touched = now;
+}
+
+/* Returns the entry of KEY, where HASH is hash(KEY), within SHARD, or NULL if
+ * there is none. PREVP, if not NULL, is set to the link pointing to it. */
+static kvmem_entry_t *kvmem_find(kvmem_shard_t *shard, uint64_t hash, const char *key,
+                                 kvmem_entry_t ***prevp) {
+  kvmem_entry_t **link = &shard->buckets[hash & (shard->nbuckets - 1)];
+  for (; *link != NULL; link = &(*link)->chain) {
+    if ((*link)->hash == hash && strcmp((*link)->data, key) == 0)
+      break;
+  }
+  if (prevp != NULL)
+    *prevp = link;
+  return *link;
+}
+
+/* Doubles the buckets of SHARD. */
+static void kvmem_grow(kvmem_shard_t *shard) {
+  uint64_t nbuckets = shard->nbuckets * 2, i;
+  kvmem_entry_t **buckets = calloc(nbuckets, sizeof(kvmem_entry_t *)), *ent, *next;
+  if (!buckets)
+    fatal_malloc();
+  for (i = 0; i < shard->nbuckets; i++) {
+    for (ent = shard->buckets[i]; ent != NULL; ent = next) {
+      next = ent->chain;
+      ent->chain = buckets[ent->hash & (nbuckets - 1)];
+      buckets[ent->hash & (nbuckets - 1)] = ent;
+    }
+  }
+  free(shard->buckets);
+  shard->buckets = buckets;
+  shard->nbuckets = nbuckets;
+}
+
+/* Removes ENT from SHARD, returning its chunk to the free chunks of its
+ * class. */
+static void kvmem_unlink(kvmem_shard_t *shard, kvmem_entry_t *ent) {
+  kvmem_class_t *klass = &shard->classes[shard->pages[ent->page].klass];
+  kvmem_entry_t **link;
+  kvmem_find(shard, ent->hash, ent->data, &link);
+  *link = ent->chain;
+  DL_DELETE(klass->lru, ent);
+  DL_APPEND(klass->free, ent);
+  ent->used = 0;
+  shard->entries--;
+  shard->bytes -= ent->keylen + ent->vallen;
+}
+
+/* Returns the entry of the class KLASS of SHARD to evict. KLASS must have
+ * entries. */
+static kvmem_entry_t *kvmem_victim(kvmem_t *kvmem, kvmem_class_t *klass) {
+  kvmem_entry_t *ent, *victim = klass->lru;
+  uint16_t now;
+  int i = 0;
+  if (kvmem->policy != KVMEM_LFU)
+    return victim;
+  now = kvmem_period();
+  for (ent = klass->lru; ent != NULL && i < KVMEM_LFU_SAMPLES; ent = ent->next, i++) {
+    if (kvmem_freq(ent, now) < kvmem_freq(victim, now))
+      victim = ent;
+  }
+  return victim;
+}
+
+/* Carves the page at index PAGE of SHARD into free chunks of class KLASS. */
+static void kvmem_carve(kvmem_t *kvmem, kvmem_shard_t *shard, uint32_t page, unsigned int klass) {
+  uint32_t size = kvmem->sizes[klass], offset;
+  kvmem_entry_t *ent;
+  shard->pages[page].klass = klass;
+  shard->classes[klass].pages++;
+  for (offset = 0; offset + size <= KVMEM_PAGE_SIZE; offset += size) {
+    ent = (kvmem_entry_t *)(shard->pages[page].mem + offset);
+    ent->page = page;
+    ent->used = 0;
+    DL_APPEND(shard->classes[klass].free, ent);
+  }
+}
+
+/* Takes a page of SHARD from the class with the most pages, evicting the
+ * entries within it, and carves it into chunks of class KLASS, which has
+ * none. */
+static void kvmem_steal(kvmem_t *kvmem, kvmem_shard_t *shard, unsigned int klass) {
+  uint32_t size, offset, page;
+  unsigned int i, from = 0;
+  kvmem_entry_t *ent;
+  for (i = 1; i < KVMEM_CLASSES; i++) {
+    if (shard->classes[i].pages > shard->classes[from].pages)
+      from = i;
+  }
+  /* Prefer the page holding the least recently used entry of the class. */
+  if (shard->classes[from].lru != NULL) {
+    page = shard->classes[from].lru->page;
+  } else {
+    for (page = 0; shard->pages[page].klass != from; page++)
+      ;
+  }
+  size = kvmem->sizes[from];
+  for (offset = 0; offset + size <= KVMEM_PAGE_SIZE; offset += size) {
+    ent = (kvmem_entry_t *)(shard->pages[page].mem + offset);
+    if (ent->used) {
+      kvmem_unlink(shard, ent);
+      shard->evictions++;
+    }
+    DL_DELETE(shard->classes[from].free, ent);
+  }
+  shard->classes[from].pages--;
+  kvmem_carve(kvmem, shard, page, klass);
+}
+
+/* Returns a free chunk of class KLASS of SHARD, allocating a page while the
+ * budget of SHARD allows, and evicting otherwise. */
+static kvmem_entry_t *kvmem_alloc(kvmem_t *kvmem, kvmem_shard_t *shard, unsigned int klass) {
+  kvmem_class_t *c = &shard->classes[klass];
+  kvmem_entry_t *ent;
+  if (c->free == NULL && shard->npages < shard->max_pages) {
+    shard->pages = realloc(shard->pages, (shard->npages + 1) * sizeof(kvmem_page_t));
+    if (!shard->pages || !(shard->pages[shard->npages].mem = malloc(KVMEM_PAGE_SIZE)))
+      fatal_malloc();
+    kvmem_carve(kvmem, shard, shard->npages++, klass);
+  } else if (c->free == NULL && c->lru != NULL) {
+    kvmem_unlink(shard, kvmem_victim(kvmem, c));
+    shard->evictions++;
+  } else if (c->free == NULL) {
+    kvmem_steal(kvmem, shard, klass);
+  }
+  ent = c->free;
+  DL_DELETE(c->free, ent);
+  return ent;
+}
+
+/* Retrieves the value of KEY, where HASH is hash(KEY), from KVMEM into VALUE,
+ * counting it as used. Returns 0 if successful, else ERR_NOKEY. */
+int kvmem_get(kvmem_t *kvmem, uint64_t hash, const char *key, char *value) {
+  kvmem_shard_t *shard = kvmem_shard(kvmem, hash);
+  kvmem_entry_t *ent;
+  pthread_mutex_lock(&shard->lock);
+  if ((ent = kvmem_find(shard, hash, key, NULL)) != NULL) {
+    memcpy(value, ent->data + ent->keylen + 1, ent->vallen + 1);
+    kvmem_touch(kvmem, shard, ent);
+  }
+  pthread_mutex_unlock(&shard->lock);
+  return ent ? 0 : ERR_NOKEY;
+}
+
+/* Returns true if KVMEM contains KEY, where HASH is hash(KEY), without counting
+ * it as used. */
+bool kvmem_haskey(kvmem_t *kvmem, uint64_t hash, const char *key) {
+  kvmem_shard_t *shard = kvmem_shard(kvmem, hash);
+  bool ret;
+  pthread_mutex_lock(&shard->lock);
+  ret = kvmem_find(shard, hash, key, NULL) != NULL;
+  pthread_mutex_unlock(&shard->lock);
+  return ret;
+}
+
+/* Stores KEY, where HASH is hash(KEY), with VALUE within KVMEM, replacing any
+ * previous value, and evicting other entries if the budget is used up. Returns
+ * 0 if successful, else a negative error code. */
+int kvmem_put(kvmem_t *kvmem, uint64_t hash, const char *key, const char *value) {
+  kvmem_shard_t *shard = kvmem_shard(kvmem, hash);
+  size_t keylen = strlen(key), vallen = strlen(value);
+  unsigned int klass;
+  kvmem_entry_t *ent;
+  if (keylen > MAX_KEYLEN || keylen == 0)
+    return ERR_KEYLEN;
+  if (vallen > MAX_VALLEN)
+    return ERR_VALLEN;
+  klass = kvmem_class(kvmem, keylen, vallen);
+  pthread_mutex_lock(&shard->lock);
+  if ((ent = kvmem_find(shard, hash, key, NULL)) != NULL) {
+    if (shard->pages[ent->page].klass == klass) {
+      /* The new value fits the chunk of the old one. */
+      memcpy(ent->data + keylen + 1, value, vallen + 1);
+      shard->bytes += vallen - ent->vallen;
+      ent->vallen = vallen;
+      kvmem_touch(kvmem, shard, ent);
+      pthread_mutex_unlock(&shard->lock);
+      return 0;
+    }
+    kvmem_unlink(shard, ent);
+  }
+  ent = kvmem_alloc(kvmem, shard, klass);
+  ent->hash = hash;
+  ent->keylen = keylen;
+  ent->vallen = vallen;
+  ent->used = 1;
+  ent->freq = KVMEM_LFU_INIT;
+  ent->touched = kvmem->policy == KVMEM_LFU ? kvmem_period() : 0;
+  memcpy(ent->data, key, keylen + 1);
+  memcpy(ent->data + keylen + 1, value, vallen + 1);
+  if (shard->entries >= shard->nbuckets)
+    kvmem_grow(shard);
+  ent->chain = shard->buckets[hash & (shard->nbuckets - 1)];
+  shard->buckets[hash & (shard->nbuckets - 1)] = ent;
+  DL_APPEND(shard->classes[klass].lru, ent);
+  shard->entries++;
+  shard->bytes += keylen + vallen;
+  pthread_mutex_unlock(&shard->lock);
+  return 0;
+}
+
+/* Removes KEY, where HASH is hash(KEY), from KVMEM. Returns 0 if successful,
+ * else ERR_NOKEY. */
+int kvmem_del(kvmem_t *kvmem, uint64_t hash, const char *key) {
+  kvmem_shard_t *shard = kvmem_shard(kvmem, hash);
+  kvmem_entry_t *ent;
+  pthread_mutex_lock(&shard->lock);
+  if ((ent = kvmem_find(shard, hash, key, NULL)) != NULL)
+    kvmem_unlink(shard, ent);
+  pthread_mutex_unlock(&shard->lock);
+  return ent ? 0 : ERR_NOKEY;
+}
+
+/* A key collected by kvmem_scan. */
+typedef struct {
+  char *key;
+  uint64_t hash;
+} kvmem_key_t;
+
+static int kvmem_key_cmp(const void *a, const void *b) {
+  return strcmp(((const kvmem_key_t *)a)->key, ((const kvmem_key_t *)b)->key);
+}
+
+/* Calls VISIT with every entry of KVMEM whose key lies within [START, END), in
+ * key order, passing ARG along, until VISIT returns nonzero. START and END may
+ * be NULL to leave the range unbounded. The keys within the range are
+ * collected from every shard and sorted first, and each entry is then read as
+ * of the time it is visited, skipping entries removed meanwhile; entries are
+ * not counted as used. Returns 0. */
+int kvmem_scan(kvmem_t *kvmem, const char *start, const char *end, kvscan_fn_t visit, void *arg) {
+  char value[MAX_VALLEN + 1];
+  kvmem_key_t *keys = NULL;
+  size_t count = 0, capacity = 0, i;
+  kvmem_shard_t *shard;
+  kvmem_entry_t *ent;
+  uint64_t b;
+  bool found, stopped = false;
+  int s;
+  for (s = 0; s < KVMEM_SHARDS; s++) {
+    shard = &kvmem->shards[s];
+    pthread_mutex_lock(&shard->lock);
+    for (b = 0; b < shard->nbuckets; b++) {
+      for (ent = shard->buckets[b]; ent != NULL; ent = ent->chain) {
+        if ((start != NULL && strcmp(ent->data, start) < 0) ||
+            (end != NULL && strcmp(ent->data, end) >= 0))
+          continue;
+        if (count == capacity) {
+          capacity = capacity ? capacity * 2 : 64;
+          if (!(keys = realloc(keys, capacity * sizeof(kvmem_key_t))))
+            fatal_malloc();
+        }
+        keys[count].hash = ent->hash;
+        if (!(keys[count++].key = strdup(ent->data)))
+          fatal_malloc();
+      }
+    }
+    pthread_mutex_unlock(&shard->lock);
+  }
+  qsort(keys, count, sizeof(kvmem_key_t), kvmem_key_cmp);
+  for (i = 0; i < count; i++) {
+    if (!stopped) {
+      shard = kvmem_shard(kvmem, keys[i].hash);
+      pthread_mutex_lock(&shard->lock);
+      if ((found = (ent = kvmem_find(shard, keys[i].hash, keys[i].key, NULL)) != NULL))
+        memcpy(value, ent->data + ent->keylen + 1, ent->vallen + 1);
+      pthread_mutex_unlock(&shard->lock);
+      stopped = found && visit(keys[i].key, value, arg);
+    }
+    free(keys[i].key);
+  }
+  free(keys);
+  return 0;
+}
+
+/* Fills STATS with the current counters of KVMEM. */
+void kvmem_stats(kvmem_t *kvmem, kvmem_stats_t *stats) {
+  kvmem_shard_t *shard;
+  int i;
+  memset(stats, 0, sizeof(kvmem_stats_t));
+  for (i = 0; i < KVMEM_SHARDS; i++) {
+    shard = &kvmem->shards[i];
+    pthread_mutex_lock(&shard->lock);
+    stats->entries += shard->entries;
+    stats->bytes += shard->bytes;
+    stats->pages += (uint64_t)shard->npages * KVMEM_PAGE_SIZE;
+    stats->evictions += shard->evictions;
+    pthread_mutex_unlock(&shard->lock);
+  }
+}
+
+/* Releases all memory held by KVMEM, dropping its entries. */
+void kvmem_destroy(kvmem_t *kvmem) {
+  kvmem_shard_t *shard;
+  uint32_t p;
+  int i;
+  for (i = 0; i < KVMEM_SHARDS; i++) {
+    shard = &kvmem->shards[i];
+    for (p = 0; p < shard->npages; p++)
+      free(shard->pages[p].mem);
+    free(shard->pages);
+    free(shard->buckets);
+    pthread_mutex_destroy(&shard->lock);
+  }
+}
@@ -0,0 +1,134 @@
+#ifndef __KV_MEM__
+#define __KV_MEM__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "kvconstants.h"
+
+/* KVMem is the storage engine of a KVStore which keeps its entries in memory
+ * only, within a fixed byte budget, evicting entries to stay within it. It is
+ * meant for stores used as a replicated cache, whose entries need not survive
+ * a restart.
+ *
+ * Entries are kept in KVMEM_SHARDS shards, selected by the hash of their key,
+ * each with its own lock, hash table and share of the budget. A shard carves
+ * its memory into pages of KVMEM_PAGE_SIZE bytes, allocated as needed until
+ * its share is used up, and each page into chunks of one of KVMEM_CLASSES size
+ * classes, growing by a factor of 1.25 up to the largest entry. An entry is
+ * stored in a chunk of the smallest class which holds it: its header, by which
+ * it is linked into its hash chain and lists, followed by its key and value.
+ *
+ * Once a shard can allocate no more pages, an entry which needs a chunk of a
+ * class without a free one evicts an entry of that class: the least recently
+ * used one (KVMEM_LRU), or of the KVMEM_LFU_SAMPLES least recently used ones,
+ * the least frequently used one (KVMEM_LFU). Frequencies are counted on a
+ * logarithmic scale, and decremented for every KVMEM_LFU_DECAY seconds an
+ * entry goes unused, so that entries which were popular long ago do not stay
+ * forever. Should the class have no entry at all, a page is taken from the
+ * class of the shard with the most pages, evicting the entries within it.
+ *
+ * Key order is not kept, so a scan collects and sorts the keys of all shards
+ * within its range, and costs time in the number of entries of the store.
+ *
+ * A KVStore with this engine has no directory, keeps expiry times in memory
+ * too, cannot store large values and makes no write wait for the disk,
+ * whatever its durability mode selects. An entry evicted is gone from the
+ * snapshots too, as if it had been removed before they were taken.
+ */
+
+/* The number of shards. */
+#define KVMEM_SHARDS 16
+
+/* The size of a page. */
+#define KVMEM_PAGE_SIZE (64 * 1024)
+
+/* The number of size classes. */
+#define KVMEM_CLASSES 16
+
+/* The default byte budget of the pages. */
+#define KVMEM_SIZE (256 * 1024 * 1024)
+
+/* The number of entries of which KVMEM_LFU evicts the least frequently used. */
+#define KVMEM_LFU_SAMPLES 8
+
+/* The number of seconds after which an unused entry has its frequency decremented. */
+#define KVMEM_LFU_DECAY 60
+
+/* Which entries are evicted. */
+typedef enum {
+  KVMEM_LRU, /* The least recently used. */
+  KVMEM_LFU, /* The least frequently used of the least recently used. */
+} kvmem_policy_t;
+
+/* An entry, as stored within a chunk. A free chunk only uses PREV and NEXT. */
+typedef struct kvmem_entry {
+  struct kvmem_entry *chain; /* The next entry within its bucket. */
+  struct kvmem_entry *prev;  /* The previous entry within its LRU (or free) list. */
+  struct kvmem_entry *next;  /* The next entry within its LRU (or free) list. */
+  uint64_t hash;             /* The hash of the key. */
+  uint32_t page;             /* The index of the page holding the chunk. */
+  uint16_t keylen;           /* The length of the key. */
+  uint16_t vallen;           /* The length of the value. */
+  uint8_t used;              /* Whether the chunk holds an entry. */
+  uint8_t freq;              /* KVMEM_LFU: the logarithmic access count. */
+  uint16_t touched;          /* KVMEM_LFU: the time of the last access, in decay periods. */
+  char data[0];              /* The key and the value, each null terminated. */
+} kvmem_entry_t;
+
+/* A page of a shard. */
+typedef struct {
+  char *mem;          /* The KVMEM_PAGE_SIZE bytes of the page. */
+  unsigned int klass; /* The size class of its chunks. */
+} kvmem_page_t;
+
+/* The chunks of a size class within a shard. */
+typedef struct {
+  kvmem_entry_t *lru;  /* The entries, from least to most recently used. */
+  kvmem_entry_t *free; /* The free chunks. */
+  uint32_t pages;      /* The number of pages of the class. */
+} kvmem_class_t;
+
+/* A shard. */
+typedef struct {
+  pthread_mutex_t lock;           /* Protects all fields of the shard. */
+  kvmem_entry_t **buckets;        /* The hash table, chained through the entries. */
+  uint64_t nbuckets;              /* The number of BUCKETS, a power of 2. */
+  kvmem_page_t *pages;            /* The pages allocated so far. */
+  uint32_t npages;                /* The number of PAGES. */
+  uint32_t max_pages;             /* The share of the budget of the shard, in pages. */
+  kvmem_class_t classes[KVMEM_CLASSES];
+  unsigned int seed;              /* KVMEM_LFU: the state of the random number generator. */
+  uint64_t entries;               /* The number of entries. */
+  uint64_t bytes;                 /* The number of bytes of their keys and values. */
+  uint64_t evictions;             /* The number of entries evicted. */
+} kvmem_shard_t;
+
+/* A KVMem. */
+typedef struct {
+  kvmem_policy_t policy;                /* Which entries are evicted. */
+  uint32_t sizes[KVMEM_CLASSES];        /* The size of the chunks of each class. */
+  kvmem_shard_t shards[KVMEM_SHARDS];
+} kvmem_t;
+
+/* Counters of a KVMem. */
+typedef struct {
+  uint64_t entries;   /* The number of entries. */
+  uint64_t bytes;     /* The number of bytes of their keys and values. */
+  uint64_t pages;     /* The number of bytes of pages allocated. */
+  uint64_t evictions; /* The number of entries evicted. */
+} kvmem_stats_t;
+
+void kvmem_init(kvmem_t *, size_t size, kvmem_policy_t policy);
+
+int kvmem_get(kvmem_t *, uint64_t hash, const char *key, char *value);
+bool kvmem_haskey(kvmem_t *, uint64_t hash, const char *key);
+int kvmem_put(kvmem_t *, uint64_t hash, const char *key, const char *value);
+int kvmem_del(kvmem_t *, uint64_t hash, const char *key);
+int kvmem_scan(kvmem_t *, const char *start, const char *end, kvscan_fn_t visit, void *arg);
+
+void kvmem_stats(kvmem_t *, kvmem_stats_t *stats);
+
+void kvmem_destroy(kvmem_t *);
+
+#endif
@@ -1,8 +1,10 @@
+#include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
+#include <inttypes.h>
 
 #include "libhttp.h"
 #include "liburl.h"
@@ -13,6 +15,11 @@
 bool kvrequest_receive(kvrequest_t *kvreq, int sockfd) {
   bool success = false;
   kvreq->type = EMPTY;
+  kvreq->stream_size = 0;
+  kvreq->prefix_size = 0;
+  kvreq->prefix = NULL;
+  kvreq->ttl = 0;
+  kvreq->txid = 0;
 
   http_request_t req;
   url_params_t params;
@@ -31,8 +38,39 @@ bool kvrequest_receive(kvrequest_t *kvreq, int sockfd) {
     break;
   }
   case PUT: {
-    if (is_empty_str(params.key) || is_empty_str(params.val))
+    if (is_empty_str(params.key))
       goto error;
+    /* Conditional puts carry their value in the URL, never streamed. */
+    if (!strcmp(params.path, CAS_PATH)) {
+      if (is_empty_str(params.val) || is_empty_str(params.expected))
+        goto error;
+      kvreq->type = CASREQ;
+      break;
+    } else if (!strcmp(params.path, PUTNX_PATH)) {
+      if (is_empty_str(params.val))
+        goto error;
+      kvreq->type = PUTNXREQ;
+      break;
+    }
+    /* A time to live is a positive number of seconds of at most
+     * MAX_TTL_DIGITS digits, and only given to values carried in the URL. */
+    if (!is_empty_str(params.ttl)) {
+      if (is_empty_str(params.val) || strlen(params.ttl) > MAX_TTL_DIGITS ||
+          strspn(params.ttl, "0123456789") != strlen(params.ttl))
+        goto error;
+      if ((kvreq->ttl = strtoull(params.ttl, NULL, 10)) == 0)
+        goto error;
+    }
+    if (is_empty_str(params.val)) {
+      if (req.content_length <= 0)
+        goto error;
+      kvreq->stream_size = req.content_length;
+      kvreq->prefix_size = min(req.body_size, kvreq->stream_size);
+      kvreq->prefix = malloc(kvreq->prefix_size + 1);
+      if (!kvreq->prefix)
+        fatal_malloc();
+      memcpy(kvreq->prefix, req.body, kvreq->prefix_size);
+    }
     kvreq->type = PUTREQ;
     break;
   }
@@ -59,8 +97,19 @@ bool kvrequest_receive(kvrequest_t *kvreq, int sockfd) {
   default:
     goto error;
   }
+  if (!is_empty_str(params.txid)) {
+    if (strlen(params.txid) > MAX_TXID_DIGITS ||
+        strspn(params.txid, "0123456789") != strlen(params.txid))
+      goto error;
+    errno = 0;
+    kvreq->txid = strtoull(params.txid, NULL, 10);
+    if (errno == ERANGE)
+      goto error;
+  }
   strcpy(kvreq->key, params.key);
   strcpy(kvreq->val, params.val);
+  strcpy(kvreq->expected, params.expected);
+  kvreq->hashed = false;
 
   return true;
 
@@ -113,6 +162,8 @@ http_method_t http_method_for_request_type(msgtype_t type) {
   case GETREQ:
     return GET;
   case PUTREQ:
+  case CASREQ:
+  case PUTNXREQ:
     return PUT;
   case DELREQ:
     return DELETE;
@@ -133,13 +184,18 @@ char *path_for_request_type(msgtype_t type) {
     return "commit";
   case ABORT:
     return "abort";
+  case CASREQ:
+    return CAS_PATH;
+  case PUTNXREQ:
+    return PUTNX_PATH;
   default:
     return "";
   }
 }
 
 /* Sends REQ on socket SOCKFD. Returns the number of bytes which were sent, and
- * 1 on error. */
+ * 1 on error. Only the headers of a streamed PUTREQ are sent, announcing its
+ * STREAM_SIZE: its value must follow, sent with http_send_data. */
 int kvrequest_send(kvrequest_t *kvreq, int sockfd) {
   http_method_t method = http_method_for_request_type(kvreq->type);
   if (method == INVALID)
@@ -149,6 +205,14 @@ int kvrequest_send(kvrequest_t *kvreq, int sockfd) {
   strcpy(params.path, path_for_request_type(kvreq->type));
   strcpy(params.key, kvreq->key);
   strcpy(params.val, kvreq->val);
+  strcpy(params.expected, kvreq->expected);
+  params.ttl[0] = '\0';
+  if (kvreq->ttl > 0 &&
+      snprintf(params.ttl, MAX_TTL_DIGITS + 1, "%" PRIu64, kvreq->ttl) > MAX_TTL_DIGITS)
+    return -1;
+  params.txid[0] = '\0';
+  if (kvreq->txid > 0)
+    snprintf(params.txid, MAX_TXID_DIGITS + 1, "%" PRIu64, kvreq->txid);
 
   char url[HTTP_MSG_MAX_SIZE + 1];
   url_encode(url, &params);
@@ -156,6 +220,11 @@ int kvrequest_send(kvrequest_t *kvreq, int sockfd) {
   http_outbound_t msg;
   if (!http_outbound_init_request(&msg, sockfd, method, url))
     return -1;
+  if (kvreq->type == PUTREQ && kvreq->stream_size > 0) {
+    char lenbuf[24];
+    sprintf(lenbuf, "%" PRIu64, kvreq->stream_size);
+    http_outbound_add_header(&msg, "Content-Length", lenbuf);
+  }
 
   http_outbound_end_headers(&msg);
   return http_outbound_send(&msg);
@@ -197,10 +266,33 @@ int kvresponse_send(kvresponse_t *kvres, int sockfd) {
   return http_outbound_send(&msg);
 }
 
+/* Returns strhash64 of the key of REQ, which is computed upon the first call
+ * and remembered within REQ for the later ones. */
+uint64_t kvrequest_hash(kvrequest_t *req) {
+  if (!req->hashed) {
+    req->hash = strhash64(req->key);
+    req->hashed = true;
+  }
+  return req->hash;
+}
+
+/* Frees the prefix of the value streamed by REQ, if any. */
+void kvrequest_free(kvrequest_t *req) {
+  free(req->prefix);
+  req->prefix = NULL;
+}
+
 void kvrequest_clear(kvrequest_t *req) {
   req->type = EMPTY;
   memset(req->key, 0, MAX_KEYLEN + 1);
   memset(req->val, 0, MAX_VALLEN + 1);
+  memset(req->expected, 0, MAX_VALLEN + 1);
+  req->ttl = 0;
+  req->txid = 0;
+  req->stream_size = 0;
+  req->prefix_size = 0;
+  req->prefix = NULL;
+  req->hashed = false;
 }
 
 void kvresponse_clear(kvresponse_t *res) {
@@ -10,6 +10,23 @@ typedef struct {
   msgtype_t type;
   char key[MAX_KEYLEN + 1]; // May be NULL, depending on type.
   char val[MAX_VALLEN + 1]; // May be NULL, depending on type.
+  char expected[MAX_VALLEN + 1]; // The value a CASREQ expects, else NULL.
+  uint64_t ttl; // The time to live of a PUTREQ, in seconds, else 0.
+  /* The transaction a TPCLeader forwards the request as, which its COMMIT or
+   * ABORT carries along with the key, else 0. */
+  uint64_t txid;
+  /* A PUTREQ with an empty VAL but an HTTP body streams its value, which may
+   * exceed MAX_VALLEN: STREAM_SIZE is the size of the value, of which the
+   * first PREFIX_SIZE bytes arrived with the request (in PREFIX, malloc()d
+   * and released by kvrequest_free) and the rest is still to be read from the
+   * socket. STREAM_SIZE is 0 and PREFIX NULL otherwise. */
+  uint64_t stream_size;
+  size_t prefix_size;
+  char *prefix;
+  /* strhash64(KEY), once HASHED is set by kvrequest_hash, so that handlers of
+   * the request hash its key only once. */
+  uint64_t hash;
+  bool hashed;
 } kvrequest_t;
 
 typedef struct {
@@ -28,6 +45,12 @@ bool kvresponse_receive(kvresponse_t *, int sockfd);
 int kvrequest_send(kvrequest_t *, int sockfd);
 int kvresponse_send(kvresponse_t *, int sockfd);
 
+/* Returns strhash64 of the key of a KVRequest, computing it only once. */
+uint64_t kvrequest_hash(kvrequest_t *);
+
+/* Releases the memory held by a KVRequest received with kvrequest_receive. */
+void kvrequest_free(kvrequest_t *);
+
 /* Helper methods to clear a KVRequest and KVResponse, respectively. */
 void kvrequest_clear(kvrequest_t *);
 void kvresponse_clear(kvresponse_t *);
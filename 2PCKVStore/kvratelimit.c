@@ -0,0 +1,49 @@
+#include <time.h>
+#include "kvratelimit.h"
+
+/* Returns the current time of the monotonic clock, in nanoseconds. */
+static uint64_t kvratelimit_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Initializes LIMIT to allow RATE tokens per second, or no limit if RATE is
+ * 0. The bucket starts full. */
+void kvratelimit_init(kvratelimit_t *limit, uint64_t rate) {
+  limit->rate = rate;
+  limit->burst = rate * KVRATELIMIT_BURST_SECONDS;
+  limit->tokens = limit->burst;
+  limit->last = kvratelimit_now();
+  limit->waited = 0;
+  pthread_mutex_init(&limit->lock, NULL);
+}
+
+/* Takes TOKENS from LIMIT, first sleeping for as long as it takes the bucket
+ * to cover them. */
+void kvratelimit_acquire(kvratelimit_t *limit, uint64_t tokens) {
+  struct timespec ts;
+  uint64_t now, wait;
+  if (limit->rate == 0)
+    return;
+  pthread_mutex_lock(&limit->lock);
+  now = kvratelimit_now();
+  limit->tokens += (double)(now - limit->last) * limit->rate / 1e9;
+  if (limit->tokens > limit->burst)
+    limit->tokens = limit->burst;
+  limit->last = now;
+  limit->tokens -= tokens;
+  /* Sleeping with the lock held makes later callers wait their turn. */
+  if (limit->tokens < 0) {
+    wait = -limit->tokens * 1e9 / limit->rate;
+    ts.tv_sec = wait / 1000000000;
+    ts.tv_nsec = wait % 1000000000;
+    while (nanosleep(&ts, &ts) != 0)
+      ;
+    limit->waited += wait;
+  }
+  pthread_mutex_unlock(&limit->lock);
+}
+
+/* Destroys LIMIT. */
+void kvratelimit_destroy(kvratelimit_t *limit) { pthread_mutex_destroy(&limit->lock); }
@@ -0,0 +1,35 @@
+#ifndef __KV_RATELIMIT__
+#define __KV_RATELIMIT__
+
+#include <stdint.h>
+#include <pthread.h>
+
+/* KVRateLimit throttles background I/O with a token bucket, so that work such
+ * as compaction proceeds at a steady rate instead of competing with requests
+ * for the disk in bursts.
+ *
+ * The bucket holds up to BURST tokens and is refilled at RATE tokens (bytes)
+ * per second. kvratelimit_acquire takes tokens for the I/O about to be done,
+ * sleeping until enough have accumulated. A request larger than the bucket
+ * may overdraw it, and is then paid back before anyone else proceeds. A rate
+ * of 0 disables throttling.
+ */
+
+/* The burst of a rate limiter, as the number of seconds of its rate. */
+#define KVRATELIMIT_BURST_SECONDS 0.1
+
+/* A token bucket rate limiter. */
+typedef struct {
+  uint64_t rate;        /* The refill rate, in tokens per second (0 = unlimited). */
+  double burst;         /* The capacity of the bucket. */
+  double tokens;        /* The tokens available; negative while overdrawn. */
+  uint64_t last;        /* The time of the last refill, in nanoseconds. */
+  uint64_t waited;      /* The total time spent throttled, in nanoseconds. */
+  pthread_mutex_t lock; /* Protects the fields above. */
+} kvratelimit_t;
+
+void kvratelimit_init(kvratelimit_t *, uint64_t rate);
+void kvratelimit_acquire(kvratelimit_t *, uint64_t tokens);
+void kvratelimit_destroy(kvratelimit_t *);
+
+#endif
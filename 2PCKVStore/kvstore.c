@@ -1,29 +1,1041 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <dirent.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <sched.h>
+#include <time.h>
+#include <stddef.h>
 #include "kvstore.h"
 #include "kvconstants.h"
+#include "kvcrc.h"
+#include "kvhash.h"
+#include "kvlog.h"
+#include "kvlsm.h"
+#include "kvmem.h"
+#include "kvcache.h"
+#include "kvblob.h"
+#include "kvlz.h"
+#include "kvversions.h"
 
-/* Initializes kvstore STORE. Uses DIRNAME as the directory in which to store
- * the entries of this store, creating the directory if necessary. Returns 0 if
+/* Returns the checksum of ENTRY, covering its header up to the checksum
+ * itself and its data. */
+static uint32_t kventry_checksum(const kventry_t *entry) {
+  uint32_t crc = kvcrc32c(0, entry, offsetof(kventry_t, crc));
+  return kvcrc32c(crc, entry->data, entry->length);
+}
+
+/* Encodes KEY and VALUE (NULL for a tombstone) as ENTRY, which must be able to
+ * hold KVENTRY_MAX_SIZE bytes. A value of at least THRESHOLD bytes (unless
+ * THRESHOLD is 0) is compressed if that makes it smaller, which is recorded in
+ * STATS (unless NULL). Returns the size of the encoded entry, including its header. */
+size_t kventry_encode(kventry_t *entry, const char *key, const char *value, size_t threshold,
+                      kvlz_stats_t *stats) {
+  size_t keylen = strlen(key), vallen, clen = 0;
+  char *dst = entry->data + keylen + 1;
+  strcpy(entry->data, key);
+  entry->length = keylen + 1;
+  entry->flags = value ? 0 : KVENTRY_TOMBSTONE;
+  if (value != NULL) {
+    vallen = strlen(value);
+    if (threshold > 0 && vallen >= threshold) {
+      /* Only worth it if it saves more than the null terminator. */
+      clen = kvlz_compress(value, vallen, dst, vallen);
+      if (stats != NULL)
+        kvlz_stats_add(stats, vallen, clen ? clen : vallen);
+    }
+    if (clen > 0) {
+      entry->flags |= KVENTRY_COMPRESSED;
+      entry->length += clen;
+    } else {
+      strcpy(dst, value);
+      entry->length += vallen + 1;
+    }
+  }
+  entry->crc = kventry_checksum(entry);
+  return sizeof(kventry_t) + entry->length;
+}
+
+/* Returns true if the SIZE bytes at ENTRY hold all of ENTRY, and its checksum
+ * matches its contents. */
+bool kventry_verify(const kventry_t *entry, size_t size) {
+  return size >= sizeof(kventry_t) && entry->length > 0 &&
+         entry->length <= KVENTRY_MAX_SIZE - sizeof(kventry_t) &&
+         size >= sizeof(kventry_t) + entry->length && entry->crc == kventry_checksum(entry);
+}
+
+/* Returns the value of ENTRY, or NULL if it is a tombstone or its value cannot
+ * be decompressed. A compressed value is decompressed into BUF, which must be
+ * able to hold MAX_VALLEN + 1 bytes; any other value is returned in place. */
+char *kventry_value(kventry_t *entry, char *buf) {
+  size_t keylen;
+  ssize_t len;
+  if (entry->flags & KVENTRY_TOMBSTONE)
+    return NULL;
+  keylen = strlen(entry->data);
+  if (!(entry->flags & KVENTRY_COMPRESSED))
+    return entry->data + keylen + 1;
+  len = kvlz_decompress(entry->data + keylen + 1, entry->length - keylen - 1, buf, MAX_VALLEN);
+  if (len < 0)
+    return NULL;
+  buf[len] = '\0';
+  return buf;
+}
+
+/* Writes the filename of the entry at CHAINPOS of the hash chain HASHVAL of
+ * STORE into FILENAME. */
+static void entry_filename(kvstore_t *store, uint64_t hashval, unsigned int chainpos,
+                           char *filename) {
+  sprintf(filename, "%s/%" PRIu64 "-%u%s", store->dirname, hashval, chainpos, KVSTORE_FILETYPE);
+}
+
+/* Returns hash(KEY) within STORE, which selects the key lock, read cache shard
+ * and (for the KVSTORE_FILES engine) hash chain of KEY. The KVSTORE_FILES
+ * engine names its entry files by it, so it must be strhash64, while the other
+ * engines only use it in memory and take the much cheaper kvhash_str. */
+static uint64_t key_hash(kvstore_t *store, const char *key) {
+  if (store->engine == KVSTORE_FILES)
+    return strhash64(key);
+  return kvhash_str(key);
+}
+
+/* Returns hash(KEY) within STORE given DIGEST, strhash64(KEY) as the caller
+ * computed it already, which the KVSTORE_FILES engine takes as it is. */
+static uint64_t key_hash_digest(kvstore_t *store, const char *key, uint64_t digest) {
+  if (store->engine == KVSTORE_FILES)
+    return digest;
+  return kvhash_str(key);
+}
+
+/* Computes key_hash of each of the COUNT keys KEYS of STORE into HASHES. */
+static void key_hash_batch(kvstore_t *store, char *const *keys, unsigned int count,
+                           uint64_t *hashes) {
+  unsigned int i;
+  if (store->engine == KVSTORE_FILES) {
+    strhash64_batch(keys, count, hashes);
+    return;
+  }
+  for (i = 0; i < count; i++)
+    hashes[i] = kvhash_str(keys[i]);
+}
+
+/* Returns the lock serializing the operations on the keys of the hash chain
+ * HASHVAL of STORE. The KVSTORE_LOG engine shares its segments and keydir
+ * among all keys, so its keys are all serialized by the lock of STORE. */
+static pthread_rwlock_t *key_lock(kvstore_t *store, uint64_t hashval) {
+  if (store->engine == KVSTORE_LOG)
+    return &store->lock;
+  return &store->stripes[hashval % KVSTORE_LOCK_STRIPES].lock;
+}
+
+/* Locks (if LOCK is true) or unlocks the key locks of all keys of STORE for
+ * writing, in the same order as batch_lock. */
+static void key_lock_all(kvstore_t *store, bool lock) {
+  int i;
+  if (store->engine == KVSTORE_LOG) {
+    if (lock)
+      pthread_rwlock_wrlock(&store->lock);
+    else
+      pthread_rwlock_unlock(&store->lock);
+    return;
+  }
+  for (i = 0; i < KVSTORE_LOCK_STRIPES; i++) {
+    if (lock)
+      pthread_rwlock_wrlock(&store->stripes[i].lock);
+    else
+      pthread_rwlock_unlock(&store->stripes[KVSTORE_LOCK_STRIPES - 1 - i].lock);
+  }
+}
+
+/* Advances the sequence number of the stripe of HASHVAL of STORE, which is odd
+ * from the first call until the second, while the entry files of the stripe
+ * change. The caller must hold the stripe for writing. */
+static void stripe_advance(kvstore_t *store, uint64_t hashval) {
+  __atomic_add_fetch(&store->stripes[hashval % KVSTORE_LOCK_STRIPES].seq, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Records in the index of STORE that KEY is stored at CHAINPOS of the hash
+ * chain HASHVAL. The caller must hold the stripe of HASHVAL for writing. */
+static void index_set(kvstore_t *store, uint64_t hashval, unsigned int chainpos,
+                      const char *key) {
+  pthread_rwlock_wrlock(&store->lock);
+  if (kvindex_set(&store->index, hashval, chainpos, key))
+    kvkeys_insert(&store->order, key);
+  pthread_rwlock_unlock(&store->lock);
+}
+
+/* Removes KEY, stored at CHAINPOS of the hash chain HASHVAL, from the index of
+ * STORE, moving the last key of the chain into its place just as kvstore_del
+ * does with the entry files. The caller must hold the stripe of HASHVAL for
+ * writing. */
+static void index_remove(kvstore_t *store, uint64_t hashval, unsigned int chainpos, char *key) {
+  pthread_rwlock_wrlock(&store->lock);
+  kvkeys_remove(&store->order, key);
+  kvindex_remove(&store->index, hashval, chainpos);
+  pthread_rwlock_unlock(&store->lock);
+}
+
+/* Frees the whole index of STORE. */
+static void index_free(kvstore_t *store) {
+  kvindex_free(&store->index);
+  kvkeys_free(&store->order);
+}
+
+/* An entry file whose key is read to build the index. */
+typedef struct {
+  char filename[MAX_FILENAME];
+  uint64_t hashval;
+  unsigned int chainpos;
+  char buf[sizeof(kventry_t) + MAX_KEYLEN + 2]; /* The header and key, terminated. */
+} index_file_t;
+
+/* Verifies ENTRY, the first SIZE bytes of an entry file of STORE read into a
+ * buffer of CAPACITY bytes to add its key to the index, counting it as
+ * corrupted if its checksum does not match. Only the beginning of the entries
+ * which do not fit the buffer is read, so their checksums are left to be
+ * verified when their values are read. */
+static void index_verify(kvstore_t *store, kventry_t *entry, size_t size, size_t capacity) {
+  if (size == capacity && entry->length > 0 && sizeof(kventry_t) + entry->length > size)
+    return;
+  if (!kventry_verify(entry, size))
+    __sync_fetch_and_add(&store->corruptions, 1);
+}
+
+/* Returns the ring of the KVSTORE_FILES store STORE through which the entry
+ * files of the hash chain HASHVAL are read. */
+static kvuring_t *store_uring(kvstore_t *store, uint64_t hashval) {
+  return &store->urings[hashval % KVSTORE_URINGS];
+}
+
+/* Adds the keys of the N entry FILES, read with READS, to the index of
+ * STORE. */
+static void index_add_files(kvstore_t *store, index_file_t *files, kvuring_read_t *reads,
+                            unsigned int n) {
+  kventry_t *entry;
+  unsigned int i;
+  kvuring_read_files(&store->urings[0], reads, n);
+  for (i = 0; i < n; i++) {
+    if (reads[i].result < 0)
+      continue;
+    index_verify(store, (kventry_t *)files[i].buf, reads[i].result, reads[i].size);
+    if (reads[i].result <= (ssize_t)sizeof(kventry_t))
+      continue;
+    entry = (kventry_t *)files[i].buf;
+    files[i].buf[reads[i].result] = '\0';
+    index_set(store, files[i].hashval, files[i].chainpos, entry->data);
+  }
+}
+
+/* Builds the index of STORE by reading the key of every entry file within
+ * its directory, KVURING_FILES files at a time (see kvuring.h). Returns 0 if
+ * successful, else a negative error code. */
+static int index_build(kvstore_t *store) {
+  char suffix[MAX_FILENAME];
+  kvuring_read_t reads[KVURING_FILES];
+  index_file_t *files, *file;
+  struct dirent *dent;
+  unsigned int n = 0;
+  DIR *dir;
+  kvindex_init(&store->index);
+  kvkeys_init(&store->order);
+  if ((dir = opendir(store->dirname)) == NULL)
+    return ERR_FILACCESS;
+  files = malloc(KVURING_FILES * sizeof(index_file_t));
+  if (!files)
+    fatal_malloc();
+  do {
+    if ((dent = readdir(dir)) != NULL) {
+      file = &files[n];
+      if (sscanf(dent->d_name, "%" SCNu64 "-%u%s", &file->hashval, &file->chainpos, suffix) != 3 ||
+          strcmp(suffix, KVSTORE_FILETYPE))
+        continue;
+      sprintf(file->filename, "%s/%s", store->dirname, dent->d_name);
+      reads[n].filename = file->filename;
+      reads[n].buf = file->buf;
+      reads[n].size = sizeof(file->buf) - 1;
+      if (++n < KVURING_FILES)
+        continue;
+    }
+    index_add_files(store, files, reads, n);
+    n = 0;
+  } while (dent != NULL);
+  free(files);
+  closedir(dir);
+  return 0;
+}
+
+/* Looks up the position of KEY within the hash chain HASHVAL using the index
+ * of STORE, which takes no lock. Returns the chain position, or ERR_NOKEY if
+ * KEY is not present. */
+static int index_lookup(kvstore_t *store, uint64_t hashval, char *key) {
+  return kvindex_lookup(&store->index, hashval, key);
+}
+
+/* Reads the hash chain HASHVAL of STORE again from its entry files, replacing
+ * whatever its index held for the chain, which the checkpoint loaded may have
+ * recorded before it changed. */
+static void index_reload(kvstore_t *store, uint64_t hashval) {
+  char filename[MAX_FILENAME];
+  char buf[sizeof(kventry_t) + MAX_KEYLEN + 2]; /* The header and key, terminated. */
+  kventry_t *entry = (kventry_t *)buf;
+  unsigned int chainpos;
+  const char *key;
+  ssize_t size;
+  int fd;
+  pthread_rwlock_wrlock(&store->lock);
+  for (chainpos = kvindex_length(&store->index, hashval); chainpos-- > 0;) {
+    if ((key = kvindex_key(&store->index, hashval, chainpos)) != NULL)
+      kvkeys_remove(&store->order, key);
+    kvindex_remove(&store->index, hashval, chainpos);
+  }
+  pthread_rwlock_unlock(&store->lock);
+  /* Chains are complete, so the first file missing ends the chain. */
+  for (chainpos = 0;; chainpos++) {
+    entry_filename(store, hashval, chainpos, filename);
+    if ((fd = open(filename, O_RDONLY)) < 0)
+      break;
+    size = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (size >= 0)
+      index_verify(store, entry, size, sizeof(buf) - 1);
+    if (size <= (ssize_t)sizeof(kventry_t))
+      continue;
+    buf[size] = '\0';
+    index_set(store, hashval, chainpos, entry->data);
+  }
+}
+
+/* Adds KEY, at CHAINPOS of the hash chain HASHVAL according to the checkpoint
+ * loaded, to the index of the store ARG. */
+static void index_load_key(uint64_t hashval, unsigned int chainpos, const char *key, void *arg) {
+  index_set(arg, hashval, chainpos, key);
+}
+
+/* The number of keys a checkpoint collects from the key order at a time. */
+#define CHECKPOINT_BATCH 1024
+
+/* The state of a checkpoint of the index of a KVSTORE_FILES store being
+ * written. */
+typedef struct {
+  kvstore_t *store;                  /* The store checkpointed. */
+  char cursor[MAX_KEYLEN + 1];       /* The last key collected. */
+  char *keys[CHECKPOINT_BATCH];      /* The keys collected, malloc()d. */
+  uint64_t hashes[CHECKPOINT_BATCH]; /* The hash chain of each. */
+  unsigned int n;                    /* The number of KEYS. */
+  unsigned int next;                 /* The next of KEYS to pass on. */
+  bool started;                      /* Whether any keys were collected yet. */
+  bool done;                         /* Whether all keys were collected. */
+} checkpoint_state_t;
+
+/* Collects the next CHECKPOINT_BATCH keys of the checkpoint STATE from the key
+ * order of its store, holding the lock of the store only meanwhile. */
+static void checkpoint_collect(checkpoint_state_t *state) {
+  kvstore_t *store = state->store;
+  kvkeys_iter_t iter;
+  bool found;
+  pthread_rwlock_rdlock(&store->lock);
+  found = kvkeys_seek(&store->order, state->cursor, &iter);
+  /* After the first batch, CURSOR is the last key collected. */
+  if (state->started && found && strcmp(iter.key, state->cursor) == 0)
+    found = kvkeys_next(&iter);
+  for (state->n = 0; state->n < CHECKPOINT_BATCH && found; found = kvkeys_next(&iter)) {
+    state->keys[state->n] = strdup(iter.key);
+    if (!state->keys[state->n++])
+      fatal_malloc();
+  }
+  pthread_rwlock_unlock(&store->lock);
+  state->started = true;
+  state->done = state->n < CHECKPOINT_BATCH;
+  state->next = 0;
+  if (state->n > 0)
+    strcpy(state->cursor, state->keys[state->n - 1]);
+  key_hash_batch(store, state->keys, state->n, state->hashes);
+}
+
+/* Stores the next key of the checkpoint ARG, as kvcheckpoint_next_fn does.
+ * Keys removed since they were collected are skipped. Those of chains changing
+ * meanwhile may be recorded inconsistently, but the chains are logged. */
+static int checkpoint_next(void *arg, uint64_t *hashval, unsigned int *chainpos, char *key) {
+  checkpoint_state_t *state = arg;
+  unsigned int i;
+  int pos;
+  for (;;) {
+    while (state->next < state->n) {
+      i = state->next++;
+      pos = index_lookup(state->store, state->hashes[i], state->keys[i]);
+      if (pos >= 0) {
+        *hashval = state->hashes[i];
+        *chainpos = pos;
+        strcpy(key, state->keys[i]);
+      }
+      free(state->keys[i]);
+      if (pos >= 0)
+        return 1;
+    }
+    if (state->done)
+      return 0;
+    checkpoint_collect(state);
+  }
+}
+
+/* Writes a checkpoint of the index of the KVSTORE_FILES store STORE. The
+ * chains changing meanwhile must be recorded by the current log. Returns 0 if
+ * successful, else a negative error code. */
+static int index_checkpoint(kvstore_t *store) {
+  checkpoint_state_t *state = malloc(sizeof(checkpoint_state_t));
+  int ret;
+  if (!state)
+    fatal_malloc();
+  state->store = store;
+  state->cursor[0] = '\0';
+  state->n = state->next = 0;
+  state->started = state->done = false;
+  ret = kvcheckpoint_write(&store->checkpoint, checkpoint_next, state);
+  /* A checkpoint which failed leaves keys behind. */
+  while (state->next < state->n)
+    free(state->keys[state->next++]);
+  free(state);
+  return ret;
+}
+
+/* Loads the index of STORE from its checkpoint, reading the hash chains
+ * changed since from their entry files, or builds it with index_build if the
+ * checkpoint cannot be used. Unless the checkpoint was up to date, a new one is
+ * written before the log of its changes is begun. Returns 0 if successful,
+ * else a negative error code, in which case the index and the checkpoint are
+ * released. */
+static int index_load(kvstore_t *store) {
+  uint64_t *hashes;
+  size_t count, i;
+  bool dirty;
+  int ret;
+  kvindex_init(&store->index);
+  kvkeys_init(&store->order);
+  if (kvcheckpoint_load(&store->checkpoint, store->dirname, index_load_key, store, &hashes,
+                        &count) < 0) {
+    index_free(store);
+    if ((ret = index_build(store)) < 0)
+      goto fail;
+    dirty = true;
+  } else {
+    for (i = 0; i < count; i++)
+      index_reload(store, hashes[i]);
+    dirty = count > 0;
+    free(hashes);
+  }
+  /* The log is begun afresh, so the checkpoint must cover its chains first. */
+  if ((dirty && (ret = index_checkpoint(store)) < 0) ||
+      (ret = kvcheckpoint_begin(&store->checkpoint)) < 0)
+    goto fail;
+  return 0;
+fail:
+  kvcheckpoint_close(&store->checkpoint, false);
+  index_free(store);
+  return ret;
+}
+
+/* Decodes the value of ENTRY, the SIZE bytes read from an entry file, into
+ * VALUE. Returns 0 if successful, ERR_CHECKSUM if ENTRY is torn or corrupted
+ * (or was being written as it was read), else a negative error code. */
+static int entry_decode(kventry_t *entry, size_t size, char *value) {
+  char *stored;
+  if (!kventry_verify(entry, size))
+    return ERR_CHECKSUM;
+  if ((stored = kventry_value(entry, value)) == NULL)
+    return ERR_FILACCESS;
+  if (stored != value)
+    strcpy(value, stored);
+  return 0;
+}
+
+/* Reads the value of the entry at CHAINPOS of the hash chain HASHVAL of STORE
+ * from its file into VALUE. Unless the caller holds the stripe of HASHVAL, the
+ * result must be validated against the sequence number of the stripe. Returns
+ * 0 if successful, else a negative error code. */
+static int entry_read(kvstore_t *store, uint64_t hashval, unsigned int chainpos, char *value) {
+  char filename[MAX_FILENAME];
+  char buf[KVENTRY_MAX_SIZE];
+  kvuring_read_t read_;
+  entry_filename(store, hashval, chainpos, filename);
+  read_.filename = filename;
+  read_.buf = buf;
+  read_.size = KVENTRY_MAX_SIZE;
+  kvuring_read_files(store_uring(store, hashval), &read_, 1);
+  if (read_.result < 0)
+    return ERR_FILACCESS;
+  return entry_decode((kventry_t *)buf, read_.result, value);
+}
+
+/* Finds KEY within the hash chain HASHVAL of STORE and, if VALUE is not NULL,
+ * reads its value into VALUE, as find_entry does. */
+static int entry_find(kvstore_t *store, uint64_t hashval, char *key, char *value) {
+  int chainpos = index_lookup(store, hashval, key), ret;
+  if (chainpos >= 0 && value != NULL && (ret = entry_read(store, hashval, chainpos, value)) < 0)
+    return ret;
+  return chainpos;
+}
+
+/* Returns RET, as entry_find returned for an entry of STORE which no writer
+ * got in the way of, counting the entry as corrupted if its checksum did not
+ * match. */
+static int entry_counted(kvstore_t *store, int ret) {
+  if (ret == ERR_CHECKSUM)
+    __sync_fetch_and_add(&store->corruptions, 1);
+  return ret;
+}
+
+/* Returns true if STORE holds any large values. Only then do the engines
+ * which lock themselves need the key locks of STORE, to keep the large values
+ * consistent with the small ones. */
+static bool has_blobs(kvstore_t *store) {
+  return __atomic_load_n(&store->blobs.count, __ATOMIC_ACQUIRE) > 0;
+}
+
+/* Returns the counter of BLOB_MARKS of STORE covering the keys whose hash is
+ * HASHVAL. */
+static uint32_t *blob_mark(kvstore_t *store, uint64_t hashval) {
+  return &store->blob_marks[(hashval >> 32) % KVSTORE_BLOB_MARKS];
+}
+
+/* Counts the large value just added to STORE under a key whose hash is
+ * HASHVAL, if ADDED, or just removed, if not. The caller must hold BLOB_LOCK,
+ * or be initializing STORE. */
+static void blob_marked(kvstore_t *store, uint64_t hashval, bool added) {
+  if (added)
+    __atomic_add_fetch(blob_mark(store, hashval), 1, __ATOMIC_RELEASE);
+  else
+    __atomic_sub_fetch(blob_mark(store, hashval), 1, __ATOMIC_RELEASE);
+}
+
+/* Marks the hashes of all keys with large values within STORE, as it is
+ * initialized. */
+static void blob_mark_all(kvstore_t *store) {
+  kvblob_extent_t *ext, *tmp;
+  memset(store->blob_marks, 0, sizeof(store->blob_marks));
+  HASH_ITER(hh, store->blobs.extents, ext, tmp)
+    blob_marked(store, key_hash(store, ext->key), true);
+}
+
+/* Returns true if KEY, where HASHVAL is hash(KEY), has a large value within
+ * STORE. Only keys whose hash is marked as shared with a large value take
+ * BLOB_LOCK to look in the map of BLOBS, so that reads of the others do not
+ * contend on it. */
+static bool blob_exists(kvstore_t *store, uint64_t hashval, char *key) {
+  bool ret;
+  if (__atomic_load_n(blob_mark(store, hashval), __ATOMIC_ACQUIRE) == 0)
+    return false;
+  pthread_mutex_lock(&store->blob_lock);
+  ret = kvblob_has(&store->blobs, key);
+  pthread_mutex_unlock(&store->blob_lock);
+  return ret;
+}
+
+/* Removes the large value of KEY, where HASHVAL is hash(KEY), from STORE, if
+ * any. The caller must hold the key lock of KEY for writing. Returns true if
+ * there was one. */
+static bool blob_remove(kvstore_t *store, uint64_t hashval, char *key) {
+  bool ret;
+  if (!has_blobs(store))
+    return false;
+  pthread_mutex_lock(&store->blob_lock);
+  if ((ret = kvblob_remove(&store->blobs, key)))
+    blob_marked(store, hashval, false);
+  pthread_mutex_unlock(&store->blob_lock);
+  return ret;
+}
+
+/* Returns true if any key of STORE has an expiry time. Only then do reads
+ * need to check whether their key has expired. */
+static bool has_ttls(kvstore_t *store) {
+  return __atomic_load_n(&store->ttl.count, __ATOMIC_ACQUIRE) > 0;
+}
+
+/* Returns true if KEY has expired within STORE as of NOW. Takes no lock (see
+ * kvttl_expired). */
+static bool key_expired(kvstore_t *store, const char *key, uint64_t now) {
+  if (!has_ttls(store))
+    return false;
+  return kvttl_expired(&store->ttl, key, now);
+}
+
+/* Clears the expiry time of KEY within STORE, if any, as every write of KEY
+ * without a time to live does once it has written KEY. The caller must hold
+ * the key lock of KEY for writing, unless the engine is KVSTORE_LSM and the
+ * write did not take it. The change is synced along with the write it belongs
+ * to (see store_sync), or at once if the write synced itself already, unless
+ * it is part of a write batch (BATCHED), which syncs it along with the rest.
+ * Returns 0 if successful, else a negative error code. */
+static int ttl_clear(kvstore_t *store, const char *key, bool batched) {
+  bool synced = !batched && store->engine == KVSTORE_FILES &&
+                store->sync.opts.mode == KVSYNC_ALWAYS;
+  int ret;
+  if (!has_ttls(store))
+    return 0;
+  pthread_mutex_lock(&store->ttl_lock);
+  ret = kvttl_clear(&store->ttl, key, synced);
+  pthread_mutex_unlock(&store->ttl_lock);
+  return ret;
+}
+
+/* Syncs the expiry times changed within STORE. Returns 0 if successful, else
+ * a negative error code. */
+static int ttl_sync(kvstore_t *store) {
+  int ret;
+  pthread_mutex_lock(&store->ttl_lock);
+  ret = kvttl_sync(&store->ttl);
+  pthread_mutex_unlock(&store->ttl_lock);
+  return ret;
+}
+
+/* Returns true if STORE has any open snapshots. */
+static bool has_snapshots(kvstore_t *store) {
+  return __atomic_load_n(&store->nsnapshots, __ATOMIC_SEQ_CST) > 0;
+}
+
+/* Ends a write to the KVSTORE_LSM engine of STORE which did not take the key
+ * locks. */
+static void lsm_write_done(kvstore_t *store) {
+  __atomic_sub_fetch(&store->unlocked_writers, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Returns true if a write to the KVSTORE_LSM engine of STORE, which locks
+ * itself, must take the key locks, as it must while large values, snapshots or
+ * exclusive writes (see exclusive_begin) exist. A write which does not is
+ * counted as unlocked until lsm_write_done, so that kvstore_snapshot and
+ * exclusive writes can wait for it. */
+static bool lsm_write_locked(kvstore_t *store) {
+  __atomic_add_fetch(&store->unlocked_writers, 1, __ATOMIC_SEQ_CST);
+  if (!has_blobs(store) && !has_snapshots(store) &&
+      __atomic_load_n(&store->exclusive_writers, __ATOMIC_SEQ_CST) == 0)
+    return false;
+  lsm_write_done(store);
+  return true;
+}
+
+/* Begins an exclusive write to STORE: one which reads or writes state beside
+ * the value of its key, and so needs every other write of the key to take the
+ * key lock, even with the KVSTORE_LSM engine. Waits for the writes in progress
+ * which did not. */
+static void exclusive_begin(kvstore_t *store) {
+  if (store->engine != KVSTORE_LSM)
+    return;
+  __atomic_add_fetch(&store->exclusive_writers, 1, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n(&store->unlocked_writers, __ATOMIC_SEQ_CST) > 0)
+    sched_yield();
+}
+
+/* Ends an exclusive write to STORE. */
+static void exclusive_end(kvstore_t *store) {
+  if (store->engine == KVSTORE_LSM)
+    __atomic_sub_fetch(&store->exclusive_writers, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Returns the sequence number of a write to STORE which is about to begin, or
+ * 0 if no snapshot is open, in which case the write need not be numbered. The
+ * caller must hold the key locks of all keys written. */
+static uint64_t version_begin(kvstore_t *store) {
+  if (!has_snapshots(store))
+    return 0;
+  return __atomic_add_fetch(&store->seq, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Reads the current version of KEY, where HASHVAL is hash(KEY), from the
+ * storage engine of STORE into VALUE, bypassing the read cache. The caller
+ * must hold the key lock of KEY. Returns the state of KEY; a value which
+ * cannot be read counts as absent. */
+static kvversion_state_t version_read(kvstore_t *store, uint64_t hashval, char *key,
+                                      char *value) {
+  int ret;
+  if (blob_exists(store, hashval, key))
+    return KVVERSION_LARGE;
+  if (store->engine == KVSTORE_LOG)
+    ret = kvlog_get(&store->log, key, value);
+  else if (store->engine == KVSTORE_LSM)
+    ret = kvlsm_get(&store->lsm, key, value);
+  else if (store->engine == KVSTORE_MEMORY)
+    ret = kvmem_get(&store->mem, hashval, key, value);
+  else
+    ret = entry_find(store, hashval, key, value);
+  return ret < 0 ? KVVERSION_ABSENT : KVVERSION_VALUE;
+}
+
+/* Records that the write numbered SEQ is about to replace the version of KEY
+ * within STORE described by STATE and VALUE, for the open snapshots. Does
+ * nothing if SEQ is 0. The caller must hold the key lock of KEY for writing. */
+static void version_record(kvstore_t *store, char *key, uint64_t seq, kvversion_state_t state,
+                           const char *value) {
+  if (seq == 0)
+    return;
+  pthread_mutex_lock(&store->version_lock);
+  kvversions_add(&store->versions, key, seq, state, value);
+  pthread_mutex_unlock(&store->version_lock);
+}
+
+/* Records the current version of KEY within STORE, where HASHVAL is hash(KEY),
+ * which the write numbered SEQ is about to replace, for the open snapshots.
+ * Does nothing if SEQ is 0. The caller must hold the key lock of KEY for
+ * writing. */
+static void version_preserve(kvstore_t *store, uint64_t hashval, char *key, uint64_t seq) {
+  char value[MAX_VALLEN + 1];
+  kvversion_state_t state;
+  if (seq == 0)
+    return;
+  state = version_read(store, hashval, key, value);
+  version_record(store, key, seq, state, value);
+}
+
+/* Syncs the entry files written within the KVSTORE_FILES store STORE since
+ * its last sync by a write batch or KVSYNC_GROUP, and its directory if files
+ * were created, removed or renamed within it. Returns 0 if successful, else a
+ * negative error code. */
+static int files_sync(kvstore_t *store) {
+  return kvsync_files_sync(&store->dirty, store->dirname);
+}
+
+/* Flushes every file written within the store directory of STORE to disk,
+ * including those no sync tracks, written with KVSYNC_NONE. Returns 0 if
+ * successful, else a negative error code. */
+static int files_sync_all(kvstore_t *store) {
+  int fd, ret;
+  if ((fd = open(store->dirname, O_RDONLY | O_DIRECTORY)) < 0)
+    return ERR_FILACCESS;
+  ret = syncfs(fd) == 0 ? 0 : ERR_FILACCESS;
+  close(fd);
+  return ret;
+}
+
+/* Syncs the directory of the KVSTORE_FILES store STORE, making the entry files
+ * created, removed and renamed within it durable. Returns 0 if successful, else
+ * a negative error code. */
+static int files_sync_dir(kvstore_t *store) {
+  int fd, ret;
+  if ((fd = open(store->dirname, O_RDONLY | O_DIRECTORY)) < 0)
+    return ERR_FILACCESS;
+  ret = fsync(fd) == 0 ? 0 : ERR_FILACCESS;
+  close(fd);
+  return ret;
+}
+
+/* Makes all writes completed within the store ARG so far durable, by syncing
+ * its storage engine. The expiry times the writes cleared are synced only
+ * after them, so that a crash never leaves a value which was replaced without
+ * a time to live in place of the new one without its expiry time. Returns 0
+ * if successful, else a negative error code. */
+static int store_sync(void *arg) {
+  kvstore_t *store = arg;
+  int ret;
+  if (store->engine == KVSTORE_MEMORY) {
+    return 0;
+  } else if (store->engine == KVSTORE_LSM) {
+    ret = kvlsm_sync(&store->lsm);
+  } else if (store->engine == KVSTORE_FILES) {
+    ret = files_sync(store);
+  } else {
+    pthread_rwlock_rdlock(&store->lock);
+    ret = kvlog_sync(&store->log);
+    pthread_rwlock_unlock(&store->lock);
+  }
+  return ret < 0 ? ret : ttl_sync(store);
+}
+
+/* Returns once the write just completed within STORE is as durable as the
+ * durability mode of STORE requires. The caller must not hold any lock of
+ * STORE. Returns 0 if successful, else a negative error code. */
+static int store_commit(kvstore_t *store) {
+  /* With KVSYNC_ALWAYS, the KVSTORE_FILES engine syncs the files of each
+   * write itself. */
+  if (store->engine == KVSTORE_FILES && store->sync.opts.mode == KVSYNC_ALWAYS)
+    return 0;
+  /* The KVSTORE_MEMORY engine has nothing to sync. */
+  if (store->engine == KVSTORE_MEMORY)
+    return 0;
+  return kvsync_commit(&store->sync);
+}
+
+/* Fills OPTS with the default options, which select the KVSTORE_FILES
+ * engine. */
+void kvstore_opts_default(kvstore_opts_t *opts) {
+  opts->engine = KVSTORE_FILES;
+  opts->segment_size = KVLOG_SEGMENT_SIZE;
+  opts->memtable_size = KVLSM_MEMTABLE_SIZE;
+  opts->bloom_bits = KVLSM_BLOOM_BITS_PER_KEY;
+  opts->cache_size = KVCACHE_SIZE;
+  opts->compress_threshold = KVSTORE_COMPRESS_THRESHOLD;
+  opts->locked_reads = false;
+  kvsync_opts_default(&opts->durability);
+  opts->compact_ratio = KVSTORE_COMPACT_RATIO;
+  opts->compact_rate = KVSTORE_COMPACT_RATE;
+  opts->direct_io = false;
+  opts->block_cache_size = KVBLOCKCACHE_SIZE;
+  opts->memory_size = KVMEM_SIZE;
+  opts->eviction = KVMEM_LRU;
+}
+
+/* Parses the engine NAME ("files", "log", "lsm" or "memory") into ENGINE.
+ * Returns 0 if successful, else -1. */
+int kvstore_engine_from_string(const char *name, kvstore_engine_t *engine) {
+  if (!strcmp(name, "files"))
+    *engine = KVSTORE_FILES;
+  else if (!strcmp(name, "log"))
+    *engine = KVSTORE_LOG;
+  else if (!strcmp(name, "lsm"))
+    *engine = KVSTORE_LSM;
+  else if (!strcmp(name, "memory"))
+    *engine = KVSTORE_MEMORY;
+  else
+    return -1;
+  return 0;
+}
+
+/* Compacts the log of the KVSTORE_LOG store STORE if at least RATIO of the
+ * bytes of its sealed segments are garbage, a chunk at a time, throttled by
+ * the compaction rate limit. Gives up early if the compactor is asked to exit.
+ * The caller must hold COMPACT_LOCK. Returns 0 if successful, else a negative
+ * error code. */
+static int log_compact(kvstore_t *store, double ratio) {
+  kvlog_compaction_t c;
+  uint64_t done;
+  bool begun;
+  int ret = 0;
+  pthread_rwlock_rdlock(&store->lock);
+  begun = kvlog_compact_begin(&store->log, &c, ratio);
+  pthread_rwlock_unlock(&store->lock);
+  if (!begun)
+    return 0;
+  while (ret == 0) {
+    if (__atomic_load_n(&store->compact_stop, __ATOMIC_RELAXED)) {
+      kvlog_compact_abort(&store->log, &c);
+      return 0;
+    }
+    done = c.read + c.written;
+    pthread_rwlock_rdlock(&store->lock);
+    ret = kvlog_compact_step(&store->log, &c, KVSTORE_COMPACT_CHUNK);
+    pthread_rwlock_unlock(&store->lock);
+    kvratelimit_acquire(&store->compact_limit, c.read + c.written - done);
+  }
+  if (ret > 0)
+    ret = kvlog_compact_sync(&c);
+  if (ret < 0) {
+    kvlog_compact_abort(&store->log, &c);
+    return ret;
+  }
+  pthread_rwlock_wrlock(&store->lock);
+  ret = kvlog_compact_finish(&store->log, &c);
+  pthread_rwlock_unlock(&store->lock);
+  return ret;
+}
+
+/* The compactor thread of the KVSTORE_LOG store ARG: compacts the log whenever
+ * enough of it is garbage, until asked to exit. */
+static void *log_compactor(void *arg) {
+  kvstore_t *store = arg;
+  struct timespec deadline;
+  pthread_mutex_lock(&store->compact_lock);
+  while (!__atomic_load_n(&store->compact_stop, __ATOMIC_RELAXED)) {
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += KVSTORE_COMPACT_INTERVAL;
+    pthread_cond_timedwait(&store->compact_cond, &store->compact_lock, &deadline);
+    if (!__atomic_load_n(&store->compact_stop, __ATOMIC_RELAXED) &&
+        log_compact(store, store->compact_ratio) < 0)
+      fprintf(stderr, "kvstore: compaction failed in %s, retrying\n", store->dirname);
+  }
+  pthread_mutex_unlock(&store->compact_lock);
+  return NULL;
+}
+
+/* Writes a new checkpoint of the index of the KVSTORE_FILES store STORE,
+ * first rotating its log while no chain is changing. The caller must hold
+ * COMPACT_LOCK. Returns 0 if successful, else a negative error code. */
+static int files_checkpoint(kvstore_t *store) {
+  int ret;
+  key_lock_all(store, true);
+  ret = kvcheckpoint_rotate(&store->checkpoint);
+  key_lock_all(store, false);
+  return ret < 0 ? ret : index_checkpoint(store);
+}
+
+/* The checkpointer thread of the KVSTORE_FILES store ARG: writes a new
+ * checkpoint of its index whenever its log is long enough, until asked to
+ * exit. */
+static void *files_checkpointer(void *arg) {
+  kvstore_t *store = arg;
+  struct timespec deadline;
+  size_t keys;
+  pthread_mutex_lock(&store->compact_lock);
+  while (!__atomic_load_n(&store->compact_stop, __ATOMIC_RELAXED)) {
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += KVSTORE_COMPACT_INTERVAL;
+    pthread_cond_timedwait(&store->compact_cond, &store->compact_lock, &deadline);
+    pthread_rwlock_rdlock(&store->lock);
+    keys = store->order.count;
+    pthread_rwlock_unlock(&store->lock);
+    if (!__atomic_load_n(&store->compact_stop, __ATOMIC_RELAXED) &&
+        kvcheckpoint_due(&store->checkpoint, keys) && files_checkpoint(store) < 0)
+      fprintf(stderr, "kvstore: checkpoint failed in %s, retrying\n", store->dirname);
+  }
+  pthread_mutex_unlock(&store->compact_lock);
+  return NULL;
+}
+
+/* Returns true if STORE has a background thread, the COMPACTOR. */
+static bool has_compactor(kvstore_t *store) {
+  return store->engine == KVSTORE_FILES ||
+         (store->engine == KVSTORE_LOG && store->compact_ratio > 0);
+}
+
+/* Stops the compactor thread of STORE, interrupting any compaction in
+ * progress. */
+static void compactor_stop(kvstore_t *store) {
+  /* Set without the lock first, so that a compaction in progress stops. */
+  __atomic_store_n(&store->compact_stop, true, __ATOMIC_RELAXED);
+  pthread_mutex_lock(&store->compact_lock);
+  pthread_cond_signal(&store->compact_cond);
+  pthread_mutex_unlock(&store->compact_lock);
+  pthread_join(store->compactor, NULL);
+}
+
+/* Compacts the log of STORE at once, dropping all of the garbage within its
+ * sealed segments. For the KVSTORE_FILES engine, writes a new checkpoint of
+ * its index at once instead. Does nothing for the other engines. Returns 0 if
  * successful, else a negative error code. */
-int kvstore_init(kvstore_t *store, char *dirname) {
+int kvstore_compact(kvstore_t *store) {
+  int ret;
+  if (store->engine != KVSTORE_LOG && store->engine != KVSTORE_FILES)
+    return 0;
+  pthread_mutex_lock(&store->compact_lock);
+  if (store->engine == KVSTORE_FILES)
+    ret = files_checkpoint(store);
+  else
+    ret = log_compact(store, 0);
+  pthread_mutex_unlock(&store->compact_lock);
+  return ret;
+}
+
+/* Initializes kvstore STORE. Uses DIRNAME as the directory in which to store
+ * the entries of this store, creating the directory if necessary. OPTS selects
+ * the storage engine to use, or may be NULL to use the defaults. The
+ * KVSTORE_MEMORY engine uses no directory, and ignores DIRNAME, which may be
+ * NULL. Returns 0 if successful, else a negative error code, in which case
+ * whatever STORE had set up is released again. */
+int kvstore_init(kvstore_t *store, char *dirname, const kvstore_opts_t *opts) {
   struct stat st;
-  if (stat(dirname, &st) == -1) {
-    if (mkdir(dirname, 0700) == -1)
-      return errno;
+  kvstore_opts_t defaults;
+  int ret, i;
+  if (opts == NULL) {
+    kvstore_opts_default(&defaults);
+    opts = &defaults;
   }
-  strcpy(store->dirname, dirname);
+  store->engine = opts->engine;
+  if (store->engine == KVSTORE_MEMORY)
+    dirname = NULL;
+  else if (stat(dirname, &st) == -1 && mkdir(dirname, 0700) == -1)
+    return errno;
+  strcpy(store->dirname, dirname ? dirname : "");
+  store->compress_threshold = opts->compress_threshold;
+  memset(&store->compression, 0, sizeof(kvlz_stats_t));
+  store->corruptions = 0;
   pthread_rwlock_init(&store->lock, NULL);
+  store->locked_reads = opts->locked_reads;
+  for (i = 0; i < KVSTORE_LOCK_STRIPES; i++) {
+    pthread_rwlock_init(&store->stripes[i].lock, NULL);
+    store->stripes[i].seq = 0;
+  }
+  pthread_mutex_init(&store->blob_lock, NULL);
+  kvversions_init(&store->versions);
+  store->snapshots = NULL;
+  store->nsnapshots = 0;
+  store->seq = 0;
+  store->unlocked_writers = 0;
+  store->exclusive_writers = 0;
+  pthread_mutex_init(&store->version_lock, NULL);
+  store->compact_ratio = opts->compact_ratio;
+  store->compact_stop = false;
+  kvratelimit_init(&store->compact_limit, opts->compact_rate);
+  pthread_mutex_init(&store->compact_lock, NULL);
+  pthread_cond_init(&store->compact_cond, NULL);
+  if (store->engine == KVSTORE_LOG)
+    ret = kvlog_init(&store->log, dirname, opts->segment_size, opts->compress_threshold);
+  else if (store->engine == KVSTORE_LSM)
+    ret = kvlsm_init(&store->lsm, dirname, opts->memtable_size, opts->bloom_bits,
+                     opts->compress_threshold, opts->direct_io, opts->block_cache_size);
+  else if (store->engine == KVSTORE_MEMORY) {
+    kvmem_init(&store->mem, opts->memory_size, opts->eviction);
+    ret = 0;
+  } else {
+    for (i = 0; i < KVSTORE_URINGS; i++)
+      kvuring_init(&store->urings[i]);
+    kvsync_files_init(&store->dirty);
+    ret = index_load(store);
+  }
+  /* An engine which fails to start releases its own resources. */
+  if (ret < 0)
+    goto destroy_engine;
+  /* Without a directory, there are no large values. */
+  memset(&store->blobs, 0, sizeof(kvblob_t));
+  if (dirname != NULL && (ret = kvblob_init(&store->blobs, dirname)) < 0)
+    goto close_blobs;
+  blob_mark_all(store);
+  pthread_mutex_init(&store->ttl_lock, NULL);
+  if ((ret = kvttl_init(&store->ttl, dirname)) < 0)
+    goto close_ttl;
+  /* The KVSTORE_MEMORY engine is as fast as the read cache would be. */
+  kvcache_init(&store->cache, store->engine == KVSTORE_MEMORY ? 0 : opts->cache_size);
+  ret = ERR_FILACCESS;
+  if (has_compactor(store) &&
+      pthread_create(&store->compactor, NULL,
+                     store->engine == KVSTORE_FILES ? files_checkpointer : log_compactor,
+                     store) != 0)
+    goto destroy_cache;
+  if ((ret = kvsync_init(&store->sync, &opts->durability, store_sync, store)) < 0)
+    goto stop_compactor;
   return 0;
+
+  /* Undo the above in reverse order. */
+stop_compactor:
+  if (has_compactor(store))
+    compactor_stop(store);
+destroy_cache:
+  kvcache_destroy(&store->cache);
+close_ttl:
+  kvttl_close(&store->ttl);
+  pthread_mutex_destroy(&store->ttl_lock);
+close_blobs:
+  kvblob_close(&store->blobs);
+  if (store->engine == KVSTORE_LOG) {
+    kvlog_close(&store->log);
+  } else if (store->engine == KVSTORE_LSM) {
+    kvlsm_close(&store->lsm);
+  } else if (store->engine == KVSTORE_MEMORY) {
+    kvmem_destroy(&store->mem);
+  } else {
+    kvcheckpoint_close(&store->checkpoint, false);
+    index_free(store);
+  }
+destroy_engine:
+  if (store->engine == KVSTORE_FILES) {
+    for (i = 0; i < KVSTORE_URINGS; i++)
+      kvuring_destroy(&store->urings[i]);
+    kvsync_files_destroy(&store->dirty);
+  }
+  pthread_rwlock_destroy(&store->lock);
+  for (i = 0; i < KVSTORE_LOCK_STRIPES; i++)
+    pthread_rwlock_destroy(&store->stripes[i].lock);
+  pthread_mutex_destroy(&store->blob_lock);
+  kvversions_free(&store->versions);
+  pthread_mutex_destroy(&store->version_lock);
+  kvratelimit_destroy(&store->compact_limit);
+  pthread_mutex_destroy(&store->compact_lock);
+  pthread_cond_destroy(&store->compact_cond);
+  return ret;
 }
 
-/* Attempts to find an entry matching KEY within the store.
+/* Attempts to find an entry matching KEY, where HASHVAL is hash(KEY), within
+ * the KVSTORE_FILES store STORE.
  *
  * Returns a nonnegative integer representing the location of the entry within
  * its hash chain (so, the entry's filename is "hash(key)-returnval.entry").
@@ -31,56 +1043,109 @@ int kvstore_init(kvstore_t *store, char *dirname) {
  * Returns a negative error code if the entry is not found or an error
  * occurred.
  *
- * If VALUE is not NULL, the value of the entry will be placed into VALUE using
- * malloced memory which should be freed later. */
-int find_entry(kvstore_t *store, char *key, char *value) {
-  uint64_t hashval;
-  unsigned int counter = 0;
-  char currfile[MAX_FILENAME];
-  size_t keylen = strlen(key);
-  struct stat st;
-  FILE *file;
-  kventry_t header;
-  if (keylen > MAX_KEYLEN)
-    return ERR_KEYLEN;
-  if (stat(store->dirname, &st) == -1)
-    return ERR_FILACCESS;
-  hashval = strhash64(key);
-  pthread_rwlock_rdlock(&store->lock);
-  sprintf(currfile, "%s/%" PRIu64 "-%u%s", store->dirname, hashval, counter++, KVSTORE_FILETYPE);
-  while (stat(currfile, &st) != -1) {
-    if ((file = fopen(currfile, "r")) == NULL) {
-      pthread_rwlock_unlock(&store->lock);
-      return ERR_FILACCESS;
-    }
-    fread(&header, sizeof(kventry_t), 1, file);
-    char entry_data[header.length + 1];
-    fread(entry_data, sizeof(char), header.length, file);
-    fclose(file);
-    if (strcmp(key, entry_data) == 0) {
-      if (value != NULL)
-        strcpy(value, entry_data + strlen(entry_data) + 1);
-      pthread_rwlock_unlock(&store->lock);
-      return counter - 1;
-    }
-    sprintf(currfile, "%s/%" PRIu64 "-%u%s", store->dirname, hashval, counter++, KVSTORE_FILETYPE);
+ * The location is resolved using the in-memory index, so no file is accessed
+ * unless VALUE is not NULL, in which case the value of the entry is read from
+ * its file into VALUE. */
+int find_entry(kvstore_t *store, uint64_t hashval, char *key, char *value) {
+  kvstore_stripe_t *stripe;
+  uint64_t seq;
+  int chainpos, tries;
+  stripe = &store->stripes[hashval % KVSTORE_LOCK_STRIPES];
+  /* Read without locking unless a writer of the stripe is busy, retrying if
+   * one got in the way. */
+  for (tries = store->locked_reads ? KVSTORE_READ_RETRIES : 0; tries < KVSTORE_READ_RETRIES;
+       tries++) {
+    seq = __atomic_load_n(&stripe->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1)
+      break;
+    chainpos = entry_find(store, hashval, key, value);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&stripe->seq, __ATOMIC_RELAXED) == seq)
+      return entry_counted(store, chainpos);
   }
-  pthread_rwlock_unlock(&store->lock);
-  return ERR_NOKEY;
+  pthread_rwlock_rdlock(&stripe->lock);
+  chainpos = entry_find(store, hashval, key, value);
+  pthread_rwlock_unlock(&stripe->lock);
+  return entry_counted(store, chainpos);
+}
+
+/* Returns true if STORE contains KEY, where HASHVAL is hash(KEY), else
+ * false. */
+static bool store_haskey(kvstore_t *store, uint64_t hashval, char *key) {
+  bool ret;
+  if (key_expired(store, key, kvttl_now()))
+    return false;
+  if (blob_exists(store, hashval, key))
+    return true;
+  if (store->engine == KVSTORE_LOG) {
+    pthread_rwlock_rdlock(&store->lock);
+    ret = kvlog_haskey(&store->log, key);
+    pthread_rwlock_unlock(&store->lock);
+    return ret;
+  } else if (store->engine == KVSTORE_LSM) {
+    return strlen(key) <= MAX_KEYLEN && kvlsm_haskey(&store->lsm, key);
+  } else if (store->engine == KVSTORE_MEMORY) {
+    return kvmem_haskey(&store->mem, hashval, key);
+  }
+  return strlen(key) <= MAX_KEYLEN && find_entry(store, hashval, key, NULL) >= 0;
 }
 
 /* Returns true if STORE contains KEY, else false. */
-bool kvstore_haskey(kvstore_t *store, char *key) { return find_entry(store, key, NULL) >= 0; }
+bool kvstore_haskey(kvstore_t *store, char *key) {
+  return store_haskey(store, key_hash(store, key), key);
+}
+
+/* Like kvstore_haskey, given DIGEST, strhash64(KEY). */
+bool kvstore_haskey_hashed(kvstore_t *store, char *key, uint64_t digest) {
+  return store_haskey(store, key_hash_digest(store, key, digest), key);
+}
+
+/* Reads the value of KEY, where HASHVAL is hash(KEY), from STORE into VALUE,
+ * as kvstore_get describes. Returns 0 if successful, else a negative error
+ * code. */
+static int store_get(kvstore_t *store, uint64_t hashval, char *key, char *value) {
+  uint64_t ticket;
+  int ret;
+  if (strlen(key) > MAX_KEYLEN)
+    return ERR_KEYLEN;
+  if (key_expired(store, key, kvttl_now()))
+    return ERR_NOKEY;
+  if (kvcache_get(&store->cache, hashval, key, value))
+    return 0;
+  ticket = kvcache_begin(&store->cache, hashval);
+  if (blob_exists(store, hashval, key))
+    return ERR_VALLEN;
+  if (store->engine == KVSTORE_LOG) {
+    pthread_rwlock_rdlock(&store->lock);
+    ret = kvlog_get(&store->log, key, value);
+    pthread_rwlock_unlock(&store->lock);
+  } else if (store->engine == KVSTORE_LSM) {
+    ret = kvlsm_get(&store->lsm, key, value);
+  } else if (store->engine == KVSTORE_MEMORY) {
+    ret = kvmem_get(&store->mem, hashval, key, value);
+  } else {
+    ret = find_entry(store, hashval, key, value);
+  }
+  if (ret < 0)
+    return ret;
+  kvcache_insert(&store->cache, hashval, key, value, ticket);
+  return 0;
+}
 
 /* Attempts to retrieve the entry denoted by KEY from STORE.
  * Returns 0 if successful, else a negative error code. The entry's value will
- * be placed into VALUE using malloc()d memory which should be free()d later. */
+ * be placed into VALUE using malloc()d memory which should be free()d later.
+ * Values are served from the read cache of STORE whenever possible, and cached
+ * after being read from the storage engine otherwise. Large values cannot be
+ * retrieved this way (ERR_VALLEN); see kvstore_get_stream_open. A key which
+ * has expired is absent (ERR_NOKEY), even before it is removed. */
 int kvstore_get(kvstore_t *store, char *key, char *value) {
-  int ret = find_entry(store, key, value);
-  if (ret < 0)
-    return ret;
-  else
-    return 0;
+  return store_get(store, key_hash(store, key), key, value);
+}
+
+/* Like kvstore_get, given DIGEST, strhash64(KEY). */
+int kvstore_get_hashed(kvstore_t *store, char *key, uint64_t digest, char *value) {
+  return store_get(store, key_hash_digest(store, key, digest), key, value);
 }
 
 /* Checks if STORE can successfully add the given KEY, VALUE pair.
@@ -91,108 +1156,1150 @@ int kvstore_put_check(kvstore_t *store, char *key, char *value) {
     return ERR_KEYLEN;
   if (strlen(value) > MAX_VALLEN)
     return ERR_VALLEN;
-  if (stat(store->dirname, &st) == -1)
+  if (store->engine != KVSTORE_MEMORY && stat(store->dirname, &st) == -1)
     return ERR_FILACCESS;
   return 0;
 }
 
-/* Adds the given KEY, VALUE entry to STORE. Returns 0 if successful, else a
- * negative error code. See tpcfollower.h for a complete description of how
- * entries are stored. */
-int kvstore_put(kvstore_t *store, char *key, char *value) {
-  uint64_t hashval;
-  int counter, check;
-  size_t keylen = strlen(key), vallen = strlen(value);
+/* Writes the entry KEY, VALUE, where HASHVAL is hash(KEY), into its file
+ * within the KVSTORE_FILES store STORE. With KVSYNC_ALWAYS, the file is synced
+ * before returning, unless the write is part of a write batch (BATCHED), which
+ * syncs once for all of its writes; those and the writes of KVSYNC_GROUP keep
+ * the file open in DIRTY for that sync. The caller must hold the stripe of
+ * HASHVAL for writing. Returns 0 if successful, else a negative error code. */
+static int files_put(kvstore_t *store, uint64_t hashval, char *key, char *value, bool batched) {
+  bool always = !batched && store->sync.opts.mode == KVSYNC_ALWAYS, created = false;
+  bool tracked = batched || store->sync.opts.mode == KVSYNC_GROUP;
+  int chainpos, fd, ret = 0;
   char filename[MAX_FILENAME];
-  struct stat st;
+  char buf[KVENTRY_MAX_SIZE];
+  kventry_t *entry = (kventry_t *)buf;
+  size_t size;
   FILE *file;
-  kventry_t *entry;
-  if ((check = kvstore_put_check(store, key, value)) < 0)
-    return check;
-  hashval = strhash64(key);
-  counter = find_entry(store, key, NULL);
-  pthread_rwlock_wrlock(&store->lock);
-  if (counter >= 0) {
-    /* Entry already exists, just update it. */
-    sprintf(filename, "%s/%" PRIu64 "-%u%s", store->dirname, hashval, counter, KVSTORE_FILETYPE);
+  /* Update the entry if it already exists, else append it to its chain. */
+  if ((chainpos = index_lookup(store, hashval, key)) < 0) {
+    chainpos = kvindex_length(&store->index, hashval);
+    created = true;
+  }
+  /* A crash while the file is rewritten may leave it torn, so it is read
+   * again whether or not the key is new. */
+  if (kvcheckpoint_log(&store->checkpoint, hashval) < 0)
+    return ERR_FILACCESS;
+  entry_filename(store, hashval, chainpos, filename);
+  size = kventry_encode(entry, key, value, store->compress_threshold, &store->compression);
+  stripe_advance(store, hashval);
+  if ((file = fopen(filename, "w")) != NULL) {
+    if (fwrite(entry, size, 1, file) != 1 ||
+        (always && (fflush(file) != 0 || fdatasync(fileno(file)) < 0)))
+      ret = ERR_FILACCESS;
+    fd = -1;
+    if (ret == 0 && tracked && (fflush(file) != 0 || (fd = dup(fileno(file))) < 0))
+      ret = ERR_FILACCESS;
+    if (fclose(file) != 0)
+      ret = ERR_FILACCESS;
+    if (fd >= 0 && ret == 0)
+      kvsync_files_add(&store->dirty, fd, created);
+    else if (fd >= 0)
+      close(fd);
+    /* The index only learns of entries written in full. A new entry which was
+     * not is removed, so that it does not join its chain upon the next scan. */
+    if (ret == 0)
+      index_set(store, hashval, chainpos, key);
+    else if (created)
+      remove(filename);
+    if (always && created && ret == 0)
+      ret = files_sync_dir(store);
   } else {
-    /* Search for the end of the hash chain to insert. */
-    counter = 0;
-    sprintf(filename, "%s/%" PRIu64 "-%u%s", store->dirname, hashval, counter++, KVSTORE_FILETYPE);
-    while (stat(filename, &st) != -1)
-      sprintf(filename, "%s/%" PRIu64 "-%u%s", store->dirname, hashval, counter++,
-              KVSTORE_FILETYPE);
-  }
-  if ((file = fopen(filename, "w")) == NULL) {
-    pthread_rwlock_unlock(&store->lock);
+    ret = ERR_FILACCESS;
+  }
+  stripe_advance(store, hashval);
+  return ret;
+}
+
+/* Removes the file of KEY, where HASHVAL is hash(KEY), from the KVSTORE_FILES
+ * store STORE, reconnecting its hash chain. It is synced as by files_put. The
+ * caller must hold the stripe of HASHVAL for writing. Returns 0 if successful,
+ * else a negative error code. */
+static int files_del(kvstore_t *store, uint64_t hashval, char *key, bool batched) {
+  char delfile[MAX_FILENAME];
+  int chainpos, last, ret = 0;
+  char currfile[MAX_FILENAME];
+  if ((chainpos = index_lookup(store, hashval, key)) < 0)
+    return chainpos;
+  last = kvindex_length(&store->index, hashval) - 1;
+  if (kvcheckpoint_log(&store->checkpoint, hashval) < 0)
     return ERR_FILACCESS;
+  entry_filename(store, hashval, chainpos, delfile);
+  stripe_advance(store, hashval);
+  if (last == chainpos) {
+    /* There were no elements in the chain after the element to be deleted. */
+    if (remove(delfile) == -1)
+      ret = errno;
+  } else {
+    /* There were elements in the chain after the element to be deleted.
+       Take the last element in the chain and swap it into the deletion
+       location. */
+    entry_filename(store, hashval, last, currfile);
+    if (rename(currfile, delfile) == -1)
+      ret = errno;
   }
-  entry = malloc(sizeof(kventry_t) + keylen + vallen + 2);
-  if (!entry)
-    fatal_malloc();
-  entry->length = keylen + vallen + 2;
-  strcpy(entry->data, key);
-  strcpy(entry->data + keylen + 1, value);
-  fwrite(entry, sizeof(kventry_t) + entry->length, 1, file);
-  fclose(file);
-  pthread_rwlock_unlock(&store->lock);
-  free(entry);
-  return 0;
+  if (ret == 0)
+    index_remove(store, hashval, chainpos, key);
+  stripe_advance(store, hashval);
+  if (ret == 0 && !batched && store->sync.opts.mode == KVSYNC_ALWAYS)
+    ret = files_sync_dir(store);
+  else if (ret == 0 && (batched || store->sync.opts.mode == KVSYNC_GROUP))
+    kvsync_files_dir(&store->dirty);
+  return ret;
+}
+
+/* Writes the entry KEY, VALUE, where HASHVAL is hash(KEY), into the storage
+ * engine of STORE. The caller must hold the key lock of KEY for writing, unless
+ * the engine is KVSTORE_LSM. Returns 0 if successful, else a negative error
+ * code. */
+static int engine_put(kvstore_t *store, uint64_t hashval, char *key, char *value) {
+  if (store->engine == KVSTORE_LSM)
+    return kvlsm_put(&store->lsm, key, value);
+  else if (store->engine == KVSTORE_LOG)
+    return kvlog_put(&store->log, key, value);
+  else if (store->engine == KVSTORE_MEMORY)
+    return kvmem_put(&store->mem, hashval, key, value);
+  return files_put(store, hashval, key, value, false);
+}
+
+/* Removes KEY, where HASHVAL is hash(KEY), from the storage engine of STORE.
+ * The caller must hold the key lock of KEY for writing, unless the engine is
+ * KVSTORE_LSM. Returns 0 if successful, else a negative error code. */
+static int engine_del(kvstore_t *store, uint64_t hashval, char *key) {
+  if (store->engine == KVSTORE_LSM)
+    return kvlsm_del(&store->lsm, key);
+  else if (store->engine == KVSTORE_LOG)
+    return kvlog_del(&store->log, key);
+  else if (store->engine == KVSTORE_MEMORY)
+    return kvmem_del(&store->mem, hashval, key);
+  return files_del(store, hashval, key, false);
+}
+
+/* Adds the entry KEY, VALUE, where HASHVAL is hash(KEY), to STORE. Returns 0
+ * if successful, else a negative error code. */
+static int store_put(kvstore_t *store, uint64_t hashval, char *key, char *value) {
+  bool locked;
+  int ret;
+  if ((ret = kvstore_put_check(store, key, value)) < 0)
+    return ret;
+  locked = store->engine != KVSTORE_LSM || lsm_write_locked(store);
+  if (locked) {
+    pthread_rwlock_wrlock(key_lock(store, hashval));
+    version_preserve(store, hashval, key, version_begin(store));
+  }
+  ret = engine_put(store, hashval, key, value);
+  /* A small value replaces any large value of KEY. */
+  if (locked && ret == 0)
+    blob_remove(store, hashval, key);
+  if (ret == 0)
+    ret = ttl_clear(store, key, false);
+  if (locked)
+    pthread_rwlock_unlock(key_lock(store, hashval));
+  else
+    lsm_write_done(store);
+  if (ret >= 0) {
+    kvcache_invalidate(&store->cache, hashval);
+    ret = store_commit(store);
+  }
+  return ret;
+}
+
+/* Adds the given KEY, VALUE entry to STORE. Returns 0 if successful, else a
+ * negative error code. See tpcfollower.h for a complete description of how
+ * entries are stored. */
+int kvstore_put(kvstore_t *store, char *key, char *value) {
+  return store_put(store, key_hash(store, key), key, value);
+}
+
+/* Like kvstore_put, given DIGEST, strhash64(KEY). */
+int kvstore_put_hashed(kvstore_t *store, char *key, uint64_t digest, char *value) {
+  return store_put(store, key_hash_digest(store, key, digest), key, value);
 }
 
 /* Checks if STORE can successfully remove the given KEY.
- * Returns 0 if it can, else a negative error code indicating why it cannot. */
+ * Returns 0 if it can, else a negative error code indicating why it cannot.
+ * This is answered from memory, without accessing the file system. */
 int kvstore_del_check(kvstore_t *store, char *key) {
-  struct stat st;
   if (strlen(key) > MAX_KEYLEN)
     return ERR_KEYLEN;
-  if (stat(store->dirname, &st) == -1)
-    return ERR_FILACCESS;
   if (!kvstore_haskey(store, key))
     return ERR_NOKEY;
   return 0;
 }
 
+/* Like kvstore_del_check, given DIGEST, strhash64(KEY). */
+int kvstore_del_check_hashed(kvstore_t *store, char *key, uint64_t digest) {
+  if (strlen(key) > MAX_KEYLEN)
+    return ERR_KEYLEN;
+  if (!kvstore_haskey_hashed(store, key, digest))
+    return ERR_NOKEY;
+  return 0;
+}
+
+/* Removes KEY, where HASHVAL is hash(KEY), from STORE. Returns 0 if
+ * successful, else a negative error code. */
+static int store_del(kvstore_t *store, uint64_t hashval, char *key) {
+  bool locked;
+  int ret;
+  if (strlen(key) > MAX_KEYLEN)
+    return ERR_KEYLEN;
+  locked = store->engine != KVSTORE_LSM || lsm_write_locked(store);
+  if (locked) {
+    pthread_rwlock_wrlock(key_lock(store, hashval));
+    version_preserve(store, hashval, key, version_begin(store));
+  }
+  ret = engine_del(store, hashval, key);
+  if (locked && blob_remove(store, hashval, key) && ret == ERR_NOKEY)
+    ret = 0;
+  if (ret == 0 || ret == ERR_NOKEY)
+    ret = ttl_clear(store, key, false) < 0 ? ERR_FILACCESS : ret;
+  if (locked)
+    pthread_rwlock_unlock(key_lock(store, hashval));
+  else
+    lsm_write_done(store);
+  if (ret >= 0) {
+    kvcache_invalidate(&store->cache, hashval);
+    ret = store_commit(store);
+  }
+  return ret;
+}
+
 /* Removes the given KEY entry from STORE. Returns 0 if successful, else a
  * negative error code. Any hash chains which are disrupted by the deletion of
  * KEY will be reconnected within this function. */
 int kvstore_del(kvstore_t *store, char *key) {
-  char delfile[MAX_FILENAME];
-  int chainpos;
-  uint64_t hashval;
-  unsigned int counter;
-  char currfile[MAX_FILENAME];
-  struct stat st;
-  chainpos = find_entry(store, key, NULL);
-  if (chainpos < 0)
-    return chainpos;
-  counter = chainpos;
-  hashval = strhash64(key);
-  pthread_rwlock_wrlock(&store->lock);
-  sprintf(delfile, "%s/%" PRIu64 "-%u%s", store->dirname, hashval, chainpos, KVSTORE_FILETYPE);
-  sprintf(currfile, "%s/%" PRIu64 "-%u%s", store->dirname, hashval, ++counter, KVSTORE_FILETYPE);
-  while (stat(currfile, &st) != -1) {
-    sprintf(currfile, "%s/%" PRIu64 "-%u%s", store->dirname, hashval, ++counter, KVSTORE_FILETYPE);
+  return store_del(store, key_hash(store, key), key);
+}
+
+/* Like kvstore_del, given DIGEST, strhash64(KEY). */
+int kvstore_del_hashed(kvstore_t *store, char *key, uint64_t digest) {
+  return store_del(store, key_hash_digest(store, key, digest), key);
+}
+
+/* Writes VALUE to KEY, where HASHVAL is hash(KEY), within STORE if the current
+ * value of KEY is EXPECTED, or if KEY is absent (or expired) when EXPECTED is
+ * NULL, as one step under the key lock of KEY, making it an exclusive write.
+ * Returns 0 if successful, else a negative error code. */
+static int conditional_put(kvstore_t *store, uint64_t hashval, char *key, const char *expected,
+                           char *value) {
+  char current[MAX_VALLEN + 1];
+  kvversion_state_t state, live;
+  int ret;
+  if ((ret = kvstore_put_check(store, key, value)) < 0)
+    return ret;
+  if (expected != NULL && strlen(expected) > MAX_VALLEN)
+    return ERR_VALLEN;
+  exclusive_begin(store);
+  pthread_rwlock_wrlock(key_lock(store, hashval));
+  state = version_read(store, hashval, key, current);
+  live = key_expired(store, key, kvttl_now()) ? KVVERSION_ABSENT : state;
+  if (expected == NULL && live != KVVERSION_ABSENT)
+    ret = ERR_KEYEXISTS;
+  else if (expected != NULL && live == KVVERSION_ABSENT)
+    ret = ERR_NOKEY;
+  else if (expected != NULL && live == KVVERSION_LARGE)
+    ret = ERR_VALLEN;
+  else if (expected != NULL && strcmp(current, expected) != 0)
+    ret = ERR_MISMATCH;
+  if (ret == 0) {
+    /* The version replaced is the one just read, so it need not be read
+     * again, and it cannot be a large value. */
+    version_record(store, key, version_begin(store), state, current);
+    ret = engine_put(store, hashval, key, value);
   }
-  if (counter == chainpos + 1) {
-    /* There were no elements in the chain after the element to be deleted. */
-    if (remove(delfile) == -1) {
+  if (ret == 0)
+    ret = ttl_clear(store, key, false);
+  pthread_rwlock_unlock(key_lock(store, hashval));
+  exclusive_end(store);
+  if (ret >= 0) {
+    kvcache_invalidate(&store->cache, hashval);
+    ret = store_commit(store);
+  }
+  return ret;
+}
+
+/* Replaces the value of KEY within STORE with VALUE, only if its current value
+ * is EXPECTED (compare-and-set). The comparison and the write are made under
+ * the key lock of KEY, so no other write of KEY comes between them. Returns 0
+ * if successful, ERR_MISMATCH if the value of KEY is not EXPECTED, ERR_NOKEY
+ * if KEY is absent, or another negative error code. */
+int kvstore_cas(kvstore_t *store, char *key, char *expected, char *value) {
+  return conditional_put(store, key_hash(store, key), key, expected, value);
+}
+
+/* Like kvstore_cas, given DIGEST, strhash64(KEY). */
+int kvstore_cas_hashed(kvstore_t *store, char *key, uint64_t digest, char *expected,
+                       char *value) {
+  return conditional_put(store, key_hash_digest(store, key, digest), key, expected, value);
+}
+
+/* Adds the given KEY, VALUE entry to STORE, only if KEY is absent. Returns 0 if
+ * successful, ERR_KEYEXISTS if KEY is present (with a small or large value),
+ * or another negative error code. */
+int kvstore_put_if_absent(kvstore_t *store, char *key, char *value) {
+  return conditional_put(store, key_hash(store, key), key, NULL, value);
+}
+
+/* Like kvstore_put_if_absent, given DIGEST, strhash64(KEY). */
+int kvstore_put_if_absent_hashed(kvstore_t *store, char *key, uint64_t digest, char *value) {
+  return conditional_put(store, key_hash_digest(store, key, digest), key, NULL, value);
+}
+
+/* Adds the entry KEY, VALUE, where HASHVAL is hash(KEY), to STORE to expire
+ * TTL seconds from now, as kvstore_put_ttl describes. Returns 0 if successful,
+ * else a negative error code. */
+static int store_put_ttl(kvstore_t *store, uint64_t hashval, char *key, char *value,
+                         uint64_t ttl) {
+  bool always = store->sync.opts.mode == KVSYNC_ALWAYS;
+  uint64_t now, expires, previous;
+  int ret;
+  if (ttl == 0)
+    return store_put(store, hashval, key, value);
+  if ((ret = kvstore_put_check(store, key, value)) < 0)
+    return ret;
+  now = kvttl_now();
+  expires = ttl > UINT64_MAX - now ? UINT64_MAX : now + ttl;
+  exclusive_begin(store);
+  pthread_rwlock_wrlock(key_lock(store, hashval));
+  version_preserve(store, hashval, key, version_begin(store));
+  pthread_mutex_lock(&store->ttl_lock);
+  previous = kvttl_get(&store->ttl, key);
+  ret = kvttl_set(&store->ttl, key, expires, always);
+  pthread_mutex_unlock(&store->ttl_lock);
+  if (ret == 0 && (ret = engine_put(store, hashval, key, value)) < 0) {
+    /* The value was not written, so neither is its expiry time. */
+    pthread_mutex_lock(&store->ttl_lock);
+    if (previous != 0)
+      kvttl_set(&store->ttl, key, previous, always);
+    else
+      kvttl_clear(&store->ttl, key, always);
+    pthread_mutex_unlock(&store->ttl_lock);
+  }
+  if (ret == 0)
+    blob_remove(store, hashval, key);
+  pthread_rwlock_unlock(key_lock(store, hashval));
+  exclusive_end(store);
+  if (ret >= 0) {
+    kvcache_invalidate(&store->cache, hashval);
+    ret = store_commit(store);
+  }
+  return ret;
+}
+
+/* Adds the given KEY, VALUE entry to STORE to expire TTL seconds from now,
+ * after which KEY is absent. Writing KEY again with a time to live replaces
+ * its expiry time; writing it without one clears it. A TTL of 0 writes KEY
+ * without a time to live. The expiry time is recorded before the value, so
+ * that a crash in between may expire the previous value of KEY early, but
+ * never leaves the new value without its expiry time. Returns 0 if
+ * successful, else a negative error code. */
+int kvstore_put_ttl(kvstore_t *store, char *key, char *value, uint64_t ttl) {
+  return store_put_ttl(store, key_hash(store, key), key, value, ttl);
+}
+
+/* Like kvstore_put_ttl, given DIGEST, strhash64(KEY). */
+int kvstore_put_ttl_hashed(kvstore_t *store, char *key, uint64_t digest, char *value,
+                           uint64_t ttl) {
+  return store_put_ttl(store, key_hash_digest(store, key, digest), key, value, ttl);
+}
+
+/* Removes the keys of STORE which have expired and were not removed yet, as
+ * deletes do, each as an exclusive write. Keys which were written again since
+ * they expired are left alone. A key which cannot be removed stays absent to
+ * readers, but is only tried again once STORE is reopened. Returns the number
+ * of keys removed if successful, else a negative error code. */
+int kvstore_expire(kvstore_t *store) {
+  uint64_t hashval, now = kvttl_now();
+  unsigned int count, i;
+  int ret = 0, removed = 0;
+  char **keys;
+  if (!has_ttls(store))
+    return 0;
+  pthread_mutex_lock(&store->ttl_lock);
+  count = kvttl_due(&store->ttl, now, &keys);
+  pthread_mutex_unlock(&store->ttl_lock);
+  if (count == 0)
+    return 0;
+  exclusive_begin(store);
+  for (i = 0; i < count; i++) {
+    hashval = key_hash(store, keys[i]);
+    pthread_rwlock_wrlock(key_lock(store, hashval));
+    if (ret == 0 && key_expired(store, keys[i], now)) {
+      version_preserve(store, hashval, keys[i], version_begin(store));
+      ret = engine_del(store, hashval, keys[i]);
+      if (blob_remove(store, hashval, keys[i]) || ret == ERR_NOKEY)
+        ret = 0;
+      if (ret == 0 && (ret = ttl_clear(store, keys[i], false)) == 0)
+        removed++;
+      kvcache_invalidate(&store->cache, hashval);
+    }
+    pthread_rwlock_unlock(key_lock(store, hashval));
+    free(keys[i]);
+  }
+  free(keys);
+  exclusive_end(store);
+  if (ret == 0)
+    ret = store_commit(store);
+  return ret < 0 ? ret : removed;
+}
+
+/* Initializes an empty write batch BATCH. */
+void kvstore_batch_init(kvstore_batch_t *batch) {
+  batch->ops = NULL;
+  batch->count = 0;
+  batch->capacity = 0;
+}
+
+/* Appends an operation of the given TYPE on KEY and VALUE to BATCH, copying
+ * both strings. */
+static void batch_append(kvstore_batch_t *batch, msgtype_t type, char *key, char *value) {
+  kvstore_batch_op_t *op;
+  if (batch->count == batch->capacity) {
+    batch->capacity = batch->capacity ? batch->capacity * 2 : 16;
+    batch->ops = realloc(batch->ops, batch->capacity * sizeof(kvstore_batch_op_t));
+    if (!batch->ops)
+      fatal_malloc();
+  }
+  op = &batch->ops[batch->count++];
+  op->type = type;
+  op->key = strdup(key);
+  op->value = value ? strdup(value) : NULL;
+  if (!op->key || (value && !op->value))
+    fatal_malloc();
+}
+
+/* Adds storing the given KEY, VALUE entry to BATCH. Returns 0 if successful,
+ * else a negative error code, in which case BATCH is left unchanged. */
+int kvstore_batch_put(kvstore_batch_t *batch, char *key, char *value) {
+  if (strlen(key) > MAX_KEYLEN)
+    return ERR_KEYLEN;
+  if (strlen(value) > MAX_VALLEN)
+    return ERR_VALLEN;
+  batch_append(batch, PUTREQ, key, value);
+  return 0;
+}
+
+/* Adds removing the given KEY to BATCH. Returns 0 if successful, else a
+ * negative error code, in which case BATCH is left unchanged. */
+int kvstore_batch_del(kvstore_batch_t *batch, char *key) {
+  if (strlen(key) > MAX_KEYLEN)
+    return ERR_KEYLEN;
+  batch_append(batch, DELREQ, key, NULL);
+  return 0;
+}
+
+/* Removes all operations from BATCH, which may then be reused. */
+void kvstore_batch_clear(kvstore_batch_t *batch) {
+  unsigned int i;
+  for (i = 0; i < batch->count; i++) {
+    free(batch->ops[i].key);
+    free(batch->ops[i].value);
+  }
+  batch->count = 0;
+}
+
+/* Frees all memory held by BATCH. */
+void kvstore_batch_free(kvstore_batch_t *batch) {
+  kvstore_batch_clear(batch);
+  free(batch->ops);
+  batch->ops = NULL;
+  batch->capacity = 0;
+}
+
+/* Locks (if LOCK is true) or unlocks the key locks of all keys of BATCH within
+ * STORE for writing, where HASHES holds the hash of each key. Each lock is
+ * taken once, in a fixed order, so that concurrent batches cannot deadlock. */
+static void batch_lock(kvstore_t *store, kvstore_batch_t *batch, uint64_t *hashes, bool lock) {
+  bool used[KVSTORE_LOCK_STRIPES];
+  kvstore_stripe_t *stripe;
+  unsigned int i;
+  if (store->engine == KVSTORE_LOG) {
+    if (lock)
+      pthread_rwlock_wrlock(&store->lock);
+    else
       pthread_rwlock_unlock(&store->lock);
-      return errno;
+    return;
+  }
+  memset(used, 0, sizeof(used));
+  for (i = 0; i < batch->count; i++)
+    used[hashes[i] % KVSTORE_LOCK_STRIPES] = true;
+  for (i = 0; i < KVSTORE_LOCK_STRIPES; i++) {
+    stripe = &store->stripes[lock ? i : KVSTORE_LOCK_STRIPES - 1 - i];
+    if (!used[stripe - store->stripes])
+      continue;
+    if (lock)
+      pthread_rwlock_wrlock(&stripe->lock);
+    else
+      pthread_rwlock_unlock(&stripe->lock);
+  }
+}
+
+/* Records the current versions of all keys of BATCH within STORE, which the
+ * batch is about to replace as a single write, for the open snapshots. HASHES
+ * holds the hash of each key. The caller must hold the key locks of all keys
+ * of BATCH for writing. */
+static void batch_preserve(kvstore_t *store, kvstore_batch_t *batch, uint64_t *hashes) {
+  uint64_t seq = version_begin(store);
+  unsigned int i;
+  for (i = 0; seq != 0 && i < batch->count; i++)
+    version_preserve(store, hashes[i], batch->ops[i].key, seq);
+}
+
+/* Applies all operations of BATCH to STORE, in order, holding the key locks
+ * of all of its keys at once, and then makes them as durable as a single
+ * write, with at most one sync. Removing a key which is not present is not an error. Returns 0 if
+ * successful, else a negative error code; operations preceding the one which
+ * failed may have been applied. BATCH is left unchanged. */
+int kvstore_write_batch(kvstore_t *store, kvstore_batch_t *batch) {
+  /* With KVSYNC_NONE, the files of the batch are neither synced nor tracked. */
+  bool synced = store->sync.opts.mode != KVSYNC_NONE;
+  kvstore_batch_op_t *op;
+  char **keys, **values;
+  uint64_t *hashes;
+  unsigned int i;
+  bool locked;
+  int ret = 0;
+  if (batch->count == 0)
+    return 0;
+  keys = malloc(batch->count * sizeof(char *));
+  hashes = malloc(batch->count * sizeof(uint64_t));
+  if (!keys || !hashes)
+    fatal_malloc();
+  for (i = 0; i < batch->count; i++)
+    keys[i] = batch->ops[i].key;
+  key_hash_batch(store, keys, batch->count, hashes);
+  if (store->engine == KVSTORE_LSM) {
+    values = malloc(batch->count * sizeof(char *));
+    if (!values)
+      fatal_malloc();
+    for (i = 0; i < batch->count; i++)
+      values[i] = batch->ops[i].type == PUTREQ ? batch->ops[i].value : NULL;
+    if ((locked = lsm_write_locked(store))) {
+      batch_lock(store, batch, hashes, true);
+      batch_preserve(store, batch, hashes);
+    }
+    ret = kvlsm_write_batch(&store->lsm, batch->count, keys, values);
+    for (i = 0; locked && ret == 0 && i < batch->count; i++)
+      blob_remove(store, hashes[i], batch->ops[i].key);
+    for (i = 0; ret == 0 && i < batch->count; i++)
+      ret = ttl_clear(store, batch->ops[i].key, true);
+    if (locked)
+      batch_lock(store, batch, hashes, false);
+    else
+      lsm_write_done(store);
+    free(values);
+    for (i = 0; i < batch->count; i++)
+      kvcache_invalidate(&store->cache, hashes[i]);
+    free(keys);
+    free(hashes);
+    /* The batch is as durable as a single write: it is synced once, or shares
+     * the sync of concurrent writes with KVSYNC_GROUP. */
+    return ret == 0 ? store_commit(store) : ret;
+  }
+  batch_lock(store, batch, hashes, true);
+  batch_preserve(store, batch, hashes);
+  for (i = 0; i < batch->count && ret == 0; i++) {
+    op = &batch->ops[i];
+    if (store->engine == KVSTORE_LOG && op->type == PUTREQ)
+      ret = kvlog_put(&store->log, op->key, op->value);
+    else if (store->engine == KVSTORE_LOG)
+      ret = kvlog_del(&store->log, op->key);
+    else if (store->engine == KVSTORE_MEMORY && op->type == PUTREQ)
+      ret = kvmem_put(&store->mem, hashes[i], op->key, op->value);
+    else if (store->engine == KVSTORE_MEMORY)
+      ret = kvmem_del(&store->mem, hashes[i], op->key);
+    else if (op->type == PUTREQ)
+      ret = files_put(store, hashes[i], op->key, op->value, synced);
+    else
+      ret = files_del(store, hashes[i], op->key, synced);
+    if (ret == ERR_NOKEY)
+      ret = 0;
+    if (ret == 0)
+      blob_remove(store, hashes[i], op->key);
+    if (ret == 0)
+      ret = ttl_clear(store, op->key, true);
+    kvcache_invalidate(&store->cache, hashes[i]);
+  }
+  free(keys);
+  /* The batch is synced once its locks are released, so that it does not hold
+   * up the readers and writers of its keys meanwhile; it only completes once
+   * synced, though. With KVSYNC_GROUP, it shares the sync of concurrent
+   * writes, while with KVSYNC_NONE, and for the KVSTORE_MEMORY engine, there
+   * is nothing to sync. */
+  batch_lock(store, batch, hashes, false);
+  free(hashes);
+  if (store->sync.opts.mode != KVSYNC_ALWAYS || store->engine == KVSTORE_MEMORY)
+    return ret == 0 ? store_commit(store) : ret;
+  if (store->engine == KVSTORE_LOG) {
+    pthread_rwlock_rdlock(&store->lock);
+    if (kvlog_sync(&store->log) < 0 && ret == 0)
+      ret = ERR_FILACCESS;
+    pthread_rwlock_unlock(&store->lock);
+  } else if (files_sync(store) < 0 && ret == 0) {
+    ret = ERR_FILACCESS;
+  }
+  if (ttl_sync(store) < 0 && ret == 0)
+    ret = ERR_FILACCESS;
+  return ret;
+}
+
+/* Starts storing a large value of SIZE bytes (which may exceed MAX_VALLEN)
+ * under KEY in STORE with W. The value must then be passed in chunks to
+ * kvstore_put_stream_write, and the put completed with kvstore_put_stream_end
+ * or dropped with kvstore_put_stream_abort. The store is not locked in the
+ * meantime. The KVSTORE_MEMORY engine stores no large values (ERR_VALLEN).
+ * Returns 0 if successful, else a negative error code. */
+int kvstore_put_stream_begin(kvstore_t *store, char *key, uint64_t size, kvblob_writer_t *w) {
+  if (store->engine == KVSTORE_MEMORY)
+    return ERR_VALLEN;
+  return kvblob_begin(&store->blobs, w, key, size);
+}
+
+/* Appends the next LEN bytes of DATA to the large value being stored with W.
+ * Returns 0 if successful, else a negative error code. */
+int kvstore_put_stream_write(kvstore_t *store, kvblob_writer_t *w, char *data, size_t len) {
+  return kvblob_write(w, data, len);
+}
+
+/* Syncs the large value written with W to disk, once all of it has been
+ * written, without yet making it the value of its key, so that it can be
+ * staged until kvstore_put_stream_end or kvstore_put_stream_abort. Returns 0 if
+ * successful, else a negative error code. */
+int kvstore_put_stream_finish(kvstore_t *store, kvblob_writer_t *w) { return kvblob_finish(w); }
+
+/* Completes storing the large value written with W, once all of it has been
+ * written, replacing any previous value of its key. Returns 0 if successful,
+ * else a negative error code; either way, W is released. */
+int kvstore_put_stream_end(kvstore_t *store, kvblob_writer_t *w) {
+  uint64_t hashval = key_hash(store, w->key);
+  uint32_t count;
+  char *key;
+  int ret;
+  if ((ret = kvblob_finish(w)) < 0) {
+    kvblob_abort(&store->blobs, w);
+    return ret;
+  }
+  key = strdup(w->key);
+  if (!key)
+    fatal_malloc();
+  /* Until the store has a large value, KVSTORE_LSM writes of KEY may not take
+   * its key lock. */
+  exclusive_begin(store);
+  pthread_rwlock_wrlock(key_lock(store, hashval));
+  version_preserve(store, hashval, key, version_begin(store));
+  pthread_mutex_lock(&store->blob_lock);
+  count = store->blobs.count;
+  ret = kvblob_install(&store->blobs, w);
+  if (ret == 0 && store->blobs.count > count)
+    blob_marked(store, hashval, true);
+  pthread_mutex_unlock(&store->blob_lock);
+  if (ret == 0) {
+    /* The large value replaces any small value of KEY. */
+    engine_del(store, hashval, key);
+    ret = ttl_clear(store, key, false);
+  }
+  pthread_rwlock_unlock(key_lock(store, hashval));
+  exclusive_end(store);
+  kvcache_invalidate(&store->cache, hashval);
+  free(key);
+  return ret == 0 ? store_commit(store) : ret;
+}
+
+/* Drops the large value being stored with W and releases W. */
+void kvstore_put_stream_abort(kvstore_t *store, kvblob_writer_t *w) {
+  kvblob_abort(&store->blobs, w);
+}
+
+/* Opens the large value of KEY within STORE for reading with R, storing its
+ * size into R->size. The value is then read in chunks with
+ * kvstore_get_stream_read and R released with kvstore_get_stream_close. The
+ * value read is unaffected by later changes to KEY. Returns 0 if successful,
+ * else a negative error code (ERR_NOKEY if KEY has no large value). */
+int kvstore_get_stream_open(kvstore_t *store, char *key, kvblob_reader_t *r) {
+  int ret;
+  if (strlen(key) > MAX_KEYLEN)
+    return ERR_KEYLEN;
+  if (!has_blobs(store))
+    return ERR_NOKEY;
+  pthread_mutex_lock(&store->blob_lock);
+  ret = kvblob_open(&store->blobs, key, r);
+  pthread_mutex_unlock(&store->blob_lock);
+  return ret;
+}
+
+/* Reads the next chunk of at most LEN bytes of the large value being read with
+ * R into BUF. Returns the number of bytes read, 0 once the whole value has
+ * been read, or a negative error code. */
+ssize_t kvstore_get_stream_read(kvblob_reader_t *r, char *buf, size_t len) {
+  return kvblob_read(r, buf, len);
+}
+
+/* Releases R. */
+void kvstore_get_stream_close(kvblob_reader_t *r) { kvblob_reader_close(r); }
+
+/* The state of a scan of a KVStore. */
+typedef struct {
+  kvstore_t *store;   /* The store scanned. */
+  uint64_t now;       /* The time as of which keys which have expired are skipped. */
+  kvscan_fn_t visit;  /* The function to call with every entry. */
+  void *arg;          /* The argument to pass to VISIT. */
+  unsigned int limit; /* The maximum number of entries to visit, or 0 for no limit. */
+  int count;          /* The number of entries visited so far. */
+} scan_state_t;
+
+/* Passes an entry found by a scan on to the caller, enforcing its limit and
+ * skipping keys which have expired. */
+static int scan_visit(const char *key, const char *value, void *state_) {
+  scan_state_t *state = state_;
+  if (key_expired(state->store, key, state->now))
+    return 0;
+  state->count++;
+  if (state->visit(key, value, state->arg))
+    return 1;
+  return state->limit != 0 && state->count >= state->limit;
+}
+
+/* The number of keys a scan of a KVSTORE_FILES store collects at a time. */
+#define SCAN_BATCH 64
+
+/* A batch of entries read by a scan of a KVSTORE_FILES store. */
+typedef struct {
+  char *keys[SCAN_BATCH];
+  uint64_t hashes[SCAN_BATCH];
+  uint64_t seqs[SCAN_BATCH];           /* The sequence numbers of their stripes. */
+  int results[SCAN_BATCH];             /* As find_entry returns for each. */
+  kvuring_read_t reads[SCAN_BATCH];
+  char filenames[SCAN_BATCH][MAX_FILENAME];
+  char entries[SCAN_BATCH][KVENTRY_MAX_SIZE];
+  char values[SCAN_BATCH][MAX_VALLEN + 1];
+} scan_batch_t;
+
+/* Finds the N keys of BATCH within STORE and reads their values, as find_entry
+ * does for each. Their entry files are read together (see kvuring.h), without
+ * locking; an entry whose stripe was written meanwhile is then read again with
+ * find_entry. */
+static void scan_batch_read(kvstore_t *store, scan_batch_t *batch, unsigned int n) {
+  kvstore_stripe_t *stripe;
+  unsigned int i, nreads = 0, slot[SCAN_BATCH];
+  bool optimistic[SCAN_BATCH];
+  int ret;
+  key_hash_batch(store, batch->keys, n, batch->hashes);
+  for (i = 0; i < n; i++) {
+    stripe = &store->stripes[batch->hashes[i] % KVSTORE_LOCK_STRIPES];
+    batch->seqs[i] = __atomic_load_n(&stripe->seq, __ATOMIC_ACQUIRE);
+    optimistic[i] = !store->locked_reads && (batch->seqs[i] & 1) == 0;
+    if (!optimistic[i])
+      continue;
+    batch->results[i] = index_lookup(store, batch->hashes[i], batch->keys[i]);
+    if (batch->results[i] < 0)
+      continue;
+    entry_filename(store, batch->hashes[i], batch->results[i], batch->filenames[nreads]);
+    batch->reads[nreads].filename = batch->filenames[nreads];
+    batch->reads[nreads].buf = batch->entries[nreads];
+    batch->reads[nreads].size = KVENTRY_MAX_SIZE;
+    slot[i] = nreads++;
+  }
+  kvuring_read_files(store_uring(store, batch->hashes[0]), batch->reads, nreads);
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  for (i = 0; i < n; i++) {
+    stripe = &store->stripes[batch->hashes[i] % KVSTORE_LOCK_STRIPES];
+    if (optimistic[i] && __atomic_load_n(&stripe->seq, __ATOMIC_RELAXED) == batch->seqs[i]) {
+      if (batch->results[i] >= 0 && batch->reads[slot[i]].result < 0)
+        batch->results[i] = ERR_FILACCESS;
+      else if (batch->results[i] >= 0 &&
+               (ret = entry_decode((kventry_t *)batch->entries[slot[i]],
+                                   batch->reads[slot[i]].result, batch->values[i])) < 0)
+        batch->results[i] = entry_counted(store, ret);
+    } else {
+      batch->results[i] = find_entry(store, batch->hashes[i], batch->keys[i], batch->values[i]);
     }
+  }
+}
+
+/* Scans the KVSTORE_FILES store STORE as kvstore_scan does, visiting at most
+ * LIMIT entries (if LIMIT is not 0). The keys are collected from the key order
+ * SCAN_BATCH at a time, and their entries are then read together, each as of
+ * the time it is read, skipping entries removed meanwhile. Returns 0 if
+ * successful, else a negative error code. */
+static int files_scan(kvstore_t *store, const char *start, const char *end, unsigned int limit,
+                      kvscan_fn_t visit, void *arg) {
+  char cursor[MAX_KEYLEN + 1];
+  scan_batch_t *batch = malloc(sizeof(scan_batch_t));
+  unsigned int n = 0, i, max, visited = 0;
+  bool done = false, stopped = false, found;
+  kvkeys_iter_t iter;
+  int ret = 0;
+  if (!batch)
+    fatal_malloc();
+  strcpy(cursor, start ? start : "");
+  while (!done) {
+    /* Read no more entries than may still be visited. */
+    max = limit != 0 && limit - visited < SCAN_BATCH ? limit - visited : SCAN_BATCH;
+    pthread_rwlock_rdlock(&store->lock);
+    found = kvkeys_seek(&store->order, cursor, &iter);
+    /* After the first batch, CURSOR is the last key collected. */
+    if (n > 0 && found && strcmp(iter.key, cursor) == 0)
+      found = kvkeys_next(&iter);
+    for (n = 0; n < max && found && (end == NULL || strcmp(iter.key, end) < 0);
+         found = kvkeys_next(&iter)) {
+      batch->keys[n] = strdup(iter.key);
+      if (!batch->keys[n++])
+        fatal_malloc();
+    }
+    pthread_rwlock_unlock(&store->lock);
+    done = n < max;
+    if (!done)
+      strcpy(cursor, batch->keys[n - 1]);
+    scan_batch_read(store, batch, n);
+    for (i = 0; i < n; i++) {
+      if (ret == 0 && !stopped) {
+        ret = batch->results[i];
+        /* Not to be counted against LIMIT. */
+        if (ret >= 0 && key_expired(store, batch->keys[i], kvttl_now()))
+          ret = ERR_NOKEY;
+        if (ret >= 0) {
+          stopped = visit(batch->keys[i], batch->values[i], arg);
+          visited++;
+        }
+        if (ret >= 0 || ret == ERR_NOKEY)
+          ret = 0;
+      }
+      free(batch->keys[i]);
+    }
+    done = done || stopped || ret < 0 || (limit != 0 && visited >= limit);
+  }
+  free(batch);
+  return ret;
+}
+
+/* Calls VISIT with every entry of STORE whose key lies within [START, END),
+ * in key order, passing ARG along, until LIMIT entries (if LIMIT is not 0)
+ * have been visited or VISIT returns nonzero. START and END may be NULL to
+ * leave the range unbounded. VISIT may be called while parts of STORE are
+ * locked and so must not modify STORE. Returns the number of entries visited
+ * if successful, else a negative error code. */
+int kvstore_scan(kvstore_t *store, const char *start, const char *end, unsigned int limit,
+                 kvscan_fn_t visit, void *arg) {
+  scan_state_t state = {store, kvttl_now(), visit, arg, limit, 0};
+  int ret;
+  if (store->engine == KVSTORE_LSM) {
+    ret = kvlsm_scan(&store->lsm, start, end, scan_visit, &state);
+  } else if (store->engine == KVSTORE_LOG) {
+    pthread_rwlock_rdlock(&store->lock);
+    ret = kvlog_scan(&store->log, start, end, scan_visit, &state);
+    pthread_rwlock_unlock(&store->lock);
+  } else if (store->engine == KVSTORE_MEMORY) {
+    ret = kvmem_scan(&store->mem, start, end, scan_visit, &state);
   } else {
-    /* There were elements in the chain after the element to be deleted.
-       Take the last element in the chain and swap it into the deletion
-       location. */
-    sprintf(currfile, "%s/%" PRIu64 "-%u%s", store->dirname, hashval, counter - 1,
-            KVSTORE_FILETYPE);
-    if (rename(currfile, delfile) == -1) {
-      pthread_rwlock_unlock(&store->lock);
-      return errno;
+    ret = files_scan(store, start, end, limit, scan_visit, &state);
+  }
+  return ret < 0 ? ret : state.count;
+}
+
+/* Calls VISIT with every entry of STORE whose key starts with PREFIX, in key
+ * order, as kvstore_scan does. Returns the number of entries visited if
+ * successful, else a negative error code. */
+int kvstore_scan_prefix(kvstore_t *store, const char *prefix, unsigned int limit,
+                        kvscan_fn_t visit, void *arg) {
+  char end[MAX_KEYLEN + 1];
+  size_t len = strlen(prefix);
+  if (len > MAX_KEYLEN)
+    return ERR_KEYLEN;
+  /* The keys starting with PREFIX are those below PREFIX with its last byte
+   * incremented, ignoring trailing bytes which cannot be incremented. */
+  strcpy(end, prefix);
+  while (len > 0 && (unsigned char)end[len - 1] == 0xff)
+    end[--len] = '\0';
+  if (len == 0)
+    return kvstore_scan(store, prefix, NULL, limit, visit, arg);
+  end[len - 1]++;
+  return kvstore_scan(store, prefix, end, limit, visit, arg);
+}
+
+/* Takes a snapshot of STORE into SNAPSHOT: a consistent view of all keys of
+ * STORE as of now, unaffected by later writes, which is read with
+ * kvstore_get_at and kvstore_scan_at. Writes in progress are completed first,
+ * so taking a snapshot briefly holds up writers. SNAPSHOT must be released
+ * with kvstore_snapshot_release, as writers keep recording the versions they
+ * replace as long as any snapshot is open. */
+void kvstore_snapshot(kvstore_t *store, kvstore_snapshot_t *snapshot) {
+  snapshot->store = store;
+  __atomic_add_fetch(&store->nsnapshots, 1, __ATOMIC_SEQ_CST);
+  /* Writes begun before the snapshot may not have recorded the versions they
+   * replace, so they must be complete as of the snapshot. Those of the
+   * KVSTORE_LSM engine may not hold the key locks, and are waited for. */
+  key_lock_all(store, true);
+  while (__atomic_load_n(&store->unlocked_writers, __ATOMIC_SEQ_CST) > 0)
+    sched_yield();
+  pthread_mutex_lock(&store->version_lock);
+  snapshot->seq = __atomic_load_n(&store->seq, __ATOMIC_SEQ_CST);
+  snapshot->next = NULL;
+  snapshot->prev = store->snapshots;
+  while (snapshot->prev != NULL && snapshot->prev->next != NULL)
+    snapshot->prev = snapshot->prev->next;
+  if (snapshot->prev != NULL)
+    snapshot->prev->next = snapshot;
+  else
+    store->snapshots = snapshot;
+  pthread_mutex_unlock(&store->version_lock);
+  key_lock_all(store, false);
+}
+
+/* Releases SNAPSHOT, dropping the versions no other snapshot needs. */
+void kvstore_snapshot_release(kvstore_snapshot_t *snapshot) {
+  kvstore_t *store = snapshot->store;
+  pthread_mutex_lock(&store->version_lock);
+  if (snapshot->prev != NULL)
+    snapshot->prev->next = snapshot->next;
+  else
+    store->snapshots = snapshot->next;
+  if (snapshot->next != NULL)
+    snapshot->next->prev = snapshot->prev;
+  __atomic_sub_fetch(&store->nsnapshots, 1, __ATOMIC_SEQ_CST);
+  kvversions_prune(&store->versions, store->snapshots ? store->snapshots->seq : UINT64_MAX);
+  pthread_mutex_unlock(&store->version_lock);
+}
+
+/* Retrieves the value of KEY as of SNAPSHOT into VALUE. Returns 0 if
+ * successful, else a negative error code (ERR_NOKEY if KEY was not present,
+ * ERR_VALLEN if it had a large value). Only writers of KEY are blocked
+ * meanwhile. */
+int kvstore_get_at(kvstore_snapshot_t *snapshot, char *key, char *value) {
+  kvstore_t *store = snapshot->store;
+  kvversion_state_t state;
+  kvversion_t *version;
+  uint64_t hashval;
+  if (strlen(key) > MAX_KEYLEN)
+    return ERR_KEYLEN;
+  hashval = key_hash(store, key);
+  pthread_rwlock_rdlock(key_lock(store, hashval));
+  pthread_mutex_lock(&store->version_lock);
+  version = kvversions_find(&store->versions, key, snapshot->seq);
+  if (version != NULL) {
+    state = version->state;
+    if (state == KVVERSION_VALUE)
+      strcpy(value, version->value);
+  }
+  pthread_mutex_unlock(&store->version_lock);
+  /* KEY has not been written since SNAPSHOT, so its current version is the
+   * one to return. */
+  if (version == NULL)
+    state = version_read(store, hashval, key, value);
+  pthread_rwlock_unlock(key_lock(store, hashval));
+  if (state == KVVERSION_LARGE)
+    return ERR_VALLEN;
+  return state == KVVERSION_VALUE ? 0 : ERR_NOKEY;
+}
+
+/* The keys collected by a batch of kvstore_scan_at. */
+typedef struct {
+  char **keys;           /* The keys collected, strdup()ed. */
+  unsigned int count;    /* The number of keys within KEYS. */
+  unsigned int capacity; /* The number of slots of KEYS. */
+  const char *after;     /* A key to skip, or NULL. */
+} scan_keys_t;
+
+static void scan_keys_add(scan_keys_t *batch, const char *key) {
+  if (batch->count == batch->capacity) {
+    batch->capacity = batch->capacity ? batch->capacity * 2 : SCAN_BATCH;
+    batch->keys = realloc(batch->keys, batch->capacity * sizeof(char *));
+    if (!batch->keys)
+      fatal_malloc();
+  }
+  if (!(batch->keys[batch->count++] = strdup(key)))
+    fatal_malloc();
+}
+
+/* Collects the keys of a scan, SCAN_BATCH at a time. */
+static int scan_collect(const char *key, const char *value, void *arg) {
+  scan_keys_t *batch = arg;
+  if (batch->after == NULL || strcmp(key, batch->after) != 0)
+    scan_keys_add(batch, key);
+  return batch->count >= SCAN_BATCH;
+}
+
+static int scan_keys_cmp(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Calls VISIT with every entry of SNAPSHOT whose key lies within [START, END),
+ * as kvstore_scan does. The keys are collected SCAN_BATCH at a time from the
+ * current entries of the store along with the keys with past versions, and
+ * each entry is then read as of SNAPSHOT, holding only its key lock. Returns
+ * the number of entries visited if successful, else a negative error code. */
+int kvstore_scan_at(kvstore_snapshot_t *snapshot, const char *start, const char *end,
+                    unsigned int limit, kvscan_fn_t visit, void *arg) {
+  kvstore_t *store = snapshot->store;
+  char cursor[MAX_KEYLEN + 1], value[MAX_VALLEN + 1];
+  scan_keys_t batch = {NULL, 0, 0, NULL};
+  skiplist_node_t *node;
+  bool done = false, stopped = false;
+  unsigned int n, i;
+  int ret = 0, count = 0;
+  strcpy(cursor, start ? start : "");
+  while (!done && !stopped) {
+    batch.count = 0;
+    if ((ret = kvstore_scan(store, cursor, end, 0, scan_collect, &batch)) < 0) {
+      for (i = 0; i < batch.count; i++)
+        free(batch.keys[i]);
+      break;
     }
+    ret = 0;
+    n = batch.count;
+    done = n < SCAN_BATCH;
+    /* Add the keys with past versions up to the last key collected. */
+    pthread_mutex_lock(&store->version_lock);
+    for (node = skiplist_seek(&store->versions.keys, cursor); node != NULL; node = node->next[0]) {
+      if (done ? end != NULL && strcmp(node->key, end) >= 0
+               : strcmp(node->key, batch.keys[n - 1]) > 0)
+        break;
+      if (batch.after == NULL || strcmp(node->key, batch.after) != 0)
+        scan_keys_add(&batch, node->key);
+    }
+    pthread_mutex_unlock(&store->version_lock);
+    if (!done)
+      strcpy(cursor, batch.keys[n - 1]);
+    batch.after = cursor;
+    qsort(batch.keys, batch.count, sizeof(char *), scan_keys_cmp);
+    for (i = 0; i < batch.count; i++) {
+      if (!stopped && (i == 0 || strcmp(batch.keys[i], batch.keys[i - 1]) != 0)) {
+        ret = kvstore_get_at(snapshot, batch.keys[i], value);
+        if (ret == 0) {
+          count++;
+          stopped = visit(batch.keys[i], value, arg) || (limit != 0 && count >= limit);
+        } else if (ret == ERR_NOKEY || ret == ERR_VALLEN) {
+          ret = 0;
+        } else {
+          stopped = true;
+        }
+      }
+    }
+    for (i = 0; i < batch.count; i++)
+      free(batch.keys[i]);
   }
-  pthread_rwlock_unlock(&store->lock);
-  return 0;
+  free(batch.keys);
+  return ret < 0 ? ret : count;
+}
+
+/* Fills STATS with the current counters of STORE. */
+void kvstore_get_stats(kvstore_t *store, kvstore_stats_t *stats) {
+  kvlz_stats_t *compression = &store->compression;
+  kvcache_stats_t cache;
+  kvblockcache_stats_t blocks;
+  kvmem_stats_t mem;
+  int i;
+  kvcache_stats(&store->cache, &cache);
+  stats->cache_hits = cache.hits;
+  stats->cache_misses = cache.misses;
+  stats->cache_evictions = cache.evictions;
+  stats->cache_entries = cache.entries;
+  stats->cache_bytes = cache.bytes;
+  stats->blobs = has_blobs(store) ? store->blobs.count : 0;
+  stats->ttls = __atomic_load_n(&store->ttl.count, __ATOMIC_ACQUIRE);
+  stats->corruptions = store->corruptions;
+  if (store->engine == KVSTORE_LOG)
+    stats->corruptions = store->log.corruptions;
+  else if (store->engine == KVSTORE_LSM)
+    stats->corruptions = store->lsm.corruptions;
+  stats->bloom_checks = stats->bloom_negatives = stats->bloom_false_positives = 0;
+  if (store->engine == KVSTORE_LSM) {
+    stats->bloom_checks = store->lsm.filter_checks;
+    stats->bloom_negatives = store->lsm.filter_negatives;
+    stats->bloom_false_positives = store->lsm.filter_false_positives;
+  }
+  stats->block_hits = stats->block_misses = stats->block_reads = 0;
+  if (store->engine == KVSTORE_LSM && store->lsm.direct_io) {
+    kvblockcache_stats(&store->lsm.blocks, &blocks);
+    stats->block_hits = blocks.hits;
+    stats->block_misses = blocks.misses;
+    stats->block_reads = blocks.reads;
+  }
+  if (store->engine == KVSTORE_LOG)
+    compression = &store->log.compression;
+  else if (store->engine == KVSTORE_LSM)
+    compression = &store->lsm.compression;
+  stats->compress_values = compression->values;
+  stats->compress_compressed = compression->compressed;
+  stats->compress_raw_bytes = compression->raw_bytes;
+  stats->compress_stored_bytes = compression->stored_bytes;
+  kvsync_stats(&store->sync, &stats->sync_commits, &stats->sync_calls);
+  stats->log_bytes = stats->log_live_bytes = stats->compactions = 0;
+  stats->compact_read_bytes = stats->compact_written_bytes = stats->compact_usecs = 0;
+  if (store->engine == KVSTORE_LOG) {
+    pthread_rwlock_rdlock(&store->lock);
+    kvlog_space(&store->log, &stats->log_live_bytes, &stats->log_bytes);
+    stats->compactions = store->log.compactions;
+    stats->compact_read_bytes = store->log.compact_read;
+    stats->compact_written_bytes = store->log.compact_written;
+    stats->compact_usecs = store->log.compact_nsecs / 1000;
+    pthread_rwlock_unlock(&store->lock);
+  }
+  stats->uring_files = stats->uring_submits = stats->index_bytes = 0;
+  if (store->engine == KVSTORE_FILES) {
+    for (i = 0; i < KVSTORE_URINGS; i++) {
+      pthread_mutex_lock(&store->urings[i].lock);
+      stats->uring_files += store->urings[i].files;
+      stats->uring_submits += store->urings[i].submits;
+      pthread_mutex_unlock(&store->urings[i].lock);
+    }
+    pthread_rwlock_rdlock(&store->lock);
+    stats->index_bytes = store->index.bytes + store->order.bytes;
+    pthread_rwlock_unlock(&store->lock);
+  }
+  stats->mem_entries = stats->mem_bytes = stats->mem_pages = stats->mem_evictions = 0;
+  if (store->engine == KVSTORE_MEMORY) {
+    kvmem_stats(&store->mem, &mem);
+    stats->mem_entries = mem.entries;
+    stats->mem_bytes = mem.bytes;
+    stats->mem_pages = mem.pages;
+    stats->mem_evictions = mem.evictions;
+  }
+}
+
+/* Closes STORE, stopping any background work and releasing its resources
+ * without removing any entries. STORE must be reinitialized before it is used
+ * again. */
+void kvstore_close(kvstore_t *store) {
+  int i, ret;
+  if (has_compactor(store))
+    compactor_stop(store);
+  kvsync_close(&store->sync);
+  if (store->engine == KVSTORE_LOG)
+    kvlog_close(&store->log);
+  else if (store->engine == KVSTORE_LSM)
+    kvlsm_close(&store->lsm);
+  else if (store->engine == KVSTORE_MEMORY)
+    kvmem_destroy(&store->mem);
+  else {
+    /* Only once all writes are on disk does the checkpoint make the log
+     * unnecessary. */
+    ret = files_sync_all(store);
+    if (ret == 0)
+      ret = index_checkpoint(store);
+    kvcheckpoint_close(&store->checkpoint, ret == 0);
+    index_free(store);
+    for (i = 0; i < KVSTORE_URINGS; i++)
+      kvuring_destroy(&store->urings[i]);
+    kvsync_files_destroy(&store->dirty);
+  }
+  kvblob_close(&store->blobs);
+  kvttl_close(&store->ttl);
+  kvcache_destroy(&store->cache);
+  pthread_rwlock_destroy(&store->lock);
+  for (i = 0; i < KVSTORE_LOCK_STRIPES; i++)
+    pthread_rwlock_destroy(&store->stripes[i].lock);
+  pthread_mutex_destroy(&store->blob_lock);
+  pthread_mutex_destroy(&store->ttl_lock);
+  kvversions_free(&store->versions);
+  pthread_mutex_destroy(&store->version_lock);
+  kvratelimit_destroy(&store->compact_limit);
+  pthread_mutex_destroy(&store->compact_lock);
+  pthread_cond_destroy(&store->compact_cond);
 }
 
 /* Deletes all current entries in STORE and removes the store directory.
@@ -201,7 +2308,9 @@ int kvstore_del(kvstore_t *store, char *key) {
 int kvstore_clean(kvstore_t *store) {
   struct dirent *dent;
   char filename[MAX_FILENAME];
-  DIR *kvstoredir = opendir(store->dirname);
+  DIR *kvstoredir;
+  kvstore_close(store);
+  kvstoredir = opendir(store->dirname);
   if (kvstoredir == NULL)
     return 0;
   while ((dent = readdir(kvstoredir)) != NULL) {
@@ -4,6 +4,21 @@
 #include <stdbool.h>
 #include <pthread.h>
 #include "kvconstants.h"
+#include "kvlog.h"
+#include "kvlsm.h"
+#include "kvmem.h"
+#include "kvcache.h"
+#include "kvblob.h"
+#include "kvlz.h"
+#include "kvindex.h"
+#include "kvkeys.h"
+#include "kvcheckpoint.h"
+#include "kvversions.h"
+#include "kvsync.h"
+#include "kvratelimit.h"
+#include "kvuring.h"
+#include "kvttl.h"
+#include "skiplist.h"
 
 /* KVStore defines the persistent storage used by a server to store <key, value>
  *entries.
@@ -36,39 +51,286 @@
  * All state is stored in persistent file storage, so it is valid to initialize
  * a KVStore using a directory name which was previously used for a KVStore,
  * and the new store will be an exact clone of the old store.
+ *
+ * The layout described above is that of the KVSTORE_FILES engine, which keeps
+ * an index of its entry files in memory (see kvindex.h). A KVStore may instead
+ * be initialized with the KVSTORE_LOG (see kvlog.h), KVSTORE_LSM (see kvlsm.h)
+ * or KVSTORE_MEMORY (see kvmem.h) engine. A directory must always be reopened
+ * with the engine it was created with.
+ *
+ * Operations on keys are serialized by key locks: rwlocks striped by
+ * hash(key). Locks are always taken in the order key lock, lock of the store,
+ * BLOB_LOCK, TTL_LOCK, and VERSION_LOCK after the key lock.
  */
 
 /* The filetype to append to the filenames of entries within the log. */
 #define KVSTORE_FILETYPE ".entry"
 
+/* The default size from which values are stored compressed. */
+#define KVSTORE_COMPRESS_THRESHOLD 128
+
+/* The default garbage ratio of the sealed segments which triggers a compaction. */
+#define KVSTORE_COMPACT_RATIO 0.5
+
+/* The default I/O rate of compactions, in bytes per second. */
+#define KVSTORE_COMPACT_RATE (16 * 1024 * 1024)
+
+/* The number of seconds between checks whether to compact (or checkpoint). */
+#define KVSTORE_COMPACT_INTERVAL 1
+
+/* The number of bytes a compaction reads between requests. */
+#define KVSTORE_COMPACT_CHUNK (64 * 1024)
+
+/* The number of stripes of the key locks of a KVStore. */
+#define KVSTORE_LOCK_STRIPES 64
+
+/* The number of io_uring rings of a KVStore, over which its readers are
+ * spread by the hash chains they read. */
+#define KVSTORE_URINGS 8
+
+/* The number of counters marking the hashes of the keys with large values. */
+#define KVSTORE_BLOB_MARKS 4096
+
+/* The number of lock-free attempts of a read before it takes the key lock. */
+#define KVSTORE_READ_RETRIES 8
+
+/* The storage engines a KVStore can be initialized with. */
+typedef enum {
+  KVSTORE_FILES, /* One file per entry, named by hash chain position. */
+  KVSTORE_LOG,   /* Entries appended to segment files, see kvlog.h. */
+  KVSTORE_LSM,   /* A log-structured merge-tree, see kvlsm.h. */
+  KVSTORE_MEMORY, /* Entries in memory only, evicted within a budget, see kvmem.h. */
+} kvstore_engine_t;
+
+/* Options used to initialize a KVStore. */
+typedef struct {
+  kvstore_engine_t engine;   /* The storage engine to use. */
+  size_t segment_size;       /* KVSTORE_LOG: the size at which a segment is sealed. */
+  size_t memtable_size;      /* KVSTORE_LSM: the size at which the memtable is flushed. */
+  unsigned int bloom_bits;   /* KVSTORE_LSM: Bloom filter bits per key of new tables (0 = none). */
+  size_t cache_size;         /* The byte budget of the read cache, or 0 to disable it. */
+  size_t compress_threshold; /* The size from which values are compressed (0 = never). */
+  bool locked_reads;         /* KVSTORE_FILES: read holding the key lock instead of lock-free. */
+  kvsync_opts_t durability;  /* When writes are synced to disk. */
+  double compact_ratio;      /* KVSTORE_LOG: the garbage ratio which triggers a compaction (0 = never). */
+  uint64_t compact_rate;     /* KVSTORE_LOG: the I/O rate of compactions, in bytes/s (0 = unlimited). */
+  bool direct_io;            /* KVSTORE_LSM: read tables with O_DIRECT through a block cache. */
+  size_t block_cache_size;   /* KVSTORE_LSM: the byte budget of that block cache. */
+  size_t memory_size;        /* KVSTORE_MEMORY: the byte budget of the entries. */
+  kvmem_policy_t eviction;   /* KVSTORE_MEMORY: which entries are evicted to stay within it. */
+} kvstore_opts_t;
+
+/* A stripe of the key locks of a KVStore, alone on its cache line. */
+typedef struct {
+  pthread_rwlock_t lock; /* The key lock. */
+  uint64_t seq;          /* KVSTORE_FILES: odd while the entry files of the stripe change. */
+} __attribute__((aligned(64))) kvstore_stripe_t;
+
+struct kvstore_snapshot;
+
 /* A KVStore. */
 typedef struct {
   char dirname[MAX_FILENAME]; /* The name of the directory used to store its
                                  entries. */
-  pthread_rwlock_t lock;      /* The lock used to make KVStore's functions thread-safe. */
+  kvstore_engine_t engine;    /* The storage engine used by this store. */
+  kvlog_t log;                /* The state of the KVSTORE_LOG engine. */
+  kvlsm_t lsm;                /* The state of the KVSTORE_LSM engine. */
+  kvmem_t mem;                /* The state of the KVSTORE_MEMORY engine. */
+  kvindex_t index;            /* The index of the KVSTORE_FILES engine. */
+  kvkeys_t order;             /* The keys of the KVSTORE_FILES engine, sorted. */
+  size_t compress_threshold;  /* KVSTORE_FILES: the size from which values are compressed. */
+  bool locked_reads;          /* KVSTORE_FILES: whether reads take the key lock. */
+  kvlz_stats_t compression;   /* KVSTORE_FILES: the compression of the values written. */
+  uint64_t corruptions;       /* KVSTORE_FILES: the entries read whose checksum did not match. */
+  kvuring_t urings[KVSTORE_URINGS]; /* KVSTORE_FILES: read entry files, by hash chain. */
+  kvcheckpoint_t checkpoint;  /* KVSTORE_FILES: persists INDEX and ORDER. */
+  kvsync_files_t dirty;       /* KVSTORE_FILES: the entry files written but not yet synced. */
+  kvcache_t cache;            /* The read cache in front of the storage engine. */
+  kvblob_t blobs;             /* The large values, kept apart from the storage engine. */
+  pthread_rwlock_t lock;      /* Protects the index hash table and key order of
+                                 KVSTORE_FILES, and the whole of KVSTORE_LOG. */
+  kvstore_stripe_t stripes[KVSTORE_LOCK_STRIPES]; /* The key locks, by hash chain. */
+  pthread_mutex_t blob_lock;  /* Protects the map of BLOBS. */
+  uint32_t blob_marks[KVSTORE_BLOB_MARKS]; /* The number of large values, by key hash, so
+                                              that reads test for one without BLOB_LOCK. */
+  kvttl_t ttl;                /* The expiry times of the keys written with a time to live. */
+  pthread_mutex_t ttl_lock;   /* Serializes the writers of TTL; reads take no lock. */
+  kvversions_t versions;      /* The past versions of keys the open snapshots need. */
+  struct kvstore_snapshot *snapshots; /* The open snapshots, oldest first. */
+  unsigned int nsnapshots;    /* The number of open snapshots. */
+  uint64_t seq;               /* The sequence number of the last write numbered. */
+  unsigned int unlocked_writers; /* KVSTORE_LSM: writes in progress without key locks. */
+  unsigned int exclusive_writers; /* KVSTORE_LSM: writes in progress which need all writes
+                                    to take the key locks. */
+  pthread_mutex_t version_lock; /* Protects VERSIONS and SNAPSHOTS. */
+  kvsync_t sync;              /* Makes writes durable as OPTS->durability selects. */
+  double compact_ratio;       /* KVSTORE_LOG: the garbage ratio which triggers a compaction. */
+  kvratelimit_t compact_limit; /* KVSTORE_LOG: throttles the I/O of compactions. */
+  pthread_t compactor;        /* KVSTORE_LOG: the thread compacting in the background;
+                                 KVSTORE_FILES: the thread writing checkpoints. */
+  pthread_mutex_t compact_lock; /* Held by compactions (or checkpoints), one at a time. */
+  pthread_cond_t compact_cond; /* Signaled when COMPACT_STOP is set. */
+  bool compact_stop;          /* Whether the COMPACTOR is to exit. */
 } kvstore_t;
 
+/* A snapshot of a KVStore, see kvstore_snapshot. */
+typedef struct kvstore_snapshot {
+  kvstore_t *store;                    /* The store this is a snapshot of. */
+  uint64_t seq;                        /* The sequence number of the last write seen. */
+  struct kvstore_snapshot *prev, *next; /* The neighbors within the open snapshots. */
+} kvstore_snapshot_t;
+
+/* Counters describing the activity of a KVStore. The observed false positive
+ * rate of the Bloom filters is
+ *    bloom_false_positives / (bloom_false_positives + bloom_negatives),
+ * the achieved compression ratio of the values written since the store was
+ * initialized is
+ *    compress_raw_bytes / compress_stored_bytes,
+ * the garbage ratio of the log is
+ *    1 - log_live_bytes / log_bytes,
+ * and the throughput of its compactions, in bytes per second, is
+ *    compact_read_bytes / (compact_usecs / 1e6). */
+typedef struct {
+  uint64_t cache_hits;            /* The number of GETs served by the read cache. */
+  uint64_t cache_misses;          /* The number of GETs which missed the read cache. */
+  uint64_t cache_evictions;       /* The number of values evicted from the read cache. */
+  uint64_t cache_entries;         /* The number of values currently cached. */
+  uint64_t cache_bytes;           /* The number of bytes currently charged to the read cache. */
+  uint64_t bloom_checks;          /* KVSTORE_LSM: table lookups which consulted a filter. */
+  uint64_t bloom_negatives;       /* KVSTORE_LSM: of those, lookups the filter answered. */
+  uint64_t bloom_false_positives; /* KVSTORE_LSM: of those, lookups which read a block in vain. */
+  uint64_t block_hits;            /* KVSTORE_LSM: pages of tables found in the block cache. */
+  uint64_t block_misses;          /* KVSTORE_LSM: pages of tables read with O_DIRECT. */
+  uint64_t block_reads;           /* KVSTORE_LSM: the reads made for those. */
+  uint64_t blobs;                 /* The number of large values stored. */
+  uint64_t ttls;                  /* The number of keys with an expiry time. */
+  uint64_t corruptions;           /* The number of entries read whose checksum did not match. */
+  uint64_t compress_values;       /* The number of values written large enough to compress. */
+  uint64_t compress_compressed;   /* Of those, the number stored compressed. */
+  uint64_t compress_raw_bytes;    /* The size of those values. */
+  uint64_t compress_stored_bytes; /* The size those values were stored with. */
+  uint64_t sync_commits;          /* The number of writes which waited to be synced. */
+  uint64_t sync_calls;            /* The number of syncs made for them. */
+  uint64_t log_bytes;             /* KVSTORE_LOG: the size of all segments. */
+  uint64_t log_live_bytes;        /* KVSTORE_LOG: of those, the bytes of current records. */
+  uint64_t compactions;           /* KVSTORE_LOG: the number of compactions completed. */
+  uint64_t compact_read_bytes;    /* KVSTORE_LOG: the number of bytes those read. */
+  uint64_t compact_written_bytes; /* KVSTORE_LOG: the number of bytes those wrote. */
+  uint64_t compact_usecs;         /* KVSTORE_LOG: the time those took, throttling included. */
+  uint64_t uring_files;           /* KVSTORE_FILES: the entry files read through io_uring. */
+  uint64_t uring_submits;         /* KVSTORE_FILES: the system calls which submitted those. */
+  uint64_t index_bytes;           /* KVSTORE_FILES: the memory held by the index and key order. */
+  uint64_t mem_entries;           /* KVSTORE_MEMORY: the number of entries. */
+  uint64_t mem_bytes;             /* KVSTORE_MEMORY: the bytes of their keys and values. */
+  uint64_t mem_pages;             /* KVSTORE_MEMORY: the bytes of memory allocated for them. */
+  uint64_t mem_evictions;         /* KVSTORE_MEMORY: the number of entries evicted. */
+} kvstore_stats_t;
+
+/* A single operation of a write batch. */
+typedef struct {
+  msgtype_t type; /* PUTREQ or DELREQ. */
+  char *key;      /* The key to store or remove. */
+  char *value;    /* The value to store, or NULL for DELREQ. */
+} kvstore_batch_op_t;
+
+/* A write batch: puts and deletes collected to be applied to a KVStore at
+ * once by kvstore_write_batch, which takes the lock of the store once and
+ * syncs the storage engine to disk once for the whole batch. */
+typedef struct {
+  kvstore_batch_op_t *ops; /* The operations of the batch, in order. */
+  unsigned int count;      /* The number of operations within OPS. */
+  unsigned int capacity;   /* The number of slots of OPS. */
+} kvstore_batch_t;
+
+/* Flags of a kvstore entry. */
+#define KVENTRY_TOMBSTONE 0x1  /* The entry marks KEY as deleted (not KVSTORE_FILES). */
+#define KVENTRY_COMPRESSED 0x2 /* The value is compressed (see kvlz.h). */
+
 /* A single kvstore entry.
  * data stores both the key and the value, in the form:
  *   key_string \0 value_string \0
- * (that is, two concatenated and null terminated strings) */
+ * (that is, two concatenated and null terminated strings). A tombstone only
+ * stores the key. A compressed entry stores the key, null terminated, followed
+ * by the compressed value, which is not. */
 typedef struct {
   int length;   /* Stores the total length of data, including null terminators. */
+  int flags;    /* KVENTRY_* flags describing this entry. */
+  uint32_t crc; /* The CRC32C of LENGTH, FLAGS and DATA (see kvcrc.h). */
   char data[0]; /* Described above. */
 } kventry_t;
 
-int kvstore_init(kvstore_t *, char *dirname);
+/* The maximum size of an entry, including its header. */
+#define KVENTRY_MAX_SIZE (sizeof(kventry_t) + MAX_KEYLEN + MAX_VALLEN + 2)
+
+size_t kventry_encode(kventry_t *, const char *key, const char *value, size_t threshold,
+                      kvlz_stats_t *stats);
+char *kventry_value(kventry_t *, char *buf);
+bool kventry_verify(const kventry_t *, size_t size);
+
+void kvstore_opts_default(kvstore_opts_t *);
+int kvstore_engine_from_string(const char *name, kvstore_engine_t *engine);
+
+int kvstore_init(kvstore_t *, char *dirname, const kvstore_opts_t *opts);
 
 int kvstore_get(kvstore_t *, char *key, char *value);
 
 int kvstore_put(kvstore_t *, char *key, char *value);
 int kvstore_put_check(kvstore_t *, char *key, char *value);
+int kvstore_cas(kvstore_t *, char *key, char *expected, char *value);
+int kvstore_put_if_absent(kvstore_t *, char *key, char *value);
+int kvstore_put_ttl(kvstore_t *, char *key, char *value, uint64_t ttl);
+int kvstore_expire(kvstore_t *);
 
 int kvstore_del(kvstore_t *, char *key);
 int kvstore_del_check(kvstore_t *, char *key);
 
 bool kvstore_haskey(kvstore_t *, char *key);
 
+/* The above, given DIGEST, strhash64(KEY), which the caller has computed
+ * already (see kvrequest_hash), so that the KVSTORE_FILES engine does not
+ * compute it again. */
+int kvstore_get_hashed(kvstore_t *, char *key, uint64_t digest, char *value);
+int kvstore_put_hashed(kvstore_t *, char *key, uint64_t digest, char *value);
+int kvstore_cas_hashed(kvstore_t *, char *key, uint64_t digest, char *expected, char *value);
+int kvstore_put_if_absent_hashed(kvstore_t *, char *key, uint64_t digest, char *value);
+int kvstore_put_ttl_hashed(kvstore_t *, char *key, uint64_t digest, char *value, uint64_t ttl);
+int kvstore_del_hashed(kvstore_t *, char *key, uint64_t digest);
+int kvstore_del_check_hashed(kvstore_t *, char *key, uint64_t digest);
+bool kvstore_haskey_hashed(kvstore_t *, char *key, uint64_t digest);
+
+int kvstore_scan(kvstore_t *, const char *start, const char *end, unsigned int limit,
+                 kvscan_fn_t visit, void *arg);
+int kvstore_scan_prefix(kvstore_t *, const char *prefix, unsigned int limit, kvscan_fn_t visit,
+                        void *arg);
+
+int kvstore_put_stream_begin(kvstore_t *, char *key, uint64_t size, kvblob_writer_t *);
+int kvstore_put_stream_write(kvstore_t *, kvblob_writer_t *, char *data, size_t len);
+int kvstore_put_stream_finish(kvstore_t *, kvblob_writer_t *);
+int kvstore_put_stream_end(kvstore_t *, kvblob_writer_t *);
+void kvstore_put_stream_abort(kvstore_t *, kvblob_writer_t *);
+
+int kvstore_get_stream_open(kvstore_t *, char *key, kvblob_reader_t *);
+ssize_t kvstore_get_stream_read(kvblob_reader_t *, char *buf, size_t len);
+void kvstore_get_stream_close(kvblob_reader_t *);
+
+void kvstore_snapshot(kvstore_t *, kvstore_snapshot_t *);
+void kvstore_snapshot_release(kvstore_snapshot_t *);
+int kvstore_get_at(kvstore_snapshot_t *, char *key, char *value);
+int kvstore_scan_at(kvstore_snapshot_t *, const char *start, const char *end, unsigned int limit,
+                    kvscan_fn_t visit, void *arg);
+
+void kvstore_batch_init(kvstore_batch_t *);
+int kvstore_batch_put(kvstore_batch_t *, char *key, char *value);
+int kvstore_batch_del(kvstore_batch_t *, char *key);
+void kvstore_batch_clear(kvstore_batch_t *);
+void kvstore_batch_free(kvstore_batch_t *);
+int kvstore_write_batch(kvstore_t *, kvstore_batch_t *);
+
+int kvstore_compact(kvstore_t *);
+
+void kvstore_get_stats(kvstore_t *, kvstore_stats_t *stats);
+
+void kvstore_close(kvstore_t *);
 int kvstore_clean(kvstore_t *);
 
 #endif
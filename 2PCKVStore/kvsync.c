@@ -0,0 +1,219 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "kvconstants.h"
+#include "kvsync.h"
+
+/* Fills OPTS with the default options, which select KVSYNC_NONE. */
+void kvsync_opts_default(kvsync_opts_t *opts) {
+  opts->mode = KVSYNC_NONE;
+  opts->group_interval = KVSYNC_GROUP_INTERVAL;
+  opts->group_size = KVSYNC_GROUP_SIZE;
+}
+
+/* Parses the durability mode NAME ("none", "always" or "group") into MODE.
+ * Returns 0 if successful, else -1. */
+int kvsync_mode_from_string(const char *name, kvsync_mode_t *mode) {
+  if (!strcmp(name, "none"))
+    *mode = KVSYNC_NONE;
+  else if (!strcmp(name, "always"))
+    *mode = KVSYNC_ALWAYS;
+  else if (!strcmp(name, "group"))
+    *mode = KVSYNC_GROUP;
+  else
+    return -1;
+  return 0;
+}
+
+/* Syncs the writes waiting on the KVSYNC_GROUP sync ARG, in groups, until it
+ * is closed. */
+static void *kvsync_group(void *arg) {
+  kvsync_t *sync = arg;
+  struct timespec deadline;
+  uint64_t target;
+  bool carried = false;
+  int ret;
+  pthread_mutex_lock(&sync->lock);
+  while (!sync->stop || sync->written > sync->durable) {
+    if (sync->written == sync->durable) {
+      pthread_cond_wait(&sync->pending, &sync->lock);
+      continue;
+    }
+    /* Give more writes the chance to share the sync, unless those waiting
+     * already waited for the previous sync. */
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += (long)sync->opts.group_interval * 1000;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+    while (!carried && !sync->stop && sync->written - sync->durable < sync->opts.group_size &&
+           pthread_cond_timedwait(&sync->pending, &sync->lock, &deadline) != ETIMEDOUT)
+      ;
+    target = sync->written;
+    pthread_mutex_unlock(&sync->lock);
+    ret = sync->sync(sync->arg);
+    pthread_mutex_lock(&sync->lock);
+    if (ret < 0 && sync->error == 0)
+      sync->error = ret;
+    sync->durable = target;
+    sync->syncs++;
+    carried = sync->written > sync->durable;
+    pthread_cond_broadcast(&sync->synced);
+  }
+  pthread_mutex_unlock(&sync->lock);
+  return NULL;
+}
+
+/* Initializes SYNC to make writes durable as OPTS (or the defaults, if NULL)
+ * select, by calling SYNC_FN with ARG. Returns 0 if successful, else a
+ * negative error code. */
+int kvsync_init(kvsync_t *sync, const kvsync_opts_t *opts, kvsync_fn_t sync_fn, void *arg) {
+  if (opts != NULL)
+    sync->opts = *opts;
+  else
+    kvsync_opts_default(&sync->opts);
+  sync->sync = sync_fn;
+  sync->arg = arg;
+  sync->written = sync->durable = sync->syncs = 0;
+  sync->error = 0;
+  sync->stop = false;
+  pthread_mutex_init(&sync->lock, NULL);
+  pthread_cond_init(&sync->pending, NULL);
+  pthread_cond_init(&sync->synced, NULL);
+  if (sync->opts.mode == KVSYNC_GROUP &&
+      pthread_create(&sync->thread, NULL, kvsync_group, sync) != 0) {
+    pthread_mutex_destroy(&sync->lock);
+    pthread_cond_destroy(&sync->pending);
+    pthread_cond_destroy(&sync->synced);
+    return ERR_FILACCESS;
+  }
+  return 0;
+}
+
+/* Completes a write which has reached the operating system, returning once it
+ * is as durable as the mode of SYNC requires. Returns 0 if successful, else a
+ * negative error code. */
+int kvsync_commit(kvsync_t *sync) {
+  uint64_t ticket;
+  int ret;
+  if (sync->opts.mode == KVSYNC_NONE)
+    return 0;
+  pthread_mutex_lock(&sync->lock);
+  ticket = ++sync->written;
+  if (sync->opts.mode == KVSYNC_ALWAYS) {
+    pthread_mutex_unlock(&sync->lock);
+    ret = sync->sync(sync->arg);
+    pthread_mutex_lock(&sync->lock);
+    if (ret < 0 && sync->error == 0)
+      sync->error = ret;
+    sync->syncs++;
+  } else {
+    if (ticket - sync->durable == 1 || ticket - sync->durable >= sync->opts.group_size)
+      pthread_cond_signal(&sync->pending);
+    while (sync->durable < ticket)
+      pthread_cond_wait(&sync->synced, &sync->lock);
+  }
+  ret = sync->error;
+  pthread_mutex_unlock(&sync->lock);
+  return ret;
+}
+
+/* Stores the number of writes committed to SYNC into COMMITS and the number
+ * of syncs made for them into SYNCS. */
+void kvsync_stats(kvsync_t *sync, uint64_t *commits, uint64_t *syncs) {
+  pthread_mutex_lock(&sync->lock);
+  *commits = sync->written;
+  *syncs = sync->syncs;
+  pthread_mutex_unlock(&sync->lock);
+}
+
+/* Closes SYNC, once all writes committed have been synced. */
+void kvsync_close(kvsync_t *sync) {
+  if (sync->opts.mode == KVSYNC_GROUP) {
+    pthread_mutex_lock(&sync->lock);
+    sync->stop = true;
+    pthread_cond_signal(&sync->pending);
+    pthread_mutex_unlock(&sync->lock);
+    pthread_join(sync->thread, NULL);
+  }
+  pthread_mutex_destroy(&sync->lock);
+  pthread_cond_destroy(&sync->pending);
+  pthread_cond_destroy(&sync->synced);
+}
+
+/* Initializes FILES, tracking no files. */
+void kvsync_files_init(kvsync_files_t *files) {
+  pthread_mutex_init(&files->lock, NULL);
+  pthread_mutex_init(&files->syncing, NULL);
+  files->count = 0;
+  files->dir = files->overflow = false;
+}
+
+/* Adds the file open as FD, just written, to FILES, which takes over FD and
+ * closes it once synced. CREATED is whether the write created the file. */
+void kvsync_files_add(kvsync_files_t *files, int fd, bool created) {
+  pthread_mutex_lock(&files->lock);
+  if (files->count < KVSYNC_FILES_MAX) {
+    files->fds[files->count++] = fd;
+    fd = -1;
+  } else {
+    files->overflow = true;
+  }
+  files->dir |= created;
+  pthread_mutex_unlock(&files->lock);
+  if (fd >= 0)
+    close(fd);
+}
+
+/* Records within FILES that a file was removed or renamed. */
+void kvsync_files_dir(kvsync_files_t *files) {
+  pthread_mutex_lock(&files->lock);
+  files->dir = true;
+  pthread_mutex_unlock(&files->lock);
+}
+
+/* Syncs the files added to FILES so far, and DIRNAME, the directory holding
+ * them, if files were created, removed or renamed within it. Returns 0 if
+ * successful, else a negative error code. */
+int kvsync_files_sync(kvsync_files_t *files, const char *dirname) {
+  int fds[KVSYNC_FILES_MAX];
+  unsigned int count, i;
+  bool dir, overflow;
+  int fd, ret = 0;
+  pthread_mutex_lock(&files->syncing);
+  pthread_mutex_lock(&files->lock);
+  count = files->count;
+  memcpy(fds, files->fds, count * sizeof(int));
+  dir = files->dir;
+  overflow = files->overflow;
+  files->count = 0;
+  files->dir = files->overflow = false;
+  pthread_mutex_unlock(&files->lock);
+  for (i = 0; i < count; i++) {
+    if (!overflow && fdatasync(fds[i]) < 0)
+      ret = ERR_FILACCESS;
+    close(fds[i]);
+  }
+  if (dir || overflow) {
+    if ((fd = open(dirname, O_RDONLY | O_DIRECTORY)) < 0) {
+      ret = ERR_FILACCESS;
+    } else {
+      if ((overflow ? syncfs(fd) : fsync(fd)) < 0)
+        ret = ERR_FILACCESS;
+      close(fd);
+    }
+  }
+  pthread_mutex_unlock(&files->syncing);
+  return ret;
+}
+
+/* Destroys FILES, closing the files it tracks without syncing them. */
+void kvsync_files_destroy(kvsync_files_t *files) {
+  unsigned int i;
+  for (i = 0; i < files->count; i++)
+    close(files->fds[i]);
+  pthread_mutex_destroy(&files->lock);
+  pthread_mutex_destroy(&files->syncing);
+}
@@ -0,0 +1,106 @@
+#ifndef __KV_SYNC__
+#define __KV_SYNC__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+/* KVSync decides when writes are synced to disk, according to one of three
+ * durability modes:
+ *
+ *    KVSYNC_NONE    writes are left to the operating system to write back, so
+ *                   a write is only as durable as the page cache.
+ *    KVSYNC_ALWAYS  every write is synced (fdatasync) before it completes.
+ *    KVSYNC_GROUP   every write is synced before it completes, but concurrent
+ *                   writers share syncs: a background thread syncs once the
+ *                   first write waiting has waited GROUP_INTERVAL microseconds
+ *                   or GROUP_SIZE writes are waiting, whichever comes first,
+ *                   and completes all writes made before the sync began.
+ *
+ * A writer calls kvsync_commit after each write, once the write has reached
+ * the operating system, which returns when the write is durable. What a sync
+ * does is up to the user of KVSync, which passes a function making all writes
+ * completed so far durable.
+ *
+ * A failed sync is not retried: since the operating system may have dropped
+ * the pages which failed to be written, every later commit fails as well.
+ *
+ * Users whose writes go to many files track those written since the last sync
+ * in a kvsync_files_t, so that a sync only flushes them (and their directory,
+ * if files were created, removed or renamed), rather than the file system.
+ *
+ * With KVSYNC_ALWAYS, the KVSTORE_FILES engine of KVStore syncs the entry file
+ * written (and the directory, when a file is created, removed or renamed), and
+ * the other engines sync their log. A write batch counts as a single write.
+ */
+
+/* The default longest time a write waits for others to share its sync. */
+#define KVSYNC_GROUP_INTERVAL 1000
+
+/* The default number of waiting writes which triggers a sync at once. */
+#define KVSYNC_GROUP_SIZE 32
+
+/* The durability modes. */
+typedef enum {
+  KVSYNC_NONE,   /* Never sync. */
+  KVSYNC_ALWAYS, /* Sync every write. */
+  KVSYNC_GROUP,  /* Sync every write, sharing syncs among concurrent writers. */
+} kvsync_mode_t;
+
+/* The most files a kvsync_files_t tracks; past them, a sync flushes the file
+ * system holding them instead. */
+#define KVSYNC_FILES_MAX 256
+
+/* Options selecting a durability mode. */
+typedef struct {
+  kvsync_mode_t mode;          /* The durability mode. */
+  unsigned int group_interval; /* KVSYNC_GROUP: the longest wait for a sync, in microseconds. */
+  unsigned int group_size;     /* KVSYNC_GROUP: the number of waiting writes which syncs at once. */
+} kvsync_opts_t;
+
+/* A function making all writes completed so far durable. Returns 0 if
+ * successful, else a negative error code. */
+typedef int (*kvsync_fn_t)(void *arg);
+
+/* A KVSync. */
+typedef struct {
+  kvsync_opts_t opts;     /* The durability mode. */
+  kvsync_fn_t sync;       /* Makes the writes durable. */
+  void *arg;              /* The argument passed to SYNC. */
+  pthread_mutex_t lock;   /* Protects the fields below. */
+  pthread_cond_t pending; /* Signaled when writes are waiting or STOP is set. */
+  pthread_cond_t synced;  /* Signaled when a sync completes. */
+  uint64_t written;       /* The number of writes committed. */
+  uint64_t durable;       /* The number of those which are durable. */
+  uint64_t syncs;         /* The number of syncs made. */
+  int error;              /* The error of the first failed sync, or 0. */
+  bool stop;              /* Whether the thread is to exit. */
+  pthread_t thread;       /* KVSYNC_GROUP: the thread making the syncs. */
+} kvsync_t;
+
+/* The files written since the last sync, within a directory. */
+typedef struct {
+  pthread_mutex_t lock;    /* Protects the fields below. */
+  pthread_mutex_t syncing; /* Held throughout a sync, so that a sync returns only
+                              once those in progress have completed. */
+  int fds[KVSYNC_FILES_MAX]; /* The open descriptors of the files written. */
+  unsigned int count;      /* The number of FDS. */
+  bool dir;                /* Whether files were created, removed or renamed. */
+  bool overflow;           /* Whether more files were written than FDS holds. */
+} kvsync_files_t;
+
+void kvsync_opts_default(kvsync_opts_t *);
+int kvsync_mode_from_string(const char *name, kvsync_mode_t *mode);
+
+int kvsync_init(kvsync_t *, const kvsync_opts_t *opts, kvsync_fn_t sync, void *arg);
+int kvsync_commit(kvsync_t *);
+void kvsync_stats(kvsync_t *, uint64_t *commits, uint64_t *syncs);
+void kvsync_close(kvsync_t *);
+
+void kvsync_files_init(kvsync_files_t *);
+void kvsync_files_add(kvsync_files_t *, int fd, bool created);
+void kvsync_files_dir(kvsync_files_t *);
+int kvsync_files_sync(kvsync_files_t *, const char *dirname);
+void kvsync_files_destroy(kvsync_files_t *);
+
+#endif
@@ -0,0 +1,383 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "utlist.h"
+#include "kvepoch.h"
+#include "kvhash.h"
+#include "kvttl.h"
+
+/* Returns the current time, in seconds since the epoch. */
+uint64_t kvttl_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return now.tv_sec;
+}
+
+/* Writes the name NAME of a file of TTL into FILENAME. */
+static void kvttl_filename(kvttl_t *ttl, const char *name, char *filename) {
+  sprintf(filename, "%s/%s", ttl->dirname, name);
+}
+
+/* Allocates a lookup table of NBUCKETS empty buckets. */
+static kvttl_table_t *kvttl_table_new(size_t nbuckets) {
+  kvttl_table_t *table;
+  table = calloc(1, sizeof(kvttl_table_t) + nbuckets * sizeof(kvttl_node_t *));
+  if (!table)
+    fatal_malloc();
+  table->mask = nbuckets - 1;
+  return table;
+}
+
+/* Allocates the node of KEY, whose hash is HASH, with EXPIRES. */
+static kvttl_node_t *kvttl_node_new(uint64_t hash, const char *key, uint64_t expires) {
+  size_t len = strlen(key) + 1;
+  kvttl_node_t *node = malloc(sizeof(kvttl_node_t) + len);
+  if (!node)
+    fatal_malloc();
+  node->next = NULL;
+  node->hash = hash;
+  node->expires = expires;
+  memcpy(node->key, key, len);
+  return node;
+}
+
+/* Returns the link to the node of KEY, whose hash is HASH, within the lookup
+ * table of TTL: the pointer to the node, which is NULL if there is none. */
+static kvttl_node_t **kvttl_link(kvttl_t *ttl, uint64_t hash, const char *key) {
+  kvttl_node_t **link = &ttl->table->buckets[hash & ttl->table->mask];
+  while (*link != NULL && ((*link)->hash != hash || strcmp((*link)->key, key) != 0))
+    link = &(*link)->next;
+  return link;
+}
+
+/* Doubles the number of buckets of the lookup table of TTL. Since nodes are
+ * linked through their buckets, every node is copied into the new table,
+ * which is then published at once. */
+static void kvttl_grow(kvttl_t *ttl) {
+  kvttl_table_t *old = ttl->table, *table = kvttl_table_new((old->mask + 1) * 2);
+  kvttl_node_t *node, *next, *copy, **bucket;
+  size_t i;
+  for (i = 0; i <= old->mask; i++) {
+    for (node = old->buckets[i]; node != NULL; node = node->next) {
+      copy = kvttl_node_new(node->hash, node->key, node->expires);
+      bucket = &table->buckets[node->hash & table->mask];
+      copy->next = *bucket;
+      *bucket = copy;
+    }
+  }
+  __atomic_store_n(&ttl->table, table, __ATOMIC_RELEASE);
+  for (i = 0; i <= old->mask; i++) {
+    for (node = old->buckets[i]; node != NULL; node = next) {
+      next = node->next;
+      kvepoch_retire(node);
+    }
+  }
+  kvepoch_retire(old);
+}
+
+/* Sets the expiry time of KEY within the lookup table of TTL to EXPIRES, or
+ * removes it if EXPIRES is 0, retiring the node it replaces. */
+static void kvttl_publish(kvttl_t *ttl, const char *key, uint64_t expires) {
+  uint64_t hash = kvhash_str(key);
+  kvttl_node_t **link = kvttl_link(ttl, hash, key), *old = *link, *node, **bucket;
+  if (old == NULL && expires == 0)
+    return;
+  if (old == NULL) {
+    node = kvttl_node_new(hash, key, expires);
+    bucket = &ttl->table->buckets[hash & ttl->table->mask];
+    node->next = *bucket;
+    __atomic_store_n(bucket, node, __ATOMIC_RELEASE);
+    if (ttl->count + 1 > ttl->table->mask + 1)
+      kvttl_grow(ttl);
+    return;
+  }
+  node = expires != 0 ? kvttl_node_new(hash, key, expires) : NULL;
+  if (node != NULL)
+    node->next = old->next;
+  __atomic_store_n(link, node ? node : old->next, __ATOMIC_RELEASE);
+  kvepoch_retire(old);
+}
+
+/* Sets the expiry time of KEY within the map of TTL to EXPIRES, or clears it
+ * if EXPIRES is 0, without recording it. */
+static void kvttl_apply(kvttl_t *ttl, const char *key, uint64_t expires) {
+  kvttl_entry_t *ent;
+  kvttl_publish(ttl, key, expires);
+  HASH_FIND_STR(ttl->entries, key, ent);
+  if (ent != NULL) {
+    kvwheel_remove(&ttl->wheel, &ent->timer);
+    if (expires == 0) {
+      HASH_DEL(ttl->entries, ent);
+      free(ent->key);
+      free(ent);
+      __atomic_sub_fetch(&ttl->count, 1, __ATOMIC_RELEASE);
+      return;
+    }
+  } else if (expires != 0) {
+    ent = calloc(1, sizeof(kvttl_entry_t));
+    if (!ent || !(ent->key = strdup(key)))
+      fatal_malloc();
+    HASH_ADD_KEYPTR(hh, ttl->entries, ent->key, strlen(ent->key), ent);
+    __atomic_add_fetch(&ttl->count, 1, __ATOMIC_RELEASE);
+  } else {
+    return;
+  }
+  ent->timer.expires = expires;
+  kvwheel_add(&ttl->wheel, &ent->timer);
+}
+
+/* Writes the record of KEY with EXPIRES into BUF, which must be able to hold
+ * sizeof(kvttl_record_t) + MAX_KEYLEN bytes. Returns the size of the record. */
+static size_t kvttl_encode(char *buf, const char *key, uint64_t expires) {
+  kvttl_record_t record;
+  memset(&record, 0, sizeof(record));
+  record.expires = expires;
+  record.keylen = strlen(key);
+  memcpy(buf, &record, sizeof(record));
+  memcpy(buf + sizeof(record), key, record.keylen);
+  return sizeof(record) + record.keylen;
+}
+
+/* Writes the LEN bytes of DATA to FD. Returns 0 if successful, else a negative
+ * error code. */
+static int kvttl_write_all(int fd, const char *data, size_t len) {
+  ssize_t written;
+  while (len > 0) {
+    if ((written = write(fd, data, len)) <= 0)
+      return ERR_FILACCESS;
+    data += written;
+    len -= written;
+  }
+  return 0;
+}
+
+/* Rewrites the file of TTL with a record of each key within its map, and
+ * reopens it. Returns 0 if successful, else a negative error code. */
+static int kvttl_compact(kvttl_t *ttl) {
+  char filename[MAX_FILENAME], tmpname[MAX_FILENAME];
+  char buf[sizeof(kvttl_record_t) + MAX_KEYLEN];
+  kvttl_entry_t *ent, *tmp;
+  int fd, dirfd, ret = 0;
+  kvttl_filename(ttl, KVTTL_FILENAME, filename);
+  kvttl_filename(ttl, KVTTL_TMPNAME, tmpname);
+  if ((fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, S_IRUSR | S_IWUSR)) < 0)
+    return ERR_FILACCESS;
+  HASH_ITER(hh, ttl->entries, ent, tmp) {
+    if ((ret = kvttl_write_all(fd, buf, kvttl_encode(buf, ent->key, ent->timer.expires))) < 0)
+      break;
+  }
+  if (ret < 0 || fdatasync(fd) < 0 || rename(tmpname, filename) < 0) {
+    close(fd);
+    unlink(tmpname);
+    return ERR_FILACCESS;
+  }
+  if ((dirfd = open(ttl->dirname, O_RDONLY | O_DIRECTORY)) >= 0) {
+    fsync(dirfd);
+    close(dirfd);
+  }
+  if (ttl->fd >= 0)
+    close(ttl->fd);
+  ttl->fd = fd;
+  ttl->records = ttl->count;
+  ttl->dirty = false;
+  return 0;
+}
+
+/* Returns true if the file of TTL holds enough stale records to be
+ * rewritten. */
+static bool kvttl_bloated(kvttl_t *ttl) {
+  return ttl->records > 2 * (uint64_t)ttl->count && ttl->records >= KVTTL_COMPACT_MIN;
+}
+
+/* Rebuilds the map of TTL by replaying its file, dropping a torn record at
+ * its end. Returns 0 if successful, else a negative error code. */
+static int kvttl_replay(kvttl_t *ttl) {
+  char key[MAX_KEYLEN + 1];
+  kvttl_record_t record;
+  off_t offset = 0;
+  FILE *file;
+  if ((file = fdopen(dup(ttl->fd), "r")) == NULL)
+    return ERR_FILACCESS;
+  while (fread(&record, sizeof(record), 1, file) == 1) {
+    if (record.keylen == 0 || record.keylen > MAX_KEYLEN ||
+        fread(key, record.keylen, 1, file) != 1)
+      break;
+    key[record.keylen] = '\0';
+    kvttl_apply(ttl, key, record.expires);
+    offset += sizeof(record) + record.keylen;
+    ttl->records++;
+  }
+  fclose(file);
+  if (ftruncate(ttl->fd, offset) < 0)
+    return ERR_FILACCESS;
+  return 0;
+}
+
+/* Initializes TTL within DIRNAME, which must already exist, rebuilding its
+ * map from its file, if any. If DIRNAME is NULL, TTL has no file and keeps its
+ * expiry times in memory only. Returns 0 if successful, else a negative error
+ * code. */
+int kvttl_init(kvttl_t *ttl, char *dirname) {
+  char filename[MAX_FILENAME];
+  int ret;
+  ttl->entries = NULL;
+  ttl->table = kvttl_table_new(KVTTL_BUCKETS);
+  ttl->count = 0;
+  ttl->records = 0;
+  ttl->dirty = false;
+  ttl->fd = -1;
+  ttl->dirname = NULL;
+  kvwheel_init(&ttl->wheel, kvttl_now());
+  if (dirname == NULL)
+    return 0;
+  if (!(ttl->dirname = strdup(dirname)))
+    fatal_malloc();
+  kvttl_filename(ttl, KVTTL_TMPNAME, filename);
+  unlink(filename);
+  kvttl_filename(ttl, KVTTL_FILENAME, filename);
+  if ((ttl->fd = open(filename, O_RDWR | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR)) < 0)
+    return ERR_FILACCESS;
+  if ((ret = kvttl_replay(ttl)) < 0)
+    return ret;
+  if (kvttl_bloated(ttl))
+    return kvttl_compact(ttl);
+  return 0;
+}
+
+/* Appends the record of KEY with EXPIRES to the file of TTL, if it has one,
+ * syncing it if SYNC is true. Returns 0 if successful, else a negative error
+ * code. */
+static int kvttl_record(kvttl_t *ttl, const char *key, uint64_t expires, bool sync) {
+  char buf[sizeof(kvttl_record_t) + MAX_KEYLEN];
+  int ret;
+  if (ttl->fd < 0)
+    return 0;
+  if ((ret = kvttl_write_all(ttl->fd, buf, kvttl_encode(buf, key, expires))) < 0)
+    return ret;
+  ttl->records++;
+  if (sync && fdatasync(ttl->fd) < 0)
+    return ERR_FILACCESS;
+  ttl->dirty = !sync;
+  return 0;
+}
+
+/* Sets the expiry time of KEY within TTL to EXPIRES, which must not be 0,
+ * replacing any previous one. The change is synced to disk if SYNC is true.
+ * Returns 0 if successful, else a negative error code. */
+int kvttl_set(kvttl_t *ttl, const char *key, uint64_t expires, bool sync) {
+  int ret;
+  if (strlen(key) > MAX_KEYLEN || strlen(key) == 0)
+    return ERR_KEYLEN;
+  if ((ret = kvttl_record(ttl, key, expires, sync)) < 0)
+    return ret;
+  kvttl_apply(ttl, key, expires);
+  if (kvttl_bloated(ttl))
+    kvttl_compact(ttl);
+  return 0;
+}
+
+/* Clears the expiry time of KEY within TTL, if it has one. The change is
+ * synced to disk if SYNC is true. Returns 0 if successful, else a negative
+ * error code. */
+int kvttl_clear(kvttl_t *ttl, const char *key, bool sync) {
+  kvttl_entry_t *ent;
+  int ret;
+  HASH_FIND_STR(ttl->entries, key, ent);
+  if (ent == NULL)
+    return 0;
+  if ((ret = kvttl_record(ttl, key, 0, sync)) < 0)
+    return ret;
+  kvttl_apply(ttl, key, 0);
+  if (kvttl_bloated(ttl))
+    kvttl_compact(ttl);
+  return 0;
+}
+
+/* Returns the expiry time of KEY within TTL, or 0 if it has none. */
+uint64_t kvttl_get(kvttl_t *ttl, const char *key) {
+  kvttl_entry_t *ent;
+  HASH_FIND_STR(ttl->entries, key, ent);
+  return ent ? ent->timer.expires : 0;
+}
+
+/* Returns true if KEY has an expiry time within TTL which is not after NOW.
+ * Takes no lock, and may be called concurrently with writers. */
+bool kvttl_expired(kvttl_t *ttl, const char *key, uint64_t now) {
+  uint64_t hash = kvhash_str(key), expires = 0;
+  kvttl_table_t *table;
+  kvttl_node_t *node;
+  kvepoch_enter();
+  table = __atomic_load_n(&ttl->table, __ATOMIC_ACQUIRE);
+  node = __atomic_load_n(&table->buckets[hash & table->mask], __ATOMIC_ACQUIRE);
+  while (node != NULL && (node->hash != hash || strcmp(node->key, key) != 0))
+    node = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+  if (node != NULL)
+    expires = node->expires;
+  kvepoch_exit();
+  return expires != 0 && expires <= now;
+}
+
+/* Advances the timers of TTL to NOW, and stores the keys whose expiry time
+ * passed meanwhile into *KEYS, a malloc()d array of malloc()d strings which
+ * should be free()d later. Their expiry times are kept (so they remain
+ * expired) until cleared, but they are not returned again unless they are set
+ * again. Returns the number of keys stored. */
+unsigned int kvttl_due(kvttl_t *ttl, uint64_t now, char ***keys) {
+  kvwheel_timer_t *due = kvwheel_advance(&ttl->wheel, now), *timer;
+  unsigned int count = 0;
+  DL_COUNT(due, timer, count);
+  *keys = NULL;
+  if (count == 0)
+    return 0;
+  if ((*keys = malloc(count * sizeof(char *))) == NULL)
+    fatal_malloc();
+  count = 0;
+  /* TIMER is the first member of its entry. */
+  DL_FOREACH(due, timer) {
+    if (((*keys)[count++] = strdup(((kvttl_entry_t *)timer)->key)) == NULL)
+      fatal_malloc();
+  }
+  return count;
+}
+
+/* Syncs the records appended to the file of TTL since it was last synced.
+ * Returns 0 if successful, else a negative error code. */
+int kvttl_sync(kvttl_t *ttl) {
+  if (!ttl->dirty)
+    return 0;
+  if (fdatasync(ttl->fd) < 0)
+    return ERR_FILACCESS;
+  ttl->dirty = false;
+  return 0;
+}
+
+/* Releases the resources of TTL, leaving its file in place. No reader may use
+ * TTL anymore. */
+void kvttl_close(kvttl_t *ttl) {
+  kvttl_entry_t *ent, *tmp;
+  kvttl_node_t *node, *next;
+  size_t i;
+  HASH_ITER(hh, ttl->entries, ent, tmp) {
+    HASH_DEL(ttl->entries, ent);
+    free(ent->key);
+    free(ent);
+  }
+  for (i = 0; i <= ttl->table->mask; i++) {
+    for (node = ttl->table->buckets[i]; node != NULL; node = next) {
+      next = node->next;
+      free(node);
+    }
+  }
+  free(ttl->table);
+  ttl->table = NULL;
+  /* Release the nodes retired meanwhile along with the table. */
+  kvepoch_synchronize();
+  if (ttl->fd >= 0)
+    close(ttl->fd);
+  ttl->fd = -1;
+  free(ttl->dirname);
+}
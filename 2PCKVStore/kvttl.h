@@ -0,0 +1,104 @@
+#ifndef __KV_TTL__
+#define __KV_TTL__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "uthash.h"
+#include "kvconstants.h"
+#include "kvwheel.h"
+
+/* KVTTL keeps the expiry times of the keys of a KVStore which were written
+ * with a time to live, apart from its storage engine, so that every engine
+ * supports them alike.
+ *
+ * Expiry times are in seconds since the epoch (see kvttl_now), so that they
+ * survive restarts. They are recorded in a single file within the store
+ * directory, KVTTL_FILENAME, to which a kvttl_record_t followed by the key is
+ * appended whenever the expiry time of a key is set or cleared (an EXPIRES of
+ * 0). The map from key to expiry time is rebuilt upon initialization by
+ * replaying the file, whose last record may be torn by a crash and is then
+ * dropped. Once the file holds more than twice as many records as there are
+ * keys with an expiry time (and at least KVTTL_COMPACT_MIN), it is rewritten
+ * with only the current ones, through a temporary file renamed into place.
+ *
+ * A KVTTL initialized without a directory has no file, and its expiry times
+ * are lost when it is closed.
+ *
+ * Every expiry time is also armed in a timer wheel (see kvwheel.h), so that
+ * the keys due are found without looking at the others (see kvttl_due).
+ *
+ * KVTTL does no locking of its own; KVStore serializes access to it, except
+ * that kvttl_expired, which every read of a key of a store with expiry times
+ * makes, takes no lock and may run concurrently with writers. It looks the key
+ * up in a second hash table, kept just as KVIndex keeps its chains (see
+ * kvindex.h): a node holding a key and its expiry time is never modified once
+ * published, but replaced with a single atomic store, and retired to KVEpoch.
+ *
+ * Snapshots of a KVStore see its keys as the storage engine held them,
+ * regardless of their expiry times.
+ */
+
+#define KVTTL_FILENAME "ttl"
+#define KVTTL_TMPNAME "ttl.tmp"
+
+/* The number of records below which the file is never rewritten. */
+#define KVTTL_COMPACT_MIN 1024
+
+/* The header of a record of the file. */
+typedef struct {
+  uint64_t expires; /* The expiry time of the key, or 0 if it was cleared. */
+  uint32_t keylen;  /* The length of the key following the header. */
+  uint32_t unused;
+} kvttl_record_t;
+
+/* The expiry time of a key. */
+typedef struct {
+  kvwheel_timer_t timer; /* Armed for the expiry time, which is TIMER.expires. */
+  char *key;             /* The key. Also the key of the hash table. */
+  UT_hash_handle hh;     /* Makes this structure hashable. */
+} kvttl_entry_t;
+
+/* The expiry time of a key, as kvttl_expired looks it up. */
+typedef struct kvttl_node {
+  struct kvttl_node *next; /* The next node within the same bucket. */
+  uint64_t hash;           /* kvhash_str(KEY). */
+  uint64_t expires;        /* The expiry time of KEY. */
+  char key[];              /* The key, terminated. */
+} kvttl_node_t;
+
+/* A version of the lookup table of kvttl_expired. */
+typedef struct {
+  size_t mask;             /* The number of buckets, minus one. */
+  kvttl_node_t *buckets[]; /* The nodes of each bucket. */
+} kvttl_table_t;
+
+/* The initial number of buckets of the lookup table. */
+#define KVTTL_BUCKETS 64
+
+/* A KVTTL. */
+typedef struct {
+  char *dirname;          /* The directory holding the file, or NULL if there is none. */
+  int fd;                 /* The file, open for appending, or -1 if there is none. */
+  kvttl_entry_t *entries; /* The keys with an expiry time (a uthash table). */
+  kvwheel_t wheel;        /* The timers of ENTRIES. */
+  kvttl_table_t *table;   /* The expiry times of ENTRIES, for kvttl_expired. */
+  uint32_t count;         /* The number of ENTRIES, which may be read atomically
+                             without serializing. */
+  uint64_t records;       /* The number of records within the file. */
+  bool dirty;             /* Whether records were appended since the last sync. */
+} kvttl_t;
+
+uint64_t kvttl_now(void);
+
+int kvttl_init(kvttl_t *, char *dirname);
+
+int kvttl_set(kvttl_t *, const char *key, uint64_t expires, bool sync);
+int kvttl_clear(kvttl_t *, const char *key, bool sync);
+uint64_t kvttl_get(kvttl_t *, const char *key);
+bool kvttl_expired(kvttl_t *, const char *key, uint64_t now);
+unsigned int kvttl_due(kvttl_t *, uint64_t now, char ***keys);
+
+int kvttl_sync(kvttl_t *);
+void kvttl_close(kvttl_t *);
+
+#endif
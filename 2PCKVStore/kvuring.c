@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "kvuring.h"
+
+/* The number of submission queue entries: three per file read. */
+#define KVURING_ENTRIES 256
+
+/* The requests of the chain reading a file, kept in the low bits of the
+ * user data of their entries, above which is the index of the read. */
+enum { KVURING_OPEN, KVURING_READ, KVURING_CLOSE };
+
+static int kvuring_setup(unsigned int entries, struct io_uring_params *p) {
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int kvuring_enter(int fd, unsigned int submit, unsigned int wait) {
+  return syscall(__NR_io_uring_enter, fd, submit, wait, IORING_ENTER_GETEVENTS, NULL, 0);
+}
+
+static int kvuring_register(int fd, unsigned int opcode, void *arg, unsigned int nargs) {
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nargs);
+}
+
+/* Unmaps the rings of RING and closes it, leaving it unavailable. */
+static void kvuring_unmap(kvuring_t *ring) {
+  if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+    munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED)
+    munmap(ring->sq_ring, ring->sq_ring_size);
+  ring->sqes = NULL;
+  ring->sq_ring = ring->cq_ring = NULL;
+  if (ring->fd >= 0)
+    close(ring->fd);
+  ring->fd = -1;
+}
+
+/* Initializes RING, which is left unavailable (see kvuring_available) if
+ * io_uring cannot be used. */
+void kvuring_init(kvuring_t *ring) {
+  struct io_uring_params p;
+  int slots[KVURING_FILES];
+  unsigned int i;
+  memset(ring, 0, sizeof(kvuring_t));
+  pthread_mutex_init(&ring->lock, NULL);
+  memset(&p, 0, sizeof(p));
+  if ((ring->fd = kvuring_setup(KVURING_ENTRIES, &p)) < 0) {
+    ring->fd = -1;
+    return;
+  }
+  ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_ring_size > ring->sq_ring_size)
+      ring->sq_ring_size = ring->cq_ring_size;
+    ring->cq_ring_size = ring->sq_ring_size;
+  }
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    ring->cq_ring = ring->sq_ring;
+  else
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+  ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring->fd, IORING_OFF_SQES);
+  if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+    kvuring_unmap(ring);
+    return;
+  }
+  ring->sq_head = (unsigned int *)((char *)ring->sq_ring + p.sq_off.head);
+  ring->sq_tail = (unsigned int *)((char *)ring->sq_ring + p.sq_off.tail);
+  ring->sq_mask = (unsigned int *)((char *)ring->sq_ring + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned int *)((char *)ring->sq_ring + p.sq_off.array);
+  ring->cq_head = (unsigned int *)((char *)ring->cq_ring + p.cq_off.head);
+  ring->cq_tail = (unsigned int *)((char *)ring->cq_ring + p.cq_off.tail);
+  ring->cq_mask = (unsigned int *)((char *)ring->cq_ring + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring + p.cq_off.cqes);
+  /* An empty table of files for the chains to open files into. Kernels which
+   * cannot register one cannot open files into it either. */
+  for (i = 0; i < KVURING_FILES; i++)
+    slots[i] = -1;
+  if (kvuring_register(ring->fd, IORING_REGISTER_FILES, slots, KVURING_FILES) < 0)
+    kvuring_unmap(ring);
+}
+
+/* Returns true if RING reads files with io_uring, rather than falling back to
+ * plain system calls. The caller must hold the lock of RING, unless it only
+ * reports on it. */
+bool kvuring_available(kvuring_t *ring) { return ring->fd >= 0; }
+
+/* Reads READ with plain system calls. */
+static void kvuring_read_sync(kvuring_read_t *read_) {
+  int fd;
+  if ((fd = open(read_->filename, O_RDONLY)) < 0) {
+    read_->result = -errno;
+    return;
+  }
+  read_->result = read(fd, read_->buf, read_->size);
+  if (read_->result < 0)
+    read_->result = -errno;
+  close(fd);
+}
+
+/* Queues into RING the request of type OP of the chain reading READ, the
+ * INDEXth read, into SLOT of the table of files. */
+static void kvuring_queue(kvuring_t *ring, kvuring_read_t *read_, unsigned int index,
+                          unsigned int slot, int op) {
+  unsigned int tail = *ring->sq_tail, i = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[i];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->user_data = (uint64_t)index << 2 | op;
+  if (op == KVURING_OPEN) {
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)read_->filename;
+    sqe->open_flags = O_RDONLY;
+    sqe->file_index = slot + 1;
+  } else if (op == KVURING_READ) {
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = slot;
+    sqe->addr = (uintptr_t)read_->buf;
+    sqe->len = read_->size;
+    sqe->off = 0;
+  } else {
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = slot + 1;
+  }
+  /* Hard links run the next request even if this one fails, so that the
+   * slot is always closed, even after a short read. */
+  if (op != KVURING_CLOSE)
+    sqe->flags |= IOSQE_IO_HARDLINK;
+  if (op == KVURING_READ)
+    sqe->flags |= IOSQE_FIXED_FILE;
+  ring->sq_array[i] = i;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Reads up to KVURING_FILES of READS, COUNT of them, through RING. Returns
+ * false if the ring failed, in which case it must not be used anymore. */
+static bool kvuring_read_chunk(kvuring_t *ring, kvuring_read_t *reads, unsigned int count) {
+  unsigned int i, head, submit = 3 * count, done = 0;
+  struct io_uring_cqe *cqe;
+  int ret;
+  for (i = 0; i < count; i++) {
+    reads[i].result = -ECANCELED;
+    kvuring_queue(ring, &reads[i], i, i, KVURING_OPEN);
+    kvuring_queue(ring, &reads[i], i, i, KVURING_READ);
+    kvuring_queue(ring, &reads[i], i, i, KVURING_CLOSE);
+  }
+  while (done < 3 * count) {
+    if ((ret = kvuring_enter(ring->fd, submit, 1)) < 0) {
+      if (errno != EINTR)
+        return false;
+      ret = 0;
+    }
+    ring->submits++;
+    submit -= ret;
+    head = *ring->cq_head;
+    for (; head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE); head++, done++) {
+      cqe = &ring->cqes[head & *ring->cq_mask];
+      i = cqe->user_data >> 2;
+      /* A read following a failed open fails as well, but the reason is
+       * that of the open. */
+      if ((cqe->user_data & 3) == KVURING_OPEN && cqe->res < 0)
+        reads[i].result = cqe->res;
+      else if ((cqe->user_data & 3) == KVURING_READ && reads[i].result == -ECANCELED)
+        reads[i].result = cqe->res;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  }
+  ring->files += count;
+  return true;
+}
+
+/* Reads the first SIZE bytes (at most) of the file of each of the COUNT
+ * READS into its BUF, setting its RESULT. Files are read with io_uring,
+ * KVURING_FILES at a time, if RING is available; a file missing is reported
+ * as -ENOENT, and a file which could not be read otherwise is read again
+ * with plain system calls. */
+void kvuring_read_files(kvuring_t *ring, kvuring_read_t *reads, unsigned int count) {
+  unsigned int i, j, n;
+  bool ok;
+  for (i = 0; i < count; i += n) {
+    n = count - i < KVURING_FILES ? count - i : KVURING_FILES;
+    pthread_mutex_lock(&ring->lock);
+    ok = kvuring_available(ring);
+    /* A ring which failed is in an unknown state, and is given up on. */
+    if (ok && !(ok = kvuring_read_chunk(ring, reads + i, n)))
+      kvuring_unmap(ring);
+    pthread_mutex_unlock(&ring->lock);
+    for (j = i; j < i + n; j++)
+      if (!ok || (reads[j].result < 0 && reads[j].result != -ENOENT))
+        kvuring_read_sync(&reads[j]);
+  }
+}
+
+/* Destroys RING. */
+void kvuring_destroy(kvuring_t *ring) {
+  kvuring_unmap(ring);
+  pthread_mutex_destroy(&ring->lock);
+}
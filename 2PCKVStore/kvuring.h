@@ -0,0 +1,62 @@
+#ifndef __KV_URING__
+#define __KV_URING__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <linux/io_uring.h>
+
+/* KVURing reads many small files with io_uring, so that a thread needing a
+ * batch of them (a scan, or rebuilding an index) hands all of them to the
+ * kernel at once and waits once, instead of stalling on an open, a read and a
+ * close per file. A single file, as a GET reads, costs one system call rather
+ * than three.
+ *
+ * Each file is read by a chain of three linked requests, opening it into a
+ * slot of a table of files registered with the ring, reading it and closing
+ * the slot again, so that no descriptor has to come back to user space in
+ * between. Up to KVURING_FILES chains are submitted with one system call.
+ *
+ * A ring serves one thread at a time, so a caller with many threads spreads
+ * them over several rings. Files are only read this way: a file created or
+ * truncated through a ring is opened by a kernel worker rather than inline,
+ * which costs more than the system calls saved.
+ *
+ * The ring is made with the raw system calls, without liburing. Where
+ * io_uring is unavailable (an old kernel, or a sandbox forbidding it), and for
+ * any file the ring fails to read for other reasons than its absence, files
+ * are read with plain system calls instead, so callers need not care.
+ */
+
+/* The largest number of files read with one submission. */
+#define KVURING_FILES 64
+
+/* A read of the beginning of a file, for kvuring_read_files. */
+typedef struct {
+  const char *filename; /* The file to read. */
+  char *buf;            /* Where to read it. */
+  size_t size;          /* The number of bytes to read, at most. */
+  ssize_t result;       /* The number of bytes read, or a negative errno. */
+} kvuring_read_t;
+
+/* A ring. */
+typedef struct {
+  int fd;                       /* The ring, or -1 if io_uring is unavailable. */
+  unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned int *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;    /* The submission queue entries. */
+  struct io_uring_cqe *cqes;    /* The completion queue entries. */
+  void *sq_ring, *cq_ring;      /* The mappings of the rings (which may be the same). */
+  size_t sq_ring_size, cq_ring_size, sqes_size;
+  uint64_t submits;             /* The number of system calls made to submit reads. */
+  uint64_t files;               /* The number of files read through the ring. */
+  pthread_mutex_t lock;         /* Serializes the users of the ring. */
+} kvuring_t;
+
+void kvuring_init(kvuring_t *);
+bool kvuring_available(kvuring_t *);
+void kvuring_read_files(kvuring_t *, kvuring_read_t *reads, unsigned int count);
+void kvuring_destroy(kvuring_t *);
+
+#endif
@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kvconstants.h"
+#include "kvversions.h"
+
+/* Initializes VERSIONS, which keeps no versions. */
+void kvversions_init(kvversions_t *versions) {
+  skiplist_init(&versions->keys);
+  versions->count = 0;
+}
+
+/* Frees a list of versions, oldest first. */
+static void kvversions_free_list(void *list) {
+  kvversion_t *version = list, *next;
+  for (; version != NULL; version = next) {
+    next = version->next;
+    free(version);
+  }
+}
+
+/* Frees VERSIONS and all versions kept within it. */
+void kvversions_free(kvversions_t *versions) {
+  skiplist_free(&versions->keys, kvversions_free_list);
+  versions->count = 0;
+}
+
+/* Records that the write numbered SEQ replaced the version of KEY described
+ * by STATE and VALUE. Writes to KEY must be recorded in order. A write which
+ * replaced KEY more than once (such as a write batch) keeps the version it
+ * replaced first. */
+void kvversions_add(kvversions_t *versions, const char *key, uint64_t seq, kvversion_state_t state,
+                    const char *value) {
+  skiplist_node_t *node = skiplist_find(&versions->keys, key);
+  kvversion_t *version, *last = node ? node->value : NULL;
+  for (; last != NULL && last->next != NULL; last = last->next)
+    ;
+  if (last != NULL && last->seq == seq)
+    return;
+  if (state != KVVERSION_VALUE)
+    value = "";
+  version = malloc(sizeof(kvversion_t) + strlen(value) + 1);
+  if (!version)
+    fatal_malloc();
+  version->seq = seq;
+  version->state = state;
+  version->next = NULL;
+  strcpy(version->value, value);
+  if (last != NULL)
+    last->next = version;
+  else
+    skiplist_insert(&versions->keys, key, version, NULL);
+  versions->count++;
+}
+
+/* Returns the version of KEY which a snapshot taken at SEQ sees, or NULL if
+ * KEY has not been written since, so that it sees the current version. */
+kvversion_t *kvversions_find(kvversions_t *versions, const char *key, uint64_t seq) {
+  skiplist_node_t *node = skiplist_find(&versions->keys, key);
+  kvversion_t *version = node ? node->value : NULL;
+  while (version != NULL && version->seq <= seq)
+    version = version->next;
+  return version;
+}
+
+/* Drops the versions no snapshot taken at SEQ or later needs, which are those
+ * replaced by writes numbered SEQ or below. */
+void kvversions_prune(kvversions_t *versions, uint64_t seq) {
+  skiplist_node_t *node, *next;
+  kvversion_t *version, *drop;
+  for (node = skiplist_first(&versions->keys); node != NULL; node = next) {
+    next = node->next[0];
+    version = node->value;
+    while (version != NULL && version->seq <= seq) {
+      drop = version;
+      version = version->next;
+      free(drop);
+      versions->count--;
+    }
+    if (version == NULL)
+      skiplist_remove(&versions->keys, node->key, NULL);
+    else
+      node->value = version;
+  }
+}
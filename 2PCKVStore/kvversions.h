@@ -0,0 +1,50 @@
+#ifndef __KV_VERSIONS__
+#define __KV_VERSIONS__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "skiplist.h"
+
+/* KVVersions keeps the past versions of keys which the snapshots of a KVStore
+ * still need.
+ *
+ * Every write to a KVStore while a snapshot is open is numbered by a sequence
+ * number, and the version of the key it replaced is recorded here under that
+ * number, oldest first. A snapshot taken at sequence number S sees, for each
+ * key, the version replaced by the first write numbered above S, or the
+ * current version if there is none. Versions are dropped once no open snapshot
+ * is older than the write which replaced them.
+ *
+ * A KVVersions does no locking of its own.
+ */
+
+/* The states of a version of a key. */
+typedef enum {
+  KVVERSION_VALUE,  /* The key had the value stored with the version. */
+  KVVERSION_ABSENT, /* The key was not present. */
+  KVVERSION_LARGE,  /* The key had a large value, which is not kept. */
+} kvversion_state_t;
+
+/* A past version of a key. */
+typedef struct kvversion {
+  uint64_t seq;            /* The sequence number of the write which replaced it. */
+  kvversion_state_t state; /* The state of the key. */
+  struct kvversion *next;  /* The version replaced by the next write. */
+  char value[];            /* KVVERSION_VALUE: the value of the key. */
+} kvversion_t;
+
+/* The past versions of keys. */
+typedef struct {
+  skiplist_t keys; /* The versions of each key (kvversion_t *), oldest first. */
+  uint64_t count;  /* The number of versions kept. */
+} kvversions_t;
+
+void kvversions_init(kvversions_t *);
+void kvversions_free(kvversions_t *);
+
+void kvversions_add(kvversions_t *, const char *key, uint64_t seq, kvversion_state_t state,
+                    const char *value);
+kvversion_t *kvversions_find(kvversions_t *, const char *key, uint64_t seq);
+void kvversions_prune(kvversions_t *, uint64_t seq);
+
+#endif
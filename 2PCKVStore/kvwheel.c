@@ -0,0 +1,92 @@
+#include <string.h>
+#include "utlist.h"
+#include "kvwheel.h"
+
+/* The number of ticks the whole wheel spans. */
+#define KVWHEEL_SPAN (1ULL << (KVWHEEL_BITS * KVWHEEL_LEVELS))
+
+/* Initializes the empty wheel WHEEL at tick NOW. */
+void kvwheel_init(kvwheel_t *wheel, uint64_t now) {
+  memset(wheel, 0, sizeof(kvwheel_t));
+  wheel->now = now;
+}
+
+/* Puts TIMER, whose deadline must not have passed, into the slot of WHEEL
+ * holding its deadline. */
+static void kvwheel_place(kvwheel_t *wheel, kvwheel_timer_t *timer) {
+  unsigned int level, shift;
+  kvwheel_timer_t **slot = &wheel->overflow;
+  for (level = 0; level < KVWHEEL_LEVELS; level++) {
+    shift = KVWHEEL_BITS * (level + 1);
+    if (timer->expires >> shift == wheel->now >> shift) {
+      slot = &wheel->slots[level][(timer->expires >> (shift - KVWHEEL_BITS)) % KVWHEEL_SLOTS];
+      break;
+    }
+  }
+  timer->slot = slot;
+  DL_APPEND(*slot, timer);
+}
+
+/* Arms TIMER within WHEEL to be due at tick TIMER->expires, or at the next
+ * tick if that has passed already. TIMER must not be armed. */
+void kvwheel_add(kvwheel_t *wheel, kvwheel_timer_t *timer) {
+  uint64_t expires = timer->expires;
+  if (timer->expires <= wheel->now)
+    timer->expires = wheel->now + 1;
+  kvwheel_place(wheel, timer);
+  timer->expires = expires;
+  wheel->count++;
+}
+
+/* Disarms TIMER of WHEEL, if it is armed. */
+void kvwheel_remove(kvwheel_t *wheel, kvwheel_timer_t *timer) {
+  if (timer->slot == NULL)
+    return;
+  DL_DELETE(*timer->slot, timer);
+  timer->slot = NULL;
+  wheel->count--;
+}
+
+/* Moves the timers of SLOT of WHEEL into the slots now holding their
+ * deadlines. */
+static void kvwheel_cascade(kvwheel_t *wheel, kvwheel_timer_t **slot) {
+  kvwheel_timer_t *list = *slot, *timer, *tmp;
+  *slot = NULL;
+  DL_FOREACH_SAFE(list, timer, tmp) {
+    DL_DELETE(list, timer);
+    kvwheel_place(wheel, timer);
+  }
+}
+
+/* Advances WHEEL to tick NOW. Returns the timers which became due on the way,
+ * disarmed and linked into a list by their PREV and NEXT (see utlist.h), or
+ * NULL if there are none. A timer whose deadline has passed already is due at
+ * the first tick after it was armed. */
+kvwheel_timer_t *kvwheel_advance(kvwheel_t *wheel, uint64_t now) {
+  kvwheel_timer_t *due = NULL, *list, *timer;
+  unsigned int level;
+  while (wheel->now < now) {
+    if (wheel->count == 0) {
+      wheel->now = now;
+      break;
+    }
+    wheel->now++;
+    /* Cascade from the top down, so that the timers moved into a slot which
+     * is itself reached are cascaded again. */
+    if (wheel->now % KVWHEEL_SPAN == 0)
+      kvwheel_cascade(wheel, &wheel->overflow);
+    for (level = KVWHEEL_LEVELS - 1; level > 0; level--) {
+      if (wheel->now % (1ULL << (KVWHEEL_BITS * level)) == 0)
+        kvwheel_cascade(
+            wheel, &wheel->slots[level][(wheel->now >> (KVWHEEL_BITS * level)) % KVWHEEL_SLOTS]);
+    }
+    list = wheel->slots[0][wheel->now % KVWHEEL_SLOTS];
+    wheel->slots[0][wheel->now % KVWHEEL_SLOTS] = NULL;
+    DL_FOREACH(list, timer) {
+      timer->slot = NULL;
+      wheel->count--;
+    }
+    DL_CONCAT(due, list);
+  }
+  return due;
+}
@@ -0,0 +1,53 @@
+#ifndef __KV_WHEEL__
+#define __KV_WHEEL__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* KVWheel is a hierarchical timer wheel, which finds the timers which are due
+ * as time advances at a constant cost per timer, however many timers are armed
+ * and however far apart their deadlines are.
+ *
+ * Time is counted in ticks. The wheel has KVWHEEL_LEVELS levels of
+ * KVWHEEL_SLOTS slots, the slots of level L spanning KVWHEEL_SLOTS^L ticks
+ * each. A timer is kept in the lowest level in which its deadline falls within
+ * the current turn of the wheel, in the slot of its deadline. Whenever time
+ * reaches the start of a slot of a level above 0, the timers of that slot are
+ * moved down into the levels below (cascaded); the timers of the slot of level
+ * 0 reached are then due. Timers further away than the whole wheel spans wait
+ * in an overflow list, which is cascaded whenever the top level turns over.
+ *
+ * KVWheel does no locking of its own.
+ */
+
+/* The number of bits of a tick which select a slot of a level. */
+#define KVWHEEL_BITS 6
+
+/* The number of slots of a level. */
+#define KVWHEEL_SLOTS (1 << KVWHEEL_BITS)
+
+/* The number of levels. With ticks of a second, the wheel spans 194 days. */
+#define KVWHEEL_LEVELS 4
+
+/* A timer, which is embedded into the structure it is the timer of. */
+typedef struct kvwheel_timer {
+  uint64_t expires;             /* The tick at which the timer is due. */
+  struct kvwheel_timer **slot;  /* The list holding the timer, or NULL if it is not armed. */
+  struct kvwheel_timer *prev;   /* The previous timer within SLOT. */
+  struct kvwheel_timer *next;   /* The next timer within SLOT. */
+} kvwheel_timer_t;
+
+/* A KVWheel. */
+typedef struct {
+  uint64_t now;                                          /* The current tick. */
+  kvwheel_timer_t *slots[KVWHEEL_LEVELS][KVWHEEL_SLOTS]; /* The timers of each slot. */
+  kvwheel_timer_t *overflow;                             /* The timers beyond the top level. */
+  size_t count;                                          /* The number of timers armed. */
+} kvwheel_t;
+
+void kvwheel_init(kvwheel_t *, uint64_t now);
+void kvwheel_add(kvwheel_t *, kvwheel_timer_t *timer);
+void kvwheel_remove(kvwheel_t *, kvwheel_timer_t *timer);
+kvwheel_timer_t *kvwheel_advance(kvwheel_t *, uint64_t now);
+
+#endif
@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <fcntl.h>
@@ -58,6 +59,25 @@ bool http_request_receive(http_request_t *req, int fd) {
   memcpy(req->path, read_init, read_size);
   req->path[read_size] = '\0';
 
+  /* Read in the headers we care about, and keep whatever part of the body
+   * came along with them. */
+  req->content_length = -1;
+  req->body_size = 0;
+  read_end = strchr(read_end, '\n');
+  while (read_end) {
+    read_init = read_end + 1;
+    if (*read_init == '\n' || !strncmp(read_init, "\r\n", 2)) {
+      read_init += (*read_init == '\n') ? 1 : 2;
+      req->body_size = min(read_buffer + bytes_read - read_init, HTTP_MSG_MAX_SIZE);
+      memcpy(req->body, read_init, req->body_size);
+      break;
+    }
+    if (!strncasecmp(read_init, "Content-Length:", 15))
+      req->content_length = strtol(read_init + 15, NULL, 10);
+    read_end = strchr(read_init, '\n');
+  }
+  req->body[req->body_size] = '\0';
+
   return true;
 
 error:
@@ -242,20 +262,23 @@ void http_outbound_add_data(http_outbound_t *msg, char *data, size_t size) {
   msg->end += size;
 }
 
-int http_outbound_send(http_outbound_t *msg) {
-  msg->body[msg->end] = '\0';
-
-  char *send = msg->body;
-  int bytes_left = msg->end;
-
+bool http_send_data(int fd, const char *data, size_t size) {
   ssize_t bytes_sent;
-  while (bytes_left > 0) {
-    bytes_sent = write(msg->fd, send, bytes_left);
+  while (size > 0) {
+    bytes_sent = write(fd, data, size);
     if (bytes_sent < 0)
-      return bytes_sent;
-    bytes_left -= bytes_sent;
-    send += bytes_sent;
+      return false;
+    size -= bytes_sent;
+    data += bytes_sent;
   }
+  return true;
+}
+
+int http_outbound_send(http_outbound_t *msg) {
+  msg->body[msg->end] = '\0';
+
+  if (!http_send_data(msg->fd, msg->body, msg->end))
+    return -1;
 
   return msg->end;
 }
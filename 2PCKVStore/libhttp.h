@@ -22,6 +22,9 @@ typedef enum {
 typedef struct {
   http_method_t method;
   char path[HTTP_MSG_MAX_SIZE + 1];
+  long content_length; /* The Content-Length header, or -1 if absent. */
+  size_t body_size;    /* The number of bytes of the body received along with the headers. */
+  char body[HTTP_MSG_MAX_SIZE + 1]; /* Those bytes; the rest is still to be read from the socket. */
 } http_request_t;
 
 typedef struct {
@@ -55,6 +58,10 @@ void http_outbound_end_headers(http_outbound_t *);
 void http_outbound_add_string(http_outbound_t *, char *data);
 void http_outbound_add_data(http_outbound_t *, char *data, size_t size);
 
+/* Writes all SIZE bytes of DATA to SOCKFD, e.g. to stream a body after its
+ * headers were sent with http_outbound_send. Returns false on error. */
+bool http_send_data(int sockfd, const char *data, size_t size);
+
 /* Sends off the http_outbound message and returns bytes send, or -1 on error.
  */
 int http_outbound_send(http_outbound_t *);
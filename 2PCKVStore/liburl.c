@@ -12,6 +12,9 @@ void zero_params(url_params_t *params) {
   memset(params->path, 0, PATH_MAX_SIZE + 1);
   memset(params->key, 0, MAX_KEYLEN + 1);
   memset(params->val, 0, MAX_VALLEN + 1);
+  memset(params->expected, 0, MAX_VALLEN + 1);
+  memset(params->ttl, 0, MAX_TTL_DIGITS + 2);
+  memset(params->txid, 0, MAX_TXID_DIGITS + 2);
 }
 
 struct param {
@@ -30,6 +33,21 @@ static bool get_param_ptr(struct param *p, url_params_t *params, char *key, int
     p->max_size = MAX_VALLEN;
     return true;
   }
+  if (!strncmp(key, "expected", keylen)) {
+    p->ptr = params->expected;
+    p->max_size = MAX_VALLEN;
+    return true;
+  }
+  if (!strncmp(key, "ttl", keylen)) {
+    p->ptr = params->ttl;
+    p->max_size = MAX_TTL_DIGITS + 1;
+    return true;
+  }
+  if (!strncmp(key, "txid", keylen)) {
+    p->ptr = params->txid;
+    p->max_size = MAX_TXID_DIGITS + 1;
+    return true;
+  }
   return false;
 }
 
@@ -56,7 +74,7 @@ bool url_decode(url_params_t *params, char *url) {
   }
 
   /* Loop through parameters, pulling only those that we support (i.e., key,
-   * val) */
+   * val, expected, ttl) */
   struct param param;
   bool found_param = false;
   char *key_end;
@@ -98,6 +116,12 @@ void url_encode(char *url, url_params_t *params) {
     end += sprintf(buf + end, "key=%s&", params->key);
   if (params->val)
     end += sprintf(buf + end, "val=%s&", params->val);
+  if (params->expected[0] != '\0')
+    end += sprintf(buf + end, "expected=%s&", params->expected);
+  if (params->ttl[0] != '\0')
+    end += sprintf(buf + end, "ttl=%s&", params->ttl);
+  if (params->txid[0] != '\0')
+    end += sprintf(buf + end, "txid=%s&", params->txid);
   buf[end - 1] = '\0';
 
   strcpy(url, buf);
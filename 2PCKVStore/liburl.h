@@ -15,6 +15,11 @@ typedef struct {
   char path[PATH_MAX_SIZE + 1];
   char key[MAX_KEYLEN + 1];
   char val[MAX_VALLEN + 1];
+  char expected[MAX_VALLEN + 1];
+  /* One digit more than a valid time to live has, so that a longer one is
+   * told apart from one cut short. */
+  char ttl[MAX_TTL_DIGITS + 2];
+  char txid[MAX_TXID_DIGITS + 2]; /* As TTL, one digit longer than a valid one. */
 } url_params_t;
 
 /* Helper method to zero out all fields in a url_params_t struct */
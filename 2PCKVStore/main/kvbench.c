@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include "kvstore.h"
+#include "kvhash.h"
+
+const char *USAGE = "Usage: kvbench "
+                    "[max_threads (default=8)] "
+                    "[seconds per run (default=1)] "
+                    "[keys (default=10000)]";
+
+/* The state shared by the threads of a run. */
+typedef struct {
+  kvstore_t *store;
+  unsigned int keys;  /* The number of keys preloaded into STORE. */
+  bool values;        /* Whether readers read values (kvstore_get) or only keys. */
+  volatile bool stop; /* Set when the run is over. */
+} bench_t;
+
+/* The state of a single thread of a run. */
+typedef struct {
+  bench_t *bench;
+  unsigned int seed;
+  uint64_t ops; /* The number of operations completed. */
+  pthread_t thread;
+} bench_thread_t;
+
+static void bench_key(char *key, unsigned int i) { sprintf(key, "bench-key-%u", i); }
+
+/* Reads random keys of the store until the run is over. */
+static void *bench_reader(void *arg) {
+  bench_thread_t *t = arg;
+  char key[MAX_KEYLEN + 1], value[MAX_VALLEN + 1];
+  while (!t->bench->stop) {
+    bench_key(key, rand_r(&t->seed) % t->bench->keys);
+    if (t->bench->values)
+      kvstore_get(t->bench->store, key, value);
+    else
+      kvstore_haskey(t->bench->store, key);
+    t->ops++;
+  }
+  return NULL;
+}
+
+/* Overwrites random keys of the store until the run is over. */
+static void *bench_writer(void *arg) {
+  bench_thread_t *t = arg;
+  char key[MAX_KEYLEN + 1], value[32];
+  while (!t->bench->stop) {
+    bench_key(key, rand_r(&t->seed) % t->bench->keys);
+    sprintf(value, "value-%u", rand_r(&t->seed));
+    kvstore_put(t->bench->store, key, value);
+    t->ops++;
+  }
+  return NULL;
+}
+
+/* Runs NREADERS readers and one writer against BENCH for SECONDS. Returns the
+ * number of reads per second. */
+static double bench_run(bench_t *bench, unsigned int nreaders, unsigned int seconds) {
+  bench_thread_t threads[nreaders + 1];
+  uint64_t reads = 0;
+  unsigned int i;
+  bench->stop = false;
+  for (i = 0; i <= nreaders; i++) {
+    threads[i].bench = bench;
+    threads[i].seed = i + 1;
+    threads[i].ops = 0;
+    pthread_create(&threads[i].thread, NULL, i < nreaders ? bench_reader : bench_writer,
+                   &threads[i]);
+  }
+  sleep(seconds);
+  bench->stop = true;
+  for (i = 0; i <= nreaders; i++) {
+    pthread_join(threads[i].thread, NULL);
+    if (i < nreaders)
+      reads += threads[i].ops;
+  }
+  return (double)reads / seconds;
+}
+
+/* Returns the number of seconds elapsed since START. */
+static double bench_elapsed(struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec - start->tv_sec + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Compares hashing KEYS keys one at a time with strhash64 against hashing
+ * them in batches with strhash64_batch and one at a time with kvhash_str, for
+ * SECONDS each. */
+static void bench_hash(unsigned int keys, unsigned int seconds) {
+  char **strs = malloc(keys * sizeof(char *));
+  uint64_t *hashes = malloc(keys * sizeof(uint64_t));
+  struct timespec start;
+  double rates[3];
+  uint64_t hashed;
+  unsigned int i, mode;
+  if (!strs || !hashes)
+    fatal_malloc();
+  for (i = 0; i < keys; i++) {
+    strs[i] = malloc(MAX_KEYLEN + 1);
+    if (!strs[i])
+      fatal_malloc();
+    bench_key(strs[i], i);
+  }
+  for (mode = 0; mode < 3; mode++) {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (hashed = 0; bench_elapsed(&start) < seconds; hashed += keys) {
+      if (mode == 0) {
+        for (i = 0; i < keys; i++)
+          hashes[i] = strhash64(strs[i]);
+      } else if (mode == 1) {
+        strhash64_batch(strs, keys, hashes);
+      } else {
+        for (i = 0; i < keys; i++)
+          hashes[i] = kvhash_str(strs[i]);
+      }
+    }
+    rates[mode] = hashed / bench_elapsed(&start);
+  }
+  printf("strhash64 keys/s:\n");
+  printf("%14s %14s %8s\n", "one at a time", "batched", "speedup");
+  printf("%14.0f %14.0f %7.2fx\n", rates[0], rates[1], rates[1] / rates[0]);
+  printf("kvhash_str keys/s:\n");
+  printf("%14.0f %23.2fx\n", rates[2], rates[2] / rates[0]);
+  for (i = 0; i < keys; i++)
+    free(strs[i]);
+  free(strs);
+  free(hashes);
+}
+
+/* Compares the read throughput of a KVSTORE_FILES store whose reads take the
+ * key locks against one whose reads are lock-free, for growing numbers of
+ * reader threads, each time alongside one writer. The read cache is disabled,
+ * so that every read goes through the index. Then compares the throughput of
+ * hashing keys one at a time, in batches and with kvhash. */
+int main(int argc, char **argv) {
+  unsigned int max_threads = 8, seconds = 1, keys = 10000, n, i, mode;
+  char dirname[MAX_FILENAME], key[MAX_KEYLEN + 1];
+  double rates[2];
+  kvstore_opts_t opts;
+  kvstore_t store;
+  bench_t bench;
+  if (argc > 4)
+    goto usage;
+  if (argc > 1 && (max_threads = atoi(argv[1])) == 0)
+    goto usage;
+  if (argc > 2 && (seconds = atoi(argv[2])) == 0)
+    goto usage;
+  if (argc > 3 && (keys = atoi(argv[3])) == 0)
+    goto usage;
+
+  sprintf(dirname, "kvbench-%d", getpid());
+  kvstore_opts_default(&opts);
+  opts.cache_size = 0;
+  if (kvstore_init(&store, dirname, &opts) < 0) {
+    printf("Error initializing store %s\n", dirname);
+    return 1;
+  }
+  for (i = 0; i < keys; i++) {
+    bench_key(key, i);
+    kvstore_put(&store, key, "value");
+  }
+  kvstore_close(&store);
+
+  bench.store = &store;
+  bench.keys = keys;
+  for (bench.values = false;; bench.values = true) {
+    printf("%s reads/s with one writer:\n", bench.values ? "kvstore_get" : "kvstore_haskey");
+    printf("%8s %14s %14s %8s\n", "readers", "locked", "lock-free", "speedup");
+    for (n = 1; n <= max_threads; n *= 2) {
+      for (mode = 0; mode < 2; mode++) {
+        opts.locked_reads = mode == 0;
+        kvstore_init(&store, dirname, &opts);
+        rates[mode] = bench_run(&bench, n, seconds);
+        kvstore_close(&store);
+      }
+      printf("%8u %14.0f %14.0f %7.2fx\n", n, rates[0], rates[1], rates[1] / rates[0]);
+    }
+    if (bench.values)
+      break;
+  }
+
+  kvstore_init(&store, dirname, &opts);
+  kvstore_clean(&store);
+  bench_hash(keys, seconds);
+  return 0;
+
+usage:
+  printf("%s\n", USAGE);
+  return 1;
+}
@@ -2,17 +2,29 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <signal.h>
 #include "socket_server.h"
 #include "tpcfollower.h"
 
 const char *USAGE = "Usage: tpcfollower "
                     "[follower_port (default=16201)] "
-                    "[leader_port (default=16200)]";
+                    "[leader_port (default=16200)] "
+                    "[engine: files|log|lsm|memory (default=files)] "
+                    "[durability: none|always|group (default=group)] "
+                    "[directories, comma-separated, e.g. one per disk "
+                    "(default=follower-port<follower_port>)] "
+                    "[log segment size in bytes (default=67108864)]";
 
 int main(int argc, char **argv) {
   int follower_port = 16201, leader_port = 16200;
   char *follower_hostname = "127.0.0.1", *leader_hostname = "127.0.0.1";
+  char *dirnames[TPCFOLLOWER_MAX_SHARDS], *dirlist = NULL;
+  unsigned int ndirs = 0;
   int index = 0;
+  kvstore_opts_t opts;
+  kvstore_opts_default(&opts);
+  /* The votes of a follower must survive a crash. */
+  opts.durability.mode = KVSYNC_GROUP;
   if (index < argc) {
     switch (argc - index - 1) {
     case 1:
@@ -23,6 +35,21 @@ int main(int argc, char **argv) {
       } else {
         goto usage;
       }
+    case 6:
+      if ((opts.segment_size = atol(argv[index + 6])) == 0)
+        goto usage;
+      /* Fall through to parse the directories. */
+    case 5:
+      dirlist = argv[index + 5];
+      /* Fall through to parse the durability mode. */
+    case 4:
+      if (kvsync_mode_from_string(argv[index + 4], &opts.durability.mode) < 0)
+        goto usage;
+      /* Fall through to parse the engine. */
+    case 3:
+      if (kvstore_engine_from_string(argv[index + 3], &opts.engine) < 0)
+        goto usage;
+      /* Fall through to parse the ports. */
     case 2:
       index += 1;
       if (argv[index][0] != '-') {
@@ -43,15 +70,31 @@ int main(int argc, char **argv) {
   printf("Follower server started on port %d\n", follower_port);
   printf("Connecting to leader at %s:%d... \n", leader_hostname, leader_port);
 
-  tpcfollower_t follower;
   server_t server;
   server.leader = 0;
   server.max_threads = 3;
 
   char follower_name[20];
   sprintf(follower_name, "follower-port%d", follower_port);
+  if (dirlist == NULL) {
+    dirnames[ndirs++] = follower_name;
+  } else {
+    for (char *dir = strtok(dirlist, ","); dir != NULL; dir = strtok(NULL, ",")) {
+      if (ndirs == TPCFOLLOWER_MAX_SHARDS)
+        goto usage;
+      dirnames[ndirs++] = dir;
+    }
+    if (ndirs == 0)
+      goto usage;
+  }
 
-  tpcfollower_init(&follower, follower_name, 2, follower_hostname, follower_port);
+  /* The follower is initialized in place: its store runs threads which refer
+   * back to it, so it must not be copied afterwards. */
+  if (tpcfollower_init_shards(&server.tpcfollower, dirnames, ndirs, &opts, 2, follower_hostname,
+                              follower_port) != 0) {
+    printf("Error opening the stores of the follower!\n");
+    return 1;
+  }
   /* Need to send registration to the leader.*/
   int ret, sockfd = connect_to(leader_hostname, leader_port, 0);
   if (sockfd < 0) {
@@ -60,14 +103,16 @@ int main(int argc, char **argv) {
            leader_hostname, leader_port);
     return 1;
   }
-  ret = tpcfollower_register_leader(&follower, sockfd);
+  ret = tpcfollower_register_leader(&server.tpcfollower, sockfd);
   if (ret < 0) {
     printf("Error registering follower with leader! "
            "Received an error message back from leader.\n");
     return 1;
   }
   close(sockfd);
-  server.tpcfollower = follower;
+  /* A leader which aborts a streamed PUT may close the socket before the
+   * follower's vote arrives. */
+  signal(SIGPIPE, SIG_IGN);
   server_run(follower_hostname, follower_port, &server);
   return 0;
 
@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <signal.h>
 #include <getopt.h>
 #include "socket_server.h"
 #include "tpcleader.h"
@@ -31,6 +32,9 @@ int main(int argc, char **argv) {
   server.leader = 1;
   server.max_threads = 3;
   tpcleader_init(&server.tpcleader, followers, redundancy);
+  /* A follower which votes against a streamed PUT closes its socket while the
+   * value is still being relayed to it. */
+  signal(SIGPIPE, SIG_IGN);
   printf("TPCLeader server started listening on port %d...\n", port);
   server_run("127.0.0.1", port, &server);
 }
@@ -284,3 +284,251 @@ void MD5_Final(unsigned char *result, MD5_CTX *ctx) {
 }
 
 #endif
+
+/*
+ * Multi-buffer MD5: several independent messages are hashed at once, each in
+ * its own 32-bit lane of a vector, so that one instruction advances the same
+ * step of every message. Four lanes fit an SSE2 register and eight an AVX2
+ * one; the vectors are GCC vector extensions, which other architectures lower
+ * to whatever they have.  Messages of different lengths share the passes over
+ * their common number of blocks, and each digest is taken from its lane after
+ * the last block of its message.  A single message, or a compiler without
+ * vector extensions, goes through the scalar code above.
+ */
+
+#include <string.h>
+
+#include "md5.h"
+
+#if !defined(HAVE_OPENSSL) && defined(__GNUC__)
+
+typedef unsigned int MD5_v4 __attribute__((vector_size(16)));
+typedef unsigned int MD5_v8 __attribute__((vector_size(32)));
+
+/* The state of every lane, as one row of lanes per state word */
+typedef unsigned int MD5_lanes[4][MD5_MULTI_LANES];
+
+/* Processes the next 64-byte block of each lane, BLOCKS[lane] */
+typedef void (*MD5_kernel)(MD5_lanes state, const unsigned char *const *blocks);
+
+#define VSTEP(f, a, b, c, d, x, t, s)                                                              \
+  (a) += f((b), (c), (d)) + (x) + (t);                                                             \
+  (a) = ((a) << (s)) | ((a) >> (32 - (s)));                                                        \
+  (a) += (b);
+
+#define VROUNDS                                                                                    \
+  /* Round 1 */                                                                                    \
+  VSTEP(F, a, b, c, d, x[0], 0xd76aa478, 7)                                                        \
+  VSTEP(F, d, a, b, c, x[1], 0xe8c7b756, 12)                                                       \
+  VSTEP(F, c, d, a, b, x[2], 0x242070db, 17)                                                       \
+  VSTEP(F, b, c, d, a, x[3], 0xc1bdceee, 22)                                                       \
+  VSTEP(F, a, b, c, d, x[4], 0xf57c0faf, 7)                                                        \
+  VSTEP(F, d, a, b, c, x[5], 0x4787c62a, 12)                                                       \
+  VSTEP(F, c, d, a, b, x[6], 0xa8304613, 17)                                                       \
+  VSTEP(F, b, c, d, a, x[7], 0xfd469501, 22)                                                       \
+  VSTEP(F, a, b, c, d, x[8], 0x698098d8, 7)                                                        \
+  VSTEP(F, d, a, b, c, x[9], 0x8b44f7af, 12)                                                       \
+  VSTEP(F, c, d, a, b, x[10], 0xffff5bb1, 17)                                                      \
+  VSTEP(F, b, c, d, a, x[11], 0x895cd7be, 22)                                                      \
+  VSTEP(F, a, b, c, d, x[12], 0x6b901122, 7)                                                       \
+  VSTEP(F, d, a, b, c, x[13], 0xfd987193, 12)                                                      \
+  VSTEP(F, c, d, a, b, x[14], 0xa679438e, 17)                                                      \
+  VSTEP(F, b, c, d, a, x[15], 0x49b40821, 22)                                                      \
+  /* Round 2 */                                                                                    \
+  VSTEP(G, a, b, c, d, x[1], 0xf61e2562, 5)                                                        \
+  VSTEP(G, d, a, b, c, x[6], 0xc040b340, 9)                                                        \
+  VSTEP(G, c, d, a, b, x[11], 0x265e5a51, 14)                                                      \
+  VSTEP(G, b, c, d, a, x[0], 0xe9b6c7aa, 20)                                                       \
+  VSTEP(G, a, b, c, d, x[5], 0xd62f105d, 5)                                                        \
+  VSTEP(G, d, a, b, c, x[10], 0x02441453, 9)                                                       \
+  VSTEP(G, c, d, a, b, x[15], 0xd8a1e681, 14)                                                      \
+  VSTEP(G, b, c, d, a, x[4], 0xe7d3fbc8, 20)                                                       \
+  VSTEP(G, a, b, c, d, x[9], 0x21e1cde6, 5)                                                        \
+  VSTEP(G, d, a, b, c, x[14], 0xc33707d6, 9)                                                       \
+  VSTEP(G, c, d, a, b, x[3], 0xf4d50d87, 14)                                                       \
+  VSTEP(G, b, c, d, a, x[8], 0x455a14ed, 20)                                                       \
+  VSTEP(G, a, b, c, d, x[13], 0xa9e3e905, 5)                                                       \
+  VSTEP(G, d, a, b, c, x[2], 0xfcefa3f8, 9)                                                        \
+  VSTEP(G, c, d, a, b, x[7], 0x676f02d9, 14)                                                       \
+  VSTEP(G, b, c, d, a, x[12], 0x8d2a4c8a, 20)                                                      \
+  /* Round 3 */                                                                                    \
+  VSTEP(H, a, b, c, d, x[5], 0xfffa3942, 4)                                                        \
+  VSTEP(H2, d, a, b, c, x[8], 0x8771f681, 11)                                                      \
+  VSTEP(H, c, d, a, b, x[11], 0x6d9d6122, 16)                                                      \
+  VSTEP(H2, b, c, d, a, x[14], 0xfde5380c, 23)                                                     \
+  VSTEP(H, a, b, c, d, x[1], 0xa4beea44, 4)                                                        \
+  VSTEP(H2, d, a, b, c, x[4], 0x4bdecfa9, 11)                                                      \
+  VSTEP(H, c, d, a, b, x[7], 0xf6bb4b60, 16)                                                       \
+  VSTEP(H2, b, c, d, a, x[10], 0xbebfbc70, 23)                                                     \
+  VSTEP(H, a, b, c, d, x[13], 0x289b7ec6, 4)                                                       \
+  VSTEP(H2, d, a, b, c, x[0], 0xeaa127fa, 11)                                                      \
+  VSTEP(H, c, d, a, b, x[3], 0xd4ef3085, 16)                                                       \
+  VSTEP(H2, b, c, d, a, x[6], 0x04881d05, 23)                                                      \
+  VSTEP(H, a, b, c, d, x[9], 0xd9d4d039, 4)                                                        \
+  VSTEP(H2, d, a, b, c, x[12], 0xe6db99e5, 11)                                                     \
+  VSTEP(H, c, d, a, b, x[15], 0x1fa27cf8, 16)                                                      \
+  VSTEP(H2, b, c, d, a, x[2], 0xc4ac5665, 23)                                                      \
+  /* Round 4 */                                                                                    \
+  VSTEP(I, a, b, c, d, x[0], 0xf4292244, 6)                                                        \
+  VSTEP(I, d, a, b, c, x[7], 0x432aff97, 10)                                                       \
+  VSTEP(I, c, d, a, b, x[14], 0xab9423a7, 15)                                                      \
+  VSTEP(I, b, c, d, a, x[5], 0xfc93a039, 21)                                                       \
+  VSTEP(I, a, b, c, d, x[12], 0x655b59c3, 6)                                                       \
+  VSTEP(I, d, a, b, c, x[3], 0x8f0ccc92, 10)                                                       \
+  VSTEP(I, c, d, a, b, x[10], 0xffeff47d, 15)                                                      \
+  VSTEP(I, b, c, d, a, x[1], 0x85845dd1, 21)                                                       \
+  VSTEP(I, a, b, c, d, x[8], 0x6fa87e4f, 6)                                                        \
+  VSTEP(I, d, a, b, c, x[15], 0xfe2ce6e0, 10)                                                      \
+  VSTEP(I, c, d, a, b, x[6], 0xa3014314, 15)                                                       \
+  VSTEP(I, b, c, d, a, x[13], 0x4e0811a1, 21)                                                      \
+  VSTEP(I, a, b, c, d, x[4], 0xf7537e82, 6)                                                        \
+  VSTEP(I, d, a, b, c, x[11], 0xbd3af235, 10)                                                      \
+  VSTEP(I, c, d, a, b, x[2], 0x2ad7d2bb, 15)                                                       \
+  VSTEP(I, b, c, d, a, x[9], 0xeb86d391, 21)
+
+/*
+ * Defines the kernel NAME, which processes LANES lanes as vectors of type
+ * VEC.  ATTR selects the instruction set it is compiled for.
+ */
+#define MD5_KERNEL(name, vec, lanes, attr)                                                         \
+  attr static void name(MD5_lanes state, const unsigned char *const *blocks) {                     \
+    vec a, b, c, d, saved_a, saved_b, saved_c, saved_d, x[16];                                     \
+    const unsigned char *p;                                                                        \
+    unsigned int w, l;                                                                             \
+    for (w = 0; w < 16; w++)                                                                       \
+      for (l = 0; l < (lanes); l++) {                                                              \
+        p = blocks[l] + w * 4;                                                                     \
+        x[w][l] = (unsigned int)p[0] | ((unsigned int)p[1] << 8) |                                 \
+                  ((unsigned int)p[2] << 16) | ((unsigned int)p[3] << 24);                         \
+      }                                                                                            \
+    memcpy(&a, state[0], sizeof(vec));                                                             \
+    memcpy(&b, state[1], sizeof(vec));                                                             \
+    memcpy(&c, state[2], sizeof(vec));                                                             \
+    memcpy(&d, state[3], sizeof(vec));                                                             \
+    saved_a = a;                                                                                   \
+    saved_b = b;                                                                                   \
+    saved_c = c;                                                                                   \
+    saved_d = d;                                                                                   \
+    VROUNDS                                                                                        \
+    a += saved_a;                                                                                  \
+    b += saved_b;                                                                                  \
+    c += saved_c;                                                                                  \
+    d += saved_d;                                                                                  \
+    memcpy(state[0], &a, sizeof(vec));                                                             \
+    memcpy(state[1], &b, sizeof(vec));                                                             \
+    memcpy(state[2], &c, sizeof(vec));                                                             \
+    memcpy(state[3], &d, sizeof(vec));                                                             \
+  }
+
+#if defined(__i386__) || defined(__x86_64__)
+#define MD5_AVX2 __attribute__((target("avx2")))
+#define MD5_HAS_AVX2() __builtin_cpu_supports("avx2")
+#else
+#define MD5_AVX2
+#define MD5_HAS_AVX2() 0
+#endif
+
+MD5_KERNEL(body4, MD5_v4, 4, )
+MD5_KERNEL(body8, MD5_v8, 8, MD5_AVX2)
+
+/*
+ * Hashes the COUNT (at most LANES) messages DATA[i] of SIZES[i] bytes into
+ * RESULTS[i] with KERNEL.
+ */
+static void multi(const void *const *data, const unsigned long *sizes, unsigned int count,
+                  unsigned char (*results)[16], unsigned int lanes, MD5_kernel kernel) {
+  static const unsigned char unused[64];
+  unsigned char tails[MD5_MULTI_LANES][128];
+  const unsigned char *blocks[MD5_MULTI_LANES];
+  unsigned long full[MD5_MULTI_LANES], total[MD5_MULTI_LANES], last = 0, n;
+  unsigned long long bits;
+  unsigned int l, i, rest, tail;
+  MD5_lanes state;
+
+  for (l = 0; l < lanes; l++) {
+    state[0][l] = 0x67452301;
+    state[1][l] = 0xefcdab89;
+    state[2][l] = 0x98badcfe;
+    state[3][l] = 0x10325476;
+    total[l] = 0;
+    if (l >= count)
+      continue;
+
+    /* The whole blocks are read in place; the rest is padded in TAILS */
+    full[l] = sizes[l] / 64;
+    rest = sizes[l] % 64;
+    tail = rest < 56 ? 64 : 128;
+    memcpy(tails[l], (const unsigned char *)data[l] + full[l] * 64, rest);
+    tails[l][rest] = 0x80;
+    memset(&tails[l][rest + 1], 0, tail - rest - 9);
+    bits = (unsigned long long)sizes[l] << 3;
+    for (i = 0; i < 8; i++)
+      tails[l][tail - 8 + i] = bits >> (i * 8);
+    total[l] = full[l] + tail / 64;
+    if (total[l] > last)
+      last = total[l];
+  }
+
+  for (n = 0; n < last; n++) {
+    for (l = 0; l < lanes; l++) {
+      if (n >= total[l])
+        blocks[l] = unused;
+      else if (n < full[l])
+        blocks[l] = (const unsigned char *)data[l] + n * 64;
+      else
+        blocks[l] = tails[l] + (n - full[l]) * 64;
+    }
+    kernel(state, blocks);
+    for (l = 0; l < count; l++) {
+      if (total[l] != n + 1)
+        continue;
+      for (i = 0; i < 16; i++)
+        results[l][i] = state[i / 4][l] >> ((i % 4) * 8);
+    }
+  }
+}
+
+/*
+ * Computes the MD5 digests of the COUNT messages DATA[i] of SIZES[i] bytes
+ * into RESULTS[i], hashing up to MD5_MULTI_LANES of them at once.
+ */
+void MD5_Multi(const void *const *data, const unsigned long *sizes, unsigned int count,
+               unsigned char (*results)[16]) {
+  unsigned int n;
+  MD5_CTX ctx;
+
+  for (; count > 0; data += n, sizes += n, results += n, count -= n) {
+    if (count == 1) {
+      MD5_Init(&ctx);
+      MD5_Update(&ctx, data[0], sizes[0]);
+      MD5_Final(results[0], &ctx);
+      n = 1;
+    } else if (count > 4 && MD5_HAS_AVX2()) {
+      n = count < 8 ? count : 8;
+      multi(data, sizes, n, results, 8, body8);
+    } else {
+      n = count < 4 ? count : 4;
+      multi(data, sizes, n, results, 4, body4);
+    }
+  }
+}
+
+#else
+
+/*
+ * Computes the MD5 digests of the COUNT messages DATA[i] of SIZES[i] bytes
+ * into RESULTS[i], one at a time.
+ */
+void MD5_Multi(const void *const *data, const unsigned long *sizes, unsigned int count,
+               unsigned char (*results)[16]) {
+  unsigned int i;
+  MD5_CTX ctx;
+
+  for (i = 0; i < count; i++) {
+    MD5_Init(&ctx);
+    MD5_Update(&ctx, data[i], sizes[i]);
+    MD5_Final(results[i], &ctx);
+  }
+}
+
+#endif
@@ -43,3 +43,14 @@ extern void MD5_Update(MD5_CTX *ctx, const void *data, unsigned long size);
 extern void MD5_Final(unsigned char *result, MD5_CTX *ctx);
 
 #endif
+
+#ifndef _MD5_MULTI_H
+#define _MD5_MULTI_H
+
+/* The largest number of messages MD5_Multi hashes in one pass */
+#define MD5_MULTI_LANES 8
+
+extern void MD5_Multi(const void *const *data, const unsigned long *sizes, unsigned int count,
+                      unsigned char (*results)[16]);
+
+#endif
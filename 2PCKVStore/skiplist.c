@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kvconstants.h"
+#include "skiplist.h"
+
+/* Allocates a node of the given HEIGHT holding a copy of KEY. */
+static skiplist_node_t *skiplist_node_new(const char *key, void *value, int height) {
+  skiplist_node_t *node = calloc(1, sizeof(skiplist_node_t) + height * sizeof(skiplist_node_t *));
+  if (!node)
+    fatal_malloc();
+  if (key != NULL) {
+    node->key = strdup(key);
+    if (!node->key)
+      fatal_malloc();
+  }
+  node->value = value;
+  node->height = height;
+  return node;
+}
+
+/* Initializes an empty skiplist LIST. */
+void skiplist_init(skiplist_t *list) {
+  list->head = skiplist_node_new(NULL, NULL, SKIPLIST_MAX_HEIGHT);
+  list->height = 1;
+  list->count = 0;
+  list->seed = (unsigned int)(size_t)list;
+}
+
+/* Picks the height of a new node; each level is reached with probability
+ * 1/4. */
+static int skiplist_random_height(skiplist_t *list) {
+  int height = 1;
+  while (height < SKIPLIST_MAX_HEIGHT && (rand_r(&list->seed) & 3) == 0)
+    height++;
+  return height;
+}
+
+/* Returns the last node of LIST whose key is less than KEY (possibly the
+ * head), storing the last such node on each level into PREV if it is not
+ * NULL. */
+static skiplist_node_t *skiplist_find_less(skiplist_t *list, const char *key,
+                                           skiplist_node_t **prev) {
+  skiplist_node_t *node = list->head;
+  int level;
+  for (level = list->height - 1; level >= 0; level--) {
+    while (node->next[level] != NULL && strcmp(node->next[level]->key, key) < 0)
+      node = node->next[level];
+    if (prev != NULL)
+      prev[level] = node;
+  }
+  return node;
+}
+
+/* Returns the node of LIST holding KEY, or NULL if there is none. */
+skiplist_node_t *skiplist_find(skiplist_t *list, const char *key) {
+  skiplist_node_t *node = skiplist_seek(list, key);
+  return (node != NULL && strcmp(node->key, key) == 0) ? node : NULL;
+}
+
+/* Returns the first node of LIST whose key is greater than or equal to KEY,
+ * or NULL if there is none. */
+skiplist_node_t *skiplist_seek(skiplist_t *list, const char *key) {
+  return skiplist_find_less(list, key, NULL)->next[0];
+}
+
+/* Returns the node of LIST with the smallest key, or NULL if LIST is
+ * empty. */
+skiplist_node_t *skiplist_first(skiplist_t *list) { return list->head->next[0]; }
+
+/* Stores VALUE under KEY in LIST. If KEY was already present, its previous
+ * value is returned and REPLACED (if not NULL) is set to true; otherwise NULL
+ * is returned and REPLACED is set to false. */
+void *skiplist_insert(skiplist_t *list, const char *key, void *value, bool *replaced) {
+  skiplist_node_t *prev[SKIPLIST_MAX_HEIGHT];
+  skiplist_node_t *node = skiplist_find_less(list, key, prev)->next[0];
+  void *old;
+  int level, height;
+  if (node != NULL && strcmp(node->key, key) == 0) {
+    old = node->value;
+    node->value = value;
+    if (replaced != NULL)
+      *replaced = true;
+    return old;
+  }
+  height = skiplist_random_height(list);
+  for (level = list->height; level < height; level++)
+    prev[level] = list->head;
+  if (height > list->height)
+    list->height = height;
+  node = skiplist_node_new(key, value, height);
+  for (level = 0; level < height; level++) {
+    node->next[level] = prev[level]->next[level];
+    prev[level]->next[level] = node;
+  }
+  list->count++;
+  if (replaced != NULL)
+    *replaced = false;
+  return NULL;
+}
+
+/* Removes KEY from LIST, returning the value it was stored with. REMOVED (if
+ * not NULL) is set to whether KEY was present. */
+void *skiplist_remove(skiplist_t *list, const char *key, bool *removed) {
+  skiplist_node_t *prev[SKIPLIST_MAX_HEIGHT];
+  skiplist_node_t *node = skiplist_find_less(list, key, prev)->next[0];
+  void *value;
+  int level;
+  if (node == NULL || strcmp(node->key, key) != 0) {
+    if (removed != NULL)
+      *removed = false;
+    return NULL;
+  }
+  for (level = 0; level < node->height; level++)
+    prev[level]->next[level] = node->next[level];
+  while (list->height > 1 && list->head->next[list->height - 1] == NULL)
+    list->height--;
+  value = node->value;
+  free(node->key);
+  free(node);
+  list->count--;
+  if (removed != NULL)
+    *removed = true;
+  return value;
+}
+
+/* Frees every node of LIST, calling FREE_VALUE (if not NULL) on each value.
+ * LIST must be reinitialized before it is used again. */
+void skiplist_free(skiplist_t *list, void (*free_value)(void *)) {
+  skiplist_node_t *node = list->head, *next;
+  while (node != NULL) {
+    next = node->next[0];
+    if (free_value != NULL && node != list->head)
+      free_value(node->value);
+    free(node->key);
+    free(node);
+    node = next;
+  }
+  list->head = NULL;
+  list->count = 0;
+}
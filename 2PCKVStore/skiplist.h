@@ -0,0 +1,44 @@
+#ifndef __SKIPLIST__
+#define __SKIPLIST__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Skiplist defines an ordered map from string keys to opaque values.
+ *
+ * Keys are compared with strcmp() and copied into the list upon insertion;
+ * values are stored as given and are owned by the caller. Nodes can be walked
+ * in key order starting from skiplist_first or skiplist_seek by following
+ * their next[0] pointers.
+ *
+ * A skiplist does no locking of its own.
+ */
+
+#define SKIPLIST_MAX_HEIGHT 16
+
+typedef struct skiplist_node {
+  char *key;                     /* The key of this node. */
+  void *value;                   /* The value stored under KEY. */
+  int height;                    /* The number of levels this node is linked into. */
+  struct skiplist_node *next[0]; /* The next node on each level. */
+} skiplist_node_t;
+
+typedef struct {
+  skiplist_node_t *head; /* A sentinel node preceding all others. */
+  int height;            /* The height of the tallest node. */
+  size_t count;          /* The number of nodes in the list. */
+  unsigned int seed;     /* The state of the random number generator. */
+} skiplist_t;
+
+void skiplist_init(skiplist_t *);
+
+skiplist_node_t *skiplist_find(skiplist_t *, const char *key);
+skiplist_node_t *skiplist_seek(skiplist_t *, const char *key);
+skiplist_node_t *skiplist_first(skiplist_t *);
+
+void *skiplist_insert(skiplist_t *, const char *key, void *value, bool *replaced);
+void *skiplist_remove(skiplist_t *, const char *key, bool *removed);
+
+void skiplist_free(skiplist_t *, void (*free_value)(void *));
+
+#endif
@@ -1,3 +1,94 @@
+# Checks a leader with a single follower, on ports 16300 and 16301, before
+# starting the system below. Values are kept within KVRES_BODY_MAX_SIZE.
+U=http://127.0.0.1:16300
+DIR=follower-port16301
+failures=0
+
+# Starts the leader and a follower with ENGINE, and log segments of
+# SEGMENT_SIZE bytes if given, keeping the entries of the previous run.
+start() {
+  ./bin/tpcleader 16300 1 1 >/dev/null &
+  LEADER=$!
+  sleep 1
+  ./bin/tpcfollower 16301 16300 $1 group $DIR $2 >/dev/null &
+  FOLLOWER=$!
+  sleep 1
+}
+
+stop() {
+  kill $LEADER $FOLLOWER
+  wait $LEADER $FOLLOWER 2>/dev/null
+}
+
+# Prints the HTTP status of a PUT of the query QUERY.
+put() {
+  curl -s -X PUT "$U/$1" -o /dev/null -w "%{http_code}"
+}
+
+get() {
+  curl -s "$U/?key=$1"
+}
+
+# Compares the result ACTUAL of the check NAME with EXPECTED.
+check() {
+  if [ "$3" = "$2" ]; then
+    echo "PASS $1"
+  else
+    echo "FAIL $1: expected '$2', got '$3'"
+    failures=$((failures + 1))
+  fi
+}
+
+# CAS and PUTNX are voted on by the follower and applied upon COMMIT.
+rm -rf $DIR
+start files
+put "?key=c&val=a" >/dev/null
+check "cas applies" "201 b" "$(put "cas?key=c&val=b&expected=a") $(get c)"
+check "cas mismatch" "500 b" "$(put "cas?key=c&val=z&expected=a") $(get c)"
+check "putnx existing" "500 b" "$(put "putnx?key=c&val=z") $(get c)"
+check "putnx absent" "201 z" "$(put "putnx?key=n&val=z") $(get n)"
+stop
+
+# A key written with a time to live reads as absent once it has passed.
+rm -rf $DIR
+start files
+put "?key=t&val=v&ttl=1" >/dev/null
+put "?key=u&val=w&ttl=100" >/dev/null
+check "ttl before" "v" "$(get t)"
+sleep 2.5
+check "ttl expired" "error: no key" "$(get t)"
+check "ttl pending" "w" "$(get u)"
+stop
+
+# Overwriting the same keys leaves the sealed segments of the log engine mostly
+# garbage, which the compactor drops within a few seconds.
+rm -rf $DIR
+start log 4096
+for i in $(seq 1 300); do
+  put "?key=k$((i % 10))&val=value-$i-of-the-log-engine" >/dev/null
+done
+segments=$(ls $DIR | grep -c "\.seg$")
+sleep 3
+check "log compaction" "yes" "$([ $(ls $DIR | grep -c "\.seg$") -lt $segments ] && echo yes)"
+stop
+start log 4096
+check "log restart" "value-300-of-the-log-engine value-299-of-the-log-engine" "$(get k0) $(get k9)"
+stop
+
+# The LSM engine replays its write-ahead log, deletions included.
+rm -rf $DIR
+start lsm
+put "?key=a&val=1" >/dev/null
+put "?key=b&val=2" >/dev/null
+curl -s -X DELETE "$U/?key=a" -o /dev/null
+stop
+start lsm
+check "lsm restart" "error: no key 2" "$(get a) $(get b)"
+stop
+rm -rf $DIR
+
+echo "$failures check(s) failed"
+
 ./bin/tpcleader 1060 2 2 &
 sleep 5
 ./bin/tpcfollower 16201 1060 &
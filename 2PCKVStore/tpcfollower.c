@@ -1,39 +1,149 @@
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <errno.h>
 #include <pthread.h>
+#include <time.h>
 #include "kvconstants.h"
 #include "kvstore.h"
 #include "kvmessage.h"
 #include "tpcfollower.h"
 #include "index.h"
 #include "tpclog.h"
+#include "libhttp.h"
 #include "socket_server.h"
 
 /* Initializes a tpcfollower. Will return 0 if successful, or a negative error
  * code if not. DIRNAME is the directory which should be used to store entries
- * for this server.  HOSTNAME and PORT indicate where SERVER will be
- * made available for requests. */
-int tpcfollower_init(tpcfollower_t *server, char *dirname, unsigned int max_threads,
-                     const char *hostname, int port) {
+ * for this server, and OPTS (which may be NULL) the options of its store,
+ * whose durability mode its log follows as well.
+ * HOSTNAME and PORT indicate where SERVER will be made available for
+ * requests. */
+int tpcfollower_init(tpcfollower_t *server, char *dirname, const kvstore_opts_t *opts,
+                     unsigned int max_threads, const char *hostname, int port) {
+  return tpcfollower_init_shards(server, &dirname, 1, opts, max_threads, hostname, port);
+}
+
+/* Removes the keys of the stores of the server ARG which have expired, every
+ * TPCFOLLOWER_SWEEP_INTERVAL seconds until SWEEP_STOP is set. */
+static void *tpcfollower_sweeper(void *arg) {
+  tpcfollower_t *server = arg;
+  struct timespec deadline;
+  unsigned int i;
+  pthread_mutex_lock(&server->sweep_lock);
+  while (!server->sweep_stop) {
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += TPCFOLLOWER_SWEEP_INTERVAL;
+    pthread_cond_timedwait(&server->sweep_cond, &server->sweep_lock, &deadline);
+    if (server->sweep_stop)
+      break;
+    /* Expiring keys takes their key locks, so requests are not held up. */
+    pthread_mutex_unlock(&server->sweep_lock);
+    for (i = 0; i < server->nshards; i++)
+      if (kvstore_expire(&server->shards[i]) < 0)
+        fprintf(stderr, "tpcfollower: expiring keys failed in %s\n", server->shards[i].dirname);
+    pthread_mutex_lock(&server->sweep_lock);
+  }
+  pthread_mutex_unlock(&server->sweep_lock);
+  return NULL;
+}
+
+/* Initializes a tpcfollower whose entries are spread over COUNT stores, one
+ * within each of the directories DIRNAMES (such as one per disk), all opened
+ * with OPTS. The log is kept within the first directory. A follower must
+ * always be reopened with the same directories, in the same order, since keys
+ * are routed to stores by their hash. Otherwise as tpcfollower_init. */
+int tpcfollower_init_shards(tpcfollower_t *server, char **dirnames, unsigned int count,
+                            const kvstore_opts_t *opts, unsigned int max_threads,
+                            const char *hostname, int port) {
+  unsigned int i;
   int ret;
-  ret = kvstore_init(&server->store, dirname);
-  if (ret < 0)
-    return ret;
-  ret = tpclog_init(&server->log, dirname);
-  if (ret < 0)
-    return ret;
+  if (count == 0 || count > TPCFOLLOWER_MAX_SHARDS)
+    return ERR_FILACCESS;
+  server->nshards = count;
+  server->shards = malloc(count * sizeof(kvstore_t));
+  if (!server->shards)
+    fatal_malloc();
+  /* A store or log which cannot create its directory fails with a positive
+   * errno. */
+  for (i = 0; i < count; i++) {
+    ret = kvstore_init(&server->shards[i], dirnames[i], opts);
+    if (ret != 0)
+      goto close_shards;
+  }
+  ret = tpclog_init(&server->log, dirnames[0], opts ? &opts->durability : NULL);
+  if (ret != 0)
+    goto close_shards;
   strcpy(server->hostname, hostname);
   server->port = port;
   server->max_threads = max_threads;
 
   server->state = TPC_INIT;
+  server->pending = NULL;
+  pthread_mutex_init(&server->pending_lock, NULL);
+  server->commits = malloc(count * sizeof(tpcfollower_commits_t));
+  if (!server->commits)
+    fatal_malloc();
+  for (i = 0; i < count; i++) {
+    server->commits[i].queue = NULL;
+    server->commits[i].draining = false;
+    pthread_mutex_init(&server->commits[i].lock, NULL);
+    pthread_cond_init(&server->commits[i].applied, NULL);
+  }
+
+  /* The sweeper is started first, so that nothing is pending yet should it
+   * fail to start. */
+  server->sweep_stop = false;
+  pthread_mutex_init(&server->sweep_lock, NULL);
+  pthread_cond_init(&server->sweep_cond, NULL);
+  if (pthread_create(&server->sweeper, NULL, tpcfollower_sweeper, server) != 0) {
+    ret = ERR_FILACCESS;
+    goto close_log;
+  }
 
   /* Rebuild TPC state. */
   tpcfollower_rebuild_state(server);
   return 0;
+
+  /* Undo the above in reverse order, leaving SERVER with no stores. */
+close_log:
+  pthread_mutex_destroy(&server->sweep_lock);
+  pthread_cond_destroy(&server->sweep_cond);
+  pthread_mutex_destroy(&server->pending_lock);
+  for (i = 0; i < count; i++) {
+    pthread_mutex_destroy(&server->commits[i].lock);
+    pthread_cond_destroy(&server->commits[i].applied);
+  }
+  free(server->commits);
+  server->commits = NULL;
+  tpclog_close(&server->log);
+close_shards:
+  while (i-- > 0)
+    kvstore_close(&server->shards[i]);
+  free(server->shards);
+  server->shards = NULL;
+  server->nshards = 0;
+  return ret;
+}
+
+/* Returns the store of SERVER which holds a key whose strhash64 is HASH. Keys
+ * are routed by the top bits of HASH: its low bits pick the key locks and hash
+ * chains within the store, which would otherwise be left partly unused. */
+static kvstore_t *tpcfollower_store(tpcfollower_t *server, uint64_t hash) {
+  if (server->nshards == 1)
+    return &server->shards[0];
+  return &server->shards[(hash >> 48) % server->nshards];
+}
+
+/* Returns strhash64 of the key of REQ, for the operations of SERVER, which take
+ * it as HASH. It is computed (once per request) only if SERVER routes keys
+ * across shards or its store hashes keys by it, and is 0 otherwise. */
+static uint64_t tpcfollower_hash(tpcfollower_t *server, kvrequest_t *req) {
+  if (server->nshards == 1 && server->shards[0].engine != KVSTORE_FILES)
+    return 0;
+  return kvrequest_hash(req);
 }
 
 /* Sends a message to register SERVER with a TPCLeader over a socket located at
@@ -43,6 +153,7 @@ int tpcfollower_init(tpcfollower_t *server, char *dirname, unsigned int max_thre
 bool tpcfollower_register_leader(tpcfollower_t *server, int sockfd) {
   kvrequest_t register_req;
 
+  kvrequest_clear(&register_req);
   register_req.type = REGISTER;
   strcpy(register_req.key, server->hostname);
   sprintf(register_req.val, "%d", server->port);
@@ -55,58 +166,370 @@ bool tpcfollower_register_leader(tpcfollower_t *server, int sockfd) {
   return res.type == SUCCESS;
 }
 
-/* Attempts to get KEY from SERVER. Returns 0 if successful, else a negative
- * error code.  If successful, VALUE will point to a string which should later
- * be free()d.  */
-int tpcfollower_get(tpcfollower_t *server, char *key, char *value) {
+/* Attempts to get KEY, whose hash is HASH (see tpcfollower_hash), from
+ * SERVER. Returns 0 if successful, else a negative error code.  If successful,
+ * VALUE will point to a string which should later be free()d.  */
+int tpcfollower_get(tpcfollower_t *server, char *key, uint64_t hash, char *value) {
   int ret;
   if (strlen(key) > MAX_KEYLEN)
     return ERR_KEYLEN;
-  ret = kvstore_get(&server->store, key, value);
+  ret = kvstore_get_hashed(tpcfollower_store(server, hash), key, hash, value);
   return ret;
 }
 
 /* Checks if the given KEY, VALUE pair can be inserted into this server's
  * store. Returns 0 if it can, else a negative error code. */
-int tpcfollower_put_check(tpcfollower_t *server, char *key, char *value) {
+int tpcfollower_put_check(tpcfollower_t *server, char *key, uint64_t hash, char *value) {
   int check;
   if (strlen(key) > MAX_KEYLEN || strlen(key) == 0)
     return ERR_KEYLEN;
   if (strlen(value) > MAX_VALLEN)
     return ERR_VALLEN;
-  if ((check = kvstore_put_check(&server->store, key, value)) < 0)
+  if ((check = kvstore_put_check(tpcfollower_store(server, hash), key, value)) < 0)
     return check;
   return 0;
 }
 
-/* Inserts the given KEY, VALUE pair into this server's store
- * Returns 0 if successful, else a negative error code. */
-int tpcfollower_put(tpcfollower_t *server, char *key, char *value) {
+/* Inserts the given KEY, VALUE pair, where HASH is the hash of KEY, into this
+ * server's store. Returns 0 if successful, else a negative error code. */
+int tpcfollower_put(tpcfollower_t *server, char *key, uint64_t hash, char *value) {
   int ret;
-  if ((ret = tpcfollower_put_check(server, key, value)) < 0)
+  if ((ret = tpcfollower_put_check(server, key, hash, value)) < 0)
     return ret;
-  ret = kvstore_put(&server->store, key, value);
+  ret = kvstore_put_hashed(tpcfollower_store(server, hash), key, hash, value);
   return ret;
 }
 
+/* Inserts the given KEY, VALUE pair into this server's store, to expire TTL
+ * seconds from now. Returns 0 if successful, else a negative error code. */
+int tpcfollower_put_ttl(tpcfollower_t *server, char *key, uint64_t hash, char *value,
+                        uint64_t ttl) {
+  int ret;
+  if ((ret = tpcfollower_put_check(server, key, hash, value)) < 0)
+    return ret;
+  return kvstore_put_ttl_hashed(tpcfollower_store(server, hash), key, hash, value, ttl);
+}
+
+/* Replaces the value of KEY within this server's store with VALUE, only if
+ * its current value is EXPECTED. Returns 0 if successful, else a negative
+ * error code (ERR_MISMATCH if the value is not EXPECTED). */
+int tpcfollower_cas(tpcfollower_t *server, char *key, uint64_t hash, char *expected,
+                    char *value) {
+  int ret;
+  if ((ret = tpcfollower_put_check(server, key, hash, value)) < 0)
+    return ret;
+  return kvstore_cas_hashed(tpcfollower_store(server, hash), key, hash, expected, value);
+}
+
+/* Inserts the given KEY, VALUE pair into this server's store, only if KEY is
+ * absent. Returns 0 if successful, else a negative error code (ERR_KEYEXISTS
+ * if KEY is present). */
+int tpcfollower_put_if_absent(tpcfollower_t *server, char *key, uint64_t hash, char *value) {
+  int ret;
+  if ((ret = tpcfollower_put_check(server, key, hash, value)) < 0)
+    return ret;
+  return kvstore_put_if_absent_hashed(tpcfollower_store(server, hash), key, hash, value);
+}
+
+/* Sends the large value of KEY, whose hash is HASH, if any, from this server's
+ * store over SOCKFD as a GETRESP, streaming it in chunks of KVBLOB_CHUNK_SIZE
+ * bytes. Returns false (having sent nothing) if KEY has no large value, else
+ * true. */
+bool tpcfollower_get_stream(tpcfollower_t *server, char *key, uint64_t hash, int sockfd) {
+  kvblob_reader_t r;
+  http_outbound_t msg;
+  char lenbuf[24];
+  ssize_t bytes_read;
+  char *buf;
+  if (strlen(key) > MAX_KEYLEN ||
+      kvstore_get_stream_open(tpcfollower_store(server, hash), key, &r) < 0)
+    return false;
+  http_outbound_init_response(&msg, sockfd, 200);
+  sprintf(lenbuf, "%lu", (unsigned long)r.size);
+  http_outbound_add_header(&msg, "Content-Length", lenbuf);
+  http_outbound_end_headers(&msg);
+  buf = malloc(KVBLOB_CHUNK_SIZE);
+  if (!buf)
+    fatal_malloc();
+  if (http_outbound_send(&msg) >= 0) {
+    while ((bytes_read = kvstore_get_stream_read(&r, buf, KVBLOB_CHUNK_SIZE)) > 0)
+      if (!http_send_data(sockfd, buf, bytes_read))
+        break;
+  }
+  free(buf);
+  kvstore_get_stream_close(&r);
+  return true;
+}
+
 /* Checks if the given KEY can be deleted from this server's store.
  * Returns 0 if it can, else a negative error code. */
-int tpcfollower_del_check(tpcfollower_t *server, char *key) {
+int tpcfollower_del_check(tpcfollower_t *server, char *key, uint64_t hash) {
   int check;
   if (strlen(key) > MAX_KEYLEN || strlen(key) == 0)
     return ERR_KEYLEN;
-  if ((check = kvstore_del_check(&server->store, key)) < 0)
+  if ((check = kvstore_del_check_hashed(tpcfollower_store(server, hash), key, hash)) < 0)
     return check;
   return 0;
 }
 
-/* Removes the given KEY from this server's store. Returns
+/* Removes the given KEY, whose hash is HASH, from this server's store. Returns
  * 0 if successful, else a negative error code. */
-int tpcfollower_del(tpcfollower_t *server, char *key) {
+int tpcfollower_del(tpcfollower_t *server, char *key, uint64_t hash) {
+  int ret;
+  if ((ret = tpcfollower_del_check(server, key, hash)) < 0)
+    return ret;
+  ret = kvstore_del_hashed(tpcfollower_store(server, hash), key, hash);
+  return ret;
+}
+
+/* Checks if the conditional request REQ (a CASREQ or PUTNXREQ), where HASH is
+ * the hash of its key, would write its value into this server's store, without
+ * writing it. Returns 0 if it would, else the negative error code the write
+ * would fail with (ERR_MISMATCH, ERR_NOKEY or ERR_KEYEXISTS if its condition
+ * does not hold). */
+static int tpcfollower_conditional_check(tpcfollower_t *server, kvrequest_t *req, uint64_t hash) {
+  char current[MAX_VALLEN + 1];
+  int ret;
+  if ((ret = tpcfollower_put_check(server, req->key, hash, req->val)) < 0)
+    return ret;
+  if (req->type == PUTNXREQ)
+    return kvstore_haskey_hashed(tpcfollower_store(server, hash), req->key, hash) ? ERR_KEYEXISTS
+                                                                                  : 0;
+  if (strlen(req->expected) > MAX_VALLEN)
+    return ERR_VALLEN;
+  if ((ret = tpcfollower_get(server, req->key, hash, current)) < 0)
+    return ret;
+  return strcmp(current, req->expected) == 0 ? 0 : ERR_MISMATCH;
+}
+
+/* Checks if the write REQ (a PUTREQ, DELREQ, CASREQ or PUTNXREQ), where HASH
+ * is the hash of its key, can be applied to this server's store. Returns 0 if
+ * it can, else a negative error code. */
+static int tpcfollower_write_check(tpcfollower_t *server, kvrequest_t *req, uint64_t hash) {
+  if (req->type == DELREQ)
+    return tpcfollower_del_check(server, req->key, hash);
+  if (req->type == PUTREQ)
+    return tpcfollower_put_check(server, req->key, hash, req->val);
+  return tpcfollower_conditional_check(server, req, hash);
+}
+
+/* Reserves the key of the write REQ, where HASH is the hash of its key, for
+ * the transaction of REQ until the decision on it arrives, storing the write
+ * left pending into *PENDING. Returns 0 if successful, else a negative error
+ * code (ERR_KEYBUSY if the key is already reserved). */
+static int tpcfollower_reserve(tpcfollower_t *server, kvrequest_t *req, uint64_t hash,
+                               tpcfollower_pending_t **pendingp) {
+  tpcfollower_pending_t *pending;
+  if (req->txid == 0)
+    return ERR_INVLDMSG;
+  if (strlen(req->key) > MAX_KEYLEN || strlen(req->key) == 0)
+    return ERR_KEYLEN;
+  pthread_mutex_lock(&server->pending_lock);
+  HASH_FIND_STR(server->pending, req->key, pending);
+  if (pending != NULL) {
+    pthread_mutex_unlock(&server->pending_lock);
+    return ERR_KEYBUSY;
+  }
+  pending = calloc(1, sizeof(tpcfollower_pending_t));
+  if (!pending)
+    fatal_malloc();
+  strcpy(pending->key, req->key);
+  pending->type = req->type;
+  strcpy(pending->value, req->val);
+  strcpy(pending->expected, req->expected);
+  pending->ttl = req->ttl;
+  pending->hash = hash;
+  pending->txid = req->txid;
+  HASH_ADD_STR(server->pending, key, pending);
+  pthread_mutex_unlock(&server->pending_lock);
+  *pendingp = pending;
+  return 0;
+}
+
+/* Drops the pending write PENDING, along with any value it staged, and
+ * releases its key. */
+static void tpcfollower_release(tpcfollower_t *server, tpcfollower_pending_t *pending) {
+  pthread_mutex_lock(&server->pending_lock);
+  HASH_DEL(server->pending, pending);
+  pthread_mutex_unlock(&server->pending_lock);
+  if (pending->blob != NULL) {
+    kvstore_put_stream_abort(tpcfollower_store(server, pending->hash), pending->blob);
+    free(pending->blob);
+  }
+  free(pending);
+}
+
+/* Votes on the write REQ (a PUTREQ, DELREQ, CASREQ or PUTNXREQ), where HASH is
+ * the hash of its key. If it can be applied, it is logged and left pending
+ * until the decision on its transaction arrives, keeping its key reserved
+ * meanwhile. A vote on a write of a key which is already reserved is refused
+ * with ERR_KEYBUSY. Returns 0 if this server votes to commit REQ, else a
+ * negative error code. */
+static int tpcfollower_vote(tpcfollower_t *server, kvrequest_t *req, uint64_t hash) {
+  tpcfollower_pending_t *pending;
   int ret;
-  if ((ret = tpcfollower_del_check(server, key)) < 0)
+  if ((ret = tpcfollower_reserve(server, req, hash, &pending)) < 0)
     return ret;
-  ret = kvstore_del(&server->store, key);
+  /* The log records the write a conditional request makes if its condition
+   * holds, which is also what replaying it after a COMMIT must do. */
+  ret = tpcfollower_write_check(server, req, hash);
+  if (ret == 0)
+    ret = tpclog_log(&server->log, req->type == DELREQ ? DELREQ : PUTREQ, req->key, req->val);
+  if (ret < 0)
+    tpcfollower_release(server, pending);
+  return ret;
+}
+
+/* Votes on the PUTREQ REQ, whose value of STREAM_SIZE bytes may exceed
+ * MAX_VALLEN, as tpcfollower_vote does. The value is staged within this
+ * server's store and synced to disk before the vote, but only replaces the
+ * value of its key upon COMMIT. The part of the value which did not arrive
+ * along with REQ is read from SOCKFD, in chunks of KVBLOB_CHUNK_SIZE bytes.
+ * Returns 0 if this server votes to commit REQ, else a negative error code. */
+int tpcfollower_put_stream(tpcfollower_t *server, kvrequest_t *req, int sockfd) {
+  uint64_t hash = tpcfollower_hash(server, req);
+  tpcfollower_pending_t *pending;
+  kvblob_writer_t *w;
+  kvstore_t *store;
+  uint64_t remaining;
+  ssize_t bytes_read;
+  char *buf;
+  int ret;
+  if ((ret = tpcfollower_reserve(server, req, hash, &pending)) < 0)
+    return ret;
+  store = tpcfollower_store(server, hash);
+  w = malloc(sizeof(kvblob_writer_t));
+  if (!w)
+    fatal_malloc();
+  if ((ret = kvstore_put_stream_begin(store, req->key, req->stream_size, w)) < 0) {
+    free(w);
+    tpcfollower_release(server, pending);
+    return ret;
+  }
+  pending->blob = w;
+  ret = kvstore_put_stream_write(store, w, req->prefix, req->prefix_size);
+  buf = malloc(KVBLOB_CHUNK_SIZE);
+  if (!buf)
+    fatal_malloc();
+  remaining = req->stream_size - req->prefix_size;
+  while (ret == 0 && remaining > 0) {
+    bytes_read = read(sockfd, buf, min(remaining, KVBLOB_CHUNK_SIZE));
+    if (bytes_read <= 0) {
+      ret = ERR_VALLEN;
+      break;
+    }
+    ret = kvstore_put_stream_write(store, w, buf, bytes_read);
+    remaining -= bytes_read;
+  }
+  free(buf);
+  if (ret == 0)
+    ret = kvstore_put_stream_finish(store, w);
+  /* The value is too large for the TPC log, which only records the request. */
+  if (ret == 0)
+    ret = tpclog_log(&server->log, req->type, req->key, req->val);
+  if (ret < 0)
+    tpcfollower_release(server, pending);
+  return ret;
+}
+
+/* Applies the committed write PENDING, a PUTREQ without a time to live or a
+ * DELREQ, to this server's store, along with those committed to the store
+ * meanwhile: it is queued for the store, and whichever thread finds no other
+ * applying the writes of the store applies all those queued as one write batch
+ * (see kvstore_write_batch), taking the key locks and syncing once for all of
+ * them, until its own has been applied. A store which does not sync its writes
+ * has no syncs to share, so its writes are applied one by one instead. Returns
+ * 0 if successful, else a negative error code. */
+static int tpcfollower_commit(tpcfollower_t *server, tpcfollower_pending_t *pending) {
+  kvstore_t *store = tpcfollower_store(server, pending->hash);
+  tpcfollower_commits_t *commits = &server->commits[store - server->shards];
+  tpcfollower_pending_t *queue, *p;
+  kvstore_batch_t batch;
+  int ret;
+  if (store->engine == KVSTORE_MEMORY || store->sync.opts.mode == KVSYNC_NONE) {
+    if (pending->type == PUTREQ)
+      return tpcfollower_put(server, pending->key, pending->hash, pending->value);
+    ret = tpcfollower_del(server, pending->key, pending->hash);
+    return ret == ERR_NOKEY ? 0 : ret;
+  }
+  pthread_mutex_lock(&commits->lock);
+  pending->applied = false;
+  pending->next = commits->queue;
+  commits->queue = pending;
+  while (!pending->applied && commits->draining)
+    pthread_cond_wait(&commits->applied, &commits->lock);
+  while (!pending->applied) {
+    commits->draining = true;
+    queue = commits->queue;
+    commits->queue = NULL;
+    pthread_mutex_unlock(&commits->lock);
+    /* Every key has a single write pending, so the order of the batch does
+     * not matter. */
+    kvstore_batch_init(&batch);
+    for (p = queue; p != NULL; p = p->next) {
+      if (p->type == DELREQ)
+        kvstore_batch_del(&batch, p->key);
+      else
+        kvstore_batch_put(&batch, p->key, p->value);
+    }
+    ret = kvstore_write_batch(store, &batch);
+    kvstore_batch_free(&batch);
+    pthread_mutex_lock(&commits->lock);
+    for (p = queue; p != NULL; p = p->next) {
+      p->result = ret;
+      p->applied = true;
+    }
+    commits->draining = false;
+    pthread_cond_broadcast(&commits->applied);
+  }
+  ret = pending->result;
+  pthread_mutex_unlock(&commits->lock);
+  return ret;
+}
+
+/* Applies the pending write PENDING to this server's store. Returns 0 if
+ * successful, else a negative error code. */
+static int tpcfollower_apply(tpcfollower_t *server, tpcfollower_pending_t *pending) {
+  int ret;
+  switch (pending->type) {
+  case CASREQ:
+    return tpcfollower_cas(server, pending->key, pending->hash, pending->expected,
+                           pending->value);
+  case PUTNXREQ:
+    return tpcfollower_put_if_absent(server, pending->key, pending->hash, pending->value);
+  case DELREQ:
+    /* The key may have expired since the vote, which is not an error. */
+    return tpcfollower_commit(server, pending);
+  default:
+    if (pending->blob != NULL) {
+      /* The staged value is released either way. */
+      ret = kvstore_put_stream_end(tpcfollower_store(server, pending->hash), pending->blob);
+      free(pending->blob);
+      pending->blob = NULL;
+      return ret;
+    }
+    if (pending->ttl > 0)
+      return tpcfollower_put_ttl(server, pending->key, pending->hash, pending->value,
+                                 pending->ttl);
+    return tpcfollower_commit(server, pending);
+  }
+}
+
+/* Applies the pending write of the transaction which REQ (a COMMIT or ABORT)
+ * decides, if this server voted for it, or drops it upon an ABORT, and
+ * releases its key. Returns 0 if successful, else a negative error code. */
+static int tpcfollower_decide(tpcfollower_t *server, kvrequest_t *req) {
+  tpcfollower_pending_t *pending;
+  int ret = 0;
+  pthread_mutex_lock(&server->pending_lock);
+  HASH_FIND_STR(server->pending, req->key, pending);
+  pthread_mutex_unlock(&server->pending_lock);
+  /* Only the decision on PENDING removes it, so it may be used unlocked. */
+  if (pending == NULL || pending->txid != req->txid)
+    return 0;
+  if (req->type == COMMIT)
+    ret = tpcfollower_apply(server, pending);
+  tpcfollower_release(server, pending);
   return ret;
 }
 
@@ -118,6 +541,7 @@ int tpcfollower_del(tpcfollower_t *server, char *key) {
  * failure. See the spec for details on logic and error messages.
  */
 void tpcfollower_handle_tpc(tpcfollower_t *server, kvrequest_t *req, kvresponse_t *res) {
+  uint64_t hash = tpcfollower_hash(server, req);
   int ret_code;
   char *value;
 
@@ -126,7 +550,7 @@ void tpcfollower_handle_tpc(tpcfollower_t *server, kvrequest_t *req, kvresponse_
     if (!value)
       fatal_malloc();
 
-    ret_code = tpcfollower_get(server, req->key, value);
+    ret_code = tpcfollower_get(server, req->key, hash, value);
     if (ret_code < 0) {
       res->type = ERROR;
       strcpy(res->body, GETMSG(ret_code));
@@ -136,40 +560,22 @@ void tpcfollower_handle_tpc(tpcfollower_t *server, kvrequest_t *req, kvresponse_
     }
     free(value);
 
-  } else if (req->type == PUTREQ) {
-    ret_code = tpclog_log(&server->log, req->type, req->key, req->val);
-    if (ret_code < 0) {
-      res->type = VOTE;
-      strcpy(res->body, GETMSG(ret_code));
-    } else {
-      ret_code = tpcfollower_put(server, req->key, req->val);
-      if (ret_code < 0) {
-	res->type = VOTE;
-	strcpy(res->body, GETMSG(ret_code));
-      } else {
-	res->type = VOTE;
-	strcpy(res->body, MSG_COMMIT);
-      }
-    }
-  } else if (req->type == DELREQ) {
-    ret_code = tpclog_log(&server->log, req->type, req->key, req->val);
-    if (ret_code < 0) {
-      res->type = VOTE;
-      strcpy(res->body, GETMSG(ret_code));
-    } else {
-      ret_code = tpcfollower_del(server, req->key);
-      if (ret_code < 0) {
-	res->type = VOTE;
-	strcpy(res->body, GETMSG(ret_code));
-      } else {
-	res->type = VOTE;
-	strcpy(res->body, MSG_COMMIT);
-      }
-    }
+  } else if (req->type == PUTREQ || req->type == DELREQ || req->type == CASREQ ||
+             req->type == PUTNXREQ) {
+    /* The write is checked now, but only made upon COMMIT. */
+    ret_code = tpcfollower_vote(server, req, hash);
+    res->type = VOTE;
+    strcpy(res->body, ret_code < 0 ? GETMSG(ret_code) : MSG_COMMIT);
   } else if (req->type == COMMIT || req->type == ABORT) {
     ret_code = tpclog_log(&server->log, req->type, req->key, req->val);
+    if (ret_code == 0)
+      ret_code = tpcfollower_decide(server, req);
+    kvresponse_clear(res);
     if (ret_code == 0) {
       res->type = ACK;
+    } else {
+      res->type = ERROR;
+      strcpy(res->body, GETMSG(ret_code));
     }
   } else {
     res->type = ERROR;
@@ -184,6 +590,7 @@ void tpcfollower_handle_tpc(tpcfollower_t *server, kvrequest_t *req, kvresponse_
 void tpcfollower_handle(tpcfollower_t *server, int sockfd) {
   kvrequest_t req;
   kvresponse_t res;
+  int ret_code;
   bool success = kvrequest_receive(&req, sockfd);
   do {
     if (!success) {
@@ -192,11 +599,18 @@ void tpcfollower_handle(tpcfollower_t *server, int sockfd) {
     } else if (req.type == INDEX) {
       index_send(sockfd, 0);
       break;
+    } else if (req.type == GETREQ && tpcfollower_get_stream(server, req.key, tpcfollower_hash(server, &req), sockfd)) {
+      break;
+    } else if (req.type == PUTREQ && req.stream_size > 0) {
+      ret_code = tpcfollower_put_stream(server, &req, sockfd);
+      res.type = VOTE;
+      strcpy(res.body, ret_code < 0 ? GETMSG(ret_code) : MSG_COMMIT);
     } else {
       tpcfollower_handle_tpc(server, &req, &res);
     }
     kvresponse_send(&res, sockfd);
   } while (0);
+  kvrequest_free(&req);
 }
 
 /* Restore SERVER back to the state it should be in, according to the
@@ -215,7 +629,35 @@ int tpcfollower_rebuild_state(tpcfollower_t *server) {
   return -1;
 }
 
-/* Deletes all current entries in SERVER's store and removes the store
- * directory.  Also cleans the associated log. Note that you will be required
+/* Deletes all current entries in SERVER's stores and removes their
+ * directories.  Also cleans the associated log. Note that you will be required
  * to reinitialize SERVER following this action. */
-int tpcfollower_clean(tpcfollower_t *server) { return kvstore_clean(&server->store); }
+int tpcfollower_clean(tpcfollower_t *server) {
+  tpcfollower_pending_t *pending, *tmp;
+  unsigned int i;
+  int ret = 0, err;
+  pthread_mutex_lock(&server->sweep_lock);
+  server->sweep_stop = true;
+  pthread_cond_signal(&server->sweep_cond);
+  pthread_mutex_unlock(&server->sweep_lock);
+  pthread_join(server->sweeper, NULL);
+  pthread_mutex_destroy(&server->sweep_lock);
+  pthread_cond_destroy(&server->sweep_cond);
+  HASH_ITER(hh, server->pending, pending, tmp)
+    tpcfollower_release(server, pending);
+  pthread_mutex_destroy(&server->pending_lock);
+  for (i = 0; i < server->nshards; i++) {
+    pthread_mutex_destroy(&server->commits[i].lock);
+    pthread_cond_destroy(&server->commits[i].applied);
+  }
+  free(server->commits);
+  server->commits = NULL;
+  tpclog_close(&server->log);
+  for (i = 0; i < server->nshards; i++)
+    if ((err = kvstore_clean(&server->shards[i])) < 0 && ret == 0)
+      ret = err;
+  free(server->shards);
+  server->shards = NULL;
+  server->nshards = 0;
+  return ret;
+}
@@ -2,9 +2,11 @@
 #define __TPC_FOLLOWER__
 
 #include <stdbool.h>
+#include <pthread.h>
 #include "kvstore.h"
 #include "kvmessage.h"
 #include "tpclog.h"
+#include "uthash.h"
 
 /* TPCFollower defines a server which will be used to store <key, value> pairs.  A TPCFollower is
  * orchestrated via a TPCLeader server.
@@ -16,7 +18,15 @@
  * tpcfollower_handle, which takes in a socket that has already been connected to a leader or
  * client and handles all further communication.
  *
- * A TPCFollower has an associated KVStore.
+ * A TPCFollower has an associated KVStore, or several: a follower may spread its keys over up to
+ * TPCFOLLOWER_MAX_SHARDS stores within different directories, such as one per disk, so that it
+ * can use the bandwidth of all of them. Keys are routed to stores by strhash64, and each store
+ * has its own locks, threads and durability, so requests for keys of different stores proceed
+ * in parallel.
+ *
+ * Keys written with a time to live (PUT with a ttl parameter, in seconds) are removed from each
+ * store by a sweeper thread once they expire, every TPCFOLLOWER_SWEEP_INTERVAL seconds; reads
+ * treat them as absent as soon as they expire (see kvstore_put_ttl).
  *
  * Because the KVStore stores all data in persistent file storage, a non-TPC TPCFollower can be
  * reinitialized using a DIRNAME which contains a previous TPCFollower and all old entries will be
@@ -24,26 +34,80 @@
  *
  * A TPCFollower maintains state beyond the current KVStore entries, so a TPCLog is used to log
  * incoming requests and can be used to recreate the state of the server upon crash recovery.
+ *
+ * A write (PUTREQ, DELREQ, CASREQ or PUTNXREQ) is checked when the follower votes on it, and
+ * applied only upon its COMMIT: a conditional write applies through kvstore_cas or
+ * kvstore_put_if_absent, which check its condition again under the key lock. From its vote to
+ * its decision, a write keeps its key reserved, and votes on other writes of the key are
+ * refused (ERR_KEYBUSY), so that no write comes between the check of a condition and the
+ * write it guards. COMMIT and ABORT messages name the transaction they decide by its key and
+ * its ID (see tpcleader_handle_tpc); writes carry no ID unless forwarded by a TPCLeader, and
+ * are refused without one. A streamed PUTREQ, which the TPCLeader relays to its followers, stages
+ * its value within the store before the vote (see tpcfollower_put_stream). Plain PUTREQs and
+ * DELREQs committed to a store while it is applying others are applied together, as one write
+ * batch synced once (see tpcfollower_commit).
  */
 struct tpcfollower;
 
-/* A TPCFollower. Stores the associated KVStore. */
+/* The largest number of stores a TPCFollower spreads its keys over. */
+#define TPCFOLLOWER_MAX_SHARDS 16
+
+/* The interval, in seconds, at which expired keys are removed. */
+#define TPCFOLLOWER_SWEEP_INTERVAL 1
+
+/* A write voted for, awaiting the decision on its transaction. */
+typedef struct tpcfollower_pending {
+  char key[MAX_KEYLEN + 1];      /* The key written. Also the key of the hash table. */
+  msgtype_t type;                /* PUTREQ, DELREQ, CASREQ or PUTNXREQ. */
+  char value[MAX_VALLEN + 1];    /* The value written, unless a DELREQ. */
+  char expected[MAX_VALLEN + 1]; /* The value a CASREQ expects. */
+  uint64_t ttl;                  /* The time to live of a PUTREQ, or 0. */
+  uint64_t hash;                 /* The hash of KEY (see tpcfollower_hash). */
+  uint64_t txid;                 /* The ID of the transaction. */
+  kvblob_writer_t *blob;         /* The value staged by a streamed PUTREQ, else NULL. */
+  struct tpcfollower_pending *next; /* The next write committed to the same store, if queued. */
+  bool applied;                  /* Whether the write was applied, once queued. */
+  int result;                    /* The result of applying it, once APPLIED. */
+  UT_hash_handle hh;             /* Makes this structure hashable. */
+} tpcfollower_pending_t;
+
+/* The committed writes of one store of a TPCFollower, which are applied to it
+ * together as a write batch (see tpcfollower_commit). */
+typedef struct {
+  tpcfollower_pending_t *queue; /* The writes waiting to be applied, linked by NEXT. */
+  bool draining;                /* Whether a thread is applying writes. */
+  pthread_mutex_t lock;         /* Protects the above, and the writes queued. */
+  pthread_cond_t applied;       /* Signaled when writes have been applied. */
+} tpcfollower_commits_t;
+
+/* A TPCFollower. Stores the associated KVStores. */
 typedef struct tpcfollower {
-  kvstore_t store; /* The store this server will use. */
+  kvstore_t *shards;    /* The stores this server will use, its keys routed by hash. */
+  unsigned int nshards; /* The number of SHARDS. */
   tpclog_t log;    /* The log this server will use. */
   tpc_state_t state;
   msgtype_t pending_msg;
   char pending_key[MAX_KEYLEN + 1];
   char pending_value[MAX_VALLEN + 1];
+  tpcfollower_pending_t *pending; /* The writes voted for, by key (a uthash table). */
+  pthread_mutex_t pending_lock;   /* Protects PENDING. */
+  tpcfollower_commits_t *commits; /* The committed writes of each of SHARDS. */
   int max_threads;   /* The max threads this server will run on. */
   int listening;     /* 1 if this server is currently listening for requests, else 0. */
   int sockfd;        /* The socket fd this server is currently listening on (if any).  */
   int port;          /* The port this server should listen on. */
   char hostname[64]; /* The host this server should listen on. */
+  pthread_t sweeper;         /* The thread removing expired keys. */
+  pthread_mutex_t sweep_lock; /* Protects SWEEP_STOP. */
+  pthread_cond_t sweep_cond; /* Signaled when SWEEP_STOP is set. */
+  bool sweep_stop;           /* Whether the sweeper is to exit. */
 } tpcfollower_t;
 
-int tpcfollower_init(tpcfollower_t *, char *dirname, unsigned int max_threads, const char *hostname,
-                     int port);
+int tpcfollower_init(tpcfollower_t *, char *dirname, const kvstore_opts_t *opts,
+                     unsigned int max_threads, const char *hostname, int port);
+int tpcfollower_init_shards(tpcfollower_t *, char **dirnames, unsigned int count,
+                            const kvstore_opts_t *opts, unsigned int max_threads,
+                            const char *hostname, int port);
 
 bool tpcfollower_register_leader(tpcfollower_t *server, int sockfd);
 
@@ -51,9 +115,17 @@ void tpcfollower_handle(tpcfollower_t *server, int sockfd);
 
 void tpcfollower_handle_tpc(tpcfollower_t *, kvrequest_t *, kvresponse_t *);
 
-int tpcfollower_get(tpcfollower_t *, char *key, char *value);
-int tpcfollower_put(tpcfollower_t *, char *key, char *value);
-int tpcfollower_del(tpcfollower_t *, char *key);
+/* HASH is strhash64(KEY) (see kvrequest_hash), which routes KEY to its shard
+ * and which the store reuses rather than hashing KEY again. */
+int tpcfollower_get(tpcfollower_t *, char *key, uint64_t hash, char *value);
+int tpcfollower_put(tpcfollower_t *, char *key, uint64_t hash, char *value);
+int tpcfollower_put_ttl(tpcfollower_t *, char *key, uint64_t hash, char *value, uint64_t ttl);
+int tpcfollower_del(tpcfollower_t *, char *key, uint64_t hash);
+int tpcfollower_cas(tpcfollower_t *, char *key, uint64_t hash, char *expected, char *value);
+int tpcfollower_put_if_absent(tpcfollower_t *, char *key, uint64_t hash, char *value);
+
+int tpcfollower_put_stream(tpcfollower_t *, kvrequest_t *, int sockfd);
+bool tpcfollower_get_stream(tpcfollower_t *, char *key, uint64_t hash, int sockfd);
 
 int tpcfollower_rebuild_state(tpcfollower_t *);
 
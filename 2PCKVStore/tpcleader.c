@@ -7,6 +7,8 @@
 #include "kvconstants.h"
 #include "kvmessage.h"
 #include "index.h"
+#include "kvblob.h"
+#include "libhttp.h"
 #include "md5.h"
 #include "socket_server.h"
 #include "time.h"
@@ -31,6 +33,7 @@ int tpcleader_init(tpcleader_t *leader, unsigned int follower_capacity, unsigned
     leader->redundancy = redundancy;
   }
   leader->followers_head = NULL;
+  leader->last_txid = 0;
   return 0;
 }
 
@@ -102,15 +105,14 @@ end:
   return;
 }
 
-/* Hashes KEY and finds the first follower that should contain it.
- * It should return the first follower whose ID is greater than the
- * KEY's hash, and the one with lowest ID if none matches the
+/* Finds the first follower that should contain a key whose strhash64 is
+ * HASH (see kvrequest_hash). It should return the first follower whose ID is
+ * greater than HASH, and the one with lowest ID if none matches the
  * requirement. Returns NULL if we're not yet at our follower capacity.
  */
-follower_t *tpcleader_get_primary(tpcleader_t *leader, char *key) {
+follower_t *tpcleader_get_primary(tpcleader_t *leader, uint64_t hash) {
   if (leader->follower_count < leader->follower_capacity)
     return NULL;
-  uint64_t hash = strhash64(key);
   pthread_rwlock_wrlock(&leader->follower_lock);
   follower_t *curr_follower = leader->followers_head;
   do {
@@ -140,7 +142,7 @@ follower_t *tpcleader_get_successor(tpcleader_t *leader, follower_t *predecessor
  * respectively.
  */
 void tpcleader_handle_get(tpcleader_t *leader, kvrequest_t *req, kvresponse_t *res) {
-  follower_t *primary = tpcleader_get_primary(leader, req->key);
+  follower_t *primary = tpcleader_get_primary(leader, kvrequest_hash(req));
   follower_t *successor;
   int sockfd;
   int ret_code;
@@ -168,6 +170,69 @@ void tpcleader_handle_get(tpcleader_t *leader, kvrequest_t *req, kvresponse_t *r
   }
 }
 
+/* Begins the transaction REQ, giving it an ID. Returns the first follower
+ * (see tpcleader_get_primary) which should store the key of REQ, or NULL,
+ * having populated RES as an ERROR, if the leader is not yet at its follower
+ * capacity. */
+static follower_t *tpcleader_begin(tpcleader_t *leader, kvrequest_t *req, kvresponse_t *res) {
+  follower_t *primary = NULL;
+  if (leader->follower_count == leader->follower_capacity)
+    primary = tpcleader_get_primary(leader, kvrequest_hash(req));
+  if (primary == NULL) {
+    res->type = ERROR;
+    strcpy(res->body, ERRMSG_NOT_AT_CAPACITY);
+    return NULL;
+  }
+  req->txid = __atomic_add_fetch(&leader->last_txid, 1, __ATOMIC_RELAXED);
+  return primary;
+}
+
+/* Sends the decision on the transaction REQ, a COMMIT unless ABORT is set, to
+ * every follower from PRIMARY on, waiting for an ACK from each, and populates
+ * RES as the response to REQ: SUCCESS, or an ERROR carrying REASON if REQ was
+ * aborted. */
+static void tpcleader_decide(tpcleader_t *leader, kvrequest_t *req, kvresponse_t *res,
+                             follower_t *primary, int abort, char *reason) {
+  follower_t *successor;
+  int first = 1;
+  int ret_code;
+  int sockfd;
+
+  if (abort) {
+    req->type = ABORT;
+  } else {
+    req->type = COMMIT;
+  }
+  successor = primary;
+  do {
+    sockfd = connect_to(successor->host, successor->port, 0);
+    if (sockfd < 0) {
+      continue;
+    } else {
+      ret_code = kvrequest_send(req, sockfd);
+      if (ret_code < 0) {
+	close(sockfd);
+	continue;
+      } else {
+	if (!kvresponse_receive(res, sockfd)) {
+	  close(sockfd);
+	  continue;
+	}
+      }
+      close(sockfd);
+    } 
+    successor = tpcleader_get_successor(leader, successor);
+    first = 0;
+  } while (successor != primary || first);
+
+  if (abort) {
+    res->type = ERROR;
+    strcpy(res->body, reason);
+  } else {
+    res->type = SUCCESS;
+  }
+}
+
 /* Handles an incoming TPC request REQ, and populates RES as a response.
  * REQ and RES both must point to valid kvrequest_t and kvrespont_t structs,
  * respectively.
@@ -175,27 +240,22 @@ void tpcleader_handle_get(tpcleader_t *leader, kvrequest_t *req, kvresponse_t *r
  * Implements the TPC algorithm, polling all the followers for a vote first and
  * sending a COMMIT or ABORT message in the second phase.  Must wait for an ACK
  * from every follower after sending the second phase messages.
+ *
+ * Every transaction is given an ID, which the followers match its COMMIT or
+ * ABORT with. It is aborted if any follower votes against it, and the reason
+ * the follower gave (such as ERRMSG_MISMATCH) is passed on within RES.
  */
 void tpcleader_handle_tpc(tpcleader_t *leader, kvrequest_t *req, kvresponse_t *res) {
+  char reason[KVRES_BODY_MAX_SIZE + 1] = ERRMSG_GENERIC_ERROR;
   follower_t *primary;
   follower_t *successor;
   int abort = 0;
-  int first = 1;
   int ret_code;
   int sockfd;
 
-  if (leader->follower_count != leader->follower_capacity) {
-    res->type = ERROR;
-    strcpy(res->body, ERRMSG_NOT_AT_CAPACITY);
+  primary = tpcleader_begin(leader, req, res);
+  if (primary == NULL)
     return;
-  }
-  
-  primary = tpcleader_get_primary(leader, req->key);
-  if (primary == NULL) {
-    res->type = ERROR;
-    strcpy(res->body, ERRMSG_NOT_AT_CAPACITY);
-    return;
-  }
 
   successor = primary;
   do {
@@ -209,6 +269,10 @@ void tpcleader_handle_tpc(tpcleader_t *leader, kvrequest_t *req, kvresponse_t *r
       } else {
 	if (!kvresponse_receive(res, sockfd)) {
 	  abort = 1;
+	} else if (res->type != VOTE || strcmp(res->body, MSG_COMMIT)) {
+	  if (!abort && res->type == VOTE)
+	    strcpy(reason, res->body);
+	  abort = 1;
 	}
       }
       close(sockfd);
@@ -216,39 +280,77 @@ void tpcleader_handle_tpc(tpcleader_t *leader, kvrequest_t *req, kvresponse_t *r
     successor = tpcleader_get_successor(leader, successor);
   } while (successor != primary);
 
-  if (abort) {
-    req->type = ABORT;
-  } else {
-    req->type = COMMIT;
-  }
+  tpcleader_decide(leader, req, res, primary, abort, reason);
+}
+
+/* Handles an incoming PUT request REQ whose value is streamed (see
+ * kvrequest_t), the rest of which is still to be read from SOCKFD, and
+ * populates RES as a response. As tpcleader_handle_tpc, but the value is never
+ * held in memory as a whole: REQ is sent to every follower at once, and its
+ * value relayed to all of them in chunks of KVBLOB_CHUNK_SIZE bytes as it
+ * arrives, before their votes are collected. A follower which has refused REQ
+ * no longer reads the value, and is simply not sent any more of it.
+ */
+void tpcleader_handle_stream(tpcleader_t *leader, kvrequest_t *req, kvresponse_t *res, int sockfd) {
+  char reason[KVRES_BODY_MAX_SIZE + 1] = ERRMSG_GENERIC_ERROR;
+  int sockfds[leader->follower_capacity];
+  follower_t *primary;
+  follower_t *successor;
+  unsigned int count = 0, i;
+  uint64_t remaining;
+  ssize_t bytes_read;
+  int abort = 0;
+  char *buf;
+
+  primary = tpcleader_begin(leader, req, res);
+  if (primary == NULL)
+    return;
+
   successor = primary;
   do {
-    sockfd = connect_to(successor->host, successor->port, 0);
-    if (sockfd < 0) {
-      continue;
-    } else {
-      ret_code = kvrequest_send(req, sockfd);
-      if (ret_code < 0) {
-	close(sockfd);
-	continue;
-      } else {
-	if (!kvresponse_receive(res, sockfd)) {
-	  close(sockfd);
-	  continue;
-	}
-      }
-      close(sockfd);
-    } 
+    sockfds[count] = connect_to(successor->host, successor->port, 0);
+    if (sockfds[count] >= 0 && kvrequest_send(req, sockfds[count]) >= 0)
+      http_send_data(sockfds[count], req->prefix, req->prefix_size);
+    count++;
     successor = tpcleader_get_successor(leader, successor);
-    first = 0;
-  } while (successor != primary || first);
+  } while (successor != primary);
 
-  if (abort) {
-    res->type = ERROR;
-    strcpy(res->body, ERRMSG_GENERIC_ERROR);
-  } else {
-    res->type = SUCCESS;
+  buf = malloc(KVBLOB_CHUNK_SIZE);
+  if (!buf)
+    fatal_malloc();
+  remaining = req->stream_size - req->prefix_size;
+  while (remaining > 0) {
+    bytes_read = read(sockfd, buf, min(remaining, KVBLOB_CHUNK_SIZE));
+    if (bytes_read <= 0) {
+      /* The followers read the end of the value early, and vote against it. */
+      for (i = 0; i < count; i++)
+        if (sockfds[i] >= 0)
+          shutdown(sockfds[i], SHUT_WR);
+      break;
+    }
+    for (i = 0; i < count; i++)
+      if (sockfds[i] >= 0)
+        http_send_data(sockfds[i], buf, bytes_read);
+    remaining -= bytes_read;
   }
+  free(buf);
+
+  for (i = 0; i < count; i++) {
+    if (sockfds[i] < 0) {
+      abort = 1;
+      continue;
+    }
+    if (!kvresponse_receive(res, sockfds[i])) {
+      abort = 1;
+    } else if (res->type != VOTE || strcmp(res->body, MSG_COMMIT)) {
+      if (!abort && res->type == VOTE)
+        strcpy(reason, res->body);
+      abort = 1;
+    }
+    close(sockfds[i]);
+  }
+
+  tpcleader_decide(leader, req, res, primary, abort, reason);
 }
 
 /* Generic entrypoint for this LEADER. Takes in a socket on SOCKFD, which
@@ -271,9 +373,12 @@ void tpcleader_handle(tpcleader_t *leader, int sockfd) {
       tpcleader_register(leader, &req, &res);
     } else if (req.type == GETREQ) {
       tpcleader_handle_get(leader, &req, &res);
+    } else if (req.type == PUTREQ && req.stream_size > 0) {
+      tpcleader_handle_stream(leader, &req, &res, sockfd);
     } else {
       tpcleader_handle_tpc(leader, &req, &res);
     }
     kvresponse_send(&res, sockfd);
   } while (0);
+  kvrequest_free(&req);
 }
@@ -40,17 +40,19 @@ typedef struct tpcleader {
   unsigned int redundancy;        /* The number of followers a single value will be stored on. */
   follower_t *followers_head;     /* The head of the list of followers. */
   pthread_rwlock_t follower_lock; /* A lock used to protect the list of followers. */
+  uint64_t last_txid;             /* The ID of the last transaction begun. */
 } tpcleader_t;
 
 int tpcleader_init(tpcleader_t *leader, unsigned int follower_capacity, unsigned int redundancy);
 
 void tpcleader_register(tpcleader_t *leader, kvrequest_t *, kvresponse_t *);
-follower_t *tpcleader_get_primary(tpcleader_t *leader, char *key);
+follower_t *tpcleader_get_primary(tpcleader_t *leader, uint64_t hash);
 follower_t *tpcleader_get_successor(tpcleader_t *leader, follower_t *predecessor);
 
 void tpcleader_handle(tpcleader_t *leader, int sockfd);
 
 void tpcleader_handle_get(tpcleader_t *leader, kvrequest_t *, kvresponse_t *);
 void tpcleader_handle_tpc(tpcleader_t *leader, kvrequest_t *req, kvresponse_t *res);
+void tpcleader_handle_stream(tpcleader_t *leader, kvrequest_t *req, kvresponse_t *res, int sockfd);
 
 #endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdbool.h>
 #include <pthread.h>
 #include <unistd.h>
@@ -7,16 +8,51 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <stddef.h>
 #include "kvconstants.h"
+#include "kvcrc.h"
 #include "tpclog.h"
 
+/* The size of the header of a log entry, which precedes its data. */
+#define TPCLOG_HEADER (sizeof(logentry_t) - MAX_LOGENTRY)
+
+/* Returns the checksum of ENTRY, covering its header up to the checksum
+ * itself and its data. */
+static uint32_t tpclog_checksum(const logentry_t *entry) {
+  uint32_t crc = kvcrc32c(0, entry, offsetof(logentry_t, crc));
+  return kvcrc32c(crc, entry->data, entry->length);
+}
+
+/* Syncs the entry files logged to the TPCLog ARG since its last sync, and
+ * their directory, making all entries logged so far durable. Returns 0 if
+ * successful, else a negative error code. */
+static int tpclog_sync(void *arg) {
+  tpclog_t *log = arg;
+  return kvsync_files_sync(&log->files, log->dirname);
+}
+
+/* Syncs the entry file FD of LOG, and the directory it was created in.
+ * Returns 0 if successful, else a negative error code. */
+static int tpclog_sync_entry(tpclog_t *log, int fd) {
+  int dirfd, ret;
+  if (fdatasync(fd) < 0)
+    return ERR_FILACCESS;
+  if ((dirfd = open(log->dirname, O_RDONLY | O_DIRECTORY)) < 0)
+    return ERR_FILACCESS;
+  ret = fsync(dirfd) == 0 ? 0 : ERR_FILACCESS;
+  close(dirfd);
+  return ret;
+}
+
 /* Initialize TPCLog LOG to use the provided DIRNAME to store its associated
  * entries. Sets LOG's NEXTID field based on the entries that currently exist
- * in DIRNAME. */
-int tpclog_init(tpclog_t *log, char *dirname) {
+ * in DIRNAME. DURABILITY selects when entries are synced to disk, or may be
+ * NULL to leave them to the operating system. */
+int tpclog_init(tpclog_t *log, char *dirname, const kvsync_opts_t *durability) {
   struct stat st;
   unsigned long nextid = 0;
   char filename[MAX_FILENAME];
+  int ret;
   if (stat(dirname, &st) == -1) {
     if (mkdir(dirname, 0700) == -1)
       return errno;
@@ -26,6 +62,8 @@ int tpclog_init(tpclog_t *log, char *dirname) {
     fatal_malloc();
   strcpy(log->dirname, dirname);
   pthread_rwlock_init(&log->lock, NULL);
+  log->corruptions = 0;
+  kvsync_files_init(&log->files);
 
   /* Iterate through entries to determine next available ID, since this log may
    * be recovering from a crash. */
@@ -33,16 +71,23 @@ int tpclog_init(tpclog_t *log, char *dirname) {
   while (stat(filename, &st) != -1)
     sprintf(filename, "%s/%lu%s", log->dirname, nextid++, TPCLOG_FILETYPE);
   log->nextid = nextid - 1;
-  return 0;
+  if ((ret = kvsync_init(&log->sync, durability, tpclog_sync, log)) < 0) {
+    kvsync_files_destroy(&log->files);
+    pthread_rwlock_destroy(&log->lock);
+    free(log->dirname);
+    log->dirname = NULL;
+  }
+  return ret;
 }
 
 /* Add a log entry to LOG which will store the message type TYPE and, as
  * applicable, the associated KEY and VALUE (which should be NULL if they are
- * not applicable). See tpclog.h for a complete description of how log entries
+ * not applicable). Returns once the entry is as durable as the durability mode
+ * of LOG requires. See tpclog.h for a complete description of how log entries
  * should be stored in the file system. */
 int tpclog_log(tpclog_t *log, msgtype_t type, char *key, char *value) {
   char filename[MAX_FILENAME];
-  int fd, keylen, vallen;
+  int fd, keylen, vallen, ret = 0;
   size_t size;
   logentry_t *entry;
   if (type != PUTREQ && type != DELREQ && type != ABORT && type != COMMIT)
@@ -71,35 +116,43 @@ int tpclog_log(tpclog_t *log, msgtype_t type, char *key, char *value) {
     strcpy(entry->data, key);
   if (type == PUTREQ)
     strcpy(entry->data + keylen, value);
+  entry->crc = tpclog_checksum(entry);
   errno = 0;
   if (write(fd, entry, size) < size) {
     pthread_rwlock_unlock(&log->lock);
     return ERR_FILACCESS;
   }
-  close(fd);
+  if (log->sync.opts.mode == KVSYNC_ALWAYS)
+    ret = tpclog_sync_entry(log, fd);
+  /* With KVSYNC_GROUP, the entry file is kept open until the next sync. */
+  if (log->sync.opts.mode == KVSYNC_GROUP)
+    kvsync_files_add(&log->files, fd, true);
+  else
+    close(fd);
   pthread_rwlock_unlock(&log->lock);
   free(entry);
-  return 0;
+  if (ret == 0 && log->sync.opts.mode == KVSYNC_GROUP)
+    ret = kvsync_commit(&log->sync);
+  return ret;
 }
 
 /* Load the logentry located at FILENAME into ENTRY, which will be set to
  * malloc()d memory which should be later free()d. Returns 0 if successful,
- * else a negative error code (and ENTRY will be NULL). */
+ * ERR_CHECKSUM if the entry is torn or corrupted, else a negative error code
+ * (and ENTRY will be NULL). */
 int tpclog_load_entry(logentry_t *entry, char *filename) {
-  logentry_t tmp;
+  ssize_t size;
   int fd;
-  size_t size;
 
   if ((fd = open(filename, O_RDONLY)) < 0)
     return ERR_FILACCESS;
-  if (read(fd, &tmp, sizeof(logentry_t) - MAX_LOGENTRY) < sizeof(logentry_t) - MAX_LOGENTRY)
-    return ERR_FILACCESS;
-  lseek(fd, SEEK_SET, 0);
-  size = tmp.length + sizeof(logentry_t) - MAX_LOGENTRY;
-  if (read(fd, entry, size) < size) {
-    return ERR_FILACCESS;
-  }
+  size = read(fd, entry, sizeof(logentry_t));
   close(fd);
+  if (size < 0)
+    return ERR_FILACCESS;
+  if (size < TPCLOG_HEADER || entry->length < 0 || entry->length > MAX_LOGENTRY ||
+      size < TPCLOG_HEADER + entry->length || entry->crc != tpclog_checksum(entry))
+    return ERR_CHECKSUM;
   return 0;
 }
 
@@ -137,6 +190,8 @@ logentry_t *tpclog_iterate_next(tpclog_t *log, logentry_t *entry) {
   sprintf(filename, "%s/%lu%s", log->dirname, log->iterpos++, TPCLOG_FILETYPE);
   ret = tpclog_load_entry(entry, filename);
   pthread_rwlock_unlock(&log->lock);
+  if (ret == ERR_CHECKSUM)
+    __sync_fetch_and_add(&log->corruptions, 1);
   return (ret < 0) ? NULL : entry;
 }
 
@@ -161,3 +216,13 @@ int tpclog_clear_log(tpclog_t *log) {
   log->nextid = 0;
   return 0;
 }
+
+/* Release the resources of LOG, leaving its entries in place. No thread may
+ * use LOG anymore. */
+void tpclog_close(tpclog_t *log) {
+  kvsync_close(&log->sync);
+  kvsync_files_destroy(&log->files);
+  pthread_rwlock_destroy(&log->lock);
+  free(log->dirname);
+  log->dirname = NULL;
+}
@@ -4,6 +4,7 @@
 #include <stdbool.h>
 #include <pthread.h>
 #include "kvconstants.h"
+#include "kvsync.h"
 
 /* TPCLog defines a log which will log the TPC actions for a server such that
  * it can recreate its state after a crash.
@@ -20,6 +21,17 @@
  * tpclog_clear_log periodically to clear the log. This will erase all entries
  * in the log, so it should only be called when the server is confident that it
  * will not need any existing entry to recreate state.
+ *
+ * A follower must not vote before the entry recording its vote is durable, so
+ * the log can be initialized with a durability mode (see kvsync.h). With
+ * KVSYNC_ALWAYS, each entry file (and the directory) is synced before
+ * tpclog_log returns; with KVSYNC_GROUP, concurrent calls share one sync of
+ * the entry files logged since the previous one, and of the directory.
+ *
+ * Each entry carries a CRC32C checksum of its contents (see kvcrc.h), so that
+ * an entry torn by a crash is not mistaken for the action it was recording:
+ * loading it fails with ERR_CHECKSUM instead, and the iteration counts it in
+ * CORRUPTIONS.
  */
 
 /* Filetype to use as an extension for the filenames of entries in the TPCLog.
@@ -37,6 +49,12 @@ typedef struct {
   unsigned long iterpos;
   /* A read-write lock used to make TPCLog thread-safe. */
   pthread_rwlock_t lock;
+  /* Makes entries durable as the durability mode of the log selects. */
+  kvsync_t sync;
+  /* KVSYNC_GROUP: the entry files logged since the last sync. */
+  kvsync_files_t files;
+  /* The number of entries iterated over whose checksum did not match. */
+  uint64_t corruptions;
 } tpclog_t;
 
 /* A single log entry.
@@ -51,11 +69,13 @@ typedef struct {
   msgtype_t type;
   /* Stores the total length of DATA, including null terminators. */
   int length;
+  /* The CRC32C of TYPE, LENGTH and DATA. */
+  uint32_t crc;
   /* Described above. */
   char data[MAX_LOGENTRY];
 } logentry_t;
 
-int tpclog_init(tpclog_t *, char *dirname);
+int tpclog_init(tpclog_t *, char *dirname, const kvsync_opts_t *durability);
 
 int tpclog_log(tpclog_t *, msgtype_t type, char *key, char *value);
 
@@ -67,4 +87,6 @@ logentry_t *tpclog_iterate_next(tpclog_t *log, logentry_t *entry);
 
 int tpclog_clear_log(tpclog_t *);
 
+void tpclog_close(tpclog_t *);
+
 #endif